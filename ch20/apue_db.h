@@ -12,18 +12,178 @@
  */
 typedef void* DBHANDLE;
 
+/**
+ * Options used when creating a database with db_openopt().  Zero-initialise
+ * the structure and set the fields of interest; a zeroed structure creates
+ * the same database as db_open().
+ */
+typedef struct {
+  int format;  /* index file format: DB_FMT_ASCII or DB_FMT_BINARY */
+  int flags;   /* DB_OPT_xxx flags */
+  long nhash;  /* initial hash table size; 0 for the default */
+  int maxload; /* binary: grow hash table above this average chain length */
+  int hashfn;  /* binary: DB_HASH_xxx hash function */
+  unsigned long seed; /* binary: hash function seed; 0 for a random one */
+  size_t cachesize;   /* binary: bytes of records to cache; 0 for no cache */
+  const char *dict;   /* binary: dictionary for DB_OPT_COMPRESS; NULL if none */
+  size_t dictlen;     /* binary: length of dict, up to DB_DICTMAX bytes */
+} DBOPTS;
+
+/**
+ * Database information returned by db_info().
+ */
+typedef struct {
+  int format;         /* DB_FMT_ASCII or DB_FMT_BINARY */
+  int hashfn;         /* DB_HASH_xxx hash function */
+  unsigned long seed; /* hash function seed */
+  long nhash;         /* size of hash table created with the database */
+  long nbucket;       /* current number of buckets */
+  int maxload;        /* hash table grows above this load; 0 if fixed */
+  int ordered;        /* keys kept in order for db_seek() and db_next() */
+  int checksum;       /* records carry CRC32C checksums */
+  int compress;       /* data of the records is compressed */
+  int snapshot;       /* scans can read from a snapshot */
+  size_t dictlen;     /* length of the compression dictionary; 0 if none */
+  long maxkey;        /* longest key db_store() accepts, in bytes */
+  long maxdata;       /* longest data db_store() accepts, in bytes */
+  unsigned long chgfirst; /* first change in the change log; 0 if none */
+  unsigned long chgnext;  /* sequence number the next change will get */
+  unsigned long chgseq;   /* binary: last change logged or applied */
+} DBINFO;
+
+/**
+ * Progress and results of db_compact().  The sizes are in bytes.
+ */
+typedef struct {
+  long nbucket; /* number of hash chains to copy */
+  long bucket;  /* hash chains copied so far */
+  long nrec;    /* live records copied so far */
+  off_t oldidx; /* size of the index file before compaction */
+  off_t olddat; /* size of the data file before compaction */
+  off_t newidx; /* size of the index file after compaction */
+  off_t newdat; /* size of the data file after compaction */
+} DBCOMPACT;
+
+/**
+ * Memory limit and results of db_bulkload().
+ */
+typedef struct {
+  size_t memlimit; /* bytes of records to sort in memory; 0 for the default */
+  long nline;      /* lines read; on EINVAL, the number of the bad line */
+  long nrec;       /* records stored */
+  long ndup;       /* records replaced by a later one with the same key */
+  long npart;      /* partitions sorted one at a time; 0 if sorted in memory */
+} DBBULK;
+
+/**
+ * Results of db_verify().  The problems found are also passed one at a time to
+ * its callback.
+ */
+typedef struct {
+  long nrec;       /* records on the hash chains */
+  long nchain;     /* nonempty hash chains */
+  long maxchain;   /* records on the longest chain */
+  long nfree;      /* free extents, or ASCII free list records */
+  off_t freebytes; /* bytes in them */
+  off_t idxsize;   /* size of the index file */
+  off_t datsize;   /* size of the data file */
+  long nbad;       /* problems found */
+} DBVERIFY;
+
+#define DB_NLAT 312 /* buckets of a latency histogram; the last is open */
+
+/**
+ * Latency of one kind of operation, in nanoseconds, as reported by db_stats().
+ * hist[i] counts the operations that took from db_latbound(i) up to
+ * db_latbound(i + 1) nanoseconds.  The buckets are exact up to 16 ns, and
+ * there are eight to each power of 2 above, so a percentile is never more than
+ * 12.5% above the latency it stands for.
+ */
+typedef struct {
+  unsigned long count; /* operations timed */
+  double total;        /* time taken by all of them */
+  double min;          /* fastest */
+  double max;          /* slowest */
+  double p50;          /* median */
+  double p90;          /* 90th percentile */
+  double p99;          /* 99th percentile */
+  double p999;         /* 99.9th percentile */
+  unsigned long hist[DB_NLAT];
+} DBLAT;
+
+/**
+ * Statistics of a handle returned by db_stats(), since the database was
+ * opened.  They count the operations of this process through the handle only.
+ */
+typedef struct {
+  unsigned long fetchok;  /* fetches of a record that was found */
+  unsigned long fetcherr; /* fetches of a key that wasn't */
+  unsigned long cachehit; /* fetches answered from the record cache */
+  unsigned long nextrec;  /* records returned by db_nextrec() */
+  unsigned long stor1;    /* stores of a new record, appended */
+  unsigned long stor2;    /* stores of a new record, in reused space */
+  unsigned long stor3;    /* replacements with data moved or appended */
+  unsigned long stor4;    /* replacements in place */
+  unsigned long storerr;  /* stores refused */
+  unsigned long delok;    /* records deleted */
+  unsigned long delerr;   /* deletes of a key that wasn't found */
+  unsigned long lookups;  /* hash chains searched for a key */
+  unsigned long hops;     /* index records compared with the key on them */
+  unsigned long bloomneg; /* lookups that a Bloom filter answered */
+  off_t idxbytes;         /* bytes of index records read */
+  off_t datbytes;         /* bytes of data read */
+  unsigned long locks;    /* record locks waited for (F_SETLKW) */
+  double lockwait;        /* nanoseconds taken to get them */
+  double lockmax;         /* longest of those waits */
+  DBLAT fetch;            /* db_fetch(), db_fetch_into(), db_read() and */
+                          /* db_fetch_view() */
+  DBLAT store;            /* db_store(), outside of a batch */
+  DBLAT delete;           /* db_delete(), outside of a batch */
+} DBSTATS;
+
 /*
  * Function prototypes for database library public functions.
  */
 DBHANDLE db_open(const char *, int, ...);
+DBHANDLE db_openopt(const char *, int, int, const DBOPTS *);
 void db_close(DBHANDLE);
 
 int db_store(DBHANDLE, const char *, const char *, int);
 char *db_fetch(DBHANDLE, const char *);
+ssize_t db_read(DBHANDLE, const char *, void *, size_t, off_t);
+ssize_t db_fetch_into(DBHANDLE, const char *, char *, size_t);
+const char *db_fetch_view(DBHANDLE, const char *, size_t *);
+void db_release(DBHANDLE, const char *);
+long db_fetch_many(DBHANDLE, char *const[], char **, long);
 int db_delete(DBHANDLE, const char *);
 
+int db_begin(DBHANDLE);
+long db_commit(DBHANDLE);
+long db_commit_results(DBHANDLE, int *);
+void db_abort(DBHANDLE);
+
 void db_rewind(DBHANDLE);
 char *db_nextrec(DBHANDLE, char *);
+int db_snapshot(DBHANDLE);
+void db_snapend(DBHANDLE);
+int db_seek(DBHANDLE, const char *);
+char *db_next(DBHANDLE, char *);
+long db_scan(DBHANDLE, int, int (*)(void *, const char *, const char *),
+             void *);
+
+ssize_t db_readchanges(DBHANDLE, unsigned long *, void *, size_t);
+ssize_t db_applychanges(DBHANDLE, const void *, size_t);
+int db_trimchanges(DBHANDLE, unsigned long);
+
+void db_info(DBHANDLE, DBINFO *);
+void db_stats(DBHANDLE, DBSTATS *);
+double db_latbound(int);
+long db_chainlen(DBHANDLE, long);
+int db_compact(DBHANDLE, DBCOMPACT *, void (*)(const DBCOMPACT *));
+int db_bulkload(DBHANDLE, int, DBBULK *);
+int db_verify(DBHANDLE, int, DBVERIFY *,
+              void (*)(void *, const char *, off_t, const char *), void *);
+size_t db_traindict(const char *const[], long, char *, size_t);
 
 /*
  * Flags for db_store()
@@ -32,6 +192,34 @@ char *db_nextrec(DBHANDLE, char *);
 #define DB_REPLACE  2   /* replace existing record */
 #define DB_STORE    3   /* replace or insert */
 
+/*
+ * Index file formats for DBOPTS.format
+ */
+#define DB_FMT_ASCII  0 /* ASCII chain ptrs and lengths, max 10 MB index */
+#define DB_FMT_BINARY 1 /* little-endian 64-bit ptrs and 32-bit lengths */
+
+/*
+ * Hash functions for DBOPTS.hashfn.  ASCII databases always use DB_HASH_APUE.
+ */
+#define DB_HASH_DEFAULT 0 /* DB_HASH_XXH64 for binary databases */
+#define DB_HASH_APUE    1 /* original sum of characters times positions */
+#define DB_HASH_XXH64   2 /* xxHash64 */
+#define DB_HASH_SIPHASH 3 /* SipHash-2-4, keyed by the seed */
+
+/*
+ * Flags for DBOPTS.flags
+ */
+#define DB_OPT_MMAP 0x1 /* serve reads from read-only mappings of the files */
+#define DB_OPT_WAL  0x2 /* log updates to a write-ahead log, pathname.wal */
+#define DB_OPT_THREADS 0x4 /* handle may be shared between threads */
+#define DB_OPT_LOCKTAB 0x8 /* lock through a shared lock table, pathname.lck */
+#define DB_OPT_ORDERED 0x10 /* binary: also keep the keys in order */
+#define DB_OPT_BLOOM 0x20 /* binary: Bloom filters of chains, pathname.blm */
+#define DB_OPT_CHANGES 0x40 /* binary: log of changes, pathname.chg */
+#define DB_OPT_CHECKSUM 0x80 /* binary: CRC32C checksums of the records */
+#define DB_OPT_COMPRESS 0x100 /* binary: compress the data of the records */
+#define DB_OPT_SNAPSHOT 0x200 /* binary: snapshots for scans, pathname.snp */
+
 /*
  * Implementation limits
  */
@@ -39,5 +227,8 @@ char *db_nextrec(DBHANDLE, char *);
 #define IDXLEN_MAX  1024    /* arbitrary */
 #define DATLEN_MIN  2       /* data byte, newline */
 #define DATLEN_MAX  1024    /* arbitrary */
+#define DATLEN_BIG  (64 * 1024 * 1024) /* binary: max data; arbitrary */
+#define DB_CHGHDR   16      /* bytes of a change record besides key and data */
+#define DB_DICTMAX  32768   /* longest compression dictionary */
 
 #endif /* _APUE_DB_H */
@@ -2,8 +2,12 @@
 #include "apue_db.h"
 #include <errno.h>
 #include <fcntl.h> /* open() & db_open() flags */
+#include <pthread.h>
 #include <stdarg.h>
-#include <sys/uio.h> /* struct iovec */
+#include <stdint.h>
+#include <sys/mman.h> /* mmap() */
+#include <sys/uio.h>  /* struct iovec */
+#include <time.h>
 
 /*
  * Internal index file constants.  These are used to construct records in the
@@ -24,35 +28,699 @@
 #define FREE_OFF 0      /* free list offset in index file */
 #define HASH_OFF PTR_SZ /* hash table offset in index file */
 
+/*
+ * Binary index file format (DB_FMT_BINARY).  The index file starts with a
+ * fixed size header identifying the format, followed by the free list slot,
+ * the hash table slots and then the index records.  Each slot holds a 64-bit
+ * chain ptr, and a hash table slot also the generation of its chain
+ * (F_CHAINGEN).  Each index record is a fixed size record header followed by
+ * the key bytes (no separators, no terminator).  All integers are stored
+ * little-endian, regardless of the byte order of the host.  The data file
+ * layout is the same for both formats, unless the index file has the F_ALLOC
+ * feature (see below).
+ */
+#define BIN_MAGIC "APUE_DB\n" /* first bytes of a binary index file */
+#define BIN_MAGIC_SZ 8
+#define BIN_VERSION 3            /* on-disk format version */
+#define BIN_VERSION_MIN 2        /* oldest version still understood */
+#define BIN_HDR_SZ 4096          /* size of the index file header */
+#define BIN_SLOT_SZ 16           /* size of free list and hash table slots */
+#define BIN_REC_MAGIC 0x00dbdb00 /* first word of every index record */
+#define BIN_REC_SZ 48            /* size of the index record header */
+#define BIN_NSEG 32              /* max number of hash table segments */
+
+/*
+ * Field offsets in the binary index file header.  A zero nbucket or maxload,
+ * as in index files created before online rehashing, means a fixed size hash
+ * table of nhash buckets.
+ */
+#define HDR_MAGIC 0     /* char[8]: BIN_MAGIC */
+#define HDR_VERSION 8   /* u32: BIN_VERSION */
+#define HDR_HDRSZ 12    /* u32: offset of free list slot */
+#define HDR_NHASH 16    /* u64: initial hash table size */
+#define HDR_NBUCKET 24  /* u64: current number of buckets */
+#define HDR_NREC 32     /* u64: number of records (only if maxload != 0) */
+#define HDR_MAXLOAD 40  /* u32: split buckets when nrec > maxload * nbucket */
+#define HDR_HASHFN 48   /* u32: DB_HASH_xxx; 0 for DB_HASH_APUE */
+#define HDR_FEATURES 52 /* u32: F_xxx features of the file */
+#define HDR_SEED 56     /* u64: hash function seed */
+#define HDR_SEGOFF 64   /* u64[BIN_NSEG]: offsets of hash table segments */
+#define HDR_MERGES 320  /* u64: number of extent merges (F_ALLOC) */
+#define HDR_TREE 328    /* u64: root node of the ordered index (F_ORDERED) */
+#define HDR_TREEGEN 336 /* u64: changes made to the ordered index (F_ORDERED) */
+#define HDR_CHGSEQ 344  /* u64: last change of the change log in the files */
+#define HDR_DICT 352    /* u64: record holding the dictionary (F_PACKED); 0 */
+                        /* if none */
+#define HDR_EPOCH 360   /* u32: latest epoch of an update (F_SNAPSHOT) */
+#define HDR_RETIRE 368  /* u64[2][3]: retire list of each heap: first block, */
+                        /* last block, epoch of the oldest entry (F_SNAPSHOT) */
+#define HDR_FREECLS 512 /* u64[2][EXT_NCLASS]: free extent lists (F_ALLOC) */
+
+/*
+ * Index file features.  Files without a feature behave as they did before it
+ * was added.
+ */
+#define F_ALLOC 0x1 /* free space managed by _db_extalloc() and _db_extfree() */
+#define F_CHAINGEN 0x2 /* hash table slots count the updates of their chains */
+#define F_BIGDATA 0x4  /* data records up to DATLEN_BIG bytes (with F_ALLOC) */
+#define F_ORDERED 0x8  /* keys also kept in order in a B+-tree (with F_ALLOC) */
+#define F_CHECKSUM 0x10 /* records carry CRC32C checksums (with F_ALLOC) */
+#define F_PACKED 0x20   /* data records may be compressed (with F_ALLOC) */
+#define F_SNAPSHOT 0x40 /* updates copy on write for snapshots (with F_ALLOC) */
+
+/*
+ * Longest data record, including the newline, that the index file allows.
+ */
+#define DATLEN(db) ((db)->features & F_BIGDATA ? DATLEN_BIG : DATLEN_MAX)
+
+/*
+ * Length of the data of the current record once unpacked, including the
+ * newline.
+ */
+#define RAWLEN(db) ((db)->rawlen != 0 ? (db)->rawlen : (db)->datlen)
+
+/*
+ * Field offsets in a binary hash table slot.  The generation of a chain goes up
+ * by one every time the chain or one of its records is changed, so that a
+ * record cache can tell whether what it holds from the chain is still current.
+ */
+#define SLOT_PTR 0 /* u64: chain ptr */
+#define SLOT_GEN 8 /* u64: generation of the chain (F_CHAINGEN) */
+
+/*
+ * Lock bytes in the binary index file header.  The bytes of the nbucket and
+ * nrec fields serialise bucket splits and updates of the record count.  Appends
+ * to the index file lock a byte of their own, instead of the whole file from
+ * the end of the hash table, because hash table segments added by splits live
+ * among the index records and their chain locks must not be overlapped.  The
+ * first byte of the root of the ordered index serialises changes to the tree,
+ * and the first byte of the change sequence number serialises the processes
+ * that apply changes with db_applychanges().
+ */
+#define LCK_SPLIT HDR_NBUCKET /* bucket split lock */
+#define LCK_NREC HDR_NREC     /* record count lock */
+#define LCK_APPEND 44         /* index file append lock */
+#define LCK_TREE HDR_TREE     /* ordered index lock */
+#define LCK_CHGSEQ HDR_CHGSEQ /* db_applychanges() lock */
+
+/*
+ * Field offsets in the binary index record header.  Bytes 32 to 39 are used by
+ * the checksums of F_CHECKSUM files, bytes 40 to 43 by records with packed
+ * data, and bytes 44 to 47 by F_SNAPSHOT files; they are otherwise reserved
+ * and must be zero.
+ */
+#define REC_MAGIC 0   /* u32: BIN_REC_MAGIC */
+#define REC_LEN 4     /* u32: record length, including header */
+#define REC_PTR 8     /* u64: chain ptr */
+#define REC_DATOFF 16 /* u64: offset of data record */
+#define REC_DATLEN 24 /* u32: length of data record, including newline */
+#define REC_KEYLEN 28 /* u16: length of key */
+#define REC_FLAGS 30  /* u16: record flags */
+#define REC_SUM 32    /* u32: CRC32C of the record but chain ptr and REC_SUM */
+#define REC_DATSUM 36 /* u32: CRC32C of the data record, including newline */
+#define REC_RAWLEN 40 /* u32: length of packed data unpacked, with newline */
+#define REC_BIRTH 44  /* u32: epoch of the update that wrote the record */
+
+/*
+ * Index record flags.  Hash table segments, the nodes of the ordered index and
+ * the compression dictionary are stored as records without a key, so that
+ * db_nextrec() can step over them.
+ */
+#define REC_F_SEGMENT 0x1 /* record holds hash table segment slots */
+#define REC_F_TREE 0x2    /* record is a node of the ordered index */
+#define REC_F_PACKED 0x4  /* data record is packed (F_PACKED) */
+#define REC_F_DICT 0x8    /* record holds the compression dictionary */
+#define REC_F_RETIRE 0x10 /* record is a block of a retire list (F_SNAPSHOT) */
+
+/*
+ * Checksums (F_CHECKSUM).  Every index record with a key carries a CRC32C of
+ * its header and key, leaving out the chain ptr, which changes whenever a
+ * record next to it on the chain comes or goes, and a CRC32C of its data
+ * record.  Both are checked whenever a whole record is read, and a record that
+ * fails the check, like one that isn't well formed in any file, is reported to
+ * the caller with EBADMSG instead of ending the process.  Records are written
+ * with their checksums in place, and a record that is rewritten in place is
+ * rewritten with the free list lock held, as when its data moves, so that
+ * db_nextrec() and db_scan() never see it half written.  Hash table segments
+ * and the nodes of the ordered index are not checksummed.
+ */
+#define CRC_POLY 0x82f63b78 /* CRC32C (Castagnoli) polynomial, reflected */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_CRC32C_HW 1 /* SSE4.2 crc32 instruction, if the CPU has it */
+#endif
+
+/*
+ * Compression of the data records (F_PACKED), in the LZ4 block format: a run
+ * of literal bytes, then a match, a copy of at least PACK_MINMATCH bytes from
+ * up to PACK_MAXOFF bytes back, and so on, with only literals at the end.  The
+ * data is packed when its record is written, if that makes its extent
+ * smaller, and the index record is flagged REC_F_PACKED and given the length
+ * of the data unpacked.  The newline still ends the data record, and the
+ * checksum of F_CHECKSUM files is of the packed record, so that db_verify()
+ * and the other checks see records as they are on disk.  A database may have a
+ * dictionary, fixed when it's created: bytes that matches may also be copied
+ * from, as if they came just before the data, so that short records that
+ * have little in them to repeat share the strings they have in common with
+ * each other.  It's kept in a record of the index file without a key.
+ */
+#define PACK_MINMATCH 4 /* shortest match */
+#define PACK_MAXOFF 65535 /* farthest a match can be copied from */
+#define PACK_LASTLIT 5  /* the last bytes are always literals */
+#define PACK_MFLIMIT 12 /* no match starts closer than this to the end */
+#define PACK_HBITS 12   /* hash table of the data: up to 2^12 positions */
+#define DICT_HBITS 15   /* hash table of the dictionary: 2^15 positions */
+#define PACK_HASH(seq, bits) /* Fibonacci hash of 4 bytes */                  \
+  ((uint32_t)((seq) * 2654435761U) >> (32 - (bits)))
+#define TRAIN_K 6       /* db_traindict(): length of the strings counted */
+#define TRAIN_SEG 64    /* db_traindict(): length of the pieces taken */
+#define TRAIN_STEP 16   /* db_traindict(): pieces start this far apart */
+#define TRAIN_HBITS 20  /* db_traindict(): 2^20 string counts */
+
+/*
+ * Ordered index (F_ORDERED).  Besides the hash table, the keys are kept in a
+ * B+-tree whose nodes are index records of TREE_NODE bytes, allocated from the
+ * heap of index records.  A leaf holds keys in order, and links to the next
+ * leaf; an interior node holds its first child, then separator keys, each
+ * followed by the child that holds the keys from that separator on.  Keys
+ * compare as unsigned bytes, as with strcmp().  Changes to the tree are made
+ * with the tree lock write locked, and count in its generation in the header,
+ * so that db_next() can tell whether the leaf it holds is still current.  A key
+ * goes into the tree before its record is written, and comes out after its
+ * record is deleted, so the tree holds every key of the database, and at times
+ * keys whose records are gone, which db_next() skips.  Nodes are not merged
+ * when keys are deleted.
+ */
+#define TREE_NODE 4096   /* size of a node, including the index record header */
+#define TREE_DEPTH 32    /* deepest tree; every level at least doubles */
+#define TN_LEVEL 48      /* u16: height above the leaves; 0 for a leaf */
+#define TN_USED 50       /* u16: bytes of entries */
+#define TN_NEXT 56       /* u64: next leaf; 0 for the last one */
+#define TN_FIRST 64      /* u64: first child of an interior node */
+#define TN_ENT 72        /* entries: u16 key length, key, interior: u64 child */
+#define TN_ROOM (TREE_NODE - TN_ENT)
+#define TN_ENTSZ(level, keylen) (2 + (keylen) + ((level) != 0 ? 8 : 0))
+
+/*
+ * Free space management (F_ALLOC).  The index records and the data records are
+ * each kept in a heap of extents: the index file from the first index record
+ * on, and the whole data file.  Every extent starts with a magic number and its
+ * size, and ends with its size again, so that the extents on both sides of
+ * any extent can be found.  The size is a multiple of EXT_ALIGN.  An index
+ * record is an extent whose header is the index record header; a data record
+ * is EXT_HDR_SZ bytes after the start of its extent.  The data file starts with
+ * a short header, because offset 0 marks the end of a free list.
+ *
+ * Free extents are kept on doubly linked lists, one per size class, with the
+ * list heads in the index file header.  There are four classes for every power
+ * of two, so a class holds extents that differ in size by less than 25%.  A
+ * free extent goes on the list of the largest class not above its size;
+ * allocation starts at the smallest class not below the size wanted, where
+ * every extent is big enough, so the first nonempty list supplies the extent
+ * without a search.  What's left over is split off as a new free extent, and
+ * freed extents are merged with free neighbours, so two free extents are never
+ * adjacent.  The free list lock protects the lists and the extent headers.
+ * Merging removes extent boundaries, so it's counted in the header, and
+ * db_nextrec() finds its place again if there has been a merge since it was
+ * last called.
+ */
+#define EXT_FREE_MAGIC 0x00dbfe00 /* first word of a free extent */
+#define EXT_DAT_MAGIC 0x00dbda00  /* first word of a data record extent */
+#define EXT_HDR_SZ 8   /* u32 magic, u32 size */
+#define EXT_FTR_SZ 4   /* u32 size */
+#define EXT_NEXT 8     /* u64: next free extent in the same class */
+#define EXT_PREV 16    /* u64: previous free extent in the same class */
+#define EXT_FREE_SZ 24 /* header of a free extent, with the list links */
+#define EXT_ALIGN 8    /* extent sizes are multiples of this */
+#define EXT_MIN 32     /* smallest extent */
+#define EXT_NCLASS 108 /* size classes, for extents of 2^5 up to 2^32 bytes */
+#define DAT_MAGIC "APUE_DAT" /* data file header */
+#define DAT_HDR_SZ 8
+#define HEAP_IDX 0 /* the heap of index records */
+#define HEAP_DAT 1 /* the heap of data records */
+
+#define MAP_CHUNK (1024 * 1024) /* mappings grow in multiples of this size */
+
+/*
+ * Write-ahead log, <name>.wal (DB_OPT_WAL).  After the header, every write that
+ * an update makes to the index and data files is logged before it is made,
+ * with the bytes it replaces, and the update ends with a commit record.
+ */
+#define WAL_MAGIC "APUE_WAL" /* log header */
+#define WAL_HDR_SZ 64
+#define WAL_GEN 8          /* u64: checkpoint generation */
+#define WAL_SYNCED 16      /* u64: log on disk up to here in this generation */
+#define WAL_LCK_WRITE 0    /* lock byte for updates, one at a time */
+#define WAL_LCK_SYNC 1     /* lock byte for syncing the log and checkpoints */
+#define WAL_REC_MAGIC 0x00dbaa10
+#define WAL_REC_SZ 48      /* log record header, then new and old bytes */
+#define WREC_MAGIC 0       /* u32: WAL_REC_MAGIC */
+#define WREC_TYPE 4        /* u16: W_WRITE or W_COMMIT */
+#define WREC_FILE 6        /* u16: HEAP_IDX, HEAP_DAT or WAL_CHG */
+#define WREC_OFF 8         /* u64: file offset of the write */
+#define WREC_LEN 16        /* u32: bytes written */
+#define WREC_OLDLEN 20     /* u32: bytes replaced; fewer at the end of file */
+#define WREC_FSIZE 24      /* u64: file size before the write, if it grew */
+#define WREC_GEN 32        /* u64: checkpoint generation */
+#define WREC_SUM 40        /* u64: xxHash64 of the record, with this zero */
+#define W_WRITE 1
+#define W_COMMIT 2
+#define WAL_NOSIZE UINT64_MAX /* the write didn't make the file bigger */
+#define WAL_CKPT (4 * 1024 * 1024) /* checkpoint when the log gets this big */
+#define WAL_CHG 2          /* WREC_FILE of writes to the change log */
+
+/*
+ * db_fetch_many() reads data records that are at most FETCH_GAP bytes apart
+ * with a single read of at most FETCH_RUN bytes.
+ */
+#define FETCH_GAP 4096
+#define FETCH_RUN (64 * 1024)
+
+/*
+ * db_scan() reads the index file SCAN_BLOCK bytes at a time, and the data file
+ * through a window of the same size.  The byte ranges of its threads start at
+ * index records found at the heads of SCAN_SAMPLES hash chains per thread.
+ */
+#define SCAN_BLOCK (1024 * 1024)
+#define SCAN_SAMPLES 64
+
+/*
+ * db_verify() reads the heaps as db_scan() does, and marks a key it can't hash
+ * with VRF_NOBUCKET.
+ */
+#define VRF_NOBUCKET (~(DBHASH)0)
+
+/*
+ * db_compact() writes the new files under the database name with this suffix
+ * added, e.g. db4.compact.idx, and renames them into place when done.
+ */
+#define COMPACT_SUFFIX ".compact"
+
+/*
+ * db_bulkload() sorts up to BULK_MEM bytes of records in memory unless told
+ * otherwise, reads and writes BULK_CHUNK bytes at a time, writes the hash table
+ * BULK_SLOTS slots at a time, spools records to at most BULK_MAXPART partition
+ * files, through buffers of BULK_FILEBUF bytes, and stores BULK_BATCH records
+ * per batch in a database that isn't empty.
+ */
+#define BULK_MEM (64 * 1024 * 1024)
+#define BULK_CHUNK (1024 * 1024)
+#define BULK_SLOTS 4096
+#define BULK_MAXPART 256
+#define BULK_FILEBUF (64 * 1024)
+#define BULK_BATCH 65536
+#define BULK_LINE (IDXLEN_MAX + DATLEN_MAX) /* no record is longer */
+#define BULK_HDR_SZ 12 /* spooled record: u64 hash, u16 key and data lengths */
+
+/*
+ * Bytes of an index record besides the key, for checking key lengths: binary
+ * keys are shorter than IDXLEN_MAX; ASCII index records also hold separators,
+ * a data offset of up to 20 digits, a length and a newline.
+ */
+#define BULK_IDXEXTRA(db) ((db)->format == DB_FMT_BINARY ? 1 : 27)
+
+/*
+ * The record cache (DBOPTS.cachesize) starts with CACHE_NHASH buckets, and
+ * doubles them whenever it holds more entries than buckets.
+ */
+#define CACHE_NHASH 256
+#define CACHE_BUCKET(db, hval) (((hval) ^ ((hval) >> 17)) & ((db)->nchash - 1))
+
+/*
+ * Files a lock is on, in the lock table of a handle shared by threads
+ * (DB_OPT_THREADS), and the end of a lock that runs to the end of the file and
+ * beyond (length 0).
+ */
+#define LOCK_IDX 0   /* index file */
+#define LOCK_DAT 1   /* data file */
+#define LOCK_WAL 2   /* write-ahead log */
+#define LOCK_CHG 3   /* change log */
+#define LOCK_SNP 4   /* snapshot file */
+#define LOCK_OTHER 5 /* the lock file of db_compact() */
+#define LOCK_EOF ((off_t)(~(uint64_t)0 >> 1))
+#define LOCK_RETRY 1000000 /* ns to wait after a false deadlock */
+
+/*
+ * Shared lock table (DB_OPT_LOCKTAB), pathname.lck.  The bytes of the index
+ * file are dealt out to LT_NPART partitions in runs of LT_RUN bytes, so that
+ * neighbouring hash chains fall in different partitions.  Byte 0 of the lock
+ * file is locked while the table is set up, and each process that uses the
+ * table holds a write lock on byte 1 + slot while it does.
+ */
+#define LT_MAGIC "APUE_LCK"
+#define LT_NPART 64   /* partitions, each with a mutex */
+#define LT_RUN 16     /* consecutive bytes of the index file per partition */
+#define LT_NENT 1024  /* locks per partition */
+#define LT_NSLOT 1024 /* processes using the table at the same time */
+#define LT_WAIT 1     /* seconds to wait before looking for dead owners */
+
+/*
+ * Bloom filters of the hash chains (DB_OPT_BLOOM), pathname.blm.  After a
+ * header, the file holds an entry of BLM_ENT_SZ bytes for each bucket: the
+ * generation of the chain that the entry describes, and a Bloom filter of the
+ * keys on the chain at that generation.  An entry is only believed while its
+ * chain is still at that generation, so a process that changes the chain
+ * without updating the entry, or an entry lost in a crash or left over from
+ * other files, only costs a walk of the chain.  An entry is marked unknown
+ * while its filter is built again, in case the process dies part way through.
+ * The entries aren't in the write-ahead log, though, and an update rolled back
+ * from it puts chains back to generations that later updates reach again with
+ * other keys, so recovery marks every entry unknown, and the process that
+ * recovered builds the filters again.  Entries are updated with their chain
+ * write locked, and read with it locked.  Bits aren't cleared when keys are
+ * deleted; once there have been more deletes than there are keys left, the
+ * filter is built again from the chain.
+ */
+#define BLM_MAGIC "APUE_BLM"
+#define BLM_HDR_SZ 64
+#define BLM_INO 8     /* u64: inode of the index file the entries are for */
+#define BLM_ENT_SZ 64 /* bytes of each entry */
+#define BLM_GEN 0     /* u64: generation of the chain; 0 if none yet */
+#define BLM_NKEY 8    /* u32: keys on the chain */
+#define BLM_NDEL 12   /* u32: keys deleted since the filter was built */
+#define BLM_BITS 16   /* the filter, of BLM_NBITS bits */
+#define BLM_NBITS ((BLM_ENT_SZ - BLM_BITS) * 8)
+#define BLM_NPROBE 4  /* bits set for each key */
+
+/*
+ * Changes to a chain, for _db_bloomput().
+ */
+#define BLM_ADD 0   /* a key was added */
+#define BLM_KEEP 1  /* the keys are the same (data replaced) */
+#define BLM_DEL 2   /* a key was deleted */
+#define BLM_BUILD 3 /* build the filter again from the chain */
+
+/*
+ * Change log (DB_OPT_CHANGES), pathname.chg.  After a header, the file holds a
+ * record for every change that db_store(), db_delete(), db_commit() and
+ * db_bulkload() make to a key, in the order they make them: the sequence
+ * number of the change, one more than that of the record before, and the key
+ * with the data it was left with, or without data if it was deleted.  Records
+ * are appended under the lock byte of the file, with the chain of the key
+ * still write locked, so the changes of a key are logged in the order they
+ * were made, and replaying the records in order leaves every key as it is in
+ * the database.  The sequence number of the last record appended is written to
+ * the index file header in the same update; db_applychanges() keeps it there
+ * in a copy of the database.  A new log starts at the time in microseconds, or
+ * after the sequence number in the header if that is higher, so a copy that
+ * followed an earlier log finds the gap.  db_trimchanges() writes the records
+ * it keeps to a new file, renames it into place, and marks the old one
+ * replaced, so that every process opens the new one.
+ */
+#define CHG_MAGIC "APUE_CHG"
+#define CHG_HDR_SZ 64
+#define CHG_FIRST 8   /* u64: sequence number of the first record */
+#define CHG_NEXT 16   /* u64: sequence number of the next record */
+#define CHG_END 24    /* u64: end of the records */
+#define CHG_FLAGS 32  /* u32: CHG_F_xxx */
+#define CHG_LCK 0     /* lock byte for appends and the header */
+#define CHG_F_COMPLETE 0x1 /* the log starts with the database empty */
+#define CHG_F_REPLACED 0x2 /* replaced by db_trimchanges(): open it again */
+#define CHG_REC_SZ DB_CHGHDR /* record header, then the key and the data */
+#define CREC_SEQ 0    /* u64: sequence number */
+#define CREC_OP 8     /* u8: CHG_PUT or CHG_DEL */
+#define CREC_KEYLEN 10 /* u16: bytes of key */
+#define CREC_DATLEN 12 /* u32: bytes of data, without the newline */
+#define CHG_PUT 1     /* the key was stored with the data */
+#define CHG_DEL 2     /* the key was deleted */
+#define CHG_FLUSH (1024 * 1024) /* _db_chgfill() appends this much at a time */
+
+/*
+ * Snapshots (F_SNAPSHOT), pathname.snp.  db_snapshot() gives db_nextrec() and
+ * db_scan() a consistent image of the database as it was when the snapshot
+ * was taken, without a lock held for the length of the scan.  Time is counted
+ * in epochs: the counter in the snapshot file goes up by one for each
+ * snapshot, which pins the new value in a slot of the file, and an update is
+ * made in the epoch the counter is at when it starts.  Every index record
+ * carries the epoch of the update that wrote it.  While any snapshot is
+ * pinned, updates copy on write: a record that is replaced gets a new index
+ * record and data record, swapped onto its chain in place of the old ones, and
+ * a record that is replaced or deleted is marked dead with the epoch of the
+ * update instead of being freed.  A snapshot of epoch E sees the records
+ * written before E that weren't dead before E.  The extents of dead records go
+ * on a retire list, one for each heap, whose blocks are index records without
+ * a key, and updates free them from there a few at a time: data records once
+ * every snapshot still pinned is younger than the update that retired them,
+ * and index records only once no snapshot is pinned, so that no extents of the
+ * index file are merged under a snapshot walking it.  An update read locks the
+ * epoch byte of the snapshot file before it reads the counter, until it is
+ * done, so db_snapshot(), which write locks it, falls between updates; the
+ * turn byte keeps a stream of updates from holding it off.  The process that
+ * pins a slot write locks its first byte, and another process clears the slot
+ * once the lock is free and the process gone.  A new snapshot file starts
+ * after the latest epoch recorded in the index file header.
+ */
+#define SNP_MAGIC "APUE_SNP"
+#define SNP_HDR_SZ 64
+#define SNP_EPOCH 8     /* u32: epoch counter */
+#define SNP_NSLOT 64    /* snapshots pinned at the same time */
+#define SNP_SLOT_SZ 16  /* slot: u32 epoch pinned, 0 if free; u32 process ID */
+#define SNP_SIZE (SNP_HDR_SZ + SNP_NSLOT * SNP_SLOT_SZ)
+#define SNP_LCK_TURN 0  /* lock byte taken before the epoch byte */
+#define SNP_LCK_EPOCH 1 /* read locked by updates, write locked by snapshots */
+#define SNP_RECLAIM 64  /* most retired extents an update frees */
+#define REC_DEAD ((uint64_t)1 << 63) /* chain ptr of a dead index record, */
+                                     /* with the epoch of the update */
+#define RB_SIZE 4096    /* size of a retire list block */
+#define RB_FIRST 48     /* u32: first entry not freed yet */
+#define RB_COUNT 52     /* u32: entries in the block */
+#define RB_ENT 56       /* entries: u64 offset of the extent, u64 epoch */
+#define RB_NENT ((RB_SIZE - RB_ENT - EXT_FTR_SZ) / 16)
+
+/*
+ * Shared lock tables need mutexes that can be shared between processes, and
+ * recovered when their owner dies.
+ */
+#if defined(_POSIX_THREAD_ROBUST_PRIO_INHERIT) &&                              \
+    _POSIX_THREAD_ROBUST_PRIO_INHERIT > 0
+#define HAVE_LOCKTAB 1
+#endif
+
+/*
+ * Record locks set through _db_lockreg(): the same as lock_reg(), on the
+ * database files of a DB structure.
+ */
+#define _db_readw_lock(db, fd, offset, len)                                    \
+  _db_lockreg((db), (fd), F_SETLKW, F_RDLCK, (offset), (len))
+#define _db_writew_lock(db, fd, offset, len)                                   \
+  _db_lockreg((db), (fd), F_SETLKW, F_WRLCK, (offset), (len))
+#define _db_write_lock(db, fd, offset, len)                                    \
+  _db_lockreg((db), (fd), F_SETLK, F_WRLCK, (offset), (len))
+#define _db_un_lock(db, fd, offset, len)                                       \
+  _db_lockreg((db), (fd), F_SETLK, F_UNLCK, (offset), (len))
+
 typedef unsigned long DBHASH; /* hash values */
 typedef unsigned long COUNT;  /* unsigned counter */
 
+/*
+ * Hash function: key, key length, seed.
+ */
+typedef uint64_t (*DBHASHFN)(const char *, size_t, uint64_t);
+
+/*
+ * Read-only mapping of the index file or data file, used when the database is
+ * opened with DB_OPT_MMAP.  The mapping may extend past the end of the file,
+ * so that it doesn't have to be remapped every time the file grows, but only
+ * the first size bytes are ever referenced.
+ */
+typedef struct {
+  char *addr;    /* start of mapping; NULL if not mapped yet */
+  size_t maplen; /* length of mapping */
+  off_t size;    /* file size when last checked */
+  long pins;     /* views into the mapping not yet released */
+  char **old;    /* malloc'ed array of earlier mappings, kept while pinned */
+  size_t *oldlen; /* lengths of the earlier mappings */
+  int nold;      /* number of earlier mappings */
+} DBMAP;
+
+/*
+ * A view handed out by db_fetch_view(): a pointer into the data file mapping,
+ * whose chain stays read locked until db_release(), or a malloc'ed copy of the
+ * data.
+ */
+typedef struct {
+  const char *data; /* the data */
+  off_t chainoff;   /* offset of the locked hash chain; -1 for a copy */
+} DBPIN;
+
+/*
+ * An update staged by db_store() or db_delete() between db_begin() and
+ * db_commit().
+ */
+typedef struct {
+  char *key;           /* malloc'ed key, followed by the data */
+  char *data;          /* data; NULL for a delete */
+  int flag;            /* DB_INSERT, DB_REPLACE or DB_STORE */
+  long seq;            /* order in which the update was staged */
+  DBHASH hval;         /* hash value of the key */
+  off_t chainoff;      /* offset of the hash chain of the key */
+  int found;           /* 1 if the key is on the chain; 2 if taken off it; */
+                       /* -1 if a bad record on the chain hid it */
+  const char *newdata; /* data to write a new record with */
+  size_t newlen;       /* _db_commitins(): length of its data record */
+  size_t rawlen;       /* _db_commitins(): length unpacked if packed, or 0 */
+  size_t packoff;      /* _db_commitins(): offset of the packed data in */
+                       /* db->packbuf */
+} DBOP;
+
+/*
+ * Results of the staged updates of a key, from _db_opresult().
+ */
+#define OP_NONE 0   /* nothing to do */
+#define OP_DELETE 1 /* delete the record */
+#define OP_PUT 2    /* write the record with new data */
+
+/*
+ * A record cache entry: the result of looking up a key, which stands as long
+ * as the generation of the chain it was found on stays the same.  Entries are
+ * kept in an array, and chained through it from the cache hash table.
+ */
+typedef struct {
+  char *key;      /* malloc'ed key, followed by the data; NULL if unused */
+  char *data;     /* data; NULL if the key wasn't found */
+  size_t size;    /* bytes charged to the cache for the entry */
+  DBHASH hval;    /* hash value of the key */
+  off_t chainoff; /* offset of the hash chain the key was looked up on */
+  uint64_t gen;   /* generation of the chain at the time */
+  long next;      /* next entry in the cache bucket, or on the free list */
+  int ref;        /* used since the clock hand last passed */
+} DBCENT;
+
+/*
+ * Latency histogram of one kind of operation, in nanoseconds, with the buckets
+ * of DBLAT.hist (see _db_latbucket()).
+ */
+typedef struct {
+  COUNT count;    /* operations timed */
+  uint64_t total; /* time taken by all of them */
+  uint64_t min;   /* fastest */
+  uint64_t max;   /* slowest */
+  COUNT hist[DB_NLAT];
+} DBHIST;
+
 /*
  * Library private representation of the database.  Used to keep all the
  * information for each open database.  The DBHANDLE value that is returned by
  * db_open() and used by all the other functions is really just a pointer to
- * this DB structure.  Since pointer and lengths are stored as ASCII in the
- * database, these are converted to numeric values and saved in the DB struct.
+ * this DB structure.  Pointers and lengths read from the index file, either
+ * ASCII or binary, are converted to numeric values and saved in the DB struct.
  */
 typedef struct {
   int idxfd;      /* fd for index file */
   int datfd;      /* fd for data file */
+  int format;     /* DB_FMT_ASCII or DB_FMT_BINARY */
+  int mapped;     /* read through idxmap and datmap (DB_OPT_MMAP) */
+  DBMAP idxmap;   /* mapping of index file */
+  DBMAP datmap;   /* mapping of data file */
   char *idxbuf;   /* malloc'ed buffer for index record */
   char *datbuf;   /* malloc'ed buffer for data record */
+  size_t datbufsize; /* size of datbuf; grows to fit the records read */
   char *name;     /* name db was opened under */
+  size_t namelen; /* length of name, without extension */
+  int oflag;      /* flags to open the files again after db_compact() */
   off_t idxoff;   /* offset in index file of index record */
                   /* key is at (idxoff + PTR_SZ + IDXLEN_SZ) */
   size_t idxlen;  /* length of index record */
                   /* excludes IDXLEN_SZ bytes at front of record */
                   /* includes newline at end of index record */
+                  /* binary: whole record, including header */
   off_t datoff;   /* offset in data file of data record */
   size_t datlen;  /* length of data record */
                   /* includes newline at end */
+  uint32_t datsum; /* checksum of data record (F_CHECKSUM) */
+  size_t rawlen;  /* length of the data unpacked, including newline, if the */
+                  /* data record is packed (F_PACKED); 0 if it isn't */
+  int bad;        /* errno of the last record read that failed; 0 if none */
   off_t ptrval;   /* contents of chain ptr in index record */
   off_t ptroff;   /* chain ptr offset pointing to this idx record */
   off_t chainoff; /* offset of hash chain for this index record */
   off_t hashoff;  /* offset in index file of hash table */
-  DBHASH nhash;   /* current hash table size */
+  off_t freeoff;  /* offset in index file of free list ptr */
+  off_t recoff;   /* offset in index file of first index record */
+  off_t scanoff;  /* offset of next record for db_nextrec() */
+  size_t slotsz;  /* size of free list and hash table slots */
+  off_t recptr;   /* offset of chain ptr within an index record */
+  DBHASHFN hashfn; /* hash function for keys */
+  int hashid;     /* DB_HASH_xxx of hashfn */
+  uint64_t seed;  /* hash function seed */
+  DBHASH nhash;   /* size of hash table created with the index file */
+  DBHASH nbucket; /* current number of buckets; more than nhash after splits */
+  unsigned maxload; /* split buckets above this load; 0 for fixed nhash */
+  off_t segoff[BIN_NSEG]; /* offsets of hash table segments (binary) */
+  unsigned features; /* F_xxx features of the index file (binary) */
+  char *packbuf;   /* malloc'ed buffer for data packed, or read to unpack */
+  size_t packsize; /* size of packbuf */
+  uint32_t *packtab; /* malloc'ed hash table of _db_lzpack() */
+  char *dict;      /* malloc'ed compression dictionary (F_PACKED); or NULL */
+  size_t dictlen;  /* length of dict */
+  uint32_t *dicttab; /* malloc'ed hash table of the positions in dict */
+  uint64_t scanmerges; /* merge count when scanoff was set (F_ALLOC) */
+  int inbatch;     /* db_begin() called, db_commit() not yet */
+  DBOP *ops;       /* malloc'ed array of updates staged in the batch */
+  long nops;       /* number of staged updates */
+  long maxops;     /* size of ops array */
+  int *results;    /* db_commit_results(): result of each staged update */
+  char *batchbuf;  /* malloc'ed buffer for records written by db_commit() */
+  size_t batchlen; /* bytes used in batchbuf */
+  size_t batchsize; /* size of batchbuf */
+  int walfd;       /* fd for write-ahead log; -1 if none */
+  int inop;        /* update in progress: log writes (_db_walbegin()) */
+  uint64_t walgen; /* checkpoint generation of the log */
+  off_t walend;    /* end of the log, during an update */
+  long walrecs;    /* records logged by the update */
+  unsigned char *walbuf; /* malloc'ed buffer for log records */
+  size_t walbufsize;     /* size of walbuf */
+  DBPIN *pins;      /* malloc'ed array of views not yet released */
+  long npins;       /* number of views */
+  long maxpins;     /* size of pins array */
+  size_t cachemax;  /* bytes the record cache may use; 0 for no cache */
+  size_t cacheused; /* bytes used by cache entries */
+  DBCENT *cents;    /* malloc'ed array of cache entries */
+  long ncent;       /* entries of cents in use or on the free list */
+  long maxcent;     /* size of cents array */
+  long cfree;       /* first entry on the free list; -1 if none */
+  long *chash;      /* malloc'ed cache hash table: first entry of each bucket */
+  long nchash;      /* size of chash, a power of 2; 0 until first used */
+  long chand;       /* clock hand: next entry to consider for eviction */
+  struct dbshare *share; /* cursors of the handle (DB_OPT_THREADS); or NULL */
+  int inuse;        /* cursor belongs to a thread that hasn't exited */
+  int lockagain;    /* lock being taken was released by another cursor */
+  ino_t idxino;     /* inode of the index file, for the lock table */
+  struct dblt *lt;  /* shared lock table (DB_OPT_LOCKTAB); or NULL */
+  uint32_t ltowner; /* owner of the locks of the structure in the table */
+  unsigned char *treebuf; /* malloc'ed leaf of the ordered index, db_next() */
+  char *seekkey;    /* in treebuf: db_next() carries on from this key */
+  size_t seeklen;   /* length of seekkey */
+  int seekfrom;     /* seekkey itself may be returned, after db_seek() */
+  int treevalid;    /* treebuf holds a leaf of the tree of generation treegen */
+  uint64_t treegen; /* generation of the tree when treebuf was read */
+  size_t treepos;   /* offset in treebuf of the next entry */
+  DBHASH bucket;    /* bucket of the chain at chainoff (_db_lockchain()) */
+  int blmfd;        /* fd for the Bloom filters (DB_OPT_BLOOM); -1 if none */
+  int blmwrite;     /* blm is writable */
+  int blmstale;     /* recovery marked the Bloom filters unknown */
+  unsigned char *blm; /* shared mapping of the Bloom filter file */
+  size_t blmsize;   /* size of the mapping */
+  int chgfd;        /* fd for the change log (DB_OPT_CHANGES); -1 if none */
+  unsigned char *chgbuf; /* malloc'ed records not yet appended to the log */
+  size_t chglen;    /* bytes used in chgbuf */
+  size_t chgsize;   /* size of chgbuf */
+  uint64_t chgreadseq; /* last record returned by db_readchanges() */
+  off_t chgreadoff;    /* offset of the record after it; 0 if not known */
+  int snpfd;        /* fd for the snapshot file (F_SNAPSHOT); -1 if none */
+  uint32_t epoch;   /* epoch of the update in progress (_db_opbegin()) */
+  int cow;          /* snapshots are pinned: the update copies on write */
+  uint32_t snapmin; /* oldest epoch pinned, if cow */
+  int snapslot;     /* slot of the snapshot of db_snapshot(); -1 if none */
+  uint32_t snapepoch; /* epoch of the snapshot */
+  off_t snapend;    /* size of the index file when it was taken */
+  off_t snaprecoff; /* offset of the first index record then */
+  off_t snapoff;    /* offset of the next extent for db_nextrec() */
+  int snapidxfd;    /* old index file kept for the snapshot after */
+                    /* db_compact() replaced it; -1 if none */
+  int snapdatfd;    /* old data file kept with it */
+  char *snapbuf;    /* malloc'ed SCAN_BLOCK bytes of the index file */
+  off_t snapboff;   /* offset of snapbuf in the file */
+  size_t snapblen;  /* bytes in snapbuf */
 
   /*
    * Counters for both successful and unsuccessful operations.  Useful for
@@ -62,29 +730,514 @@ typedef struct {
   COUNT cnt_delerr;   /* delete error */
   COUNT cnt_fetchok;  /* fetch OK */
   COUNT cnt_fetcherr; /* fetch error */
+  COUNT cnt_cachehit; /* fetch answered from the record cache */
   COUNT cnt_nextrec;  /* nextrec */
   COUNT cnt_stor1;    /* store: DB_INSERT, no empty, appended */
   COUNT cnt_stor2;    /* store: DB_INSERT, found empty, reused */
   COUNT cnt_stor3;    /* store: DB_REPLACE, different len, appended */
   COUNT cnt_stor4;    /* store: DB_REPLACE, same len, overwrote */
   COUNT cnt_storerr;  /* store error */
+  COUNT cnt_lookup;   /* hash chains searched by _db_findrec() */
+  COUNT cnt_hops;     /* index records compared on them */
+  COUNT cnt_bloomneg; /* lookups the Bloom filter answered */
+  off_t cnt_idxbytes; /* bytes of index records read */
+  off_t cnt_datbytes; /* bytes of data read */
+  COUNT cnt_lock;     /* record locks waited for */
+  uint64_t lockns;    /* nanoseconds taken to get them */
+  uint64_t lockmax;   /* longest of those waits */
+  DBHIST latfetch;    /* latency of fetches */
+  DBHIST latstore;    /* latency of stores */
+  DBHIST latdelete;   /* latency of deletes */
 } DB;
 
+/*
+ * A record lock held by a cursor of a handle shared by threads: a range of
+ * bytes of one of the files.  Locks on the index and data files are also
+ * tagged with the inode of the index file, since db_compact() replaces the
+ * files, and cursors open the new ones at different times.
+ */
+typedef struct {
+  DB *owner;   /* cursor that holds the lock */
+  int file;    /* LOCK_xxx */
+  ino_t ino;   /* inode of the index file; 0 for the other files */
+  int type;    /* F_RDLCK or F_WRLCK */
+  int granted; /* taken with fcntl(); 0 while the owner is still taking it */
+  off_t start; /* first byte */
+  off_t end;   /* byte past the last; LOCK_EOF for the rest of the file */
+} DBLOCK;
+
+/*
+ * State shared by the cursors of a handle opened with DB_OPT_THREADS.  Each
+ * thread that uses the handle gets a cursor of its own: a DB structure with
+ * its own descriptors, buffers and cursor state, which goes back to the pool
+ * when the thread exits.  The fcntl() record locks belong to the process, so
+ * the cursors lock each other out with the lock table first.
+ */
+typedef struct dbshare {
+  DB *leader;            /* the handle: cursor of the thread that opened it */
+  pthread_key_t key;     /* cursor of the calling thread */
+  pthread_mutex_t mutex; /* protects the rest of the structure */
+  pthread_cond_t cond;   /* signalled when locks are released */
+  DBLOCK *locks;         /* malloc'ed lock table */
+  long nlocks;           /* locks held */
+  long maxlocks;         /* size of locks */
+  DB **cursors;          /* malloc'ed array of the other cursors */
+  long ncursors;         /* number of cursors */
+  long maxcursors;       /* size of cursors */
+} DBSHARE;
+
+/*
+ * A record lock on the index file in a shared lock table.  A lock is entered
+ * in every partition it has bytes in, and only those bytes count in each.
+ */
+typedef struct {
+  uint32_t slot;  /* slot of the process that holds the lock */
+  uint32_t owner; /* DB structure of the process that holds it */
+  uint64_t ino;   /* inode of the index file */
+  int64_t start;  /* first byte */
+  int64_t end;    /* byte past the last; LOCK_EOF for the rest of the file */
+  int32_t type;   /* F_RDLCK or F_WRLCK */
+} LTENT;
+
+/*
+ * A partition of a shared lock table.  The mutex is robust: when a process
+ * dies holding it, the next process to lock it is told, and removes the locks
+ * of dead processes.
+ */
+typedef struct {
+  pthread_mutex_t mutex; /* protects the partition; process-shared, robust */
+  pthread_cond_t cond;   /* broadcast when locks are released */
+  int32_t nwait;         /* processes waiting on cond */
+  int32_t nent;          /* entries of ent in use; counts complete ones only */
+  LTENT ent[LT_NENT];
+} LTPART;
+
+/*
+ * Layout of the lock file, which every process that uses it maps.
+ */
+typedef struct {
+  char magic[8];  /* LT_MAGIC, once set up */
+  uint32_t size;  /* sizeof(LTAB) */
+  LTPART part[LT_NPART];
+} LTAB;
+
+/*
+ * A shared lock table as mapped by this process.  All the DB structures of the
+ * process on the same database use one mapping, since closing any descriptor
+ * for the lock file would release the lock on the slot.
+ */
+typedef struct dblt {
+  struct dblt *next;  /* next table mapped by the process */
+  dev_t dev;          /* device of the lock file */
+  ino_t ino;          /* inode of the lock file */
+  pid_t pid;          /* process that mapped it, in case of fork() */
+  int fd;             /* descriptor for the lock file */
+  LTAB *tab;          /* the mapping */
+  uint32_t slot;      /* slot of the process */
+  uint32_t lastowner; /* owner last handed out */
+  long refs;          /* DB structures using the table */
+} DBLT;
+
+/*
+ * Shared lock tables mapped by the process, protected by _db_ltmutex.
+ */
+static DBLT *_db_lts;
+static pthread_mutex_t _db_ltmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * One key of db_fetch_many().
+ */
+typedef struct {
+  long key;       /* index of the key in the caller's array */
+  off_t chainoff; /* offset of the hash chain of the key */
+  off_t datoff;   /* offset of the data record, once found */
+  size_t datlen;  /* length of the data record; 0 if not found */
+  uint32_t datsum; /* checksum of the data record (F_CHECKSUM) */
+  size_t rawlen;  /* length of the data unpacked if packed; 0 if not */
+} DBFETCH;
+
+/*
+ * One thread of db_scan(), and the index records it passes to the callback:
+ * those that start from start up to end.
+ */
+typedef struct {
+  DB *db;             /* database */
+  off_t start;        /* first index record of the range */
+  off_t end;          /* end of the range: an index record, or end of file */
+  int (*fn)(void *, const char *, const char *); /* callback */
+  void *arg;          /* first argument of fn */
+  pthread_mutex_t *mutex; /* protects *stop; taken around lockblk reads */
+  int *stop;          /* set when fn asks for the scan to stop */
+  long nrec;          /* records passed to fn */
+  int bad;            /* errno of a bad record that stopped the range */
+  pthread_t tid;      /* thread scanning the range */
+  int started;        /* tid was created */
+  char *ibuf;         /* malloc'ed buffer for SCAN_BLOCK bytes of index */
+  char *dbuf;         /* malloc'ed window of SCAN_BLOCK bytes of data */
+  off_t dwin;         /* offset of the window in the data file */
+  size_t dlen;        /* bytes in the window */
+  char *bigbuf;       /* malloc'ed buffer for data bigger than the window */
+  size_t bigsize;     /* size of bigbuf */
+  char *rawbuf;       /* malloc'ed buffer for packed data unpacked */
+  size_t rawsize;     /* size of rawbuf */
+  int idxfd;          /* index file to read */
+  int datfd;          /* data file to read */
+  uint32_t epoch;     /* epoch of the snapshot read; 0 for the files as */
+                      /* they are, with the free list read locked */
+  int lockblk;        /* read lock the free list to read each block */
+} DBSCAN;
+
+/*
+ * State of db_verify() shared by its threads.
+ */
+typedef struct {
+  DB *db;             /* database, with the index file read locked */
+  void (*report)(void *, const char *, off_t, const char *); /* callback */
+  void *arg;          /* first argument of report */
+  pthread_mutex_t mutex; /* serialises report and nbad */
+  long nbad;          /* problems found */
+  char *name[2];      /* malloc'ed names of the index and data files */
+  off_t size[2];      /* sizes of the index and data files */
+  off_t *retired;     /* malloc'ed sorted data extents on the retire list */
+  long nretired;      /* number of them (F_SNAPSHOT) */
+} DBVCHECK;
+
+/*
+ * An index record found by db_verify().
+ */
+typedef struct {
+  off_t off;       /* offset of the index record */
+  off_t next;      /* its chain ptr */
+  off_t datoff;    /* offset of its data record */
+  uint32_t datlen; /* length of the data record; 0 if not valid */
+  uint32_t datsum; /* checksum of the data record (F_CHECKSUM) */
+  uint32_t rawlen; /* length of the data unpacked if packed; 0 if not */
+  DBHASH bucket;   /* bucket of the key; VRF_NOBUCKET if the key is bad */
+  DBHASH chain;    /* 1 + the bucket whose chain it was found on; 0 if none */
+} DBVREC;
+
+/*
+ * A free extent found by db_verify().
+ */
+typedef struct {
+  off_t off;     /* offset of the extent */
+  off_t next;    /* next extent on its free list */
+  off_t prev;    /* previous extent on its free list */
+  uint32_t size; /* size of the extent */
+  int listed;    /* found on a free list */
+} DBVFREE;
+
+/*
+ * One thread of db_verify(), and the extents of one of the heaps it checks:
+ * those that start from start up to end.  In the heap of index records, it
+ * collects the index records, hash table segments and free extents; in the
+ * heap of data records, it checks the data records against the index records
+ * that refer to them, and collects the free extents.
+ */
+typedef struct {
+  DBVCHECK *vc;       /* shared state */
+  int heap;           /* HEAP_IDX or HEAP_DAT */
+  off_t start;        /* first extent of the range */
+  off_t end;          /* end of the range: an extent, or end of file */
+  DBVREC *recs;       /* malloc'ed array of index records (HEAP_IDX) */
+  long nrec;          /* number of index records */
+  long maxrec;        /* size of recs array */
+  off_t *segs;        /* malloc'ed array of segment records (HEAP_IDX) */
+  long nseg;          /* number of segment records */
+  long maxseg;        /* size of segs array */
+  DBVFREE *frees;     /* malloc'ed array of free extents */
+  long nfree;         /* number of free extents */
+  long maxfree;       /* size of frees array */
+  DBVREC **refs;      /* index records with data in the range, by datoff */
+  long nref;          /* number of refs (HEAP_DAT) */
+  pthread_t tid;      /* thread checking the range */
+  int started;        /* tid was created */
+  char *buf;          /* malloc'ed buffer for SCAN_BLOCK bytes of the heap */
+  off_t boff;         /* offset of buf in the file */
+  size_t blen;        /* bytes in buf */
+  char *bigbuf;       /* malloc'ed buffer for extents bigger than buf */
+  size_t bigsize;     /* size of bigbuf */
+  char *rawbuf;       /* malloc'ed buffer for packed data unpacked */
+  size_t rawsize;     /* size of rawbuf */
+} DBVRANGE;
+
+/*
+ * A record read by db_bulkload().
+ */
+typedef struct {
+  char *key;     /* null-terminated key */
+  char *data;    /* null-terminated data, after the key */
+  DBHASH hval;   /* hash value of the key */
+  DBHASH bucket; /* bucket of the key, once the hash table is laid out */
+  long seq;      /* order in which the record was read */
+  off_t datoff;  /* offset of the data record; -1 if replaced */
+  size_t datlen; /* length of the data record, as written */
+  size_t rawlen; /* length of the data unpacked if packed; 0 if not */
+  uint32_t datsum; /* checksum of the data record (F_CHECKSUM) */
+} DBBREC;
+
+/*
+ * State of db_bulkload().
+ */
+typedef struct {
+  int fd;            /* file the records are read from */
+  char *inbuf;       /* malloc'ed buffer of BULK_CHUNK bytes for reading */
+  size_t inlen;      /* bytes in inbuf */
+  size_t inpos;      /* start of the next line in inbuf */
+  int eof;           /* nothing more to read */
+  DBBREC *recs;      /* malloc'ed array of records in memory */
+  long nrecs;        /* records in memory */
+  long maxrecs;      /* size of recs */
+  char **chunks;     /* malloc'ed buffers the records are copied into */
+  long nchunks;      /* buffers in use */
+  long nalloc;       /* buffers allocated, kept for the next partition */
+  long maxchunks;    /* size of chunks */
+  size_t chunkused;  /* bytes used in the last buffer */
+  size_t memused;    /* memory taken by the records in memory */
+  size_t memlimit;   /* spool the records when they take more than this */
+  FILE *spool;       /* temporary file of records; NULL if none */
+  size_t spoolmem;   /* memory the spooled records would take */
+  long npart;        /* partitions of the spooled records */
+  long nin;          /* records read */
+  long nrec;         /* records written */
+  long ndup;         /* records replaced by a later one with the same key */
+  DBHASH nslot;      /* slots in the hash table and its segments */
+  DBHASH slotbase;   /* bucket of heads[0] */
+  off_t *heads;      /* chain ptrs of BULK_SLOTS buckets from slotbase */
+  char *slotbuf;     /* the same, formatted for the index file */
+  DBHASH bucket;     /* bucket of the chain being written */
+  off_t head;        /* last record written on it; 0 if none */
+  off_t idxend;      /* end of the index file */
+  off_t datend;      /* end of the data file */
+} DBLOAD;
+
 /*
  * Internal (private) functions; prefixed with _db_
  */
 static DB *_db_alloc(int);
+static int _db_readhdr(DB *);
+static void _db_inithdr(DB *, const DBOPTS *);
 static void _db_dodelete(DB *);
 static int _db_find_and_lock(DB *, const char *, int);
+static void _db_lockchain(DB *, DBHASH, int);
+static void _db_unlockchains(DB *, off_t, off_t);
+static ssize_t _db_fetch(DB *, const char *, char *, size_t);
+static int _db_findrec(DB *, const char *);
+static void _db_chaingen(DB *, off_t);
+static DBCENT *_db_cacheget(DB *, const char *, DBHASH);
+static void _db_cacheput(DB *, DBCENT *, const char *, DBHASH, uint64_t,
+                         const char *);
+static void _db_cachedrop(DB *, long);
+static void _db_cacheclear(DB *);
+static int _db_bloomopen(DB *, int, int);
+static void _db_bloomclose(DB *);
+static int _db_bloommap(DB *, size_t);
+static unsigned char *_db_blooment(DB *, DBHASH, int);
+static int _db_bloomhas(DB *, const char *);
+static void _db_bloomput(DB *, DBHASH, off_t, const char *, int);
+static void _db_bloombuild(DB *, unsigned char *, off_t);
+static void _db_bloomfill(DB *);
+static void _db_bloomforget(DB *);
+static void _db_bloomkey(DB *, unsigned char *, const char *);
+static int _db_chgopen(DB *, int, int);
+static void _db_chglock(DB *, int, unsigned char *);
+static off_t _db_chgfind(DB *, uint64_t, off_t);
+static void _db_chgadd(DB *, int, const char *, const char *);
+static void _db_chgflush(DB *);
+static void _db_chgfill(DB *);
+static int _db_snpopen(DB *, int);
+static void _db_snpbegin(DB *);
+static void _db_snapclear(DB *);
+static char *_db_snapnext(DB *, char *);
+static int _db_visible(const unsigned char *, uint32_t);
+static void _db_retire(DB *, int, off_t);
+static void _db_reclaim(DB *);
 static int _db_findfree(DB *, int, int);
 static void _db_free(DB *);
+static void _db_abort(DB *);
+static int _db_share(DB *);
+static DB *_db_cursor(DB *);
+static void _db_cursorexit(void *);
+static int _db_lockreg(DB *, int, int, int, off_t, off_t);
+static int _db_lockset(DB *, int, int, int, off_t, off_t);
+static int _db_lockgaps(DBSHARE *, int, int, ino_t, off_t, off_t);
+static int _db_lockwait(int, int, int, off_t, off_t);
+static void _db_lockcut(DBSHARE *, DB *, int, ino_t, off_t, off_t, int);
+static int _db_ltopen(DB *, int, int);
+static int _db_ltmap(DBLT *, const char *, int);
+static void _db_ltjoin(DB *, DBLT *);
+static void _db_ltclose(DB *);
+static int _db_ltlock(DB *, ino_t, int, int, off_t, off_t);
+static int _db_ltcheck(DB *, int, ino_t, int64_t, int64_t, int);
+static void _db_ltset(DB *, int, ino_t, int64_t, int64_t, int);
+static void _db_ltenter(DBLT *, LTPART *);
+static void _db_ltrepair(DBLT *, LTPART *);
+static void _db_ltpurge(DBLT *, uint32_t, ino_t);
+static void _db_ltreap(DBLT *, LTPART *);
+static uint64_t _db_ltparts(int64_t, int64_t);
+static int _db_ltover(int, int64_t, int64_t, int64_t, int64_t);
+static size_t _db_mapget(DBMAP *, int, off_t, size_t, const char **);
+static void _db_unmap(DBMAP *);
 static DBHASH _db_hash(DB *, const char *);
+static uint64_t _db_hash_apue(const char *, size_t, uint64_t);
+static uint64_t _db_hash_xxh64(const char *, size_t, uint64_t);
+static uint64_t _db_hash_sip24(const char *, size_t, uint64_t);
+static void _db_crcinit(void);
+static uint32_t _db_crc32c(uint32_t, const void *, size_t);
+static uint32_t _db_recsum(const unsigned char *, size_t);
+static uint32_t _db_datsum(const char *, size_t);
+static size_t _db_pack(DB *, const char *, size_t, size_t);
+static char *_db_unpack(DB *, const char *, char *);
+static size_t _db_lzpack(const DB *, const unsigned char *, size_t,
+                         unsigned char *, size_t, uint32_t *);
+static int _db_lzunpack(const DB *, const unsigned char *, size_t,
+                        unsigned char *, size_t);
+static size_t _db_lzlen(unsigned char *, size_t, size_t);
+static char *_db_rawbuf(char **, size_t *, size_t);
+static int _db_dictload(DB *);
+static void _db_dictfree(DB *);
+static uint32_t _db_trainhash(const unsigned char *);
+static uint32_t _db_trainscore(const uint32_t *, const unsigned char *,
+                               size_t);
+static void _db_trainheap(uint64_t *, long, long);
+static uint64_t _db_newseed(void);
+static DBHASH _db_bucket(DB *, DBHASH);
+static off_t _db_bucketoff(DB *, DBHASH);
+static DBHASH _db_readnbucket(DB *);
+static uint64_t _db_addnrec(DB *, long);
+static void _db_split(DB *);
+static void _db_readsegs(DB *);
 static char *_db_readdat(DB *);
+static char *_db_readdatinto(DB *, char *);
+static char *_db_readdatfrom(DB *, int, char *);
+static int _db_readpart(DB *, char *, size_t, off_t);
+static char *_db_datbuf(DB *, size_t);
 static off_t _db_readidx(DB *, off_t);
+static off_t _db_readidx_bin(DB *, off_t);
+static off_t _db_badidx(DB *, int, int);
 static off_t _db_readptr(DB *, off_t);
-static void _db_writedat(DB *, const char *, off_t, int);
+static void _db_writedat(DB *, const char *, size_t, off_t, int);
 static void _db_writeidx(DB *, const char *, off_t, int, off_t);
+static void _db_writeidx_bin(DB *, const char *, off_t, int, off_t);
 static void _db_writeptr(DB *, off_t, off_t);
+static int _db_allocrec(DB *, int, int);
+static int _db_rewritedat(DB *, const char *, int);
+static size_t _db_extsize(size_t);
+static int _db_extclass(size_t, int);
+static off_t _db_extalloc(DB *, int, size_t *, int *);
+static void _db_extfree(DB *, int, off_t);
+static void _db_extlink(DB *, int, off_t, size_t);
+static void _db_extunlink(DB *, int, const unsigned char *);
+static void _db_extput(DB *, int, off_t, uint32_t, size_t, off_t);
+static uint64_t _db_readmerges(DB *);
+static void _db_rescan(DB *);
+static int _db_checkswap(DB *);
+static void _db_setfiles(DB *, int, int);
+static void _db_finishswap(const char *);
+static void _db_syncdir(const char *);
+static int _db_fetchchains(DB *, char *const[], DBFETCH *, long, off_t *,
+                           off_t *);
+static int _db_cmpchain(const void *, const void *);
+static int _db_cmpdatoff(const void *, const void *);
+static int _db_stageop(DB *, const char *, const char *, int);
+static long _db_commitops(DB *, int *);
+static int _db_opresult(DB *, const DBOP *, long, int, const char **, long *);
+static void _db_commitchain(DB *, DBOP *, long, long *, long *);
+static void _db_commitins(DB *, off_t, DBOP **, long);
+static int _db_extnone(const unsigned char *, size_t);
+static char *_db_batchput(DB *, const void *, size_t);
+static void _db_batchext(DB *, uint32_t, size_t, const char *, size_t, int);
+static void _db_batchidx(DB *, const char *, off_t);
+static int _db_cmpop(const void *, const void *);
+static int _db_cmpopkey(const void *, const void *);
+static ssize_t _db_pwrite(DB *, int, const void *, size_t, off_t);
+static ssize_t _db_pwritev(DB *, int, const struct iovec *, int, off_t);
+static int _db_walopen(DB *, int, int);
+static int _db_walrecover(DB *);
+static size_t _db_walread(DB *, off_t, off_t);
+static void _db_walapply(DB *, off_t, off_t, int);
+static void _db_opbegin(DB *);
+static void _db_opend(DB *);
+static void _db_walbegin(DB *);
+static void _db_walend(DB *);
+static void _db_walappend(DB *, int, int, const struct iovec *, int, off_t);
+static void _db_walsync(DB *, uint64_t, off_t);
+static void _db_walckpt(DB *);
+static unsigned char *_db_walbuf(DB *, size_t);
+static int _db_bulkline(DBLOAD *, char **, size_t *);
+static void _db_bulkadd(DBLOAD *, DBHASH, const char *, size_t, const char *,
+                        size_t);
+static void _db_bulkreset(DBLOAD *, int);
+static void _db_bulkspill(DBLOAD *);
+static void _db_bulkput(DBLOAD *, FILE *, DBHASH, const char *, size_t,
+                        const char *, size_t);
+static int _db_bulkget(FILE *, DBHASH *, char *, size_t *, size_t *);
+static void _db_bulktable(DB *, DBLOAD *);
+static void _db_bulkslot(DB *, DBLOAD *, DBHASH, off_t);
+static void _db_bulkflush(DB *, DBLOAD *);
+static int _db_bulkrecs(DB *, DBLOAD *);
+static int _db_bulkparts(DB *, DBLOAD *);
+static int _db_cmpbrec(const void *, const void *);
+static void _db_bulktree(DB *, off_t, off_t);
+static void _db_treeput(DB *, const char *, int, int);
+static off_t _db_treenew(DB *, unsigned char *, int, int);
+static void _db_treeread(DB *, off_t, unsigned char *);
+static void _db_treewrite(DB *, off_t, const unsigned char *);
+static size_t _db_treepos(const unsigned char *, const char *, size_t, int *);
+static off_t _db_treechild(const unsigned char *, const char *, size_t);
+static int _db_treecmp(const unsigned char *, size_t, const char *, size_t);
+static void _db_treebuf(DB *);
+static long _db_scansplit(DB *, off_t, int, off_t *);
+static void *_db_scanrange(void *);
+static ssize_t _db_scanblock(DBSCAN *, off_t);
+static char *_db_scandat(DBSCAN *, off_t, size_t, uint32_t);
+static int _db_cmpoff(const void *, const void *);
+static void _db_vascii(DBVCHECK *, DBVERIFY *);
+static off_t *_db_vheads(DBVCHECK *, off_t *);
+static void _db_vretired(DBVCHECK *);
+static long _db_vsplit(DBVRANGE *, const off_t *, long, int, off_t *);
+static void _db_vrun(DBVRANGE *, long);
+static void *_db_vrange(void *);
+static void _db_vidxrec(DBVRANGE *, off_t, uint32_t);
+static void _db_vdatrec(DBVRANGE *, off_t, uint32_t, const DBVREC *);
+static uint32_t _db_vextent(DBVRANGE *, off_t, uint32_t *);
+static const unsigned char *_db_vread(DBVRANGE *, off_t, size_t);
+static void _db_vchains(DBVCHECK *, const off_t *, const off_t *, DBVREC *,
+                        long, DBVERIFY *);
+static void _db_vfreelists(DBVCHECK *, DBVFREE **, const long *);
+static void *_db_vfind(const void *, long, size_t, off_t);
+static void *_db_vgrow(void *, long, long *, size_t);
+static void _db_vreport(DBVCHECK *, int, off_t, const char *, ...);
+static int _db_cmpvref(const void *, const void *);
+static uint64_t _db_now(void);
+static void _db_lat(DBHIST *, uint64_t);
+static int _db_latbucket(uint64_t);
+static void _db_statsadd(DBSTATS *, const DB *);
+static void _db_latsum(DBLAT *, const DBHIST *);
+static void _db_latfinish(DBLAT *);
+
+/*
+ * Little-endian encoding and decoding of the integers in binary index files.
+ */
+static uint16_t _db_get16(const unsigned char *);
+static uint32_t _db_get32(const unsigned char *);
+static uint64_t _db_get64(const unsigned char *);
+static void _db_put16(unsigned char *, uint16_t);
+static void _db_put32(unsigned char *, uint32_t);
+static void _db_put64(unsigned char *, uint64_t);
+
+/*
+ * Hash functions, indexed by DB_HASH_xxx.  Index files created before the hash
+ * function was recorded in the header have 0 there, which is also the index of
+ * the original APUE hash function.
+ */
+static const DBHASHFN _db_hashfns[] = {
+    _db_hash_apue, /* 0: index files without a recorded hash function */
+    _db_hash_apue, /* DB_HASH_APUE */
+    _db_hash_xxh64, /* DB_HASH_XXH64 */
+    _db_hash_sip24, /* DB_HASH_SIPHASH */
+};
+#define NHASHFN (sizeof(_db_hashfns) / sizeof(_db_hashfns[0]))
 
 /**
  * Open or create a database.  Same arguments as open(2).  If successful, two
@@ -100,33 +1253,157 @@ static void _db_writeptr(DB *, off_t, off_t);
  * error.
  */
 DBHANDLE db_open(const char *pathname, int oflag, ...) {
+  int mode = 0;
+
+  /* Check if the caller wants to create the database files */
+  if (oflag & O_CREAT) {
+    va_list ap;
+
+    va_start(ap, oflag);
+    mode = va_arg(ap, int);
+    va_end(ap);
+  }
+  return (db_openopt(pathname, oflag, mode, NULL));
+} /* db_open() */
+
+/**
+ * Open or create a database, with options.  Same as db_open(), except that the
+ * mode is always passed, and opts selects how a new database is created and
+ * how the files are accessed.  The format only applies when the database is
+ * created (O_CREAT | O_TRUNC); an existing database is always opened in the
+ * format it was created with.  opts->nhash sets the size of the hash table of
+ * a new database.  For the binary format, a nonzero opts->maxload makes the
+ * hash table grow online, one bucket at a time (linear hashing), whenever the
+ * average chain length exceeds maxload, and opts->hashfn and opts->seed select
+ * the hash function; both are recorded in the index file header.  A new binary
+ * database reuses the space of deleted records for records of any size.
+ *
+ * DB_OPT_MMAP maps the index and data files read-only and serves all reads
+ * from the mappings; updates are still written with write(2), and the fcntl()
+ * record locks are used as before.
+ *
+ * DB_OPT_WAL gives the database a write-ahead log, pathname.wal.  Each update
+ * is logged, and the log synced, before it is applied to the files;
+ * concurrent updaters share each fsync of the log.  db_openopt() replays
+ * committed updates and rolls back an interrupted one before the files are
+ * used.
+ *
+ * DB_OPT_THREADS makes the handle safe to share between the threads of the
+ * process.  Each thread that uses it gets a cursor of its own, with its own
+ * descriptors, so the data returned by db_fetch() and db_nextrec(), a scan, a
+ * batch and views belong to the thread.
+ *
+ * DB_OPT_LOCKTAB gives the database a shared lock table, pathname.lck, in
+ * which the locks on the index file are taken under robust mutexes instead of
+ * with fcntl(), so an uncontended lock costs no system call.  Where the system
+ * can't share robust mutexes, the database keeps fcntl() locks.
+ *
+ * DB_OPT_ORDERED creates a binary database that also keeps its keys in order,
+ * in a B+-tree in the index file, for db_seek() and db_next().
+ *
+ * DB_OPT_BLOOM gives a binary database a Bloom filter of the keys of each hash
+ * chain, in pathname.blm, so that a lookup of a missing key usually returns
+ * without reading the chain.  The filters can be enabled at any time, and the
+ * file removed.
+ *
+ * DB_OPT_CHANGES gives a binary database a change log, pathname.chg, to which
+ * each change is appended, numbered in sequence; see db_readchanges().
+ *
+ * DB_OPT_CHECKSUM creates a binary database whose records carry CRC32C
+ * checksums, checked whenever a record is read.  A damaged record makes the
+ * read fail with EBADMSG in any database; db_verify() checks a whole one.
+ *
+ * DB_OPT_COMPRESS creates a binary database that compresses the data of each
+ * record when that makes it smaller.  opts->dict, of opts->dictlen bytes, is a
+ * dictionary kept with the database that helps short records compress; see
+ * db_traindict().
+ *
+ * DB_OPT_SNAPSHOT creates a binary database whose updates copy on write while
+ * a snapshot is held, so that db_nextrec() and db_scan() can read it as it was
+ * at db_snapshot(); the processes pin their snapshots in pathname.snp.
+ *
+ * The write-ahead log, the lock table, the Bloom filters and the change log
+ * are used by every process that opens the database from then on; enable the
+ * log, the lock table and the change log while no other process has it open.
+ * @param pathname string containing prefix of database filenames.
+ * @param oflag used as the 2nd argument to open(2).
+ * @param mode used as the 3rd argument to open(2) if the files are created.
+ * @param opts database options; NULL for the defaults.
+ * @return handle (opaque pointer) representing the database if OK; NULL on
+ * error, with errno set to EINVAL for invalid options or an unrecognised
+ * index file.
+ */
+DBHANDLE db_openopt(const char *pathname, int oflag, int mode,
+                    const DBOPTS *opts) {
   DB *db;
-  int mode;
-  size_t len, i;
-  char asciiptr[PTR_SZ + 1];
-  char hash[(NHASH_DEF + 1) * PTR_SZ + 2]; /* +2 for newline & null */
+  size_t len;
+  DBOPTS o;
   struct stat statbuff;
 
+  if (opts == NULL) {
+    memset(&o, 0, sizeof(o));
+  } else {
+    o = *opts;
+  }
+  if (o.nhash == 0) {
+    o.nhash = NHASH_DEF;
+  }
+  if (o.hashfn == DB_HASH_DEFAULT) {
+    o.hashfn = (o.format == DB_FMT_ASCII ? DB_HASH_APUE : DB_HASH_XXH64);
+  }
+  if ((o.format != DB_FMT_ASCII && o.format != DB_FMT_BINARY) ||
+      (o.flags & ~(DB_OPT_MMAP | DB_OPT_WAL | DB_OPT_THREADS |
+                   DB_OPT_LOCKTAB | DB_OPT_ORDERED | DB_OPT_BLOOM |
+                   DB_OPT_CHANGES | DB_OPT_CHECKSUM | DB_OPT_COMPRESS |
+                   DB_OPT_SNAPSHOT)) != 0 ||
+      o.nhash < 0 || o.maxload < 0 || o.hashfn < 0 || o.hashfn >= NHASHFN ||
+      o.dictlen > DB_DICTMAX || (o.dictlen != 0 && o.dict == NULL) ||
+      (o.dictlen != 0 && !(o.flags & DB_OPT_COMPRESS))) {
+    errno = EINVAL;
+    return (NULL);
+  }
+  /*
+   * An ASCII hash table must fit below PTR_MAX, and can't grow, use another
+   * hash function, keep the keys in order, carry checksums, compress or copy
+   * on write since there's no header to record them in.
+   */
+  if (o.format == DB_FMT_ASCII &&
+      (o.maxload != 0 || (o.nhash + 1) * PTR_SZ + 1 > PTR_MAX ||
+       o.hashfn != DB_HASH_APUE ||
+       (o.flags & (DB_OPT_ORDERED | DB_OPT_CHECKSUM | DB_OPT_COMPRESS |
+                   DB_OPT_SNAPSHOT)))) {
+    errno = EINVAL;
+    return (NULL);
+  }
+  /* The mappings are read-only, so the files must be opened for reading */
+  if ((o.flags & DB_OPT_MMAP) && (oflag & O_ACCMODE) == O_WRONLY) {
+    errno = EINVAL;
+    return (NULL);
+  }
+
   /*
    * Allocate a DB structure, and the buffers it needs.
    */
   len = strlen(pathname);
   if ((db = _db_alloc(len)) == NULL) {
-    err_dump("db_open(): _db_alloc() error for DB");
+    err_dump("db_openopt(): _db_alloc() error for DB");
   }
   db->nhash = NHASH_DEF;  /* hash table size */
   db->hashoff = HASH_OFF; /* offset in index file of hash table */
+  db->mapped = (o.flags & DB_OPT_MMAP) != 0;
+  db->cachemax = o.cachesize;
+  db->namelen = len;
+  db->oflag = oflag & ~(O_CREAT | O_EXCL | O_TRUNC);
   strcpy(db->name, pathname);
   strcat(db->name, ".idx");
 
-  /* Check if the caller wants to create the database files */
-  if (oflag & O_CREAT) {
-    va_list ap;
-
-    va_start(ap, oflag);
-    mode = va_arg(ap, int);
-    va_end(ap);
+  /*
+   * Complete a db_compact() that was interrupted while renaming the new files
+   * into place, before opening the files.
+   */
+  _db_finishswap(pathname);
 
+  if (oflag & O_CREAT) {
     /*
      * Open index file and data file.
      */
@@ -157,86 +1434,349 @@ DBHANDLE db_open(const char *pathname, int oflag, ...) {
      * entire file so that we can stat it, check its size, and initialise it,
      * in an atomic operation.
      */
-    if (writew_lock(db->idxfd, 0, SEEK_SET, 0) < 0) {
-      err_dump("db_open(): writew_lock() error");
+    if (_db_writew_lock(db, db->idxfd, 0, 0) < 0) {
+      err_dump("db_openopt(): writew_lock() error");
     }
 
     if (fstat(db->idxfd, &statbuff) < 0) {
-      err_sys("db_open(): fstat() error");
+      err_sys("db_openopt(): fstat() error");
     }
 
     if (statbuff.st_size == 0) {
-      /*
-       * We have to build a list of (NHASH_DEF + 1) chain ptrs with a value of
-       * 0.  The +1 is for the free list pointer that precedes the hash table.
-       */
-      sprintf(asciiptr, "%*d", PTR_SZ, 0);
-      hash[0] = 0;
-      for (i = 0; i < NHASH_DEF + 1; i++) {
-        strcat(hash, asciiptr);
-      }
-      strcat(hash, "\n");
-      i = strlen(hash);
-      if (write(db->idxfd, hash, i) != i) {
-        err_dump("db_open(): index file init write() error");
-      }
+      _db_inithdr(db, &o);
     }
-    if (un_lock(db->idxfd, 0, SEEK_SET, 0) < 0) {
-      err_dump("db_open(): un_lock() error");
+    if (_db_un_lock(db, db->idxfd, 0, 0) < 0) {
+      err_dump("db_openopt(): un_lock() error");
     }
   }
-  db_rewind(db);
-  return (db);
-} /* db_open() */
-
-/**
- * Allocate and initialise a DB structure and its buffers.
- * @param namelen length of database name string (without extension).
- * @return pointer to DB structure on success; dump core on error.
- */
-static DB *_db_alloc(int namelen) {
-  DB *db;
 
   /*
-   * Use calloc() to initialise the structure to zero.
+   * Lock the index file through the shared lock table from here on, if the
+   * database has one.
    */
-  if ((db = calloc(1, sizeof(DB))) == NULL) {
-    err_dump("_db_alloc(): calloc() error for DB");
+  if (_db_ltopen(db, o.flags & DB_OPT_LOCKTAB, oflag) < 0) {
+    _db_free(db);
+    return (NULL);
   }
+
   /*
-   * Side effect of calloc() sets database file descriptors to 0; reset fd to -1
-   * to indicate that they are not yet valid.
+   * Open the change log, if the database has one, before recovery, since the
+   * write-ahead log also covers it.
    */
-  db->idxfd = db->datfd = -1; /* descriptors */
+  if (_db_chgopen(db, 0, oflag) < 0) {
+    _db_free(db);
+    return (NULL);
+  }
 
   /*
-   * Allocate room for the name.
-   * +5 for ".idx" or ".dat" plus null at end.
+   * Recover the files from the write-ahead log, if the database has one, before
+   * anything is read from them.  Only a process that can write recovers.
    */
-  if ((db->name = malloc(namelen + 5)) == NULL) {
-    err_dump("_db_alloc(): malloc() error for name");
+  if ((oflag & O_ACCMODE) != O_RDONLY &&
+      _db_walopen(db, o.flags & DB_OPT_WAL, oflag) < 0) {
+    _db_free(db);
+    return (NULL);
   }
 
   /*
-   * Allocate an index buffer and a data buffer.
-   * +2 for newline and null at end.
+   * Work out the format of the index file, and where the free list, the hash
+   * table and the index records are.
    */
-  if ((db->idxbuf = malloc(IDXLEN_MAX + 2)) == NULL) {
+  if (_db_readhdr(db) < 0) {
+    _db_free(db);
+    errno = EINVAL;
+    return (NULL);
+  }
+
+  /*
+   * Open the snapshot file of a database that copies on write.
+   */
+  if ((db->features & F_SNAPSHOT) && _db_snpopen(db, oflag) < 0) {
+    _db_free(db);
+    return (NULL);
+  }
+
+  /*
+   * Start a change log if asked to, now that the format is known.
+   */
+  if ((o.flags & DB_OPT_CHANGES) && _db_chgopen(db, 1, oflag) < 0) {
+    _db_free(db);
+    return (NULL);
+  }
+
+  /*
+   * Use the Bloom filters of the chains, if the database has them.
+   */
+  if (_db_bloomopen(db, o.flags & DB_OPT_BLOOM, oflag) < 0) {
+    _db_free(db);
+    return (NULL);
+  }
+  db_rewind(db);
+  if ((o.flags & DB_OPT_THREADS) && _db_share(db) < 0) {
+    _db_free(db);
+    return (NULL);
+  }
+  return (db);
+} /* db_openopt() */
+
+/**
+ * Write the initial contents of a new, empty index file: the header (binary
+ * format only), the free list ptr and the hash table, with all chain ptrs set
+ * to 0, and the data file header of a binary database.  Called by db_openopt()
+ * with the index file write locked.
+ * @param db pointer to database structure.
+ * @param opts validated options: format, nhash, maxload, hashfn, seed, the
+ * dictionary and the DB_OPT_ORDERED, DB_OPT_CHECKSUM and DB_OPT_COMPRESS flags.
+ */
+static void _db_inithdr(DB *db, const DBOPTS *opts) {
+  size_t i, len, dictsz;
+  char *hash;
+  unsigned char *hdr, *rec;
+  DBHASH nhash = opts->nhash;
+
+  if (opts->format == DB_FMT_ASCII) {
+    /*
+     * We have to build a list of (nhash + 1) chain ptrs with a value of 0.
+     * The +1 is for the free list pointer that precedes the hash table.  The
+     * newline at the end tells _db_readhdr() the size of the hash table.
+     */
+    len = (nhash + 1) * PTR_SZ + 1;
+    if ((hash = malloc(len + 1)) == NULL) { /* +1 for null */
+      err_dump("_db_inithdr(): malloc() error");
+    }
+    for (i = 0; i < nhash + 1; i++) {
+      sprintf(hash + i * PTR_SZ, "%*d", PTR_SZ, 0);
+    }
+    strcat(hash, "\n");
+    if (write(db->idxfd, hash, len) != len) {
+      err_dump("_db_inithdr(): index file init write() error");
+    }
+    free(hash);
+    return;
+  }
+
+  /*
+   * Binary format: the header, followed by (nhash + 1) zeroed slots, and then
+   * by the compression dictionary, if there is one, as the first index record.
+   */
+  len = BIN_HDR_SZ + (nhash + 1) * BIN_SLOT_SZ;
+  dictsz = (opts->dictlen != 0 ? _db_extsize(BIN_REC_SZ + opts->dictlen) : 0);
+  if ((hdr = calloc(1, len + dictsz)) == NULL) {
+    err_dump("_db_inithdr(): calloc() error");
+  }
+  memcpy(hdr + HDR_MAGIC, BIN_MAGIC, BIN_MAGIC_SZ);
+  _db_put32(hdr + HDR_VERSION, BIN_VERSION);
+  _db_put32(hdr + HDR_HDRSZ, BIN_HDR_SZ);
+  _db_put64(hdr + HDR_NHASH, nhash);
+  _db_put64(hdr + HDR_NBUCKET, nhash);
+  _db_put32(hdr + HDR_MAXLOAD, opts->maxload);
+  _db_put32(hdr + HDR_HASHFN, opts->hashfn);
+  _db_put32(hdr + HDR_FEATURES,
+            F_ALLOC | F_CHAINGEN | F_BIGDATA |
+                ((opts->flags & DB_OPT_ORDERED) ? F_ORDERED : 0) |
+                ((opts->flags & DB_OPT_CHECKSUM) ? F_CHECKSUM : 0) |
+                ((opts->flags & DB_OPT_COMPRESS) ? F_PACKED : 0) |
+                ((opts->flags & DB_OPT_SNAPSHOT) ? F_SNAPSHOT : 0));
+  _db_put64(hdr + HDR_SEED, opts->seed != 0 ? opts->seed : _db_newseed());
+  if (dictsz != 0) {
+    _db_put64(hdr + HDR_DICT, len);
+    rec = hdr + len;
+    _db_put32(rec + REC_MAGIC, BIN_REC_MAGIC);
+    _db_put32(rec + REC_LEN, dictsz);
+    _db_put32(rec + REC_DATLEN, opts->dictlen);
+    _db_put16(rec + REC_FLAGS, REC_F_DICT);
+    _db_put32(rec + REC_DATSUM, _db_crc32c(0, opts->dict, opts->dictlen));
+    memcpy(rec + BIN_REC_SZ, opts->dict, opts->dictlen);
+    _db_put32(rec + dictsz - EXT_FTR_SZ, dictsz);
+    len += dictsz;
+  }
+  if (write(db->idxfd, hdr, len) != len) {
+    err_dump("_db_inithdr(): index file init write() error");
+  }
+  if (pwrite(db->datfd, DAT_MAGIC, DAT_HDR_SZ, 0) != DAT_HDR_SZ) {
+    err_dump("_db_inithdr(): data file init pwrite() error");
+  }
+  free(hdr);
+} /* _db_inithdr() */
+
+/**
+ * Determine the format of an open index file and set the offsets of the free
+ * list ptr, the hash table and the first index record accordingly.  Index
+ * files that don't start with the binary magic are in the original ASCII
+ * format, where the hash table size is found from the newline that ends the
+ * hash table.
+ * @param db pointer to database structure.
+ * @return 0 if OK; -1 if the index file header is not valid.
+ */
+static int _db_readhdr(DB *db) {
+  unsigned char hdr[HDR_SEGOFF];
+  char buf[1024];
+  char *nl;
+  ssize_t n;
+  off_t off;
+
+  if ((n = pread(db->idxfd, hdr, sizeof(hdr), 0)) < 0) {
+    err_dump("_db_readhdr(): pread() error");
+  }
+  if (n < BIN_MAGIC_SZ || memcmp(hdr + HDR_MAGIC, BIN_MAGIC, BIN_MAGIC_SZ)) {
+    /*
+     * ASCII format: look for the newline at the end of the hash table.  An
+     * empty index file is left with the default hash table size.
+     */
+    for (off = 0; (n = pread(db->idxfd, buf, sizeof(buf), off)) > 0;
+         off += n) {
+      if ((nl = memchr(buf, NEWLINE, n)) != NULL) {
+        off += nl - buf;
+        if (off % PTR_SZ != 0 || off / PTR_SZ < 2) {
+          return (-1);
+        }
+        db->nhash = off / PTR_SZ - 1; /* -1 for free list ptr */
+        break;
+      }
+    }
+    db->format = DB_FMT_ASCII;
+    db->hashid = DB_HASH_APUE;
+    db->hashfn = _db_hash_apue;
+    db->nbucket = db->nhash;
+    db->slotsz = PTR_SZ;
+    db->freeoff = FREE_OFF;
+    db->hashoff = HASH_OFF;
+    db->recoff = (db->nhash + 1) * PTR_SZ + 1; /* +1 for newline */
+    db->recptr = 0;
+    return (0);
+  }
+  if (n != sizeof(hdr) || _db_get32(hdr + HDR_VERSION) < BIN_VERSION_MIN ||
+      _db_get32(hdr + HDR_VERSION) > BIN_VERSION ||
+      _db_get32(hdr + HDR_HDRSZ) < HDR_SEGOFF + BIN_NSEG * 8 ||
+      _db_get64(hdr + HDR_NHASH) == 0 ||
+      _db_get32(hdr + HDR_HASHFN) >= NHASHFN) {
+    return (-1);
+  }
+  db->features = _db_get32(hdr + HDR_FEATURES);
+  if ((db->features & ~(F_ALLOC | F_CHAINGEN | F_BIGDATA | F_ORDERED |
+                        F_CHECKSUM | F_PACKED | F_SNAPSHOT)) != 0 ||
+      ((db->features &
+        (F_BIGDATA | F_ORDERED | F_CHECKSUM | F_PACKED | F_SNAPSHOT)) &&
+       !(db->features & F_ALLOC)) ||
+      ((db->features & F_ALLOC) &&
+       _db_get32(hdr + HDR_HDRSZ) < HDR_FREECLS + 2 * EXT_NCLASS * 8)) {
+    return (-1);
+  }
+  db->format = DB_FMT_BINARY;
+  if ((db->hashid = _db_get32(hdr + HDR_HASHFN)) == 0) {
+    db->hashid = DB_HASH_APUE;
+  }
+  db->hashfn = _db_hashfns[db->hashid];
+  db->seed = _db_get64(hdr + HDR_SEED);
+  db->slotsz = BIN_SLOT_SZ;
+  db->nhash = _db_get64(hdr + HDR_NHASH);
+  db->maxload = _db_get32(hdr + HDR_MAXLOAD);
+  if ((db->nbucket = _db_get64(hdr + HDR_NBUCKET)) < db->nhash) {
+    db->nbucket = db->nhash;
+  }
+  db->freeoff = _db_get32(hdr + HDR_HDRSZ);
+  db->hashoff = db->freeoff + BIN_SLOT_SZ;
+  db->recoff = db->hashoff + db->nhash * BIN_SLOT_SZ;
+  db->recptr = REC_PTR;
+  memset(db->segoff, 0, sizeof(db->segoff)); /* may be reopening */
+  if (db->nbucket > db->nhash) {
+    _db_readsegs(db);
+  }
+  return (_db_dictload(db));
+} /* _db_readhdr() */
+
+/**
+ * Read the offsets of the hash table segments from the binary index file
+ * header.  Segment 0 is the hash table created with the index file; segment k
+ * holds buckets nhash * 2^(k-1) through nhash * 2^k - 1, and is added by
+ * _db_split() when the first of those buckets is needed.
+ * @param db pointer to database structure.
+ */
+static void _db_readsegs(DB *db) {
+  unsigned char segs[BIN_NSEG * 8];
+  int k;
+
+  if (pread(db->idxfd, segs, sizeof(segs), HDR_SEGOFF) != sizeof(segs)) {
+    err_dump("_db_readsegs(): pread() error");
+  }
+  db->segoff[0] = db->hashoff;
+  for (k = 1; k < BIN_NSEG; k++) {
+    db->segoff[k] = _db_get64(segs + k * 8);
+  }
+} /* _db_readsegs() */
+
+/**
+ * Allocate and initialise a DB structure and its buffers.
+ * @param namelen length of database name string (without extension).
+ * @return pointer to DB structure on success; dump core on error.
+ */
+static DB *_db_alloc(int namelen) {
+  DB *db;
+
+  /*
+   * Use calloc() to initialise the structure to zero.
+   */
+  if ((db = calloc(1, sizeof(DB))) == NULL) {
+    err_dump("_db_alloc(): calloc() error for DB");
+  }
+  /*
+   * Side effect of calloc() sets database file descriptors to 0; reset fd to -1
+   * to indicate that they are not yet valid.
+   */
+  db->idxfd = db->datfd = db->walfd = db->blmfd = db->chgfd = -1;
+  db->snpfd = db->snapidxfd = db->snapdatfd = -1;
+  db->snapslot = -1;                       /* no snapshot */
+  db->cfree = -1;                          /* no free cache entries */
+
+  /*
+   * Allocate room for the name.
+   * +5 for ".idx" or ".dat" plus null at end.
+   */
+  if ((db->name = malloc(namelen + 5)) == NULL) {
+    err_dump("_db_alloc(): malloc() error for name");
+  }
+
+  /*
+   * Allocate an index buffer and a data buffer.
+   * +2 for newline and null at end.
+   */
+  if ((db->idxbuf = malloc(IDXLEN_MAX + 2)) == NULL) {
     err_dump("_db_alloc(): malloc() error for index buffer");
   }
   if ((db->datbuf = malloc(DATLEN_MAX + 2)) == NULL) {
     err_dump("_db_alloc(): malloc() error for data buffer");
   }
+  db->datbufsize = DATLEN_MAX + 2;
   return (db);
 } /* _db_alloc() */
 
 /**
  * Relinquish access to the database.  This function closes the index file and
  * the data file and releases any memory that it allocated for internal buffers.
+ * A handle shared by threads must no longer be in use by any of them.
  * @param h database handle.
  */
 void db_close(DBHANDLE h) {
-  _db_free((DB *)h); /* closes fds, free buffers & struct */
+  DB *db = h;
+  DBSHARE *sh = db->share;
+  long i;
+
+  if (sh != NULL) {
+    pthread_key_delete(sh->key);
+    for (i = 0; i < sh->ncursors; i++) {
+      _db_free(sh->cursors[i]);
+    }
+    pthread_mutex_destroy(&sh->mutex);
+    pthread_cond_destroy(&sh->cond);
+    if (sh->locks != NULL) {
+      free(sh->locks);
+    }
+    if (sh->cursors != NULL) {
+      free(sh->cursors);
+    }
+    free(sh);
+  }
+  _db_free(db); /* closes fds, free buffers & struct */
 }
 
 /**
@@ -245,816 +1785,10973 @@ void db_close(DBHANDLE h) {
  * @param db pointer to DB structure.
  */
 static void _db_free(DB *db) {
+  long i;
+
+  if (db->lt != NULL) {
+    _db_ltclose(db);
+  }
+  if (db->snapslot >= 0) {
+    _db_snapclear(db); /* closing the file drops the lock on the slot */
+  }
+  _db_bloomclose(db);
+  _db_unmap(&db->idxmap);
+  _db_unmap(&db->datmap);
+  for (i = 0; i < db->npins; i++) {
+    if (db->pins[i].chainoff < 0) {
+      free((char *)db->pins[i].data);
+    }
+  }
+  if (db->pins != NULL) {
+    free(db->pins);
+  }
   if (db->idxfd >= 0) {
     close(db->idxfd);
   }
   if (db->datfd >= 0) {
     close(db->datfd);
   }
+  if (db->walfd >= 0) {
+    close(db->walfd);
+  }
+  if (db->chgfd >= 0) {
+    close(db->chgfd);
+  }
+  if (db->snpfd >= 0) {
+    close(db->snpfd);
+  }
+  if (db->snapbuf != NULL) {
+    free(db->snapbuf);
+  }
+  if (db->chgbuf != NULL) {
+    free(db->chgbuf);
+  }
+  if (db->walbuf != NULL) {
+    free(db->walbuf);
+  }
   if (db->idxbuf != NULL) {
     free(db->idxbuf);
   }
   if (db->datbuf != NULL) {
     free(db->datbuf);
   }
+  if (db->treebuf != NULL) {
+    free(db->treebuf);
+  }
   if (db->name != NULL) {
     free(db->name);
   }
+  _db_abort(db); /* discard any uncommitted batch */
+  if (db->ops != NULL) {
+    free(db->ops);
+  }
+  if (db->batchbuf != NULL) {
+    free(db->batchbuf);
+  }
+  _db_dictfree(db);
+  free(db->packbuf);
+  free(db->packtab);
+  _db_cacheclear(db);
+  if (db->cents != NULL) {
+    free(db->cents);
+  }
+  if (db->chash != NULL) {
+    free(db->chash);
+  }
   free(db);
 }
 
 /**
- * Fetch a record and return a pointer to the null-terminated data.
- * @param h database handle.
- * @param key lookup key for the data record.
- * @return pointer to the data stored with key, if the record is found; NULL if
- * the record is not found.
+ * Make a new handle shareable by threads (DB_OPT_THREADS).  The handle becomes
+ * the cursor of the calling thread.
+ * @param db pointer to database structure, with the files open.
+ * @return 0 if OK; -1 on error, with errno set.
  */
-char *db_fetch(DBHANDLE h, const char *key) {
-  DB *db = h;
-  char *ptr;
+static int _db_share(DB *db) {
+  DBSHARE *sh;
+  struct stat statbuff;
+  int err;
 
-  if (_db_find_and_lock(db, key, 0) < 0) {
-    ptr = NULL; /* error, record not found */
-    db->cnt_fetcherr++;
-  } else {
-    ptr = _db_readdat(db); /* return pointer to data */
-    db->cnt_fetchok++;
+  if (fstat(db->idxfd, &statbuff) < 0) {
+    err_dump("_db_share(): fstat() error");
   }
-
-  /*
-   * Unlock the hash chain that _db_find_and_lock() locked.
-   */
-  if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0) {
-    err_dump("db_fetch(): un_lock() error");
+  if ((sh = calloc(1, sizeof(DBSHARE))) == NULL) {
+    errno = ENOMEM;
+    return (-1);
   }
-  return (ptr);
-} /* db_fetch() */
+  if ((err = pthread_key_create(&sh->key, _db_cursorexit)) != 0) {
+    free(sh);
+    errno = err;
+    return (-1);
+  }
+  pthread_mutex_init(&sh->mutex, NULL);
+  pthread_cond_init(&sh->cond, NULL);
+  pthread_setspecific(sh->key, db);
+  sh->leader = db;
+  db->share = sh;
+  db->inuse = 1;
+  db->idxino = statbuff.st_ino;
+  return (0);
+} /* _db_share() */
 
 /**
- * Find the specified record.  Called by db_delete(), db_fetch(), and
- * db_store().  Returns with the hash chain locked.
- * @param db pointer to database object.
- * @param key search key.
- * @param writelock nonzero value to acquire a write lock on the index file
- * while searching for the record.
- * @return 0 if record found; -1 if record not found.
+ * Find the cursor of the calling thread, for the public functions.  A handle
+ * that isn't shared by threads is its own cursor, as is every cursor passed
+ * back in by the library itself.  A thread that hasn't used a shared handle
+ * before gets a cursor left by a thread that has exited, or a new one, which
+ * opens the files again: the database descriptors of a process must stay open
+ * for as long as any thread might hold a lock on them.
+ * @param h database handle, or cursor.
+ * @return pointer to the database structure to use.
  */
-static int _db_find_and_lock(DB *db, const char *key, int writelock) {
-  off_t offset, nextoffset;
+static DB *_db_cursor(DB *h) {
+  DBSHARE *sh = h->share;
+  DB *db;
+  struct stat statbuff;
+  long i;
 
-  /*
-   * Calculate the hash value for this key, then calculate the byte offset of
-   * corresponding chain ptr in hash table.  This is where the search starts.
-   * First calculate the offset in the hash table for this key.
-   */
-  db->chainoff = (_db_hash(db, key) * PTR_SZ) + db->hashoff;
-  db->ptroff = db->chainoff;
+  if (sh == NULL || h != sh->leader) {
+    return (h);
+  }
+  if ((db = pthread_getspecific(sh->key)) != NULL) {
+    return (db);
+  }
+  pthread_mutex_lock(&sh->mutex);
+  for (i = 0; i < sh->ncursors && sh->cursors[i]->inuse; i++) {
+    ;
+  }
+  if (i < sh->ncursors) {
+    db = sh->cursors[i];
+    db->inuse = 1;
+    pthread_mutex_unlock(&sh->mutex);
+    pthread_setspecific(sh->key, db);
+    return (db);
+  }
+  pthread_mutex_unlock(&sh->mutex);
 
-  /*
-   * Lock the hash chain here.  The caller must unlock it when done.  Note,
-   * only lock and unlock the first byte.  This increases concurrency by
-   * allowing multiple processes to search different hash chains at the same
-   * time.
-   */
-  if (writelock) {
-    if (writew_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0) {
-      err_dump("_db_find_and_lock(): writew_lock() error");
-    }
-  } else {
-    /* Read lock the index file while searching it */
-    if (readw_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0) {
-      err_dump("_db_find_and_lock(): readw_lock() error");
+  if ((db = _db_alloc(h->namelen)) == NULL) {
+    err_dump("_db_cursor(): _db_alloc() error for DB");
+  }
+  db->nhash = NHASH_DEF;
+  db->hashoff = HASH_OFF;
+  db->mapped = h->mapped;
+  db->cachemax = h->cachemax;
+  db->namelen = h->namelen;
+  db->oflag = h->oflag;
+  memcpy(db->name, h->name, h->namelen);
+  strcpy(db->name + db->namelen, ".idx");
+  if ((db->idxfd = open(db->name, db->oflag)) < 0) {
+    err_dump("_db_cursor(): can't open %s", db->name);
+  }
+  strcpy(db->name + db->namelen, ".dat");
+  if ((db->datfd = open(db->name, db->oflag)) < 0) {
+    err_dump("_db_cursor(): can't open %s", db->name);
+  }
+  if (h->walfd >= 0) {
+    strcpy(db->name + db->namelen, ".wal");
+    if ((db->walfd = open(db->name, O_RDWR)) < 0) {
+      err_dump("_db_cursor(): can't open %s", db->name);
     }
   }
+  if (fstat(db->idxfd, &statbuff) < 0) {
+    err_dump("_db_cursor(): fstat() error");
+  }
+  db->idxino = statbuff.st_ino;
+  if (_db_readhdr(db) < 0) {
+    err_dump("_db_cursor(): invalid index file header");
+  }
+  if (h->blmfd >= 0 && _db_bloomopen(db, 1, db->oflag) < 0) {
+    err_dump("_db_cursor(): can't open Bloom filters");
+  }
+  if (h->chgfd >= 0 && (_db_chgopen(db, 0, db->oflag) < 0 || db->chgfd < 0)) {
+    err_dump("_db_cursor(): can't open change log");
+  }
+  if (h->snpfd >= 0 && _db_snpopen(db, db->oflag) < 0) {
+    err_dump("_db_cursor(): can't open snapshot file");
+  }
+  if (h->lt != NULL) {
+    pthread_mutex_lock(&_db_ltmutex);
+    _db_ltjoin(db, h->lt);
+    pthread_mutex_unlock(&_db_ltmutex);
+  }
+  db->share = sh;
+  db->inuse = 1;
+  db_rewind(db);
 
-  /*
-   * Get the offset in the index file of first record on the hash chain
-   * (can be 0 if the hash chain is empty).
-   */
-  offset = _db_readptr(db, db->ptroff);
-  /* Loop through each index record on the hash chain, comparing keys */
-  while (offset != 0) {
-    /*
-     * Read each index record, populating idxbuf field with key of current
-     * record.  _db_readidx() returns 0 when the last entry in the chain is
-     * reached.
-     */
-    nextoffset = _db_readidx(db, offset);
-    if (strcmp(db->idxbuf, key) == 0) {
-      break; /* match found */
-      /*
-       * ptroff contains address of previous index record
-       * datoff contains address of the data record
-       * datlen contains the size of the data record
-       */
+  pthread_mutex_lock(&sh->mutex);
+  if (sh->ncursors == sh->maxcursors) {
+    sh->maxcursors = sh->maxcursors * 2 + 8;
+    if ((sh->cursors = realloc(sh->cursors, sh->maxcursors * sizeof(DB *))) ==
+        NULL) {
+      err_dump("_db_cursor(): realloc() error");
     }
-    db->ptroff = offset; /* offset of this (unequal) record */
-    offset = nextoffset; /* next one to compare; 0 == end of hash chain */
   }
-
-  /*
-   * offset == 0 on error (record not found).
-   */
-  return (offset == 0 ? -1 : 0);
-} /* _db_find_and_lock() */
+  sh->cursors[sh->ncursors++] = db;
+  pthread_mutex_unlock(&sh->mutex);
+  pthread_setspecific(sh->key, db);
+  return (db);
+} /* _db_cursor() */
 
 /**
- * Calculate the hash value for a key.
- * @param db pointer to database structure.
- * @param key pointer to key string.
- * @return hash value for the given key.
+ * Give the cursor of a thread that is exiting back to the pool, discarding any
+ * uncommitted batch and releasing its views and its snapshot.  Called by
+ * pthread_exit() through the thread-specific data key of the handle.
+ * @param arg pointer to the cursor.
  */
-static DBHASH _db_hash(DB *db, const char *key) {
-  DBHASH hval = 0;
-  char c;
-  int i;
+static void _db_cursorexit(void *arg) {
+  DB *db = arg;
+  DBSHARE *sh = db->share;
 
-  /*
-   * Hash value for a key is calculated by multiplying each ASCII character by
-   * its 1-based index and dividing the result by the number of hash table
-   * entries, with the remainder of the division being the hash value.
-   */
-  for (i = 1; (c = *key++) != 0; i++) {
-    hval += c * i; /* ascii char times its 1-based index */
+  if (db == sh->leader) {
+    return; /* freed by db_close() */
   }
-  return (hval % db->nhash);
-} /* _db_hash() */
+  _db_abort(db);
+  while (db->npins > 0) {
+    db_release(db, db->pins[db->npins - 1].data);
+  }
+  db_snapend(db);
+  pthread_mutex_lock(&sh->mutex);
+  db->inuse = 0;
+  pthread_mutex_unlock(&sh->mutex);
+} /* _db_cursorexit() */
 
 /**
- * Read a chain ptr field from anywhere in the index file: the free list
- * pointer, a hash table chain ptr, or an index record chain ptr.  This function
- * does not perform any locking of the database files.
- * @param db pointer to database structure.
- * @param offset pointer offset to start reading from.
- * @return pointer read at the given offset, on success; core dump on failure.
+ * Lock or unlock a range of bytes of one of the database files, as lock_reg()
+ * does with fcntl().  In a handle shared by threads, the cursors first lock
+ * each other out in the lock table of the handle: a lock is taken with fcntl()
+ * only once no other cursor holds or is taking a lock on the bytes that
+ * conflicts with it, and a byte is only unlocked with fcntl() when no other
+ * cursor has been granted a lock on it.  Like fcntl(), a lock replaces any
+ * lock of the same cursor on the bytes.  Locks on the index file of a database
+ * with a shared lock table are only taken in the table.  F_SETLKW first tries
+ * without waiting, and only the locks that have to be waited for are counted
+ * and timed for db_stats().
+ * @param db pointer to database structure: the cursor.
+ * @param fd db->idxfd, db->datfd, db->walfd or db->chgfd, or the lock file of
+ * db_compact().
+ * @param cmd F_SETLK or F_SETLKW.
+ * @param type F_RDLCK, F_WRLCK or F_UNLCK.
+ * @param offset offset of the first byte.
+ * @param len number of bytes; 0 for up to the end of the file and beyond.
+ * @return 0 if OK; -1 on error, with errno set as by fcntl().
  */
-static off_t _db_readptr(DB *db, off_t offset) {
-  char asciiptr[PTR_SZ + 1];
+static int _db_lockreg(DB *db, int fd, int cmd, int type, off_t offset,
+                       off_t len) {
+  uint64_t start, ns;
+  int rc;
 
-  if (lseek(db->idxfd, offset, SEEK_SET) == -1) {
-    err_dump("_db_readptr(): lseek() error to ptr field");
+  if (cmd != F_SETLKW || type == F_UNLCK) {
+    return (_db_lockset(db, fd, cmd, type, offset, len));
   }
-  if (read(db->idxfd, asciiptr, PTR_SZ) != PTR_SZ) {
-    err_dump("_db_readptr(): read() error of ptr field");
+
+  if ((rc = _db_lockset(db, fd, F_SETLK, type, offset, len)) == 0 ||
+      (errno != EAGAIN && errno != EACCES)) {
+    return (rc);
   }
-  asciiptr[PTR_SZ] = 0; /* null terminate */
-  return (atol(asciiptr));
-} /* _db_readptr() */
+  start = _db_now();
+  rc = _db_lockset(db, fd, cmd, type, offset, len);
+  ns = _db_now() - start;
+  db->cnt_lock++;
+  db->lockns += ns;
+  if (ns > db->lockmax) {
+    db->lockmax = ns;
+  }
+  return (rc);
+} /* _db_lockreg() */
 
 /**
- * Read the next index record, starting at the specified offset in the index
- * file.  Read the index record into db->idxbuf and replace the separators with
- * null bytes.  On success, set db->datoff and db->datlen to the offset and
- * length of the corresponding data record in the data file.
- * @param db pointer to database structure.
- * @param offset in the index file.
- * @return
+ * Lock or unlock a range of bytes for _db_lockreg(), which has the same
+ * arguments.
  */
-static off_t _db_readidx(DB *db, off_t offset) {
-  ssize_t i;
-  char *ptr1, *ptr2;
-  char asciiptr[PTR_SZ + 1], asciilen[IDXLEN_SZ + 1];
-  struct iovec iov[2];
+static int _db_lockset(DB *db, int fd, int cmd, int type, off_t offset,
+                       off_t len) {
+  DBSHARE *sh = db->share;
+  DBLOCK *lk;
+  off_t end;
+  ino_t ino;
+  long i;
+  int file, rc, err;
+
+  if (db->lt != NULL && fd == db->idxfd) {
+    return (_db_ltlock(db, db->idxino, cmd, type, offset, len));
+  }
+  if (sh == NULL) {
+    return (_db_lockwait(fd, cmd, type, offset, len));
+  }
+  if (fd == db->idxfd) {
+    file = LOCK_IDX;
+  } else if (fd == db->datfd) {
+    file = LOCK_DAT;
+  } else if (fd == db->walfd) {
+    file = LOCK_WAL;
+  } else if (fd == db->chgfd) {
+    file = LOCK_CHG;
+  } else if (fd == db->snpfd) {
+    file = LOCK_SNP;
+  } else {
+    file = LOCK_OTHER;
+  }
+  ino = (file == LOCK_IDX || file == LOCK_DAT ? db->idxino : 0);
+  end = (len == 0 ? LOCK_EOF : offset + len);
+  pthread_mutex_lock(&sh->mutex);
+
+  if (type == F_UNLCK) {
+    _db_lockcut(sh, db, file, ino, offset, end, 1);
+    rc = _db_lockgaps(sh, fd, file, ino, offset, end);
+    pthread_cond_broadcast(&sh->cond);
+    pthread_mutex_unlock(&sh->mutex);
+    return (rc);
+  }
 
   /*
-   * Position index file and record the offset.  db_nextrec() calls this
-   * function with offet == 0, meaning read from current offset.  Still need to
-   * call lseek() to record the current offset.  Since an index record will
-   * never be stored at offset 0 in the index file, the offset value 0 can be
-   * safely overloaded to mean - read from the current offset.
+   * Wait for conflicting locks of other cursors to go, and enter the lock in
+   * the table before taking it with fcntl(), so that no other cursor can take a
+   * conflicting lock in between.
    */
-  if ((db->idxoff =
-           lseek(db->idxfd, offset, offset == 0 ? SEEK_CUR : SEEK_SET)) == -1) {
-    err_dump("_db_readidx(): lseek() error");
+  for (;;) {
+    for (i = 0; i < sh->nlocks; i++) {
+      lk = &sh->locks[i];
+      if (lk->owner != db && lk->file == file && lk->ino == ino &&
+          lk->start < end && lk->end > offset &&
+          (type == F_WRLCK || lk->type == F_WRLCK)) {
+        break;
+      }
+    }
+    if (i == sh->nlocks) {
+      break;
+    }
+    if (cmd == F_SETLK) {
+      pthread_mutex_unlock(&sh->mutex);
+      errno = EAGAIN;
+      return (-1);
+    }
+    pthread_cond_wait(&sh->cond, &sh->mutex);
   }
+  if (sh->nlocks == sh->maxlocks) {
+    sh->maxlocks = sh->maxlocks * 2 + 16;
+    if ((sh->locks = realloc(sh->locks, sh->maxlocks * sizeof(DBLOCK))) ==
+        NULL) {
+      err_dump("_db_lockset(): realloc() error");
+    }
+  }
+  lk = &sh->locks[sh->nlocks++];
+  lk->owner = db;
+  lk->file = file;
+  lk->ino = ino;
+  lk->type = type;
+  lk->granted = 0;
+  lk->start = offset;
+  lk->end = end;
+  db->lockagain = 0;
+  pthread_mutex_unlock(&sh->mutex);
 
   /*
-   * Read the ascii chain ptr and the ascii length at the front of the index
-   * record.  This provides the remaining size of the index record.
+   * Another cursor may unlock some of the bytes just after fcntl() has given
+   * them to us; if so, take them again, without waiting, now that no cursor
+   * can unlock them.  Should another process have got in first, let go of
+   * the bytes this cursor has been given so far, and wait again.
    */
-  iov[0].iov_base = asciiptr;
-  iov[0].iov_len = PTR_SZ;
-  iov[1].iov_base = asciilen;
-  iov[1].iov_len = IDXLEN_SZ;
-  if ((i = readv(db->idxfd, &iov[0], 2)) != PTR_SZ + IDXLEN_SZ) {
-    if (i == 0 && offset == 0) {
-      return (-1); /* EOF for db_nextrec() */
+  for (;;) {
+    rc = _db_lockwait(fd, cmd, type, offset, len);
+    err = errno;
+    pthread_mutex_lock(&sh->mutex);
+    if (rc < 0 || !db->lockagain) {
+      break;
+    }
+    db->lockagain = 0;
+    if ((rc = lock_reg(fd, F_SETLK, type, offset, SEEK_SET, len)) == 0 ||
+        (errno != EAGAIN && errno != EACCES) || cmd != F_SETLKW) {
+      err = errno;
+      break;
     }
-    err_dump("_db_readidx(): readv() error of index record");
+    _db_lockgaps(sh, fd, file, ino, offset, end);
+    db->lockagain = 0;
+    pthread_mutex_unlock(&sh->mutex);
+  }
+  if (rc < 0) {
+    _db_lockcut(sh, db, file, ino, offset, end, 0);
+    _db_lockgaps(sh, fd, file, ino, offset, end);
+    pthread_cond_broadcast(&sh->cond);
+    pthread_mutex_unlock(&sh->mutex);
+    errno = err;
+    return (-1);
   }
 
   /*
-   * Return value; always >= 0
+   * Until fcntl() returned, the process still held the bytes as this cursor had
+   * them before, so the locks it replaces stayed in the table to keep the other
+   * cursors from unlocking those bytes.
    */
-  asciiptr[PTR_SZ] = 0;        /* null terminate */
-  db->ptrval = atol(asciiptr); /* offset of next key in chain */
+  _db_lockcut(sh, db, file, ino, offset, end, 1);
+  for (i = 0; i < sh->nlocks; i++) {
+    if (sh->locks[i].owner == db && !sh->locks[i].granted) {
+      sh->locks[i].granted = 1;
+    }
+  }
+  pthread_mutex_unlock(&sh->mutex);
+  return (0);
+} /* _db_lockset() */
 
-  asciilen[IDXLEN_SZ] = 0; /* null terminate */
-  if ((db->idxlen = atoi(asciilen)) < IDXLEN_MIN || db->idxlen > IDXLEN_MAX) {
-    err_dump("_db_readidx(): invalid length");
+/**
+ * Unlock with fcntl() the bytes of a range that no cursor has been granted a
+ * lock on in the lock table.  A cursor still taking a lock on some of the bytes
+ * is told to make sure it has them.  Called with the mutex locked.
+ * @param sh state shared by the cursors.
+ * @param fd file descriptor.
+ * @param file LOCK_xxx file of the range.
+ * @param ino inode the locks on the file are tagged with.
+ * @param offset first byte of the range.
+ * @param end byte past the last; LOCK_EOF for the rest of the file.
+ * @return 0 if OK; -1 on error, with errno set as by fcntl().
+ */
+static int _db_lockgaps(DBSHARE *sh, int fd, int file, ino_t ino, off_t offset,
+                        off_t end) {
+  DBLOCK *lk;
+  off_t next;
+  long i;
+  int rc;
+
+  for (rc = 0; rc == 0 && offset < end; offset = next) {
+    for (i = 0; i < sh->nlocks; i++) {
+      lk = &sh->locks[i];
+      if (lk->file == file && lk->ino == ino && lk->granted &&
+          lk->start <= offset && lk->end > offset) {
+        offset = lk->end; /* held by a cursor; and look again */
+        i = -1;
+      }
+    }
+    if (offset >= end) {
+      break;
+    }
+    for (next = end, i = 0; i < sh->nlocks; i++) {
+      lk = &sh->locks[i];
+      if (lk->file == file && lk->ino == ino && lk->granted &&
+          lk->start > offset && lk->start < next) {
+        next = lk->start;
+      }
+    }
+    rc = lock_reg(fd, F_SETLK, F_UNLCK, offset, SEEK_SET,
+                  next == LOCK_EOF ? 0 : next - offset);
+    for (i = 0; i < sh->nlocks; i++) {
+      lk = &sh->locks[i];
+      if (lk->file == file && lk->ino == ino && !lk->granted &&
+          lk->start < next && lk->end > offset) {
+        lk->owner->lockagain = 1;
+      }
+    }
   }
+  return (rc);
+} /* _db_lockgaps() */
 
-  /*
-   * Now read the actual index record.  Read it into the key buffer that was
-   * malloced when the database was opened.
-   */
-  if ((i = read(db->idxfd, db->idxbuf, db->idxlen)) != db->idxlen) {
-    err_dump("_db_readidx(): read() error of index record");
+/**
+ * Lock or unlock a range of bytes with lock_reg().  The kernel sees a process
+ * as a whole waiting for a lock, even though only one of its threads is; with
+ * handles shared by threads in any of the processes, a thread waiting for a
+ * lock that a different thread of another process holds can look like a
+ * deadlock, and fcntl() fails with EDEADLK.  The lock orders of the library
+ * never deadlock, so just try again a little later.
+ * @param fd file descriptor.
+ * @param cmd F_SETLK or F_SETLKW.
+ * @param type F_RDLCK, F_WRLCK or F_UNLCK.
+ * @param offset offset of the first byte.
+ * @param len number of bytes; 0 for up to the end of the file and beyond.
+ * @return 0 if OK; -1 on error, with errno set as by fcntl().
+ */
+static int _db_lockwait(int fd, int cmd, int type, off_t offset, off_t len) {
+  struct timespec ts;
+  int rc;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = LOCK_RETRY;
+  while ((rc = lock_reg(fd, cmd, type, offset, SEEK_SET, len)) < 0 &&
+         errno == EDEADLK && cmd == F_SETLKW) {
+    nanosleep(&ts, NULL);
   }
-  if (db->idxbuf[db->idxlen - 1] != NEWLINE) { /* sanity check */
-    err_dump("_db_readidx(): missing newline");
+  return (rc);
+} /* _db_lockwait() */
+
+/**
+ * Take the granted or the pending locks of a cursor off a range of bytes in the
+ * lock table, cutting down the locks that extend past the range.  Called with
+ * the mutex locked.
+ * @param sh state shared by the cursors.
+ * @param db the cursor.
+ * @param file LOCK_xxx file of the range.
+ * @param ino inode the locks on the file are tagged with.
+ * @param start first byte of the range.
+ * @param end byte past the last; LOCK_EOF for the rest of the file.
+ * @param granted 1 for the granted locks; 0 for the pending ones.
+ */
+static void _db_lockcut(DBSHARE *sh, DB *db, int file, ino_t ino, off_t start,
+                        off_t end, int granted) {
+  DBLOCK *lk, tail;
+  long i;
+
+  for (i = 0; i < sh->nlocks; i++) {
+    lk = &sh->locks[i];
+    if (lk->owner != db || lk->granted != granted || lk->file != file ||
+        lk->ino != ino || lk->end <= start || lk->start >= end) {
+      continue;
+    }
+    if (lk->start < start && lk->end > end) {
+      /*
+       * Split the lock in two; the second half goes at the end of the table,
+       * beyond the range.
+       */
+      tail = *lk;
+      tail.start = end;
+      lk->end = start;
+      if (sh->nlocks == sh->maxlocks) {
+        sh->maxlocks = sh->maxlocks * 2 + 16;
+        if ((sh->locks = realloc(sh->locks, sh->maxlocks * sizeof(DBLOCK))) ==
+            NULL) {
+          err_dump("_db_lockcut(): realloc() error");
+        }
+      }
+      sh->locks[sh->nlocks++] = tail;
+    } else if (lk->start < start) {
+      lk->end = start;
+    } else if (lk->end > end) {
+      lk->start = end;
+    } else {
+      sh->locks[i--] = sh->locks[--sh->nlocks]; /* covered: remove it */
+    }
   }
-  db->idxbuf[db->idxlen - 1] = 0; /* replace newline with null */
+} /* _db_lockcut() */
 
-  /*
-   * Find the separators in the index record.  Separate the index record into
-   * three fields:
-   *   1. key
-   *   2. offset of the corresponding data record.
-   *   3. length of the data record.
-   * The strchr() function finds the first occurrence of the specified character
-   * in the given string.  Here we look for the character that separates fields
-   * in the record (SEP, which is defined to be a colon).
-   */
-  if ((ptr1 = strchr(db->idxbuf, SEP)) == NULL) {
-    err_dump("_db_readidx(): missing first separator");
+/**
+ * Attach the database to its shared lock table, if it has one or is to have
+ * one.  A database has a lock table once it has been opened with
+ * DB_OPT_LOCKTAB, and every process that opens it locks the index file through
+ * the table from then on.  If the table can't be set up, because the system
+ * can't share robust mutexes between processes or map the lock file, the
+ * database goes on with fcntl() locks.
+ * @param db pointer to database structure, with the files open.
+ * @param create nonzero to create the table if there is none (DB_OPT_LOCKTAB).
+ * @param oflag flags the database was opened with.
+ * @return 0 if OK, or if the database has no lock table; -1 on error, with
+ * errno set.
+ */
+static int _db_ltopen(DB *db, int create, int oflag) {
+  struct stat statbuff;
+  DBLT *lt;
+  int fd, rc, err;
+  mode_t mode;
+
+  if (fstat(db->idxfd, &statbuff) < 0) {
+    err_dump("_db_ltopen(): fstat() error");
+  }
+  db->idxino = statbuff.st_ino;
+  mode = statbuff.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+  strcpy(db->name + db->namelen, ".lck");
+  if (oflag & O_TRUNC) {
+    /*
+     * A table left over from the old files holds locks on them.
+     */
+    unlink(db->name);
+    if (!create) {
+      return (0);
+    }
   }
-  *ptr1++ = 0; /* replace SEP with null */
 
-  if ((ptr2 = strchr(ptr1, SEP)) == NULL) {
-    err_dump("_db_readidx(): missing second separator");
+  pthread_mutex_lock(&_db_ltmutex);
+  if (stat(db->name, &statbuff) == 0) {
+    for (lt = _db_lts; lt != NULL; lt = lt->next) {
+      if (lt->dev == statbuff.st_dev && lt->ino == statbuff.st_ino &&
+          lt->pid == getpid()) {
+        _db_ltjoin(db, lt); /* already mapped by the process */
+        pthread_mutex_unlock(&_db_ltmutex);
+        return (0);
+      }
+    }
   }
-  *ptr2++ = 0; /* replace SEP with null */
+  if ((fd = open(db->name, O_RDWR | (create ? O_CREAT : 0), mode)) < 0) {
+    err = errno;
+    pthread_mutex_unlock(&_db_ltmutex);
+    if (err == ENOENT && !create) {
+      return (0); /* no lock table */
+    }
+    errno = err;
+    return (-1);
+  }
+  if ((lt = calloc(1, sizeof(DBLT))) == NULL) {
+    err_dump("_db_ltopen(): calloc() error");
+  }
+  lt->fd = fd;
+  if ((rc = _db_ltmap(lt, db->name, create)) <= 0) {
+    err = errno;
+    close(fd);
+    free(lt);
+    pthread_mutex_unlock(&_db_ltmutex);
+    errno = err;
+    return (rc);
+  }
+  lt->next = _db_lts;
+  _db_lts = lt;
+  _db_ltjoin(db, lt);
+  pthread_mutex_unlock(&_db_ltmutex);
+  return (0);
+} /* _db_ltopen() */
 
-  if (strchr(ptr2, SEP) != NULL) {
-    err_dump("_db_readidx(): too many separators");
+/**
+ * Map a lock file, setting up the table if the file is new, and take a slot in
+ * it for the process.  The first byte of the file is write locked meanwhile,
+ * so that no other process looks at a table that isn't set up yet.
+ * @param lt the table, with the lock file open.
+ * @param name pathname of the lock file.
+ * @param create nonzero if the lock file may be new.
+ * @return 1 if OK; 0 if there is no table to use, and the lock file has been
+ * removed if it was new; -1 on error, with errno set to EINVAL if the lock file
+ * is not recognised, ENOTSUP if the system can't use it, or ENOLCK if all the
+ * slots are taken.
+ */
+static int _db_ltmap(DBLT *lt, const char *name, int create) {
+  struct stat statbuff;
+#ifdef HAVE_LOCKTAB
+  pthread_mutexattr_t mattr;
+  pthread_condattr_t cattr;
+  int i;
+#endif
+  LTAB *tab = MAP_FAILED;
+  uint32_t s;
+  int rc = 1, err = 0;
+
+  if (_db_lockwait(lt->fd, F_SETLKW, F_WRLCK, 0, 1) < 0) {
+    err_dump("_db_ltmap(): writew_lock() error");
+  }
+  if (fstat(lt->fd, &statbuff) < 0) {
+    err_dump("_db_ltmap(): fstat() error");
+  }
+  lt->dev = statbuff.st_dev;
+  lt->ino = statbuff.st_ino;
+  lt->pid = getpid();
+
+  if (statbuff.st_size == 0) {
+    /*
+     * A new lock file.  Should the table not work here, remove the file, so
+     * that the processes that open the database lock with fcntl() instead.
+     */
+    rc = 0;
+#ifdef HAVE_LOCKTAB
+    if (create && ftruncate(lt->fd, sizeof(LTAB)) == 0 &&
+        (tab = mmap(NULL, sizeof(LTAB), PROT_READ | PROT_WRITE, MAP_SHARED,
+                    lt->fd, 0)) != MAP_FAILED) {
+      pthread_mutexattr_init(&mattr);
+      pthread_condattr_init(&cattr);
+      if (pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED) == 0 &&
+          pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST) == 0 &&
+          pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED) == 0) {
+        for (i = 0; i < LT_NPART; i++) {
+          if (pthread_mutex_init(&tab->part[i].mutex, &mattr) != 0 ||
+              pthread_cond_init(&tab->part[i].cond, &cattr) != 0) {
+            break;
+          }
+        }
+        rc = (i == LT_NPART);
+      }
+      pthread_mutexattr_destroy(&mattr);
+      pthread_condattr_destroy(&cattr);
+    }
+#endif
+    if (rc) {
+      tab->size = sizeof(LTAB);
+      memcpy(tab->magic, LT_MAGIC, sizeof(tab->magic));
+    } else if (create) {
+      unlink(name);
+    }
+  } else if (statbuff.st_size != sizeof(LTAB)) {
+    err = EINVAL;
+  } else {
+#ifdef HAVE_LOCKTAB
+    if ((tab = mmap(NULL, sizeof(LTAB), PROT_READ | PROT_WRITE, MAP_SHARED,
+                    lt->fd, 0)) == MAP_FAILED) {
+      err = errno;
+    } else if (memcmp(tab->magic, LT_MAGIC, sizeof(tab->magic)) != 0 ||
+               tab->size != sizeof(LTAB)) {
+      err = EINVAL;
+    }
+#else
+    err = ENOTSUP;
+#endif
+  }
+  if (lock_reg(lt->fd, F_SETLK, F_UNLCK, 0, SEEK_SET, 1) < 0) {
+    err_dump("_db_ltmap(): un_lock() error");
   }
 
   /*
-   * Get the starting offset and length of the data record.
+   * Take the first free slot; the lock on it goes when the process closes the
+   * lock file, or dies.
    */
-  if ((db->datoff = atol(ptr1)) < 0) {
-    err_dump("_db_readidx(): starting offset < 0");
+  for (s = 0; rc == 1 && err == 0 && s < LT_NSLOT; s++) {
+    if (lock_reg(lt->fd, F_SETLK, F_WRLCK, 1 + s, SEEK_SET, 1) == 0) {
+      break;
+    }
   }
-  if ((db->datlen = atol(ptr2)) <= 0 || db->datlen > DATLEN_MAX) {
-    err_dump("_db_readidx(): invalid length");
+  if (s == LT_NSLOT) {
+    err = ENOLCK;
   }
-  return (db->ptrval); /* return offset of next key in chain */
-} /* _db_readidx() */
+  if (err != 0 || rc == 0) {
+    if (tab != MAP_FAILED) {
+      munmap(tab, sizeof(LTAB));
+    }
+    errno = err;
+    return (err != 0 ? -1 : 0);
+  }
+  lt->tab = tab;
+  lt->slot = s;
+  _db_ltpurge(lt, 0, 0); /* locks left by a dead process with the slot */
+  return (1);
+} /* _db_ltmap() */
 
 /**
- * Read the current data record into the data buffer.  Return a pointer to the
- * null-terminated data buffer.
+ * Give a DB structure an owner of its own in a shared lock table mapped by the
+ * process.  Called with _db_ltmutex locked.
  * @param db pointer to database structure.
- * @return pointer to the null-terminated data buffer.
+ * @param lt the table.
  */
-static char *_db_readdat(DB *db) {
-  if (lseek(db->datfd, db->datoff, SEEK_SET) == -1) {
-    err_dump("_db_readdat(): lseek() error");
+static void _db_ltjoin(DB *db, DBLT *lt) {
+  lt->refs++;
+  if (++lt->lastowner == 0) {
+    lt->lastowner = 1;
   }
-  if (read(db->datfd, db->datbuf, db->datlen) != db->datlen) {
-    err_dump("_db_readdat(): read() error");
+  db->lt = lt;
+  db->ltowner = lt->lastowner;
+} /* _db_ltjoin() */
+
+/**
+ * Detach a DB structure from its shared lock table, releasing its locks.  The
+ * last structure of the process to go unmaps the table and gives up the slot.
+ * @param db pointer to database structure.
+ */
+static void _db_ltclose(DB *db) {
+  DBLT *lt = db->lt, **pp;
+
+  _db_ltpurge(lt, db->ltowner, 0);
+  pthread_mutex_lock(&_db_ltmutex);
+  if (--lt->refs == 0) {
+    for (pp = &_db_lts; *pp != lt; pp = &(*pp)->next) {
+      ;
+    }
+    *pp = lt->next;
+    munmap(lt->tab, sizeof(LTAB));
+    close(lt->fd);
+    free(lt);
   }
-  if (db->datbuf[db->datlen - 1] != NEWLINE) { /* sanity check */
-    err_dump("_db_readdat(): missing newline");
+  pthread_mutex_unlock(&_db_ltmutex);
+  db->lt = NULL;
+} /* _db_ltclose() */
+
+/**
+ * Lock or unlock a range of bytes of the index file in the shared lock table,
+ * as lock_reg() does with fcntl(): a lock replaces any lock of the same DB
+ * structure on the bytes, and F_SETLKW waits for conflicting locks of other
+ * structures, in this process or another, to go.  The partitions the range has
+ * bytes in are locked in increasing order while their locks are checked and
+ * changed, so the whole range changes at once.  Without contention, no system
+ * call is made.  A waiter lets go of the partitions and waits on the one with
+ * the conflicting lock; if that lock isn't released within LT_WAIT seconds,
+ * the locks of dead processes are removed from the partition.
+ * @param db pointer to database structure.
+ * @param ino inode of the index file.
+ * @param cmd F_SETLK or F_SETLKW.
+ * @param type F_RDLCK, F_WRLCK or F_UNLCK.
+ * @param offset offset of the first byte.
+ * @param len number of bytes; 0 for up to the end of the file and beyond.
+ * @return 0 if OK; -1 on error, with errno set to EAGAIN if F_SETLK finds a
+ * conflicting lock, or ENOLCK if a partition is full of locks of db.
+ */
+static int _db_ltlock(DB *db, ino_t ino, int cmd, int type, off_t offset,
+                      off_t len) {
+  DBLT *lt = db->lt;
+  LTPART *pt;
+  struct timespec ts;
+  uint64_t mask;
+  int64_t end = (len == 0 ? LOCK_EOF : offset + len);
+  int p, wait, rc, err;
+
+  mask = _db_ltparts(offset, end);
+  for (;;) {
+    for (wait = -1, err = 0, p = 0; p < LT_NPART; p++) {
+      if ((mask >> p & 1) == 0) {
+        continue;
+      }
+      _db_ltenter(lt, &lt->tab->part[p]);
+      if (wait < 0 && err == 0) {
+        if ((rc = _db_ltcheck(db, p, ino, offset, end, type)) > 0) {
+          wait = p;
+        } else if (rc < 0) {
+          err = ENOLCK;
+        }
+      }
+    }
+    if (wait < 0 && err == 0) {
+      for (p = 0; p < LT_NPART; p++) {
+        if (mask >> p & 1) {
+          _db_ltset(db, p, ino, offset, end, type);
+        }
+      }
+    }
+
+    /*
+     * An unlock only waits for room to split a lock, so it always waits.
+     */
+    if (wait < 0 || err != 0 || (cmd == F_SETLK && type != F_UNLCK)) {
+      for (p = 0; p < LT_NPART; p++) {
+        if (mask >> p & 1) {
+          pthread_mutex_unlock(&lt->tab->part[p].mutex);
+        }
+      }
+      if (wait < 0 && err == 0) {
+        return (0);
+      }
+      errno = (err != 0 ? err : EAGAIN);
+      return (-1);
+    }
+    for (p = 0; p < LT_NPART; p++) {
+      if ((mask >> p & 1) && p != wait) {
+        pthread_mutex_unlock(&lt->tab->part[p].mutex);
+      }
+    }
+    pt = &lt->tab->part[wait];
+    if (clock_gettime(CLOCK_REALTIME, &ts) < 0) {
+      err_dump("_db_ltlock(): clock_gettime() error");
+    }
+    ts.tv_sec += LT_WAIT;
+    pt->nwait++;
+    rc = pthread_cond_timedwait(&pt->cond, &pt->mutex, &ts);
+    pt->nwait--;
+    if (rc == EOWNERDEAD) {
+      _db_ltrepair(lt, pt);
+    } else if (rc == ETIMEDOUT) {
+      _db_ltreap(lt, pt);
+    }
+    pthread_mutex_unlock(&pt->mutex);
   }
-  db->datbuf[db->datlen - 1] = 0; /* replace newline with null */
-  return (db->datbuf);            /* return pointer to data record */
-} /* _db_readdat() */
+} /* _db_ltlock() */
 
 /**
- * Delete the specified record.
- * @param h database handle.
- * @param key pointer to null-terminated key.
- * @return 0 on success if record is found; -1 if record not found.
+ * Check whether a DB structure can lock or unlock a range of bytes in one
+ * partition of the shared lock table: no other structure has a conflicting
+ * lock on the bytes of the range in the partition, and there's room for the
+ * entries the change needs.  Called with the partition locked.
+ * @param db pointer to database structure.
+ * @param p the partition.
+ * @param ino inode of the index file.
+ * @param start first byte of the range.
+ * @param end byte past the last; LOCK_EOF for the rest of the file.
+ * @param type F_RDLCK, F_WRLCK or F_UNLCK.
+ * @return 0 if the change can be made; 1 if it has to wait; -1 if it never can,
+ * since the partition is full of the locks of db.
  */
-int db_delete(DBHANDLE h, const char *key) {
-  DB *db = h;
-  int rc = 0; /* assume record will be found */
+static int _db_ltcheck(DB *db, int p, ino_t ino, int64_t start, int64_t end,
+                       int type) {
+  LTPART *pt = &db->lt->tab->part[p];
+  LTENT *e;
+  uint64_t bit = (uint64_t)1 << p;
+  int32_t i, need;
+  int others = 0;
 
-  /* Determine whether the record exists in the database; request write lock */
-  if (_db_find_and_lock(db, key, 1) == 0) {
-    _db_dodelete(db); /* delete record */
-    db->cnt_delok++;
-  } else {
-    rc = -1; /* record not found */
-    db->cnt_delerr++;
+  need = (type == F_UNLCK ? 0 : 1);
+  for (i = 0; i < pt->nent; i++) {
+    e = &pt->ent[i];
+    if (e->slot != db->lt->slot || e->owner != db->ltowner) {
+      others = 1;
+      if (type != F_UNLCK && e->ino == ino &&
+          (type == F_WRLCK || e->type == F_WRLCK) &&
+          _db_ltover(p, e->start, e->end, start, end)) {
+        return (1);
+      }
+    } else if (e->ino == ino && e->start < start && e->end > end &&
+               (_db_ltparts(e->start, start) & bit) != 0 &&
+               (_db_ltparts(end, e->end) & bit) != 0) {
+      need++; /* our lock will be split in two */
+    }
   }
-  /* _db_find_and_lock() returns with lock still held; must release lock */
-  if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0) {
-    err_dump("db_delete(): un_lock() error");
+  if (pt->nent + need <= LT_NENT) {
+    return (0);
   }
-  return (rc);
-} /* db_delete() */
+  return (others ? 1 : -1);
+} /* _db_ltcheck() */
 
 /**
- * Delete the current record specified by the DB structure.  This function is
- * called by db_delete() and db_store(), after the record has been located by
- * _db_find_and_lock().
+ * Set the lock of a DB structure on a range of bytes in one partition of the
+ * shared lock table, replacing its locks on the bytes, and wake the waiters if
+ * any lock was released.  The pieces of a replaced lock that are left with no
+ * bytes in the partition are dropped.  Called with the partition locked, after
+ * _db_ltcheck().
  * @param db pointer to database structure.
+ * @param p the partition.
+ * @param ino inode of the index file.
+ * @param start first byte of the range.
+ * @param end byte past the last; LOCK_EOF for the rest of the file.
+ * @param type F_RDLCK, F_WRLCK or F_UNLCK.
  */
-static void _db_dodelete(DB *db) {
-  int i;
-  char *ptr;
-  off_t freeptr, saveptr;
+static void _db_ltset(DB *db, int p, ino_t ino, int64_t start, int64_t end,
+                      int type) {
+  DBLT *lt = db->lt;
+  LTPART *pt = &lt->tab->part[p];
+  LTENT *e, *n;
+  uint64_t bit = (uint64_t)1 << p;
+  int32_t i;
+  int left, right, freed = 0;
 
-  /*
-   * Set data buffer and key to all blanks.
-   */
-  for (ptr = db->datbuf, i = 0; i < db->datlen - 1; i++) {
-    *ptr++ = SPACE;
+  for (i = 0; i < pt->nent; i++) {
+    e = &pt->ent[i];
+    if (e->slot != lt->slot || e->owner != db->ltowner || e->ino != ino ||
+        e->end <= start || e->start >= end) {
+      continue;
+    }
+    freed = 1;
+    left = e->start < start && (_db_ltparts(e->start, start) & bit) != 0;
+    right = e->end > end && (_db_ltparts(end, e->end) & bit) != 0;
+    if (left && right) {
+      n = &pt->ent[pt->nent];
+      *n = *e;
+      n->start = end;
+      pt->nent++;
+      e->end = start;
+    } else if (left) {
+      e->end = start;
+    } else if (right) {
+      e->start = end;
+    } else {
+      *e = pt->ent[--pt->nent];
+      i--;
+    }
   }
-  *ptr = 0; /* null terminate for _db_writedat() */
-  ptr = db->idxbuf;
-  while (*ptr) {
-    *ptr++ = SPACE;
+  if (type != F_UNLCK) {
+    n = &pt->ent[pt->nent];
+    n->slot = lt->slot;
+    n->owner = db->ltowner;
+    n->ino = ino;
+    n->start = start;
+    n->end = end;
+    n->type = type;
+    pt->nent++;
   }
-
-  /*
-   * Have to write lock the free list to prevent two processes that are deleting
-   * records at the same time, on two different hash chains, from interfering
-   * with each other.  Since the deleted record is added to the free list, which
-   * changes the free-list pointer, only one process at a time can be doing
-   * this.
-   */
-  if (writew_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
-    err_dump("_db_dodelete(): writew_lock() error");
+  if (freed && pt->nwait > 0) {
+    pthread_cond_broadcast(&pt->cond);
   }
+} /* _db_ltset() */
 
-  /*
-   * Write the data record with all blanks.  No need for _db_writedat() to lock
-   * the data file in this case, since db_delete() has write locked the hash
-   * chain for this record, therefore, no other process is reading or writing
-   * this particular data record.
-   */
-  _db_writedat(db, db->datbuf, db->datoff, SEEK_SET);
-
-  /*
-   * Read the free list pointer.  Its value becomes the chain ptr field of the
-   * deleted index record.  This means the deleted record becomes the head of
-   * the free list.
-   */
-  freeptr = _db_readptr(db, FREE_OFF);
+/**
+ * Lock the mutex of a partition of a shared lock table, repairing the
+ * partition if the last process to hold the mutex died holding it.
+ * @param lt the table.
+ * @param pt the partition.
+ */
+static void _db_ltenter(DBLT *lt, LTPART *pt) {
+  int rc;
 
-  /*
-   * Save the contents of index record chain pointer, before it's rewritten by
-   * _db_writeidx().
-   */
-  saveptr = db->ptrval;
+  if ((rc = pthread_mutex_lock(&pt->mutex)) == EOWNERDEAD) {
+    _db_ltrepair(lt, pt);
+  } else if (rc != 0) {
+    errno = rc;
+    err_dump("_db_ltenter(): pthread_mutex_lock() error");
+  }
+} /* _db_ltenter() */
 
-  /*
-   * Rewrite the index record.  This also rewrites the length of the index
-   * record, the data offset, and the data length, none of which has changed,
-   * but that's OK.
-   */
-  _db_writeidx(db, db->idxbuf, db->idxoff, SEEK_SET, freeptr);
+/**
+ * Make a partition usable again after a process died holding its mutex.  Its
+ * entries are complete, since the count of entries is only raised once an entry
+ * is; the locks of the dead process are removed.  Called with the partition
+ * locked.
+ * @param lt the table.
+ * @param pt the partition.
+ */
+static void _db_ltrepair(DBLT *lt, LTPART *pt) {
+#ifdef HAVE_LOCKTAB
+  pthread_mutex_consistent(&pt->mutex);
+#endif
+  _db_ltreap(lt, pt);
+} /* _db_ltrepair() */
 
-  /*
-   * Write the new free list pointer.
-   */
-  _db_writeptr(db, FREE_OFF, db->idxoff);
+/**
+ * Remove the locks of some or all of the DB structures of the process from a
+ * shared lock table, and wake the waiters.
+ * @param lt the table.
+ * @param owner owner of the locks to remove; 0 for every owner.
+ * @param ino remove the locks on this index file; 0 for every file.
+ */
+static void _db_ltpurge(DBLT *lt, uint32_t owner, ino_t ino) {
+  LTPART *pt;
+  LTENT *e;
+  int32_t i;
+  int p, freed;
 
-  /*
-   * Rewrite the chain ptr that pointed to this record being deleted.
-   * _db_find_and_lock() sets db->ptroff to point to this chain ptr.  Set this
-   * chain ptr to the contents of the deleted record's chain ptr, saveptr.
-   */
-  _db_writeptr(db, db->ptroff, saveptr);
-  if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
-    err_dump("_db_dodelete(): un_lock() error");
+  for (p = 0; p < LT_NPART; p++) {
+    pt = &lt->tab->part[p];
+    _db_ltenter(lt, pt);
+    for (freed = 0, i = 0; i < pt->nent; i++) {
+      e = &pt->ent[i];
+      if (e->slot == lt->slot && (owner == 0 || e->owner == owner) &&
+          (ino == 0 || e->ino == ino)) {
+        *e = pt->ent[--pt->nent];
+        i--;
+        freed = 1;
+      }
+    }
+    if (freed && pt->nwait > 0) {
+      pthread_cond_broadcast(&pt->cond);
+    }
+    pthread_mutex_unlock(&pt->mutex);
   }
-}
+} /* _db_ltpurge() */
 
 /**
- * Write a data record.  Called by _db_dodelete() (to write the record with
- * blanks) and db_store().
- * @param db pointer to database structure.
- * @param data pointer to null-terminated data string to be written to db.
- * @param offset of data record to be written.
- * @param whence flag controls append if set to SEEK_END.
+ * Remove the locks of dead processes from a partition of a shared lock table,
+ * and wake the waiters.  A process is alive for as long as it holds the lock
+ * on the byte of its slot in the lock file.  Called with the partition locked.
+ * @param lt the table.
+ * @param pt the partition.
  */
-static void _db_writedat(DB *db, const char *data, off_t offset, int whence) {
-  struct iovec iov[2];
-  static char newline = NEWLINE;
+static void _db_ltreap(DBLT *lt, LTPART *pt) {
+  uint32_t s, alive = LT_NSLOT, dead = LT_NSLOT;
+  int32_t i;
+  int freed = 0;
 
-  /*
-   * If appending, have to lock before doing the lseek() and write() to make the
-   * two operations atomic.  If overwriting an existing record, then no locking
-   * is necessary.
-   */
-  if (whence == SEEK_END) { /* appending, therefore lock entire file */
-    if (writew_lock(db->datfd, 0, SEEK_SET, 0) < 0) {
-      err_dump("_db_writedat(): writew_lock() error");
+  for (i = 0; i < pt->nent; i++) {
+    s = pt->ent[i].slot;
+    if (s == lt->slot || s == alive) {
+      continue;
+    }
+    if (s != dead) {
+      if (lock_test(lt->fd, F_WRLCK, 1 + s, SEEK_SET, 1) != 0) {
+        alive = s;
+        continue;
+      }
+      dead = s;
     }
+    pt->ent[i--] = pt->ent[--pt->nent];
+    freed = 1;
   }
-
-  if ((db->datoff = lseek(db->datfd, offset, whence)) == -1) {
-    err_dump("_db_writedat(): lseek() error");
+  if (freed && pt->nwait > 0) {
+    pthread_cond_broadcast(&pt->cond);
   }
-  db->datlen = strlen(data) + 1; /* datlen includes newline */
+} /* _db_ltreap() */
 
-  iov[0].iov_base = (char *)data;
-  iov[0].iov_len = db->datlen - 1;
-  iov[1].iov_base = &newline;
-  iov[1].iov_len = 1;
-  if (writev(db->datfd, &iov[0], 2) != db->datlen) {
-    err_dump("_db_writedat(): writev() error of data record");
-  }
+/**
+ * Find the partitions of a shared lock table that a range of bytes has bytes
+ * in.
+ * @param start first byte of the range.
+ * @param end byte past the last; LOCK_EOF for the rest of the file.
+ * @return bit mask of the partitions.
+ */
+static uint64_t _db_ltparts(int64_t start, int64_t end) {
+  uint64_t mask = 0;
+  int64_t r;
 
-  /* Release write lock held for append operation */
-  if (whence == SEEK_END) {
-    if (un_lock(db->datfd, 0, SEEK_SET, 0) < 0) {
-      err_dump("_db_writedat(): un_lock() error");
-    }
+  if (end - start >= (int64_t)LT_NPART * LT_RUN) {
+    return (~(uint64_t)0);
   }
-}
+  for (r = start / LT_RUN; r <= (end - 1) / LT_RUN; r++) {
+    mask |= (uint64_t)1 << (r % LT_NPART);
+  }
+  return (mask);
+} /* _db_ltparts() */
 
 /**
- * Write an index record.  _db_writedat() is called before this function to set
- * the datoff and datlen fields in the DB structure, which is needed to write
- * the index record.
- * @param db pointer to database structure.
- * @param key pointer to null-terminated key string.
- * @param offset where to write the index record.
- * @param whence flag controls append if set to SEEK_END.
- * @param ptrval contents of chain ptr in index record.
+ * Check whether two ranges of bytes overlap in a partition of a shared lock
+ * table.
+ * @param p the partition.
+ * @param s1 first byte of the first range.
+ * @param e1 byte past the last of the first range.
+ * @param s2 first byte of the second range.
+ * @param e2 byte past the last of the second range.
+ * @return nonzero if some byte of the partition is in both ranges.
  */
-static void _db_writeidx(DB *db, const char *key, off_t offset, int whence,
-                         off_t ptrval) {
-  struct iovec iov[2];
-  char asciiptrlen[PTR_SZ + IDXLEN_SZ + 1];
-  int len;
+static int _db_ltover(int p, int64_t s1, int64_t e1, int64_t s2, int64_t e2) {
+  int64_t s = (s1 > s2 ? s1 : s2), e = (e1 < e2 ? e1 : e2);
 
-  if ((db->ptrval = ptrval) < 0 || ptrval > PTR_MAX) {
-    err_quit("_db_writeidx(): invalid ptr: %d", ptrval);
-  }
-  sprintf(db->idxbuf, "%s%c%lld%c%ld\n", key, SEP, (long long)db->datoff, SEP,
-          (long)db->datlen);
-  len = strlen(db->idxbuf);
-  if (len < IDXLEN_MIN || len > IDXLEN_MAX) {
-    err_dump("_db_writeidx(): invalid length");
-  }
-  /* First half of the of the index record */
-  sprintf(asciiptrlen, "%*lld%*d", PTR_SZ, (long long)ptrval, IDXLEN_SZ, len);
+  return (s < e && (_db_ltparts(s, e) >> p & 1) != 0);
+} /* _db_ltover() */
 
-  /*
-   * If we're appending, we have to lock before doing the lseek() and write() to
-   * make the two an atomic operation.  If we're overwriting an existing record,
-   * we don't have to lock.
-   */
-  if (whence == SEEK_END) { /* appending */
-    if (writew_lock(db->idxfd, ((db->nhash + 1) * PTR_SZ) + 1, SEEK_SET, 0) <
-        0) {
-      err_dump("_db_writeidx(): writew_lock() error");
-    }
+/**
+ * Fetch a record and return a pointer to the null-terminated data.  The data is
+ * in a buffer of the handle, and is overwritten by the next call.
+ * @param h database handle.
+ * @param key lookup key for the data record.
+ * @return pointer to the data stored with key, if the record is found; NULL
+ * with errno set to ENOENT if the record is not found, or to EBADMSG if a
+ * record that had to be read is bad (or the error of the read).
+ */
+char *db_fetch(DBHANDLE h, const char *key) {
+  DB *db = _db_cursor(h);
+  uint64_t start = _db_now();
+  char *ptr;
+
+  ptr = (_db_fetch(db, key, NULL, 0) < 0 ? NULL : db->datbuf);
+  _db_unlockchains(db, db->chainoff, 1);
+  _db_lat(&db->latfetch, start);
+  if (ptr == NULL) {
+    errno = (db->bad ? db->bad : ENOENT);
   }
+  return (ptr);
+} /* db_fetch() */
 
-  /*
-   * Position the index file and record the offset.
-   */
-  if ((db->idxoff = lseek(db->idxfd, offset, whence)) == -1) {
-    err_dump("_db_writeidx(): lseek() error");
+/**
+ * Fetch a record into a buffer supplied by the caller, as snprintf(3) formats
+ * a string: the data is null-terminated, and cut short if the buffer is too
+ * small.  The data is read straight into the buffer, or copied from the record
+ * cache, without going through a buffer of the handle.
+ * @param h database handle.
+ * @param key lookup key for the data record.
+ * @param buf buffer for the data.
+ * @param len size of buf.
+ * @return length of the data, without the null; if it's len or more, only the
+ * first len - 1 bytes are in buf, and aren't checked against the checksum of
+ * the record.  -1 with errno set to ENOENT if the record is not found, or as
+ * for db_fetch() if a record is bad.
+ */
+ssize_t db_fetch_into(DBHANDLE h, const char *key, char *buf, size_t len) {
+  DB *db = _db_cursor(h);
+  uint64_t start = _db_now();
+  ssize_t n;
+
+  n = _db_fetch(db, key, buf, len);
+  _db_unlockchains(db, db->chainoff, 1);
+  _db_lat(&db->latfetch, start);
+  if (n < 0) {
+    errno = (db->bad ? db->bad : ENOENT);
   }
+  return (n);
+} /* db_fetch_into() */
 
-  iov[0].iov_base = asciiptrlen;
-  iov[0].iov_len = PTR_SZ + IDXLEN_SZ;
-  iov[1].iov_base = db->idxbuf;
-  iov[1].iov_len = len;
-  if (writev(db->idxfd, &iov[0], 2) != PTR_SZ + IDXLEN_SZ + len) {
-    err_dump("_db_writeidx(): writev() error of index record");
+/**
+ * Look up a record for db_fetch() and db_fetch_into(), and copy its data.  With
+ * a record cache, if the cache holds the key and the generation of its chain
+ * hasn't changed since, the data is taken from the cache instead of reading
+ * the records.  Returns with the hash chain locked.
+ * @param db pointer to database structure.
+ * @param key lookup key for the data record.
+ * @param buf buffer for the data; NULL for the data buffer of the handle.
+ * @param len size of buf.
+ * @return length of the data, as for db_fetch_into(); -1 if the record is not
+ * found, with db->bad set if a record is bad.
+ */
+static ssize_t _db_fetch(DB *db, const char *key, char *buf, size_t len) {
+  DBCENT *ce = NULL;
+  DBHASH hval;
+  uint64_t gen = 0;
+  ssize_t n;
+  int cache;
+
+  db->bad = 0;
+  hval = _db_hash(db, key);
+  _db_lockchain(db, hval, 0);
+  cache = (db->cachemax != 0 && (db->features & F_CHAINGEN));
+  if (cache) {
+    gen = (uint64_t)_db_readptr(db, db->chainoff + SLOT_GEN);
+    if ((ce = _db_cacheget(db, key, hval)) != NULL &&
+        ce->chainoff == db->chainoff && ce->gen == gen) {
+      ce->ref = 1;
+      db->cnt_cachehit++;
+      if (ce->data == NULL) {
+        db->cnt_fetcherr++;
+        return (-1);
+      }
+      db->cnt_fetchok++;
+      n = strlen(ce->data);
+      if (buf == NULL) {
+        memcpy(_db_datbuf(db, n + 1), ce->data, n + 1);
+      } else if (len > 0) {
+        memcpy(buf, ce->data, (size_t)n < len ? n : len - 1);
+        buf[(size_t)n < len ? n : len - 1] = 0;
+      }
+      return (n);
+    }
+  }
+  if (_db_findrec(db, key) < 0) {
+    db->cnt_fetcherr++; /* error, record not found */
+    if (cache && !db->bad) {
+      _db_cacheput(db, ce, key, hval, gen, NULL);
+    }
+    return (-1);
+  }
+  n = RAWLEN(db) - 1; /* without the newline */
+  if (buf == NULL) {
+    buf = _db_readdat(db);
+  } else if ((size_t)n < len) {
+    buf = _db_readdatinto(db, buf);
+  } else {
+    if (len > 0) {
+      if (_db_readpart(db, buf, len - 1, 0) < 0) {
+        db->cnt_fetcherr++;
+        return (-1);
+      }
+      buf[len - 1] = 0;
+    }
+    db->cnt_fetchok++;
+    return (n); /* too long for buf, so not cached */
+  }
+  if (buf == NULL) {
+    db->cnt_fetcherr++; /* bad data record */
+    return (-1);
+  }
+  db->cnt_fetchok++;
+  if (cache) {
+    _db_cacheput(db, ce, key, hval, gen, buf);
   }
+  return (n);
+} /* _db_fetch() */
 
-  /* If appending, release lock */
-  if (whence == SEEK_END) {
-    if (un_lock(db->idxfd, ((db->nhash + 1) * PTR_SZ) + 1, SEEK_SET, 0) < 0) {
-      err_dump("_db_writeidx(): un_lock() error");
+/**
+ * Read part of the data of a record into a buffer, as pread(2) does for a
+ * file, so that long data can be read a piece at a time without holding it all
+ * in memory.  The bytes are read from the data file straight into the buffer.
+ * Each call looks the key up again: if the record is replaced between calls,
+ * the pieces may come from different versions of the data.
+ * @param h database handle.
+ * @param key lookup key for the data record.
+ * @param buf buffer for the data.
+ * @param nbytes size of buf.
+ * @param offset offset in the data of the first byte to read.
+ * @return number of bytes read, which is less than nbytes only at the end of
+ * the data, and 0 at or beyond the end; -1 with errno set to ENOENT if the
+ * record is not found, to EINVAL if offset is negative, or as for db_fetch()
+ * if a record is bad.  The bytes read aren't checked against the checksum of
+ * the record, unless it's packed (DB_OPT_COMPRESS), since then the whole of it
+ * is read and unpacked for every piece.
+ */
+ssize_t db_read(DBHANDLE h, const char *key, void *buf, size_t nbytes,
+                off_t offset) {
+  DB *db = _db_cursor(h);
+  uint64_t start;
+  ssize_t n;
+
+  if (offset < 0) {
+    errno = EINVAL;
+    return (-1);
+  }
+  start = _db_now();
+  if (_db_find_and_lock(db, key, 0) < 0) {
+    n = -1;
+  } else {
+    n = 0;
+    if (offset < RAWLEN(db) - 1) { /* the newline isn't part of the data */
+      if (nbytes > RAWLEN(db) - 1 - offset) {
+        nbytes = RAWLEN(db) - 1 - offset;
+      }
+      n = (_db_readpart(db, buf, nbytes, offset) < 0 ? -1 : nbytes);
     }
   }
-} /* _db_writeidx() */
+  if (n < 0) {
+    db->cnt_fetcherr++;
+  } else {
+    db->cnt_fetchok++;
+  }
+  _db_unlockchains(db, db->chainoff, 1);
+  _db_lat(&db->latfetch, start);
+  if (n < 0) {
+    errno = (db->bad ? db->bad : ENOENT);
+  }
+  return (n);
+} /* db_read() */
 
 /**
- * Write a chain ptr field somewhere in the index file: the free list, the hash
- * table, or in an index record.
- * @param db pointer to database strucutre.
- * @param offset of where to write the chain ptr field in the index file.
- * @param ptrval contents of chain ptr in index record.
+ * Fetch a record without copying its data, when the database is mapped
+ * (DB_OPT_MMAP): the pointer returned is into the mapping of the data file.
+ * The view is pinned until it's given to db_release(): the chain of the key
+ * stays read locked, so the data can't be changed or moved, and the mapping
+ * isn't dropped.  Meanwhile the handle can still be used to read, but not to
+ * update the database.  Without a mapping, or if the record is packed
+ * (DB_OPT_COMPRESS), the data is read into memory that db_release() frees, and
+ * the handle isn't restricted.
+ * @param h database handle.
+ * @param key lookup key for the data record.
+ * @param lenp set to the length of the data.
+ * @return pointer to the data, which is not null-terminated in a mapping; NULL
+ * with errno set to ENOENT if the record is not found, to ENOMEM if memory
+ * can't be allocated, or as for db_fetch() if a record is bad.
  */
-static void _db_writeptr(DB *db, off_t offset, off_t ptrval) {
-  char asciiptr[PTR_SZ + 1];
+const char *db_fetch_view(DBHANDLE h, const char *key, size_t *lenp) {
+  DB *db = _db_cursor(h);
+  DBPIN *pin;
+  uint64_t start;
+  const char *p;
+  char *copy;
+  size_t len;
 
-  /* Validate chain pointer is within bounds */
-  if (ptrval < 0 || ptrval > PTR_MAX) {
-    err_quit("_db_writeptr(): invalid ptr: %d", ptrval);
+  if (db->npins == db->maxpins) {
+    if ((pin = realloc(db->pins, (db->maxpins * 2 + 16) * sizeof(DBPIN))) ==
+        NULL) {
+      errno = ENOMEM;
+      return (NULL);
+    }
+    db->pins = pin;
+    db->maxpins = db->maxpins * 2 + 16;
   }
-  /* Convert chain pointer to ASCII string */
-  sprintf(asciiptr, "%*lld", PTR_SZ, (long long)ptrval);
+  start = _db_now();
+  if (_db_find_and_lock(db, key, 0) < 0) {
+    goto fail;
+  }
+  pin = db->pins + db->npins;
+  len = RAWLEN(db) - 1;
+  if (db->mapped && db->rawlen == 0) {
+    if (_db_mapget(&db->datmap, db->datfd, db->datoff, db->datlen, &p) !=
+            db->datlen ||
+        p[db->datlen - 1] != NEWLINE || /* sanity check */
+        ((db->features & F_CHECKSUM) &&
+         _db_crc32c(0, p, db->datlen) != db->datsum)) {
+      db->bad = EBADMSG;
+      goto fail;
+    }
+    pin->data = p;
+    pin->chainoff = db->chainoff; /* keep the chain locked */
+    db->datmap.pins++;
+    db->cnt_datbytes += db->datlen;
+  } else {
+    if ((copy = malloc(len + 1)) == NULL) {
+      _db_unlockchains(db, db->chainoff, 1);
+      errno = ENOMEM;
+      return (NULL);
+    }
+    if ((pin->data = _db_readdatinto(db, copy)) == NULL) {
+      free(copy);
+      goto fail;
+    }
+    pin->chainoff = -1;
+    _db_unlockchains(db, db->chainoff, 1);
+  }
+  db->cnt_fetchok++;
+  db->npins++;
+  *lenp = len;
+  _db_lat(&db->latfetch, start);
+  return (pin->data);
+
+fail:
+  db->cnt_fetcherr++;
+  _db_unlockchains(db, db->chainoff, 1);
+  _db_lat(&db->latfetch, start);
+  errno = (db->bad ? db->bad : ENOENT);
+  return (NULL);
+} /* db_fetch_view() */
+
+/**
+ * Release a view returned by db_fetch_view().  The data can't be used after
+ * this.
+ * @param h database handle.
+ * @param data pointer returned by db_fetch_view().
+ */
+void db_release(DBHANDLE h, const char *data) {
+  DB *db = _db_cursor(h);
+  DBPIN pin;
+  long i;
+  int j;
 
-  /* Seek to the specified offset in the index file */
-  if (lseek(db->idxfd, offset, SEEK_SET) == -1) {
-    err_dump("_db_writeptr(): lseek() error to ptr field");
+  for (i = db->npins - 1; i >= 0 && db->pins[i].data != data; i--) {
+    ;
   }
-  /* Write the pointer in the index file */
-  if (write(db->idxfd, asciiptr, PTR_SZ) != PTR_SZ) {
-    err_dump("_db_writeptr(): write() error of ptr field");
+  if (i < 0) {
+    err_dump("db_release(): not a view");
   }
-} /* _db_writeptr() */
+  pin = db->pins[i];
+  db->pins[i] = db->pins[--db->npins];
+  if (pin.chainoff < 0) {
+    free((char *)pin.data);
+    return;
+  }
+
+  /*
+   * Unlock the chain, unless another view is on it, and drop the mappings
+   * that were kept for the views once they have all gone.
+   */
+  _db_unlockchains(db, pin.chainoff, 1);
+  if (--db->datmap.pins == 0) {
+    for (j = 0; j < db->datmap.nold; j++) {
+      munmap(db->datmap.old[j], db->datmap.oldlen[j]);
+    }
+    db->datmap.nold = 0;
+  }
+} /* db_release() */
 
 /**
- * Store a record in the database.  Return 0 if OK, 1 if record exists and
- * DB_INSERT specified, -1 on error.
+ * Fetch the records of several keys at once.  The keys are grouped by hash
+ * chain, each chain is locked once and searched once for all of its keys, and
+ * the data records are then read in order of their offsets in the data file,
+ * with records close to each other read together.  The chains stay read locked
+ * until all the data has been read, and are unlocked with a single call.
  * @param h database handle.
- * @param key pointer to null-terminated string for key.
- * @param data pointer to null-terminated string for data.
- * @param flag used to control behaviour:
- *   DB_INSERT to insert a new record only.
- *   DB_STORE to replace or insert.
- *   DB_REPLACE to replace an existing record.
- * @return 0 on success; 1 if record exists & DB_INSERT specified; -1 on error
- *   1. If flag is not valid, errno is set to EINVAL.
- *   2. If record does not exist, errno is set to ENOENT.
- * If length of data record is not valid, this function drops core and the
- * process is terminated.
+ * @param keys array of nkeys pointers to null-terminated keys.
+ * @param datas array of nkeys pointers, filled in with a copy of the data of
+ * each key, in malloc'ed memory that the caller must free(), or with NULL for
+ * each key that is not found.
+ * @param nkeys number of keys.
+ * @return number of keys found; -1 with errno set to ENOMEM if memory can't be
+ * allocated, or as for db_fetch() if a record is bad, in which case all of
+ * datas is NULL.
  */
-int db_store(DBHANDLE h, const char *key, const char *data, int flag) {
-  DB *db = h;
-  int rc, keylen, datlen;
-  off_t ptrval;
+long db_fetch_many(DBHANDLE h, char *const keys[], char **datas, long nkeys) {
+  DB *db = _db_cursor(h);
+  DBFETCH *f;
+  long i, j, k, nfound;
+  off_t start, end, lockmin, lockmax;
+  size_t runlen, maxrun;
+  ssize_t n;
+  const char *p;
+  char *run;
+  int err;
 
-  /* Validate flag */
-  if (flag != DB_INSERT && flag != DB_REPLACE && flag != DB_STORE) {
-    errno = EINVAL;
+  for (i = 0; i < nkeys; i++) {
+    datas[i] = NULL;
+  }
+  if (nkeys <= 0) {
+    return (0);
+  }
+  if ((f = malloc(nkeys * sizeof(DBFETCH))) == NULL) {
+    errno = ENOMEM;
     return (-1);
   }
-  keylen = strlen(key);
-  datlen = strlen(data) + 1; /* +1 for newline at end */
-  /* Validate length of data record */
-  if (datlen < DATLEN_MIN || datlen > DATLEN_MAX) {
-    err_dump("db_store(): invalid data length");
+  for (i = 0; i < nkeys; i++) {
+    f[i].key = i;
+  }
+  run = NULL;
+  if ((err = _db_fetchchains(db, keys, f, nkeys, &lockmin, &lockmax)) != 0) {
+    goto fail;
   }
 
   /*
-   * _db_find_and_lock() calculates which hash table this new record goes into
-   * (db->chainoff), regardless of whether it already exists or not.  The
-   * following calls to _db_writeptr() change the hash table entry for this
-   * chain to point to the new record.  The new record is added to the front of
-   * the hash chain.
+   * Read the data records in order of offset; the keys that weren't found
+   * sort last.  Records no more than FETCH_GAP bytes apart are read together.
    */
-  if (_db_find_and_lock(db, key, 1) < 0) { /* write lock; record not found */
-    if (flag == DB_REPLACE) {
-      rc = -1;
-      db->cnt_storerr++;
-      errno = ENOENT; /* error, record does not exist */
-      goto doreturn;
+  qsort(f, nkeys, sizeof(DBFETCH), _db_cmpdatoff);
+  for (nfound = 0; nfound < nkeys && f[nfound].datlen != 0; nfound++) {
+    ;
+  }
+  maxrun = 0;
+  for (i = 0; i < nfound; i = j) {
+    start = f[i].datoff;
+    end = start + f[i].datlen;
+    for (j = i + 1; j < nfound && f[j].datoff <= end + FETCH_GAP &&
+                    f[j].datoff + f[j].datlen - start <= FETCH_RUN;
+         j++) {
+      if (f[j].datoff + f[j].datlen > end) {
+        end = f[j].datoff + f[j].datlen;
+      }
+    }
+    runlen = end - start;
+    if (db->mapped) {
+      if (_db_mapget(&db->datmap, db->datfd, start, runlen, &p) != runlen) {
+        err = EBADMSG; /* data record beyond end of data file */
+        goto fail;
+      }
+    } else {
+      if (runlen > maxrun) {
+        free(run);
+        if ((run = malloc(runlen)) == NULL) {
+          err = ENOMEM;
+          goto fail;
+        }
+        maxrun = runlen;
+      }
+      if ((n = pread(db->datfd, run, runlen, start)) != runlen) {
+        err = (n < 0 ? errno : EBADMSG);
+        goto fail;
+      }
+      p = run;
+    }
+    for (k = i; k < j; k++) {
+      if (p[f[k].datoff - start + f[k].datlen - 1] != NEWLINE || /* sanity */
+          ((db->features & F_CHECKSUM) &&
+           _db_crc32c(0, p + (f[k].datoff - start), f[k].datlen) !=
+               f[k].datsum)) {
+        err = EBADMSG;
+        goto fail;
+      }
+      if ((datas[f[k].key] = malloc(f[k].rawlen != 0 ? f[k].rawlen
+                                                     : f[k].datlen)) == NULL) {
+        err = ENOMEM;
+        goto fail;
+      }
+      if (f[k].rawlen != 0) {
+        db->datlen = f[k].datlen;
+        db->rawlen = f[k].rawlen;
+        if (_db_unpack(db, p + (f[k].datoff - start), datas[f[k].key]) ==
+            NULL) {
+          err = EBADMSG;
+          goto fail;
+        }
+        continue;
+      }
+      memcpy(datas[f[k].key], p + (f[k].datoff - start), f[k].datlen - 1);
+      datas[f[k].key][f[k].datlen - 1] = 0; /* replace newline with null */
+    }
+  }
+  free(run);
+  free(f);
+
+  /*
+   * Unlock the hash chains that _db_fetchchains() locked.
+   */
+  _db_unlockchains(db, lockmin, lockmax - lockmin + 1);
+  db->cnt_fetchok += nfound;
+  db->cnt_fetcherr += nkeys - nfound;
+  return (nfound);
+
+fail:
+  for (i = 0; i < nkeys; i++) {
+    free(datas[i]);
+    datas[i] = NULL;
+  }
+  free(run);
+  free(f);
+  _db_unlockchains(db, lockmin, lockmax - lockmin + 1);
+  db->cnt_fetcherr += nkeys;
+  errno = err;
+  return (-1);
+} /* db_fetch_many() */
+
+/**
+ * Find the index records of the keys of db_fetch_many().  The keys are sorted
+ * by hash chain and the chains are read locked in increasing order, so the
+ * hash table is read sequentially.  Each chain is walked once, until all of
+ * its keys have been found.  The chains are left locked; only read locks are
+ * held at the same time, so holding several can't deadlock with a writer.
+ * @param db pointer to database structure.
+ * @param keys array of nkeys pointers to null-terminated keys.
+ * @param f array of nkeys entries with key set; chainoff, datoff and datlen
+ * are filled in, with datlen 0 for the keys that are not found.
+ * @param nkeys number of keys.
+ * @param lockmin set to the lowest offset locked.
+ * @param lockmax set to the highest offset locked.
+ * @return 0 if OK; the error of the first bad record found otherwise, with all
+ * the chains still locked.
+ */
+static int _db_fetchchains(DB *db, char *const keys[], DBFETCH *f,
+                           long nkeys, off_t *lockmin, off_t *lockmax) {
+  long i, j, k, nleft;
+  off_t offset;
+  DBHASH nbucket;
+  int err = 0;
+
+again:
+  for (i = 0; i < nkeys; i++) {
+    f[i].chainoff =
+        _db_bucketoff(db, _db_bucket(db, _db_hash(db, keys[f[i].key])));
+    f[i].datlen = 0;
+  }
+  qsort(f, nkeys, sizeof(DBFETCH), _db_cmpchain);
+  *lockmin = f[0].chainoff;
+  *lockmax = f[0].chainoff;
+
+  for (i = 0; i < nkeys; i = j) {
+    if (_db_readw_lock(db, db->idxfd, f[i].chainoff, 1) < 0) {
+      err_dump("_db_fetchchains(): readw_lock() error");
+    }
+    if (f[i].chainoff < *lockmin) {
+      *lockmin = f[i].chainoff;
+    }
+    if (f[i].chainoff > *lockmax) {
+      *lockmax = f[i].chainoff;
     }
 
     /*
-     * _db_find_and_lock() locked the hash chain; read the chain ptr to the
-     * first index record on hash chain.
+     * db_compact() can't replace the files while we hold a chain lock, so
+     * they only need to be checked once, after the first lock.
      */
-    ptrval = _db_readptr(db, db->chainoff);
+    if (i == 0 && _db_checkswap(db)) {
+      goto again;
+    }
 
     /*
-     * Search the free list for a deleted record witht he same size key and same
-     * size data.  Four cases are possible.
+     * As in _db_find_and_lock(), a split since the number of buckets was read
+     * can have moved some of the keys that are left to new buckets: find their
+     * chains again.  The chain just locked stays locked, and is searched if it
+     * is still the first one.
      */
-    if (_db_findfree(db, keylen, datlen) < 0) {
-      /*
-       * Case 1: Can't find an empty record big enough.  Append the new record
-       * to the ends of the index and data files.
-       */
-      _db_writedat(db, data, 0, SEEK_END);
-      _db_writeidx(db, key, 0, SEEK_END, ptrval);
+    if (db->maxload != 0 && (nbucket = _db_readnbucket(db)) != db->nbucket) {
+      db->nbucket = nbucket;
+      for (k = i; k < nkeys; k++) {
+        f[k].chainoff =
+            _db_bucketoff(db, _db_bucket(db, _db_hash(db, keys[f[k].key])));
+      }
+      qsort(f + i, nkeys - i, sizeof(DBFETCH), _db_cmpchain);
+      j = i;
+      continue;
+    }
 
-      /*
-       * db->idxoff was set by _db_writeidx().  The new record goes to the front
-       * of the hash chain.
-       */
-      _db_writeptr(db, db->chainoff, db->idxoff);
-      db->cnt_stor1++;
-    } else {
-      /*
-       * Case 2: Reuse an empty record.  _db_freefind() removed it from the free
-       * list and set both db->datoff and db->idxoff.  Reused record goes to the
-       * front of the hash chain.
-       */
-      _db_writedat(db, data, db->datoff, SEEK_SET);
-      _db_writeidx(db, key, db->idxoff, SEEK_SET, ptrval);
-      _db_writeptr(db, db->chainoff, db->idxoff);
-      db->cnt_stor2++;
+    /*
+     * Walk the chain once for all the keys on it.  The same key may have been
+     * asked for more than once.
+     */
+    for (j = i + 1; j < nkeys && f[j].chainoff == f[i].chainoff; j++) {
+      ;
     }
-  } else { /* record found */
-    if (flag == DB_INSERT) {
-      rc = 1; /* error, record already in db */
-      db->cnt_storerr++;
-      goto doreturn;
+    nleft = j - i;
+    offset = _db_readptr(db, f[i].chainoff);
+    while (offset != 0 && nleft > 0) {
+      offset = _db_readidx(db, offset);
+      if (db->bad) {
+        if (err == 0) {
+          err = db->bad;
+        }
+        break;
+      }
+      for (k = i; k < j; k++) {
+        if (f[k].datlen == 0 && strcmp(db->idxbuf, keys[f[k].key]) == 0) {
+          f[k].datoff = db->datoff;
+          f[k].datlen = db->datlen;
+          f[k].rawlen = db->rawlen;
+          f[k].datsum = db->datsum;
+          nleft--;
+        }
+      }
     }
+  }
+  return (err);
+} /* _db_fetchchains() */
+
+/**
+ * qsort() comparison function that orders db_fetch_many() keys by the offset
+ * of their hash chain.
+ * @param a pointer to a DBFETCH.
+ * @param b pointer to a DBFETCH.
+ * @return negative, zero or positive as a is before, with or after b.
+ */
+static int _db_cmpchain(const void *a, const void *b) {
+  const DBFETCH *fa = a, *fb = b;
+
+  if (fa->chainoff != fb->chainoff) {
+    return (fa->chainoff < fb->chainoff ? -1 : 1);
+  }
+  return (fa->key < fb->key ? -1 : fa->key > fb->key);
+} /* _db_cmpchain() */
+
+/**
+ * qsort() comparison function that orders db_fetch_many() keys by the offset
+ * of their data record, with the keys that were not found last.
+ * @param a pointer to a DBFETCH.
+ * @param b pointer to a DBFETCH.
+ * @return negative, zero or positive as a is before, with or after b.
+ */
+static int _db_cmpdatoff(const void *a, const void *b) {
+  const DBFETCH *fa = a, *fb = b;
+
+  if ((fa->datlen == 0) != (fb->datlen == 0)) {
+    return (fa->datlen == 0 ? 1 : -1);
+  }
+  if (fa->datoff != fb->datoff) {
+    return (fa->datoff < fb->datoff ? -1 : 1);
+  }
+  return (fa->key < fb->key ? -1 : fa->key > fb->key);
+} /* _db_cmpdatoff() */
+
+/**
+ * Find the specified record.  Called by db_delete(), db_read() and db_store().
+ * Returns with the hash chain locked.
+ * @param db pointer to database object.
+ * @param key search key.
+ * @param writelock nonzero value to acquire a write lock on the index file
+ * while searching for the record.
+ * @return 0 if record found; -1 if record not found.
+ */
+static int _db_find_and_lock(DB *db, const char *key, int writelock) {
+  _db_lockchain(db, _db_hash(db, key), writelock);
+  return (_db_findrec(db, key));
+} /* _db_find_and_lock() */
+
+/**
+ * Lock the hash chain of a hash value, and set db->chainoff to its offset.
+ * Called by _db_find_and_lock() and db_fetch().
+ * @param db pointer to database object.
+ * @param hval hash value of the key.
+ * @param writelock nonzero value to write lock the chain; zero to read lock it.
+ */
+static void _db_lockchain(DB *db, DBHASH hval, int writelock) {
+  DBHASH nbucket;
+
+  /*
+   * Calculate the byte offset of the corresponding chain ptr in the hash
+   * table.  This is where the search starts.
+   */
+  for (;;) {
+    db->bucket = _db_bucket(db, hval);
+    db->chainoff = _db_bucketoff(db, db->bucket);
 
     /*
-     * Replacing an existing record.  The new key equals the existing
-     * key, but need to check if the data records are the same size.
+     * Lock the hash chain here.  The caller must unlock it when done.  Note,
+     * only lock and unlock the first byte.  This increases concurrency by
+     * allowing multiple processes to search different hash chains at the
+     * same time.
      */
-    if (datlen != db->datlen) {
-      /*
-       * Case 3: Existing record is being replaced, and the length of the new
-       * data record differs from the length of the existing data record.
-       */
-      _db_dodelete(db); /* delete the existing record; deleted record placed
-                       at the head of the free list */
+    if (writelock) {
+      if (_db_writew_lock(db, db->idxfd, db->chainoff, 1) < 0) {
+        err_dump("_db_lockchain(): writew_lock() error");
+      }
+    } else {
+      /* Read lock the index file while searching it */
+      if (_db_readw_lock(db, db->idxfd, db->chainoff, 1) < 0) {
+        err_dump("_db_lockchain(): readw_lock() error");
+      }
+    }
 
-      /*
-       * Reread the chain ptr in the hash table (it may change with the
-       * deletion).
+    /*
+     * If db_compact() has replaced the files, the lock went with the old index
+     * file when it was closed; start again with the new files.
+     */
+    if (_db_checkswap(db)) {
+      continue;
+    }
+    if (db->maxload == 0) {
+      break; /* fixed size hash table */
+    }
+
+    /*
+     * Another process may have split buckets since we last looked at the
+     * number of buckets.  A bucket can't be split while we hold its lock, so
+     * if the key still maps to the chain we locked, it's the right one.
+     * Otherwise, unlock it and try again with the new bucket.
+     */
+    if ((nbucket = _db_readnbucket(db)) == db->nbucket) {
+      break;
+    }
+    db->nbucket = nbucket;
+    if (_db_bucketoff(db, _db_bucket(db, hval)) == db->chainoff) {
+      break;
+    }
+    _db_unlockchains(db, db->chainoff, 1);
+  }
+} /* _db_lockchain() */
+
+/**
+ * Unlock hash chains, except for those with views from db_fetch_view() on
+ * them.  A process has only one lock on a byte of a file, however many times
+ * it is locked, so the chains of the views must be left out when unlocking.
+ * @param db pointer to database structure.
+ * @param start offset of the first byte to unlock.
+ * @param len number of bytes to unlock.
+ */
+static void _db_unlockchains(DB *db, off_t start, off_t len) {
+  off_t end = start + len, next;
+  long i;
+
+  while (start < end) {
+    for (next = end, i = 0; i < db->npins; i++) {
+      if (db->pins[i].chainoff >= start && db->pins[i].chainoff < next) {
+        next = db->pins[i].chainoff; /* first view in what's left */
+      }
+    }
+    if (next > start && _db_un_lock(db, db->idxfd, start, next - start) < 0) {
+      err_dump("_db_unlockchains(): un_lock() error");
+    }
+    start = next + 1;
+  }
+} /* _db_unlockchains() */
+
+/**
+ * Search the hash chain locked by _db_lockchain() for a key.  On success, the
+ * index record is in db->idxbuf, and db->ptroff is the offset of the chain ptr
+ * that points to it.  A key that the Bloom filter of the chain rules out isn't
+ * looked for on the chain.  A bad record ends the search, with db->bad set.
+ * @param db pointer to database object.
+ * @param key search key.
+ * @return 0 if record found; -1 if record not found, with db->bad set if the
+ * chain couldn't be searched to the end.
+ */
+static int _db_findrec(DB *db, const char *key) {
+  off_t offset, nextoffset;
+
+  db->ptroff = db->chainoff;
+  db->cnt_lookup++;
+  db->bad = 0;
+
+  /*
+   * Get the offset in the index file of first record on the hash chain
+   * (can be 0 if the hash chain is empty).
+   */
+  offset = _db_readptr(db, db->ptroff);
+  if (offset != 0 && !_db_bloomhas(db, key)) {
+    db->cnt_bloomneg++;
+    offset = 0; /* the Bloom filter of the chain rules the key out */
+  }
+  /* Loop through each index record on the hash chain, comparing keys */
+  while (offset != 0) {
+    /*
+     * Read each index record, populating idxbuf field with key of current
+     * record.  _db_readidx() returns 0 when the last entry in the chain is
+     * reached.
+     */
+    nextoffset = _db_readidx(db, offset);
+    db->cnt_hops++;
+    if (db->bad) {
+      offset = 0;
+      break;
+    }
+    if (strcmp(db->idxbuf, key) == 0) {
+      break; /* match found */
+      /*
+       * ptroff contains address of chain ptr in previous index record
+       * datoff contains address of the data record
+       * datlen contains the size of the data record
        */
-      ptrval = _db_readptr(db, db->chainoff);
+    }
+    db->ptroff = offset + db->recptr; /* chain ptr of this (unequal) record */
+    offset = nextoffset; /* next one to compare; 0 == end of hash chain */
+  }
+
+  /*
+   * offset == 0 on error (record not found).
+   */
+  return (offset == 0 ? -1 : 0);
+} /* _db_findrec() */
+
+/**
+ * Look up a key in the record cache.
+ * @param db pointer to database structure.
+ * @param key search key.
+ * @param hval hash value of the key.
+ * @return the cache entry of the key, whether or not it is current; NULL if
+ * the cache doesn't hold the key.
+ */
+static DBCENT *_db_cacheget(DB *db, const char *key, DBHASH hval) {
+  long i;
+
+  if (db->nchash == 0) {
+    return (NULL);
+  }
+  for (i = db->chash[CACHE_BUCKET(db, hval)]; i >= 0; i = db->cents[i].next) {
+    if (db->cents[i].hval == hval && strcmp(db->cents[i].key, key) == 0) {
+      return (&db->cents[i]);
+    }
+  }
+  return (NULL);
+} /* _db_cacheget() */
+
+/**
+ * Add the result of looking up a key to the record cache, replacing the entry
+ * of the key if there is one.  Entries are evicted with the CLOCK algorithm
+ * until the new one fits: the clock hand passes over entries used since it
+ * last passed them, and evicts the first that hasn't been.  The cache is only
+ * a hint, so an entry that can't be allocated is simply not added.
+ * @param db pointer to database structure.
+ * @param ce entry of the key from _db_cacheget(); NULL if none.
+ * @param key the key.
+ * @param hval hash value of the key.
+ * @param gen generation of the chain of the key, at db->chainoff.
+ * @param data data of the key; NULL if the key wasn't found.
+ */
+static void _db_cacheput(DB *db, DBCENT *ce, const char *key, DBHASH hval,
+                         uint64_t gen, const char *data) {
+  size_t keylen, datlen, size;
+  long i, j, b, n, *chash;
+  DBCENT *cents;
+  char *p;
+
+  if (ce != NULL) {
+    _db_cachedrop(db, ce - db->cents);
+  }
+  keylen = strlen(key) + 1;
+  datlen = (data == NULL ? 0 : strlen(data) + 1);
+  size = sizeof(DBCENT) + keylen + datlen;
+  if (size > db->cachemax) {
+    return;
+  }
+  while (db->cacheused + size > db->cachemax) {
+    if (db->chand >= db->ncent) {
+      db->chand = 0;
+    }
+    ce = &db->cents[db->chand++];
+    if (ce->key == NULL) {
+      continue;
+    }
+    if (ce->ref) {
+      ce->ref = 0; /* second chance */
+    } else {
+      _db_cachedrop(db, ce - db->cents);
+    }
+  }
+
+  /*
+   * Find an unused entry, and grow the hash table if there are now more
+   * entries than buckets.
+   */
+  if (db->cfree < 0 && db->ncent == db->maxcent) {
+    n = (db->maxcent == 0 ? CACHE_NHASH : db->maxcent * 2);
+    if ((cents = realloc(db->cents, n * sizeof(DBCENT))) == NULL) {
+      return;
+    }
+    db->cents = cents;
+    db->maxcent = n;
+  }
+  if (db->ncent >= db->nchash) {
+    n = (db->nchash == 0 ? CACHE_NHASH : db->nchash * 2);
+    if ((chash = malloc(n * sizeof(long))) == NULL) {
+      return;
+    }
+    for (b = 0; b < n; b++) {
+      chash[b] = -1;
+    }
+    if (db->chash != NULL) {
+      free(db->chash);
+    }
+    db->chash = chash;
+    db->nchash = n;
+    for (j = 0; j < db->ncent; j++) {
+      if (db->cents[j].key != NULL) {
+        b = CACHE_BUCKET(db, db->cents[j].hval);
+        db->cents[j].next = chash[b];
+        chash[b] = j;
+      }
+    }
+  }
+  if ((p = malloc(keylen + datlen)) == NULL) {
+    return;
+  }
+  if (db->cfree >= 0) {
+    i = db->cfree;
+    db->cfree = db->cents[i].next;
+  } else {
+    i = db->ncent++;
+  }
+  ce = &db->cents[i];
+  ce->key = p;
+  memcpy(ce->key, key, keylen);
+  if (data != NULL) {
+    ce->data = ce->key + keylen;
+    memcpy(ce->data, data, datlen);
+  } else {
+    ce->data = NULL;
+  }
+  ce->size = size;
+  ce->hval = hval;
+  ce->chainoff = db->chainoff;
+  ce->gen = gen;
+  ce->ref = 0;
+  b = CACHE_BUCKET(db, hval);
+  ce->next = db->chash[b];
+  db->chash[b] = i;
+  db->cacheused += size;
+} /* _db_cacheput() */
+
+/**
+ * Remove an entry from the record cache, and put it on the free list.
+ * @param db pointer to database structure.
+ * @param i index of the entry.
+ */
+static void _db_cachedrop(DB *db, long i) {
+  long *pp;
+
+  for (pp = &db->chash[CACHE_BUCKET(db, db->cents[i].hval)]; *pp != i;
+       pp = &db->cents[*pp].next) {
+    ;
+  }
+  *pp = db->cents[i].next;
+  free(db->cents[i].key);
+  db->cents[i].key = NULL;
+  db->cacheused -= db->cents[i].size;
+  db->cents[i].next = db->cfree;
+  db->cfree = i;
+} /* _db_cachedrop() */
+
+/**
+ * Empty the record cache, keeping its arrays for reuse.
+ * @param db pointer to database structure.
+ */
+static void _db_cacheclear(DB *db) {
+  long i;
+
+  for (i = 0; i < db->ncent; i++) {
+    if (db->cents[i].key != NULL) {
+      free(db->cents[i].key);
+    }
+  }
+  for (i = 0; i < db->nchash; i++) {
+    db->chash[i] = -1;
+  }
+  db->ncent = 0;
+  db->cfree = -1;
+  db->cacheused = 0;
+  db->chand = 0;
+} /* _db_cacheclear() */
+
+/**
+ * Open and map the Bloom filter file of a database, if it has one, and make
+ * one if asked to.  A file left over from other index files, such as the files
+ * db_compact() replaced, is replaced with an empty one, swapped in with
+ * rename() in case other processes are doing the same; then the filters of
+ * all the chains are built.  Without write access, a file that doesn't match
+ * the index file is left alone, and not used.
+ * @param db pointer to database structure, with the header read.
+ * @param create nonzero to make the file if the database hasn't got one; only
+ * binary databases with chain generations can have filters.
+ * @param oflag flags the database was opened with; with O_TRUNC, any old file
+ * is removed first.
+ * @return 0 if OK, with db->blmfd set if the database has filters; -1 on
+ * error, with errno set to EINVAL if the database can't have filters.
+ */
+static int _db_bloomopen(DB *db, int create, int oflag) {
+  struct stat statbuff;
+  unsigned char hdr[BLM_HDR_SZ];
+  char *name, *tmpname;
+  int fd, wr, made, err;
+  ino_t ino;
+  mode_t mode;
+
+  if (db->format != DB_FMT_BINARY || !(db->features & F_CHAINGEN)) {
+    if (create) {
+      errno = EINVAL;
+      return (-1);
+    }
+    return (0);
+  }
+  if (fstat(db->idxfd, &statbuff) < 0) {
+    err_dump("_db_bloomopen(): fstat() error");
+  }
+  ino = statbuff.st_ino;
+  mode = statbuff.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+  if ((name = malloc(db->namelen + 5)) == NULL ||
+      (tmpname = malloc(db->namelen + 48)) == NULL) {
+    err_dump("_db_bloomopen(): malloc() error");
+  }
+  memcpy(name, db->name, db->namelen);
+  strcpy(name + db->namelen, ".blm");
+  sprintf(tmpname, "%s.%ld.%lx", name, (long)getpid(), (unsigned long)db);
+  if (oflag & O_TRUNC) {
+    unlink(name); /* filters of the old files */
+  }
+  wr = (oflag & O_ACCMODE) != O_RDONLY;
+  made = 0;
+  for (;;) {
+    if ((fd = open(name, wr ? O_RDWR : O_RDONLY)) < 0) {
+      if (errno != ENOENT || !create || !wr) {
+        err = errno;
+        free(name);
+        free(tmpname);
+        if (err == ENOENT) {
+          return (0); /* no filters */
+        }
+        errno = err;
+        return (-1);
+      }
+    } else if (pread(fd, hdr, BLM_HDR_SZ, 0) == BLM_HDR_SZ &&
+               memcmp(hdr, BLM_MAGIC, 8) == 0 &&
+               _db_get64(hdr + BLM_INO) == (uint64_t)ino) {
+      break;
+    } else {
+      close(fd);
+      if (!wr) {
+        free(name);
+        free(tmpname);
+        return (0);
+      }
+    }
+
+    /*
+     * Make a new file, of the header only: the entries of the chains read as
+     * zeros, and so as unknown, until the file is extended over them.
+     */
+    memset(hdr, 0, BLM_HDR_SZ);
+    memcpy(hdr, BLM_MAGIC, 8);
+    _db_put64(hdr + BLM_INO, ino);
+    if ((fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, mode)) < 0) {
+      err = errno;
+      free(name);
+      free(tmpname);
+      errno = err;
+      return (-1);
+    }
+    if (write(fd, hdr, BLM_HDR_SZ) != BLM_HDR_SZ || rename(tmpname, name) < 0) {
+      err = errno;
+      close(fd);
+      unlink(tmpname);
+      free(name);
+      free(tmpname);
+      errno = err;
+      return (-1);
+    }
+    close(fd);
+    made = 1;
+  }
+  free(name);
+  free(tmpname);
+  db->blmfd = fd;
+  db->blmwrite = wr;
+  if (_db_bloommap(db, BLM_HDR_SZ) < 0) {
+    err_dump("_db_bloomopen(): Bloom filter file too short");
+  }
+  if (made || db->blmstale) {
+    _db_bloomfill(db);
+    db->blmstale = 0;
+  }
+  return (0);
+} /* _db_bloomopen() */
+
+/**
+ * Close the Bloom filter file of a database, if it has one.
+ * @param db pointer to database structure.
+ */
+static void _db_bloomclose(DB *db) {
+  if (db->blm != NULL) {
+    munmap(db->blm, db->blmsize);
+    db->blm = NULL;
+    db->blmsize = 0;
+  }
+  if (db->blmfd >= 0) {
+    close(db->blmfd);
+    db->blmfd = -1;
+  }
+} /* _db_bloomclose() */
+
+/**
+ * Map the whole Bloom filter file again, if it has grown to at least a size.
+ * @param db pointer to database structure.
+ * @param need bytes that the mapping must cover.
+ * @return 0 if the mapping covers need bytes; -1 if the file is shorter.
+ */
+static int _db_bloommap(DB *db, size_t need) {
+  struct stat statbuff;
+  void *p;
+
+  if (fstat(db->blmfd, &statbuff) < 0) {
+    err_dump("_db_bloommap(): fstat() error");
+  }
+  if ((size_t)statbuff.st_size < need) {
+    return (-1);
+  }
+  if (db->blm != NULL) {
+    munmap(db->blm, db->blmsize);
+  }
+  if ((p = mmap(NULL, statbuff.st_size,
+                PROT_READ | (db->blmwrite ? PROT_WRITE : 0), MAP_SHARED,
+                db->blmfd, 0)) == MAP_FAILED) {
+    err_dump("_db_bloommap(): mmap() error");
+  }
+  db->blm = p;
+  db->blmsize = statbuff.st_size;
+  return (0);
+} /* _db_bloommap() */
+
+/**
+ * Find the Bloom filter entry of a bucket.  The file only grows, with its
+ * first byte write locked, to twice the buckets needed, so that it isn't
+ * extended on every split.
+ * @param db pointer to database structure.
+ * @param bucket bucket number.
+ * @param grow nonzero to extend the file if it hasn't got the entry yet.
+ * @return pointer to the entry in the mapping; NULL if the file hasn't got it,
+ * and grow is 0.
+ */
+static unsigned char *_db_blooment(DB *db, DBHASH bucket, int grow) {
+  size_t need = BLM_HDR_SZ + (bucket + 1) * BLM_ENT_SZ;
+  struct stat statbuff;
+  off_t size;
+
+  if (need > db->blmsize && _db_bloommap(db, need) < 0) {
+    if (!grow) {
+      return (NULL);
+    }
+    if (_db_writew_lock(db, db->blmfd, 0, 1) < 0) {
+      err_dump("_db_blooment(): writew_lock() error");
+    }
+    size = BLM_HDR_SZ + (off_t)(bucket + 1) * 2 * BLM_ENT_SZ;
+    if (fstat(db->blmfd, &statbuff) < 0) {
+      err_dump("_db_blooment(): fstat() error");
+    }
+    if (statbuff.st_size < size && ftruncate(db->blmfd, size) < 0) {
+      err_dump("_db_blooment(): ftruncate() error");
+    }
+    if (_db_un_lock(db, db->blmfd, 0, 1) < 0) {
+      err_dump("_db_blooment(): un_lock() error");
+    }
+    if (_db_bloommap(db, need) < 0) {
+      err_dump("_db_blooment(): Bloom filter file too short");
+    }
+  }
+  return (db->blm + BLM_HDR_SZ + bucket * BLM_ENT_SZ);
+} /* _db_blooment() */
+
+/**
+ * Check the Bloom filter of the chain locked by _db_lockchain() for a key.
+ * @param db pointer to database structure.
+ * @param key the key.
+ * @return 0 if the key is not on the chain; 1 if it may be, or if the chain
+ * has no current filter.
+ */
+static int _db_bloomhas(DB *db, const char *key) {
+  unsigned char bits[BLM_NBITS / 8];
+  const unsigned char *e;
+  uint64_t gen;
+  int i;
+
+  if (db->blmfd < 0) {
+    return (1);
+  }
+  gen = (uint64_t)_db_readptr(db, db->chainoff + SLOT_GEN);
+  if (gen == 0 || (e = _db_blooment(db, db->bucket, 0)) == NULL ||
+      _db_get64(e + BLM_GEN) != gen) {
+    return (1);
+  }
+  memset(bits, 0, sizeof(bits));
+  _db_bloomkey(db, bits, key);
+  for (i = 0; i < BLM_NBITS / 8; i++) {
+    if ((e[BLM_BITS + i] & bits[i]) != bits[i]) {
+      return (0);
+    }
+  }
+  return (1);
+} /* _db_bloomhas() */
+
+/**
+ * Bring the Bloom filter of a chain up to date with a change to the chain.
+ * Called with the chain write locked, after the chain has been changed and
+ * before its generation goes up; the entry is then for the next generation.
+ * If the entry wasn't for the current generation, or the chain hasn't got one
+ * yet (a split in a process without the filters leaves the new chain at 0),
+ * the filter is built from the chain.
+ * @param db pointer to database structure.
+ * @param bucket bucket of the chain.
+ * @param chainoff offset of the hash chain.
+ * @param key key added or deleted; NULL for BLM_KEEP and BLM_BUILD.
+ * @param op BLM_ADD, BLM_KEEP, BLM_DEL or BLM_BUILD.
+ */
+static void _db_bloomput(DB *db, DBHASH bucket, off_t chainoff,
+                         const char *key, int op) {
+  unsigned char *e;
+  uint64_t gen;
+  uint32_t nkey, ndel;
+
+  if (db->blmfd < 0 || !db->blmwrite) {
+    return;
+  }
+  gen = (uint64_t)_db_readptr(db, chainoff + SLOT_GEN);
+  e = _db_blooment(db, bucket, 1);
+  nkey = _db_get32(e + BLM_NKEY);
+  ndel = _db_get32(e + BLM_NDEL);
+  if (op == BLM_ADD) {
+    nkey++;
+  } else if (op == BLM_DEL) {
+    nkey -= (nkey > 0);
+    ndel++;
+  }
+  if (op == BLM_BUILD || gen == 0 || _db_get64(e + BLM_GEN) != gen ||
+      ndel > nkey) {
+    _db_bloombuild(db, e, chainoff);
+  } else {
+    if (op == BLM_ADD) {
+      _db_bloomkey(db, e + BLM_BITS, key);
+    }
+    _db_put32(e + BLM_NKEY, nkey);
+    _db_put32(e + BLM_NDEL, ndel);
+  }
+  _db_put64(e + BLM_GEN, gen + 1);
+} /* _db_bloomput() */
+
+/**
+ * Build the Bloom filter of a chain from the keys on it, leaving the
+ * generation of the entry at 0 for the caller to set.  A bad record on the
+ * chain hides the keys after it, so the filter then lets every key through.
+ * @param db pointer to database structure.
+ * @param e the entry of the chain.
+ * @param chainoff offset of the hash chain, locked.
+ */
+static void _db_bloombuild(DB *db, unsigned char *e, off_t chainoff) {
+  off_t offset;
+  uint32_t nkey;
+
+  _db_put64(e + BLM_GEN, 0);
+  memset(e + BLM_BITS, 0, BLM_ENT_SZ - BLM_BITS);
+  nkey = 0;
+  for (offset = _db_readptr(db, chainoff); offset != 0; nkey++) {
+    offset = _db_readidx(db, offset);
+    if (db->bad) {
+      memset(e + BLM_BITS, 0xff, BLM_ENT_SZ - BLM_BITS);
+      break;
+    }
+    _db_bloomkey(db, e + BLM_BITS, db->idxbuf);
+  }
+  _db_put32(e + BLM_NKEY, nkey);
+  _db_put32(e + BLM_NDEL, 0);
+} /* _db_bloombuild() */
+
+/**
+ * Build the Bloom filters of all the chains whose entries aren't current,
+ * write locking each chain in turn.  Chains added by splits meanwhile get
+ * theirs from _db_split().
+ * @param db pointer to database structure.
+ */
+static void _db_bloomfill(DB *db) {
+  unsigned char *e;
+  DBHASH b;
+  off_t chainoff;
+  uint64_t gen;
+
+  if (db->blmfd < 0 || !db->blmwrite) {
+    return;
+  }
+  if (db->maxload != 0) {
+    db->nbucket = _db_readnbucket(db);
+  }
+  for (b = 0; b < db->nbucket; b++) {
+    chainoff = _db_bucketoff(db, b);
+    if (_db_writew_lock(db, db->idxfd, chainoff, 1) < 0) {
+      err_dump("_db_bloomfill(): writew_lock() error");
+    }
+    gen = (uint64_t)_db_readptr(db, chainoff + SLOT_GEN);
+    e = _db_blooment(db, b, 1);
+    if (gen != 0 && _db_get64(e + BLM_GEN) != gen) {
+      _db_bloombuild(db, e, chainoff);
+      _db_put64(e + BLM_GEN, gen);
+    }
+    if (_db_un_lock(db, db->idxfd, chainoff, 1) < 0) {
+      err_dump("_db_bloomfill(): un_lock() error");
+    }
+  }
+} /* _db_bloomfill() */
+
+/**
+ * Mark every entry of the Bloom filter file unknown, for _db_walrecover(),
+ * which has rolled chains back: their generations may be reached again with
+ * other keys on them.  Called with the whole index file write locked, so no
+ * process is using the filters, before this process opens the file;
+ * db->blmstale makes _db_bloomopen() build them again.
+ * @param db pointer to database structure.
+ */
+static void _db_bloomforget(DB *db) {
+  unsigned char buf[BLM_ENT_SZ * 64];
+  off_t off;
+  ssize_t n;
+  int fd, i;
+
+  strcpy(db->name + db->namelen, ".blm");
+  if ((fd = open(db->name, O_RDWR)) < 0) {
+    return; /* no filters */
+  }
+  for (off = BLM_HDR_SZ; (n = pread(fd, buf, sizeof(buf), off)) > 0;
+       off += n) {
+    for (i = 0; i + BLM_ENT_SZ <= n; i += BLM_ENT_SZ) {
+      memset(buf + i + BLM_GEN, 0, 8);
+    }
+    if (pwrite(fd, buf, n, off) != n) {
+      err_dump("_db_bloomforget(): pwrite() error");
+    }
+  }
+  if (n < 0) {
+    err_dump("_db_bloomforget(): pread() error");
+  }
+  close(fd);
+  db->blmstale = 1;
+} /* _db_bloomforget() */
+
+/**
+ * Set the bits of a key in a Bloom filter: BLM_NPROBE bits picked by double
+ * hashing with a 64-bit hash of the key, made with a seed of its own so that
+ * the bits don't follow the bucket of the key.
+ * @param db pointer to database structure.
+ * @param bits the filter, of BLM_NBITS bits.
+ * @param key the key.
+ */
+static void _db_bloomkey(DB *db, unsigned char *bits, const char *key) {
+  uint64_t h = _db_hash_xxh64(key, strlen(key), ~db->seed);
+  uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1, bit;
+  int i;
+
+  for (i = 0; i < BLM_NPROBE; i++) {
+    bit = (h1 + i * h2) % BLM_NBITS;
+    bits[bit / 8] |= 1 << (bit % 8);
+  }
+} /* _db_bloomkey() */
+
+/**
+ * Read the changes made to a database with a change log (DB_OPT_CHANGES) since
+ * a given one, to apply them to a copy of the database with
+ * db_applychanges().  The changes are copied as they are in the log: records
+ * of a DB_CHGHDR byte header, the key and then the data, or none for a delete.
+ * The header holds the sequence number of the change (u64), its kind (u8), a
+ * zero byte, and the lengths of the key (u16) and of the data (u32), all
+ * little-endian.  The records of an update can be read before it is on disk;
+ * with a write-ahead log, an update that was under way when its process died
+ * is rolled back, so its records should only be relied on once a later
+ * update has been read.
+ * @param h database handle.
+ * @param seqp sequence number of the last change already read, 0 to start
+ * from the beginning of a log that holds every change made to the database
+ * since it was created; set to the last change copied.
+ * @param buf buffer to copy the records to.
+ * @param len size of buf; DB_CHGHDR + DBINFO.maxkey + DBINFO.maxdata bytes
+ * always hold a record.
+ * @return number of bytes copied, of whole records only; 0 if there are no
+ * changes after *seqp yet; -1 on error, with errno set to EINVAL if the
+ * database has no change log, to ERANGE if the log no longer holds, or never
+ * held, the changes after *seqp, or to ENOSPC if buf can't hold the next
+ * record.
+ */
+ssize_t db_readchanges(DBHANDLE h, unsigned long *seqp, void *buf,
+                       size_t len) {
+  DB *db = _db_cursor(h);
+  unsigned char hdr[CHG_HDR_SZ], *p = buf;
+  uint64_t seq, first, next;
+  off_t off, end;
+  size_t n, reclen;
+
+  if (db->chgfd < 0) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  /*
+   * Records are never changed once the header counts them, so only the header
+   * is read under the lock.
+   */
+  _db_chglock(db, F_RDLCK, hdr);
+  if (_db_un_lock(db, db->chgfd, CHG_LCK, 1) < 0) {
+    err_dump("db_readchanges(): un_lock() error");
+  }
+  first = _db_get64(hdr + CHG_FIRST);
+  next = _db_get64(hdr + CHG_NEXT);
+  end = _db_get64(hdr + CHG_END);
+  seq = *seqp;
+  if (seq == 0 && (_db_get32(hdr + CHG_FLAGS) & CHG_F_COMPLETE)) {
+    seq = first - 1;
+  }
+  if (seq < first - 1 || seq >= next) {
+    errno = ERANGE;
+    return (-1);
+  }
+  if (seq == next - 1) {
+    return (0);
+  }
+  off = _db_chgfind(db, seq, end);
+  if (len > end - off) {
+    len = end - off;
+  }
+  if (pread(db->chgfd, buf, len, off) != len) {
+    err_dump("db_readchanges(): pread() error");
+  }
+  for (n = 0; len - n >= CHG_REC_SZ; n += reclen) {
+    reclen = CHG_REC_SZ + (size_t)_db_get16(p + n + CREC_KEYLEN) +
+             _db_get32(p + n + CREC_DATLEN);
+    if (reclen > len - n) {
+      break;
+    }
+    seq = _db_get64(p + n + CREC_SEQ);
+  }
+  if (n == 0) {
+    errno = ENOSPC;
+    return (-1);
+  }
+  *seqp = seq;
+  db->chgreadseq = seq;
+  db->chgreadoff = off + n;
+  return (n);
+} /* db_readchanges() */
+
+/**
+ * Apply changes read from another database with db_readchanges() to this
+ * one, a copy of it: a follower.  The changes after the last one applied
+ * are made as a batch, as by db_commit(), each stored with DB_STORE or
+ * deleted; those applied before are skipped, so the same changes can be
+ * passed again.  The sequence number of the last change applied is kept in
+ * the index file header, in the same update, and DBINFO.chgseq reports it.
+ * A follower starts either empty, from a log that holds every change, or as a
+ * copy of the files of the other database made while nothing was changing
+ * them, which carries the sequence number of the last change in them.  Only
+ * one process at a time applies changes to a database; updates made any other
+ * way are not undone, and make the copy differ.
+ * @param h database handle: a binary database without a change log of its own.
+ * @param buf records from db_readchanges(), possibly with part of a record at
+ * the end.
+ * @param len number of bytes in buf.
+ * @return number of bytes of whole records at the start of buf, which have
+ * been applied; -1 on error, with nothing applied and errno set to EINVAL if
+ * a record is not valid for the database, the database is not binary or has
+ * a change log, or a batch is open, to ERANGE if changes are missing between
+ * the last one applied and the first one in buf, to EBUSY if the handle holds
+ * mapped views from db_fetch_view(), or to ENOMEM.
+ */
+ssize_t db_applychanges(DBHANDLE h, const void *buf, size_t len) {
+  DB *db = _db_cursor(h);
+  const unsigned char *p = buf;
+  unsigned char seqbuf[8];
+  uint64_t seq, cur;
+  size_t off, end, keylen, datlen;
+  char *key;
+  int op, rc = 0;
+
+  if (db->format != DB_FMT_BINARY || db->chgfd >= 0 || db->inbatch) {
+    errno = EINVAL;
+    return (-1);
+  }
+  if (db->datmap.pins > 0) {
+    errno = EBUSY;
+    return (-1);
+  }
+
+  /*
+   * Check the whole records first, so that none is applied if one is bad.
+   */
+  for (end = 0; len - end >= CHG_REC_SZ; end += CHG_REC_SZ + keylen + datlen) {
+    op = p[end + CREC_OP];
+    keylen = _db_get16(p + end + CREC_KEYLEN);
+    datlen = _db_get32(p + end + CREC_DATLEN);
+    if ((op != CHG_PUT && op != CHG_DEL) || keylen == 0 ||
+        keylen + BULK_IDXEXTRA(db) > IDXLEN_MAX ||
+        (op == CHG_PUT ? datlen + 1 < DATLEN_MIN || datlen + 1 > DATLEN(db)
+                       : datlen != 0)) {
+      errno = EINVAL;
+      return (-1);
+    }
+    if (keylen + datlen > len - end - CHG_REC_SZ) {
+      break; /* part of a record */
+    }
+    if (memchr(p + end + CHG_REC_SZ, 0, keylen + datlen) != NULL) {
+      errno = EINVAL;
+      return (-1);
+    }
+  }
+  if (end == 0) {
+    return (0);
+  }
+
+  /*
+   * Stage the changes after the last one applied, and commit them together
+   * with the new sequence number.
+   */
+  _db_opbegin(db);
+  do {
+    if (_db_writew_lock(db, db->idxfd, LCK_CHGSEQ, 1) < 0) {
+      err_dump("db_applychanges(): writew_lock() error");
+    }
+  } while (_db_checkswap(db)); /* closing the old files dropped the lock */
+  if (pread(db->idxfd, seqbuf, 8, HDR_CHGSEQ) != 8) {
+    err_dump("db_applychanges(): pread() error");
+  }
+  cur = _db_get64(seqbuf);
+  db->inbatch = 1;
+  db->nops = 0;
+  for (off = 0; off < end && rc == 0; off += CHG_REC_SZ + keylen + datlen) {
+    seq = _db_get64(p + off + CREC_SEQ);
+    keylen = _db_get16(p + off + CREC_KEYLEN);
+    datlen = _db_get32(p + off + CREC_DATLEN);
+    if (seq <= cur) {
+      continue; /* applied already */
+    }
+    if (cur != 0 && seq != cur + 1) {
+      errno = ERANGE;
+      rc = -1;
+      break;
+    }
+    cur = seq;
+    key = _db_datbuf(db, keylen + datlen + 2);
+    memcpy(key, p + off + CHG_REC_SZ, keylen);
+    key[keylen] = 0;
+    if (p[off + CREC_OP] == CHG_PUT) {
+      memcpy(key + keylen + 1, p + off + CHG_REC_SZ + keylen, datlen);
+      key[keylen + 1 + datlen] = 0;
+      rc = _db_stageop(db, key, key + keylen + 1, DB_STORE);
+    } else {
+      rc = _db_stageop(db, key, NULL, 0);
+    }
+  }
+  if (rc == 0 && db->nops > 0) {
+    _db_commitops(db, NULL);
+    _db_put64(seqbuf, cur);
+    if (_db_pwrite(db, db->idxfd, seqbuf, 8, HDR_CHGSEQ) != 8) {
+      err_dump("db_applychanges(): pwrite() error");
+    }
+  }
+  _db_abort(db);
+  if (_db_un_lock(db, db->idxfd, LCK_CHGSEQ, 1) < 0) {
+    err_dump("db_applychanges(): un_lock() error");
+  }
+  _db_opend(db);
+  return (rc < 0 ? -1 : (ssize_t)end);
+} /* db_applychanges() */
+
+/**
+ * Remove the changes up to a given one from the change log of a database, to
+ * keep it from growing without end once every copy has applied them.  The
+ * changes that are left are copied to a new file, which is renamed into
+ * place; processes reading or appending to the old one switch to it.
+ * @param h database handle, open for writing.
+ * @param seq sequence number of the last change to remove; every change is
+ * removed if it is past the last one.
+ * @return 0 if OK; -1 on error, with errno set to EINVAL if the database has
+ * no change log or is open read-only, or as set by open(2) or write(2).
+ */
+int db_trimchanges(DBHANDLE h, unsigned long seq) {
+  DB *db = _db_cursor(h);
+  struct stat statbuff;
+  unsigned char hdr[CHG_HDR_SZ], flags[4];
+  char *name, *tmpname, *buf;
+  uint64_t first, next;
+  off_t off, end, pos;
+  size_t n;
+  int fd, err;
+
+  if (db->chgfd < 0 || (db->oflag & O_ACCMODE) == O_RDONLY) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  /*
+   * Hold off updates with the log lock, if there is a write-ahead log, and
+   * empty it, since its records refer to offsets in the old file; then lock
+   * out appends.
+   */
+  _db_walbegin(db);
+  if (db->walfd >= 0) {
+    _db_walckpt(db);
+  }
+  _db_chglock(db, F_WRLCK, hdr);
+  first = _db_get64(hdr + CHG_FIRST);
+  next = _db_get64(hdr + CHG_NEXT);
+  end = _db_get64(hdr + CHG_END);
+  if (seq >= next) {
+    seq = next - 1;
+  }
+  if (seq < first) {
+    if (_db_un_lock(db, db->chgfd, CHG_LCK, 1) < 0) {
+      err_dump("db_trimchanges(): un_lock() error");
+    }
+    _db_walend(db);
+    return (0); /* removed already */
+  }
+  off = _db_chgfind(db, seq, end);
+
+  if (fstat(db->chgfd, &statbuff) < 0) {
+    err_dump("db_trimchanges(): fstat() error");
+  }
+  if ((name = malloc(db->namelen + 5)) == NULL ||
+      (tmpname = malloc(db->namelen + 48)) == NULL ||
+      (buf = malloc(CHG_FLUSH)) == NULL) {
+    err_dump("db_trimchanges(): malloc() error");
+  }
+  memcpy(name, db->name, db->namelen);
+  strcpy(name + db->namelen, ".chg");
+  sprintf(tmpname, "%s.%ld.%lx", name, (long)getpid(), (unsigned long)db);
+  _db_put64(hdr + CHG_FIRST, seq + 1);
+  _db_put64(hdr + CHG_END, CHG_HDR_SZ + end - off);
+  _db_put32(hdr + CHG_FLAGS, 0);
+  err = 0;
+  if ((fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC,
+                 statbuff.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO))) < 0) {
+    err = errno;
+  } else if (write(fd, hdr, CHG_HDR_SZ) != CHG_HDR_SZ) {
+    err = errno;
+  }
+  for (pos = off; err == 0 && pos < end; pos += n) {
+    n = (end - pos < CHG_FLUSH ? end - pos : CHG_FLUSH);
+    if (pread(db->chgfd, buf, n, pos) != n) {
+      err_dump("db_trimchanges(): pread() error");
+    }
+    if (write(fd, buf, n) != n) {
+      err = (errno != 0 ? errno : ENOSPC);
+    }
+  }
+  if (err == 0 && (fsync(fd) < 0 || rename(tmpname, name) < 0)) {
+    err = errno;
+  }
+  if (err != 0) {
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmpname);
+    }
+  } else {
+    /*
+     * The new file is in place: send the processes that have the old one open
+     * to it.
+     */
+    _db_syncdir(name);
+    _db_put32(flags, CHG_F_REPLACED);
+    if (pwrite(db->chgfd, flags, 4, CHG_FLAGS) != 4) {
+      err_dump("db_trimchanges(): pwrite() error");
+    }
+  }
+  if (_db_un_lock(db, db->chgfd, CHG_LCK, 1) < 0) {
+    err_dump("db_trimchanges(): un_lock() error");
+  }
+  if (err == 0) {
+    close(db->chgfd);
+    db->chgfd = fd;
+    db->chgreadoff = 0;
+  }
+  _db_walend(db);
+  free(name);
+  free(tmpname);
+  free(buf);
+  if (err != 0) {
+    errno = err;
+    return (-1);
+  }
+  return (0);
+} /* db_trimchanges() */
+
+/**
+ * Open the change log of a database, or start one.  db_openopt() calls this
+ * twice: before the files are recovered from the write-ahead log, which also
+ * covers the change log, to open a log that exists, and with the header read,
+ * to start a log if asked to.  A log started with the database (O_TRUNC)
+ * holds every change made to it.
+ * @param db pointer to database structure.
+ * @param create 0 to open the log if there is one, with O_TRUNC removing any
+ * log of the old files instead; nonzero to start a log if there is none, in a
+ * binary database opened for writing.
+ * @param oflag flags the database was opened with.
+ * @return 0 if OK, with db->chgfd set if the database has a change log; -1 on
+ * error, with errno set to EINVAL if the log is not recognised or the
+ * database can't have one.
+ */
+static int _db_chgopen(DB *db, int create, int oflag) {
+  struct stat statbuff;
+  struct timespec ts;
+  unsigned char hdr[CHG_HDR_SZ];
+  char *name, *tmpname;
+  uint64_t seq;
+  int fd, wr, err;
+
+  wr = (oflag & O_ACCMODE) != O_RDONLY;
+  strcpy(db->name + db->namelen, ".chg");
+  if (!create) {
+    if (oflag & O_TRUNC) {
+      unlink(db->name); /* changes of the old files */
+      return (0);
+    }
+    if ((fd = open(db->name, wr ? O_RDWR : O_RDONLY)) < 0) {
+      return (errno == ENOENT ? 0 : -1);
+    }
+    if (pread(fd, hdr, CHG_HDR_SZ, 0) != CHG_HDR_SZ ||
+        memcmp(hdr, CHG_MAGIC, 8) != 0) {
+      close(fd);
+      errno = EINVAL;
+      return (-1);
+    }
+    db->chgfd = fd;
+    return (0);
+  }
+  if (db->format != DB_FMT_BINARY) {
+    errno = EINVAL;
+    return (-1);
+  }
+  if (db->chgfd >= 0 || !wr) {
+    return (0);
+  }
+
+  /*
+   * Write the header to a file of its own, and link it into place, unless
+   * another process has just done the same.
+   */
+  if (fstat(db->idxfd, &statbuff) < 0) {
+    err_dump("_db_chgopen(): fstat() error");
+  }
+  if (pread(db->idxfd, hdr, 8, HDR_CHGSEQ) != 8) {
+    err_dump("_db_chgopen(): pread() error");
+  }
+  if (clock_gettime(CLOCK_REALTIME, &ts) < 0) {
+    err_dump("_db_chgopen(): clock_gettime() error");
+  }
+  seq = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  if (seq <= _db_get64(hdr)) {
+    seq = _db_get64(hdr) + 1;
+  }
+  memset(hdr, 0, CHG_HDR_SZ);
+  memcpy(hdr, CHG_MAGIC, 8);
+  _db_put64(hdr + CHG_FIRST, seq);
+  _db_put64(hdr + CHG_NEXT, seq);
+  _db_put64(hdr + CHG_END, CHG_HDR_SZ);
+  _db_put32(hdr + CHG_FLAGS, (oflag & O_TRUNC) ? CHG_F_COMPLETE : 0);
+  if ((name = malloc(db->namelen + 5)) == NULL ||
+      (tmpname = malloc(db->namelen + 48)) == NULL) {
+    err_dump("_db_chgopen(): malloc() error");
+  }
+  strcpy(name, db->name);
+  sprintf(tmpname, "%s.%ld.%lx", name, (long)getpid(), (unsigned long)db);
+  if ((fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC,
+                 statbuff.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO))) < 0) {
+    err = errno;
+    free(name);
+    free(tmpname);
+    errno = err;
+    return (-1);
+  }
+  if (write(fd, hdr, CHG_HDR_SZ) != CHG_HDR_SZ ||
+      (link(tmpname, name) < 0 && errno != EEXIST)) {
+    err = errno;
+    close(fd);
+    unlink(tmpname);
+    free(name);
+    free(tmpname);
+    errno = err;
+    return (-1);
+  }
+  close(fd);
+  unlink(tmpname);
+  free(name);
+  free(tmpname);
+  return (_db_chgopen(db, 0, oflag & ~O_TRUNC));
+} /* _db_chgopen() */
+
+/**
+ * Lock the change log and read its header, first opening the log again for as
+ * long as db_trimchanges() has replaced it.
+ * @param db pointer to database structure, with a change log.
+ * @param type F_RDLCK or F_WRLCK.
+ * @param hdr filled in with the header.
+ */
+static void _db_chglock(DB *db, int type, unsigned char *hdr) {
+  int fd;
+
+  for (;;) {
+    if (_db_lockreg(db, db->chgfd, F_SETLKW, type, CHG_LCK, 1) < 0) {
+      err_dump("_db_chglock(): lock error");
+    }
+    if (pread(db->chgfd, hdr, CHG_HDR_SZ, 0) != CHG_HDR_SZ) {
+      err_dump("_db_chglock(): pread() error");
+    }
+    if (!(_db_get32(hdr + CHG_FLAGS) & CHG_F_REPLACED)) {
+      return;
+    }
+    if (_db_un_lock(db, db->chgfd, CHG_LCK, 1) < 0) {
+      err_dump("_db_chglock(): un_lock() error");
+    }
+    strcpy(db->name + db->namelen, ".chg");
+    if ((fd = open(db->name, (db->oflag & O_ACCMODE) == O_RDONLY ? O_RDONLY
+                                                                 : O_RDWR)) <
+        0) {
+      err_dump("_db_chglock(): can't open %s", db->name);
+    }
+    close(db->chgfd);
+    db->chgfd = fd;
+    db->chgreadoff = 0;
+  }
+} /* _db_chglock() */
+
+/**
+ * Find the record after a given change in the change log.  The place after
+ * the last record db_readchanges() returned is remembered; otherwise the log
+ * is read from the start.
+ * @param db pointer to database structure, with a change log.
+ * @param seq sequence number of the change, from the first record on.
+ * @param end end of the records.
+ * @return offset of the record after the change.
+ */
+static off_t _db_chgfind(DB *db, uint64_t seq, off_t end) {
+  unsigned char rec[CHG_REC_SZ];
+  off_t off;
+
+  if (db->chgreadoff != 0 && db->chgreadseq == seq) {
+    return (db->chgreadoff);
+  }
+  for (off = CHG_HDR_SZ; off < end;
+       off += CHG_REC_SZ + (off_t)_db_get16(rec + CREC_KEYLEN) +
+              _db_get32(rec + CREC_DATLEN)) {
+    if (pread(db->chgfd, rec, CHG_REC_SZ, off) != CHG_REC_SZ) {
+      err_dump("_db_chgfind(): pread() error");
+    }
+    if (_db_get64(rec + CREC_SEQ) > seq) {
+      break;
+    }
+  }
+  return (off);
+} /* _db_chgfind() */
+
+/**
+ * Add the record of a change to those to be appended to the change log by
+ * _db_chgflush().  Does nothing for a database without a log.
+ * @param db pointer to database structure.
+ * @param op CHG_PUT or CHG_DEL.
+ * @param key the key.
+ * @param data the data the key was stored with; NULL for CHG_DEL.
+ */
+static void _db_chgadd(DB *db, int op, const char *key, const char *data) {
+  unsigned char *p;
+  size_t keylen, datlen, need;
+
+  if (db->chgfd < 0) {
+    return;
+  }
+  keylen = strlen(key);
+  datlen = (data == NULL ? 0 : strlen(data));
+  need = db->chglen + CHG_REC_SZ + keylen + datlen;
+  if (need > db->chgsize) {
+    if ((p = realloc(db->chgbuf, need * 2 + 4096)) == NULL) {
+      err_dump("_db_chgadd(): realloc() error");
+    }
+    db->chgbuf = p;
+    db->chgsize = need * 2 + 4096;
+  }
+  p = db->chgbuf + db->chglen;
+  memset(p, 0, CHG_REC_SZ);
+  p[CREC_OP] = op;
+  _db_put16(p + CREC_KEYLEN, keylen);
+  _db_put32(p + CREC_DATLEN, datlen);
+  memcpy(p + CHG_REC_SZ, key, keylen);
+  if (data != NULL) {
+    memcpy(p + CHG_REC_SZ + keylen, data, datlen);
+  }
+  db->chglen = need;
+} /* _db_chgadd() */
+
+/**
+ * Append the records added by _db_chgadd() to the change log, numbering them,
+ * and record the last sequence number in the index file header.  Called with
+ * the chains of the keys write locked, as part of the update.
+ * @param db pointer to database structure.
+ */
+static void _db_chgflush(DB *db) {
+  unsigned char hdr[CHG_HDR_SZ];
+  uint64_t seq;
+  off_t end;
+  size_t off;
+
+  if (db->chglen == 0) {
+    return;
+  }
+  _db_chglock(db, F_WRLCK, hdr);
+  seq = _db_get64(hdr + CHG_NEXT);
+  end = _db_get64(hdr + CHG_END);
+  for (off = 0; off < db->chglen;
+       off += CHG_REC_SZ + (size_t)_db_get16(db->chgbuf + off + CREC_KEYLEN) +
+              _db_get32(db->chgbuf + off + CREC_DATLEN)) {
+    _db_put64(db->chgbuf + off + CREC_SEQ, seq++);
+  }
+  if (_db_pwrite(db, db->chgfd, db->chgbuf, db->chglen, end) != db->chglen) {
+    err_dump("_db_chgflush(): pwrite() error");
+  }
+  _db_put64(hdr + CHG_NEXT, seq);
+  _db_put64(hdr + CHG_END, end + db->chglen);
+  if (_db_pwrite(db, db->chgfd, hdr + CHG_NEXT, 16, CHG_NEXT) != 16) {
+    err_dump("_db_chgflush(): pwrite() error");
+  }
+  _db_put64(hdr, seq - 1);
+  if (_db_pwrite(db, db->idxfd, hdr, 8, HDR_CHGSEQ) != 8) {
+    err_dump("_db_chgflush(): pwrite() error");
+  }
+  if (_db_un_lock(db, db->chgfd, CHG_LCK, 1) < 0) {
+    err_dump("_db_chgflush(): un_lock() error");
+  }
+  db->chglen = 0;
+} /* _db_chgflush() */
+
+/**
+ * Log every record of the database as stored, for db_bulkload(), which writes
+ * the records of an empty database without going through db_store().  Called
+ * with the index file write locked.
+ * @param db pointer to database structure.
+ */
+static void _db_chgfill(DB *db) {
+  DBHASH b;
+  off_t offset;
+  char *data;
+
+  if (db->chgfd < 0) {
+    return;
+  }
+  for (b = 0; b < db->nbucket; b++) {
+    for (offset = _db_readptr(db, _db_bucketoff(db, b)); offset != 0;) {
+      offset = _db_readidx(db, offset);
+      if (!db->bad && (data = _db_readdat(db)) != NULL) {
+        _db_chgadd(db, CHG_PUT, db->idxbuf, data);
+      }
+      if (db->chglen >= CHG_FLUSH) {
+        _db_chgflush(db);
+      }
+    }
+  }
+  _db_chgflush(db);
+} /* _db_chgfill() */
+
+/**
+ * Open the snapshot file of a database that copies on write (F_SNAPSHOT), or
+ * create it if there is none.  The file is opened for writing if it can be,
+ * even in a read-only handle, since db_snapshot() pins its snapshots there.
+ * @param db pointer to database structure, with the header read.
+ * @param oflag flags the database was opened with; O_TRUNC removes the file
+ * of the old files first.
+ * @return 0 if OK, with db->snpfd set; -1 on error, with errno set to EINVAL
+ * if the file is not recognised.
+ */
+static int _db_snpopen(DB *db, int oflag) {
+  struct stat statbuff;
+  unsigned char hdr[SNP_SIZE];
+  char *name, *tmpname;
+  int fd, err;
+
+  strcpy(db->name + db->namelen, ".snp");
+  if (oflag & O_TRUNC) {
+    unlink(db->name); /* snapshots of the old files */
+  }
+  if ((fd = open(db->name, O_RDWR)) >= 0 ||
+      (errno == EACCES && (fd = open(db->name, O_RDONLY)) >= 0)) {
+    if (pread(fd, hdr, SNP_SIZE, 0) != SNP_SIZE ||
+        memcmp(hdr, SNP_MAGIC, 8) != 0) {
+      close(fd);
+      errno = EINVAL;
+      return (-1);
+    }
+    db->snpfd = fd;
+    return (0);
+  }
+  if (errno != ENOENT) {
+    return (-1);
+  }
+
+  /*
+   * Write the header and the empty slots to a file of their own, and link it
+   * into place, unless another process has just done the same.  The epochs
+   * go on after the latest one recorded in the index file.
+   */
+  if (fstat(db->idxfd, &statbuff) < 0) {
+    err_dump("_db_snpopen(): fstat() error");
+  }
+  if (pread(db->idxfd, hdr, 4, HDR_EPOCH) != 4) {
+    err_dump("_db_snpopen(): pread() error");
+  }
+  _db_put32(hdr + SNP_EPOCH, _db_get32(hdr) + 1);
+  memset(hdr, 0, SNP_EPOCH);
+  memset(hdr + SNP_EPOCH + 4, 0, SNP_SIZE - SNP_EPOCH - 4);
+  memcpy(hdr, SNP_MAGIC, 8);
+  if ((name = malloc(db->namelen + 5)) == NULL ||
+      (tmpname = malloc(db->namelen + 48)) == NULL) {
+    err_dump("_db_snpopen(): malloc() error");
+  }
+  strcpy(name, db->name);
+  sprintf(tmpname, "%s.%ld.%lx", name, (long)getpid(), (unsigned long)db);
+  if ((fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC,
+                 statbuff.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO))) < 0) {
+    err = errno;
+    free(name);
+    free(tmpname);
+    errno = err;
+    return (-1);
+  }
+  if (write(fd, hdr, SNP_SIZE) != SNP_SIZE ||
+      (link(tmpname, name) < 0 && errno != EEXIST)) {
+    err = errno;
+    close(fd);
+    unlink(tmpname);
+    free(name);
+    free(tmpname);
+    errno = err;
+    return (-1);
+  }
+  close(fd);
+  unlink(tmpname);
+  free(name);
+  free(tmpname);
+  return (_db_snpopen(db, oflag & ~O_TRUNC));
+} /* _db_snpopen() */
+
+/**
+ * Find out, at the start of an update of a database that copies on write, the
+ * epoch the update is made in, and whether it must copy on write: whether any
+ * snapshot is pinned, and the oldest one.  The epoch byte of the snapshot file
+ * stays read locked until _db_opend(), so that no snapshot is taken in the
+ * middle of the update.
+ * @param db pointer to database structure, with a snapshot file.
+ */
+static void _db_snpbegin(DB *db) {
+  unsigned char buf[SNP_SIZE];
+  uint32_t epoch;
+  int i;
+
+  if (_db_readw_lock(db, db->snpfd, SNP_LCK_TURN, 2) < 0) {
+    err_dump("_db_snpbegin(): readw_lock() error");
+  }
+  if (_db_un_lock(db, db->snpfd, SNP_LCK_TURN, 1) < 0) {
+    err_dump("_db_snpbegin(): un_lock() error");
+  }
+  if (pread(db->snpfd, buf, SNP_SIZE, 0) != SNP_SIZE) {
+    err_dump("_db_snpbegin(): pread() error");
+  }
+  db->epoch = _db_get32(buf + SNP_EPOCH);
+  db->cow = 0;
+  db->snapmin = 0;
+  for (i = 0; i < SNP_NSLOT; i++) {
+    epoch = _db_get32(buf + SNP_HDR_SZ + i * SNP_SLOT_SZ);
+    if (epoch != 0 && (!db->cow || epoch < db->snapmin)) {
+      db->cow = 1;
+      db->snapmin = epoch;
+    }
+  }
+} /* _db_snpbegin() */
+
+/**
+ * Take a snapshot of a database created with DB_OPT_SNAPSHOT, for db_nextrec()
+ * and db_scan() to read until db_snapend().  db_snapshot() waits for the
+ * updates under way to end; the snapshot then holds no lock, and updates go
+ * on, but the scans of the handle see the records as they were when it was
+ * taken.  db_rewind() goes back to the first of them.  db_fetch() and the other
+ * reads still see the latest records.  A handle, or the cursor of a thread in
+ * a handle shared by threads, has one snapshot at a time.  The updates made
+ * while any snapshot is pinned copy on write, and the space of the records
+ * they replace is only reused once no snapshot can see them, so a snapshot
+ * should not be kept for longer than it is needed.
+ * @param h database handle.
+ * @return 0 if OK; -1 on error, with errno set to EINVAL if the database
+ * doesn't copy on write or the handle already has a snapshot, or to EAGAIN if
+ * SNP_NSLOT snapshots are pinned already.
+ */
+int db_snapshot(DBHANDLE h) {
+  DB *db = _db_cursor(h);
+  unsigned char buf[SNP_SIZE], *slot;
+  struct stat statbuff;
+  uint32_t epoch;
+  pid_t pid;
+  int i, err = 0;
+
+  if (db->snpfd < 0 || db->snapslot >= 0) {
+    errno = EINVAL;
+    return (-1);
+  }
+  _db_checkswap(db);
+  if (_db_writew_lock(db, db->snpfd, SNP_LCK_TURN, 2) < 0) {
+    return (-1); /* EBADF: the file is read-only for this process */
+  }
+  if (pread(db->snpfd, buf, SNP_SIZE, 0) != SNP_SIZE) {
+    err_dump("db_snapshot(): pread() error");
+  }
+
+  /*
+   * Free the slots of processes that died without ending their snapshots.
+   * The lock on the first byte of a slot is free once its process is gone,
+   * or has closed the file.
+   */
+  for (i = 0, slot = buf + SNP_HDR_SZ; i < SNP_NSLOT;
+       i++, slot += SNP_SLOT_SZ) {
+    pid = _db_get32(slot + 4);
+    if (_db_get32(slot) == 0 || pid == getpid() ||
+        _db_write_lock(db, db->snpfd, slot - buf, 1) < 0) {
+      continue;
+    }
+    if (kill(pid, 0) < 0 && errno == ESRCH) {
+      memset(slot, 0, SNP_SLOT_SZ);
+      if (pwrite(db->snpfd, slot, SNP_SLOT_SZ, slot - buf) != SNP_SLOT_SZ) {
+        err_dump("db_snapshot(): pwrite() error");
+      }
+    }
+    if (_db_un_lock(db, db->snpfd, slot - buf, 1) < 0) {
+      err_dump("db_snapshot(): un_lock() error");
+    }
+  }
+
+  /*
+   * Pin the next epoch in the first free slot.  Updates made from now on are
+   * made in it, and the snapshot only sees the records of earlier ones.
+   */
+  for (i = 0, slot = buf + SNP_HDR_SZ; i < SNP_NSLOT;
+       i++, slot += SNP_SLOT_SZ) {
+    if (_db_get32(slot) == 0 &&
+        _db_write_lock(db, db->snpfd, slot - buf, 1) == 0) {
+      break;
+    }
+  }
+  if (i == SNP_NSLOT) {
+    err = EAGAIN;
+  } else {
+    epoch = _db_get32(buf + SNP_EPOCH) + 1;
+    _db_put32(buf + SNP_EPOCH, epoch);
+    _db_put32(slot, epoch);
+    _db_put32(slot + 4, getpid());
+    if (pwrite(db->snpfd, slot, SNP_SLOT_SZ, slot - buf) != SNP_SLOT_SZ ||
+        pwrite(db->snpfd, buf + SNP_EPOCH, 4, SNP_EPOCH) != 4) {
+      err_dump("db_snapshot(): pwrite() error");
+    }
+    if (fstat(db->idxfd, &statbuff) < 0) {
+      err_dump("db_snapshot(): fstat() error");
+    }
+    db->snapend = statbuff.st_size;
+    db->snaprecoff = db->snapoff = db->recoff;
+    db->snapblen = 0;
+    db->snapepoch = epoch;
+    db->snapslot = i;
+  }
+  if (_db_un_lock(db, db->snpfd, SNP_LCK_TURN, 2) < 0) {
+    err_dump("db_snapshot(): un_lock() error");
+  }
+  if (err != 0) {
+    errno = err;
+    return (-1);
+  }
+  return (0);
+} /* db_snapshot() */
+
+/**
+ * End the snapshot of a handle taken by db_snapshot(), so that updates can
+ * reuse the space of the records only it could see.  db_nextrec() carries on
+ * where it was before the snapshot was taken, through the latest records.
+ * Does nothing if the handle has no snapshot.
+ * @param h database handle.
+ */
+void db_snapend(DBHANDLE h) {
+  DB *db = _db_cursor(h);
+  int i = db->snapslot;
+
+  if (i < 0) {
+    return;
+  }
+  _db_snapclear(db);
+  if (_db_un_lock(db, db->snpfd, SNP_HDR_SZ + i * SNP_SLOT_SZ, 1) < 0) {
+    err_dump("db_snapend(): un_lock() error");
+  }
+} /* db_snapend() */
+
+/**
+ * Free the slot of the snapshot of a handle, and close the old files that it
+ * kept reading after db_compact() replaced them.  The lock on the slot is left
+ * to the caller.
+ * @param db pointer to database structure, with a snapshot.
+ */
+static void _db_snapclear(DB *db) {
+  unsigned char slot[SNP_SLOT_SZ];
+
+  memset(slot, 0, SNP_SLOT_SZ);
+  if (pwrite(db->snpfd, slot, SNP_SLOT_SZ,
+             SNP_HDR_SZ + db->snapslot * SNP_SLOT_SZ) != SNP_SLOT_SZ) {
+    err_dump("_db_snapclear(): pwrite() error");
+  }
+  if (db->snapidxfd >= 0) {
+    close(db->snapidxfd);
+    close(db->snapdatfd);
+    db->snapidxfd = db->snapdatfd = -1;
+  }
+  db->snapslot = -1;
+} /* _db_snapclear() */
+
+/**
+ * Calculate the hash value for a key, using the hash function and seed of the
+ * database.  The hash value is reduced to a bucket number by _db_bucket().
+ * @param db pointer to database structure.
+ * @param key pointer to key string.
+ * @return hash value for the given key.
+ */
+static DBHASH _db_hash(DB *db, const char *key) {
+  return ((DBHASH)db->hashfn(key, strlen(key), db->seed));
+} /* _db_hash() */
+
+/**
+ * The original hash function: the sum of each ASCII character multiplied by
+ * its 1-based index.  Cheap, but anagrams and short numeric keys collide
+ * systematically.  Used by all ASCII databases.
+ * @param key pointer to key.
+ * @param len length of key.
+ * @param seed ignored.
+ * @return hash value for the given key.
+ */
+static uint64_t _db_hash_apue(const char *key, size_t len, uint64_t seed) {
+  DBHASH hval = 0;
+  char c;
+  size_t i;
+
+  for (i = 1; i <= len; i++) {
+    c = *key++;
+    hval += c * i; /* ascii char times its 1-based index */
+  }
+  return (hval);
+} /* _db_hash_apue() */
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/*
+ * xxHash64 primes.
+ */
+#define XXH_P1 0x9e3779b185ebca87ULL
+#define XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define XXH_P3 0x165667b19e3779f9ULL
+#define XXH_P4 0x85ebca77c2b2ae63ULL
+#define XXH_P5 0x27d4eb2f165667c5ULL
+
+/**
+ * Mix one 64-bit lane of input into an xxHash64 accumulator.
+ */
+static uint64_t _db_xxh64_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_P2;
+  acc = ROTL64(acc, 31);
+  return (acc * XXH_P1);
+}
+
+/**
+ * xxHash64 (Yann Collet), a fast non-cryptographic hash with good
+ * distribution.  Input words are read little-endian, so the same key hashes
+ * the same on every host, which matters since the hash function is part of
+ * the index file.  The default for binary databases.
+ * @param key pointer to key.
+ * @param len length of key.
+ * @param seed hash function seed.
+ * @return hash value for the given key.
+ */
+static uint64_t _db_hash_xxh64(const char *key, size_t len, uint64_t seed) {
+  const unsigned char *p = (const unsigned char *)key;
+  const unsigned char *end = p + len;
+  uint64_t h, v1, v2, v3, v4;
+
+  if (len >= 32) {
+    v1 = seed + XXH_P1 + XXH_P2;
+    v2 = seed + XXH_P2;
+    v3 = seed;
+    v4 = seed - XXH_P1;
+    do {
+      v1 = _db_xxh64_round(v1, _db_get64(p));
+      v2 = _db_xxh64_round(v2, _db_get64(p + 8));
+      v3 = _db_xxh64_round(v3, _db_get64(p + 16));
+      v4 = _db_xxh64_round(v4, _db_get64(p + 24));
+      p += 32;
+    } while (p + 32 <= end);
+    h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+    h = (h ^ _db_xxh64_round(0, v1)) * XXH_P1 + XXH_P4;
+    h = (h ^ _db_xxh64_round(0, v2)) * XXH_P1 + XXH_P4;
+    h = (h ^ _db_xxh64_round(0, v3)) * XXH_P1 + XXH_P4;
+    h = (h ^ _db_xxh64_round(0, v4)) * XXH_P1 + XXH_P4;
+  } else {
+    h = seed + XXH_P5;
+  }
+  h += len;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= _db_xxh64_round(0, _db_get64(p));
+    h = ROTL64(h, 27) * XXH_P1 + XXH_P4;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)_db_get32(p) * XXH_P1;
+    h = ROTL64(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * XXH_P5;
+    h = ROTL64(h, 11) * XXH_P1;
+  }
+
+  /* Final avalanche */
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return (h);
+} /* _db_hash_xxh64() */
+
+#define SIPROUND                                                               \
+  do {                                                                         \
+    v0 += v1;                                                                  \
+    v1 = ROTL64(v1, 13);                                                       \
+    v1 ^= v0;                                                                  \
+    v0 = ROTL64(v0, 32);                                                       \
+    v2 += v3;                                                                  \
+    v3 = ROTL64(v3, 16);                                                       \
+    v3 ^= v2;                                                                  \
+    v0 += v3;                                                                  \
+    v3 = ROTL64(v3, 21);                                                       \
+    v3 ^= v0;                                                                  \
+    v2 += v1;                                                                  \
+    v1 = ROTL64(v1, 17);                                                       \
+    v1 ^= v2;                                                                  \
+    v2 = ROTL64(v2, 32);                                                       \
+  } while (0)
+
+/**
+ * SipHash-2-4 (Aumasson and Bernstein), a keyed hash function.  Slower than
+ * xxHash64, but with a secret seed an attacker can't choose keys that all land
+ * on the same hash chain.  The 128-bit SipHash key is derived from the seed.
+ * @param key pointer to key.
+ * @param len length of key.
+ * @param seed hash function seed.
+ * @return hash value for the given key.
+ */
+static uint64_t _db_hash_sip24(const char *key, size_t len, uint64_t seed) {
+  const unsigned char *p = (const unsigned char *)key;
+  const unsigned char *end = p + (len & ~(size_t)7);
+  uint64_t k0 = seed, k1 = seed ^ 0x9e3779b97f4a7c15ULL;
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  uint64_t m, b;
+  int i;
+
+  for (; p != end; p += 8) {
+    m = _db_get64(p);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+
+  /* Last block: remaining bytes, with the length in the top byte */
+  b = (uint64_t)len << 56;
+  for (i = (len & 7) - 1; i >= 0; i--) {
+    b |= (uint64_t)p[i] << (i * 8);
+  }
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return (v0 ^ v1 ^ v2 ^ v3);
+} /* _db_hash_sip24() */
+
+/*
+ * CRC32C tables for slicing by 8, built on first use, and whether the CPU has
+ * an instruction for it.
+ */
+static pthread_once_t _db_crconce = PTHREAD_ONCE_INIT;
+static uint32_t _db_crctab[8][256];
+static int _db_crchw;
+
+/**
+ * Build the CRC32C tables, and see whether the CPU can do the work instead.
+ */
+static void _db_crcinit(void) {
+  uint32_t c;
+  int i, j;
+
+  for (i = 0; i < 256; i++) {
+    for (c = i, j = 0; j < 8; j++) {
+      c = (c >> 1) ^ ((c & 1) ? CRC_POLY : 0);
+    }
+    _db_crctab[0][i] = c;
+  }
+  for (i = 0; i < 256; i++) {
+    for (j = 1; j < 8; j++) {
+      c = _db_crctab[j - 1][i];
+      _db_crctab[j][i] = (c >> 8) ^ _db_crctab[0][c & 0xff];
+    }
+  }
+#ifdef HAVE_CRC32C_HW
+  __builtin_cpu_init();
+  _db_crchw = __builtin_cpu_supports("sse4.2");
+#endif
+} /* _db_crcinit() */
+
+#ifdef HAVE_CRC32C_HW
+/**
+ * CRC32C with the SSE4.2 crc32 instruction, eight bytes at a time.
+ * @param crc CRC so far, not inverted.
+ * @param p bytes to add.
+ * @param len number of bytes.
+ * @return CRC, not inverted.
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+_db_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t c = crc, w;
+
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; len--) {
+    c = __builtin_ia32_crc32qi(c, *p++);
+  }
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&w, p, 8);
+    c = __builtin_ia32_crc32di(c, w);
+  }
+  for (; len > 0; len--) {
+    c = __builtin_ia32_crc32qi(c, *p++);
+  }
+  return (c);
+} /* _db_crc32c_hw() */
+#endif
+
+/**
+ * CRC32C (Castagnoli) of a buffer, the checksum of iSCSI, ext4 and btrfs.
+ * Calls can be chained, passing the CRC of the bytes before as crc.  Uses the
+ * crc32 instruction where the CPU has it, and tables eight bytes at a time
+ * otherwise.
+ * @param crc CRC of the bytes before; 0 for none.
+ * @param buf bytes to add.
+ * @param len number of bytes.
+ * @return CRC32C of the bytes so far.
+ */
+static uint32_t _db_crc32c(uint32_t crc, const void *buf, size_t len) {
+  const unsigned char *p = buf;
+
+  pthread_once(&_db_crconce, _db_crcinit);
+  crc = ~crc;
+#ifdef HAVE_CRC32C_HW
+  if (_db_crchw) {
+    return (~_db_crc32c_hw(crc, p, len));
+  }
+#endif
+  for (; len >= 8; len -= 8, p += 8) {
+    crc ^= _db_get32(p);
+    crc = _db_crctab[7][crc & 0xff] ^ _db_crctab[6][(crc >> 8) & 0xff] ^
+          _db_crctab[5][(crc >> 16) & 0xff] ^ _db_crctab[4][crc >> 24] ^
+          _db_crctab[3][p[4]] ^ _db_crctab[2][p[5]] ^ _db_crctab[1][p[6]] ^
+          _db_crctab[0][p[7]];
+  }
+  for (; len > 0; len--) {
+    crc = (crc >> 8) ^ _db_crctab[0][(crc ^ *p++) & 0xff];
+  }
+  return (~crc);
+} /* _db_crc32c() */
+
+/**
+ * Checksum of a binary index record with a key (F_CHECKSUM): the header, but
+ * the chain ptr and the checksum itself, and the key.
+ * @param rec the record header, followed by the key.
+ * @param keylen length of the key.
+ * @return the checksum for REC_SUM.
+ */
+static uint32_t _db_recsum(const unsigned char *rec, size_t keylen) {
+  uint32_t crc;
+
+  crc = _db_crc32c(0, rec, REC_PTR);
+  crc = _db_crc32c(crc, rec + REC_DATOFF, REC_SUM - REC_DATOFF);
+  return (_db_crc32c(crc, rec + REC_DATSUM, BIN_REC_SZ - REC_DATSUM + keylen));
+} /* _db_recsum() */
+
+/**
+ * Checksum of a data record (F_CHECKSUM): the data and the newline after it.
+ * @param data the data.
+ * @param len length of the data, without the newline.
+ * @return the checksum for REC_DATSUM.
+ */
+static uint32_t _db_datsum(const char *data, size_t len) {
+  return (_db_crc32c(_db_crc32c(0, data, len), "\n", 1));
+} /* _db_datsum() */
+
+/**
+ * Pack the data of a record about to be written, if the database compresses
+ * its data (F_PACKED) and the packed record fits a smaller extent.  The packed
+ * bytes are put at an offset in db->packbuf, so that a batch can pack all its
+ * records first.
+ * @param db pointer to database structure.
+ * @param data the data.
+ * @param len length of its data record, including the newline.
+ * @param off where to put the packed bytes in db->packbuf.
+ * @return length of the packed data record, including the newline, which
+ * isn't put in db->packbuf; 0 if the data is to be written as it is.
+ */
+static size_t _db_pack(DB *db, const char *data, size_t len, size_t off) {
+  size_t n;
+
+  if (!(db->features & F_PACKED) || len < PACK_MFLIMIT + 2) {
+    return (0);
+  }
+  _db_rawbuf(&db->packbuf, &db->packsize, off + len);
+  if (db->packtab == NULL &&
+      (db->packtab = malloc(sizeof(uint32_t) << PACK_HBITS)) == NULL) {
+    err_dump("_db_pack(): malloc() error");
+  }
+  n = _db_lzpack(db, (const unsigned char *)data, len - 1,
+                 (unsigned char *)db->packbuf + off, len - 1, db->packtab);
+  if (n == 0 ||
+      _db_extsize(EXT_HDR_SZ + n + 1) >= _db_extsize(EXT_HDR_SZ + len)) {
+    return (0);
+  }
+  return (n + 1);
+} /* _db_pack() */
+
+/**
+ * Unpack the current data record (REC_F_PACKED) into a buffer, and
+ * null-terminate it.
+ * @param db pointer to database structure, with db->datlen and db->rawlen
+ * those of the current record.
+ * @param p the packed data record.
+ * @param buf buffer of at least db->rawlen bytes.
+ * @return buf if OK; NULL, with db->bad set to EBADMSG, if the record doesn't
+ * unpack to db->rawlen - 1 bytes.
+ */
+static char *_db_unpack(DB *db, const char *p, char *buf) {
+  if (_db_lzunpack(db, (const unsigned char *)p, db->datlen - 1,
+                   (unsigned char *)buf, db->rawlen - 1) < 0) {
+    db->bad = EBADMSG;
+    return (NULL);
+  }
+  buf[db->rawlen - 1] = 0;
+  return (buf);
+} /* _db_unpack() */
+
+/**
+ * Compress bytes into the LZ4 block format, greedily.  Matches are looked up
+ * by the hash of their first PACK_MINMATCH bytes, first in a table of the
+ * positions of the bytes already packed, then in the table of the dictionary,
+ * if the database has one.  Bytes with no match are skipped faster the longer
+ * they go on, since data that doesn't repeat isn't worth the search.
+ * @param db pointer to database structure, for its dictionary.
+ * @param src the bytes.
+ * @param len number of bytes.
+ * @param dst buffer for the packed bytes.
+ * @param cap size of dst.
+ * @param tab hash table of 2^PACK_HBITS entries to work in.
+ * @return number of packed bytes; 0 if they don't fit in cap bytes.
+ */
+static size_t _db_lzpack(const DB *db, const unsigned char *src, size_t len,
+                         unsigned char *dst, size_t cap, uint32_t *tab) {
+  const unsigned char *dict = (const unsigned char *)db->dict;
+  size_t ip = 0, anchor = 0, op = 0, limit, ref, off = 0, mlen, lit, tok;
+  uint32_t seq, h, misses = 0;
+  int bits;
+
+  if (len > PACK_MFLIMIT) {
+    /* A table no bigger than the input, since it's cleared every time */
+    for (bits = PACK_HBITS; bits > 8 && ((size_t)1 << (bits - 1)) >= len;
+         bits--) {
+      ;
+    }
+    memset(tab, 0, sizeof(uint32_t) << bits);
+    limit = len - PACK_MFLIMIT;
+    while (ip <= limit) {
+      seq = _db_get32(src + ip);
+      h = PACK_HASH(seq, bits);
+      ref = tab[h];
+      tab[h] = ip + 1;
+      mlen = 0;
+      if (ref != 0 && ip - (ref - 1) <= PACK_MAXOFF &&
+          _db_get32(src + ref - 1) == seq) {
+        ref--;
+        off = ip - ref;
+        for (mlen = PACK_MINMATCH;
+             ip + mlen < len - PACK_LASTLIT &&
+             src[ref + mlen] == src[ip + mlen];
+             mlen++) {
+          ;
+        }
+      } else if (db->dictlen != 0 &&
+                 (ref = db->dicttab[PACK_HASH(seq, DICT_HBITS)]) != 0 &&
+                 ip + db->dictlen - (ref - 1) <= PACK_MAXOFF &&
+                 _db_get32(dict + ref - 1) == seq) {
+        /* The match may run on from the dictionary into the input */
+        ref--;
+        off = ip + db->dictlen - ref;
+        for (mlen = PACK_MINMATCH;
+             ip + mlen < len - PACK_LASTLIT &&
+             (ref + mlen < db->dictlen ? dict[ref + mlen]
+                                       : src[ref + mlen - db->dictlen]) ==
+                 src[ip + mlen];
+             mlen++) {
+          ;
+        }
+      }
+      if (mlen == 0) {
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      /* Token, literals, offset and match length */
+      lit = ip - anchor;
+      if (op + lit + lit / 255 + mlen / 255 + 5 > cap) {
+        return (0);
+      }
+      tok = op++;
+      dst[tok] = (lit < 15 ? lit : 15) << 4;
+      if (lit >= 15) {
+        op = _db_lzlen(dst, op, lit - 15);
+      }
+      memcpy(dst + op, src + anchor, lit);
+      op += lit;
+      dst[op++] = off & 0xff;
+      dst[op++] = off >> 8;
+      mlen -= PACK_MINMATCH;
+      dst[tok] |= mlen < 15 ? mlen : 15;
+      if (mlen >= 15) {
+        op = _db_lzlen(dst, op, mlen - 15);
+      }
+      ip += mlen + PACK_MINMATCH;
+      anchor = ip;
+      if (ip <= limit) {
+        tab[PACK_HASH(_db_get32(src + ip - 2), bits)] = ip - 2 + 1;
+      }
+    }
+  }
+
+  /* The last literals */
+  lit = len - anchor;
+  if (op + lit + lit / 255 + 2 > cap) {
+    return (0);
+  }
+  dst[op++] = (lit < 15 ? lit : 15) << 4;
+  if (lit >= 15) {
+    op = _db_lzlen(dst, op, lit - 15);
+  }
+  memcpy(dst + op, src + anchor, lit);
+  return (op + lit);
+} /* _db_lzpack() */
+
+/**
+ * Write the extra bytes of a literal or match length of the LZ4 block format:
+ * 255 for each 255 of it, then what is left.
+ * @param dst buffer being packed into.
+ * @param op where to write in it.
+ * @param n the length, less the 15 of the token.
+ * @return where the next byte goes.
+ */
+static size_t _db_lzlen(unsigned char *dst, size_t op, size_t n) {
+  for (; n >= 255; n -= 255) {
+    dst[op++] = 255;
+  }
+  dst[op++] = n;
+  return (op);
+} /* _db_lzlen() */
+
+/**
+ * Decompress bytes in the LZ4 block format, with the dictionary of the
+ * database, if it has one, before them.  Every length and offset is checked,
+ * so that a damaged record is found out rather than read or written past its
+ * buffers.
+ * @param db pointer to database structure, for its dictionary.
+ * @param src the packed bytes.
+ * @param len number of packed bytes.
+ * @param dst buffer for the bytes unpacked.
+ * @param rawlen number of bytes they must unpack to.
+ * @return 0 if OK; -1 if they are not rawlen bytes packed.
+ */
+static int _db_lzunpack(const DB *db, const unsigned char *src, size_t len,
+                        unsigned char *dst, size_t rawlen) {
+  const unsigned char *dict = (const unsigned char *)db->dict;
+  size_t ip = 0, op = 0, lit, mlen, off, n;
+
+  for (;;) {
+    if (ip >= len) {
+      return (-1);
+    }
+    lit = src[ip] >> 4;
+    mlen = src[ip++] & 15;
+    if (lit == 15) {
+      do {
+        if (ip >= len) {
+          return (-1);
+        }
+        lit += src[ip];
+      } while (src[ip++] == 255);
+    }
+    if (lit > len - ip || lit > rawlen - op) {
+      return (-1);
+    }
+    memcpy(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == len) {
+      break; /* the last literals */
+    }
+
+    if (len - ip < 2) {
+      return (-1);
+    }
+    off = src[ip] | (size_t)src[ip + 1] << 8;
+    ip += 2;
+    if (mlen == 15) {
+      do {
+        if (ip >= len) {
+          return (-1);
+        }
+        mlen += src[ip];
+      } while (src[ip++] == 255);
+    }
+    mlen += PACK_MINMATCH;
+    if (off == 0 || off > op + db->dictlen || mlen > rawlen - op) {
+      return (-1);
+    }
+    if (off > op) {
+      /* Starts in the dictionary */
+      n = off - op < mlen ? off - op : mlen;
+      memcpy(dst + op, dict + db->dictlen - (off - op), n);
+      op += n;
+      mlen -= n;
+    }
+    if (mlen <= off) {
+      memcpy(dst + op, dst + op - off, mlen);
+      op += mlen;
+    } else {
+      for (; mlen > 0; mlen--, op++) {
+        dst[op] = dst[op - off]; /* overlaps itself: a repeat */
+      }
+    }
+  }
+  return (op == rawlen ? 0 : -1);
+} /* _db_lzunpack() */
+
+/**
+ * Make sure a malloc'ed buffer is big enough, keeping what it holds.
+ * @param bufp pointer to the buffer; NULL if not allocated yet.
+ * @param sizep pointer to its size.
+ * @param len bytes needed.
+ * @return the buffer.
+ */
+static char *_db_rawbuf(char **bufp, size_t *sizep, size_t len) {
+  char *buf;
+
+  if (len > *sizep) {
+    if (len < 2 * *sizep) {
+      len = 2 * *sizep;
+    }
+    if ((buf = realloc(*bufp, len)) == NULL) {
+      err_dump("_db_rawbuf(): realloc() error");
+    }
+    *bufp = buf;
+    *sizep = len;
+  }
+  return (*bufp);
+} /* _db_rawbuf() */
+
+/**
+ * Read the compression dictionary of the database, if it has one, and build
+ * the table of its positions that _db_lzpack() looks matches up in.  A
+ * dictionary read before is dropped first, since db_compact() may have put
+ * new files in place.
+ * @param db pointer to database structure.
+ * @return 0 if OK; -1 if the dictionary record is not valid.
+ */
+static int _db_dictload(DB *db) {
+  unsigned char rec[BIN_REC_SZ];
+  off_t off;
+  size_t len, i;
+
+  _db_dictfree(db);
+  if (!(db->features & F_PACKED)) {
+    return (0);
+  }
+  if (pread(db->idxfd, rec, 8, HDR_DICT) != 8) {
+    return (-1);
+  }
+  if ((off = _db_get64(rec)) == 0) {
+    return (0);
+  }
+  if (pread(db->idxfd, rec, BIN_REC_SZ, off) != BIN_REC_SZ ||
+      _db_get32(rec + REC_MAGIC) != BIN_REC_MAGIC ||
+      _db_get16(rec + REC_FLAGS) != REC_F_DICT ||
+      (len = _db_get32(rec + REC_DATLEN)) < PACK_MINMATCH ||
+      len > DB_DICTMAX || BIN_REC_SZ + len > _db_get32(rec + REC_LEN)) {
+    return (-1);
+  }
+  if ((db->dict = malloc(len)) == NULL ||
+      (db->dicttab = calloc((size_t)1 << DICT_HBITS, sizeof(uint32_t))) ==
+          NULL) {
+    err_dump("_db_dictload(): malloc() error");
+  }
+  if (pread(db->idxfd, db->dict, len, off + BIN_REC_SZ) != (ssize_t)len ||
+      _db_crc32c(0, db->dict, len) != _db_get32(rec + REC_DATSUM)) {
+    _db_dictfree(db);
+    return (-1);
+  }
+  db->dictlen = len;
+  for (i = 0; i + PACK_MINMATCH <= len; i++) {
+    db->dicttab[PACK_HASH(_db_get32((unsigned char *)db->dict + i),
+                          DICT_HBITS)] = i + 1;
+  }
+  return (0);
+} /* _db_dictload() */
+
+/**
+ * Free the compression dictionary of the database.
+ * @param db pointer to database structure.
+ */
+static void _db_dictfree(DB *db) {
+  free(db->dict);
+  free(db->dicttab);
+  db->dict = NULL;
+  db->dicttab = NULL;
+  db->dictlen = 0;
+} /* _db_dictfree() */
+
+/**
+ * Build a dictionary for DB_OPT_COMPRESS from samples of the data a database
+ * is going to hold.  The samples are cut into pieces of TRAIN_SEG bytes,
+ * starting every TRAIN_STEP bytes, and the pieces are taken best first: a
+ * piece scores the number of samples each of its strings of TRAIN_K bytes
+ * turns up in, counting only strings in more than one sample and not yet in a
+ * piece taken.  The best pieces go last, closest to the data that matches
+ * are copied from, so that their offsets are shortest.
+ * @param samples array of null-terminated samples.
+ * @param nsamples number of samples.
+ * @param dict buffer for the dictionary.
+ * @param size size of dict; no more than DB_DICTMAX bytes of it are used.
+ * @return length of the dictionary, at the start of dict; 0 if the samples
+ * have nothing in common.
+ */
+size_t db_traindict(const char *const samples[], long nsamples, char *dict,
+                    size_t size) {
+  const unsigned char **cptr;
+  uint32_t *count, *seen, h, score;
+  uint64_t *heap;
+  size_t *clen, len, pos, n, m;
+  long i, ncand, nheap;
+
+  if (size > DB_DICTMAX) {
+    size = DB_DICTMAX;
+  }
+  if ((count = calloc((size_t)1 << TRAIN_HBITS, sizeof(uint32_t))) == NULL ||
+      (seen = calloc((size_t)1 << TRAIN_HBITS, sizeof(uint32_t))) == NULL) {
+    err_dump("db_traindict(): calloc() error");
+  }
+
+  /* Count the samples each string turns up in, and the pieces */
+  for (i = 0, ncand = 0; i < nsamples; i++) {
+    len = strlen(samples[i]);
+    for (pos = 0; pos + TRAIN_K <= len; pos++) {
+      h = _db_trainhash((const unsigned char *)samples[i] + pos);
+      if (seen[h] != (uint32_t)i + 1) {
+        seen[h] = i + 1;
+        count[h]++;
+      }
+    }
+    if (len >= TRAIN_K) {
+      ncand += (len > TRAIN_SEG
+                    ? (len - TRAIN_SEG + TRAIN_STEP - 1) / TRAIN_STEP
+                    : 0) +
+               1;
+    }
+  }
+  free(seen);
+  if ((cptr = malloc(ncand * sizeof(cptr[0]) + 1)) == NULL ||
+      (clen = malloc(ncand * sizeof(clen[0]) + 1)) == NULL ||
+      (heap = malloc(ncand * sizeof(heap[0]) + 1)) == NULL) {
+    err_dump("db_traindict(): malloc() error");
+  }
+  for (i = 0, ncand = 0; i < nsamples; i++) {
+    len = strlen(samples[i]);
+    if (len < TRAIN_K) {
+      continue;
+    }
+    for (pos = 0; pos + TRAIN_SEG < len; pos += TRAIN_STEP) {
+      cptr[ncand] = (const unsigned char *)samples[i] + pos;
+      clen[ncand++] = TRAIN_SEG;
+    }
+    pos = len > TRAIN_SEG ? len - TRAIN_SEG : 0; /* the last piece */
+    cptr[ncand] = (const unsigned char *)samples[i] + pos;
+    clen[ncand++] = len - pos;
+  }
+
+  /*
+   * A max-heap of the pieces by score.  Scores only go down as pieces are
+   * taken, so the one on top is taken if its score is still what it was, and
+   * goes back down the heap with its new score otherwise.
+   */
+  for (i = 0, nheap = 0; i < ncand; i++) {
+    if ((score = _db_trainscore(count, cptr[i], clen[i])) > 0) {
+      heap[nheap++] = (uint64_t)score << 32 | i;
+    }
+  }
+  for (i = nheap / 2 - 1; i >= 0; i--) {
+    _db_trainheap(heap, nheap, i);
+  }
+  n = 0;
+  while (nheap > 0 && n < size) {
+    i = heap[0] & 0xffffffff;
+    score = _db_trainscore(count, cptr[i], clen[i]);
+    if (score != 0 && score < heap[0] >> 32) {
+      heap[0] = (uint64_t)score << 32 | i;
+      _db_trainheap(heap, nheap, 0);
+      continue;
+    }
+    heap[0] = heap[--nheap];
+    _db_trainheap(heap, nheap, 0);
+    if (score == 0) {
+      continue;
+    }
+    m = clen[i] < size - n ? clen[i] : size - n;
+    memcpy(dict + size - n - m, cptr[i], m);
+    n += m;
+    for (pos = 0; pos + TRAIN_K <= clen[i]; pos++) {
+      count[_db_trainhash(cptr[i] + pos)] = 0;
+    }
+  }
+  memmove(dict, dict + size - n, n);
+  free(count);
+  free(cptr);
+  free(clen);
+  free(heap);
+  return (n);
+} /* db_traindict() */
+
+/**
+ * Hash of a string of TRAIN_K (6) bytes for db_traindict().
+ * @param p the string.
+ * @return hash of TRAIN_HBITS bits.
+ */
+static uint32_t _db_trainhash(const unsigned char *p) {
+  uint64_t v;
+
+  v = _db_get32(p) | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40;
+  return ((v * 0x9e3779b97f4a7c15ULL) >> (64 - TRAIN_HBITS));
+} /* _db_trainhash() */
+
+/**
+ * Score of a piece of a sample for db_traindict().
+ * @param count the number of samples each string turns up in.
+ * @param p the piece.
+ * @param len its length.
+ * @return sum of the counts of its strings in more than one sample.
+ */
+static uint32_t _db_trainscore(const uint32_t *count, const unsigned char *p,
+                               size_t len) {
+  uint32_t score = 0, c;
+  size_t pos;
+
+  for (pos = 0; pos + TRAIN_K <= len; pos++) {
+    if ((c = count[_db_trainhash(p + pos)]) > 1) {
+      score += c;
+    }
+  }
+  return (score);
+} /* _db_trainscore() */
+
+/**
+ * Move an entry of the heap of db_traindict() down to its place.
+ * @param heap the heap, greatest first.
+ * @param n number of entries.
+ * @param i the entry.
+ */
+static void _db_trainheap(uint64_t *heap, long n, long i) {
+  uint64_t t;
+  long c;
+
+  if (i >= n) {
+    return;
+  }
+  t = heap[i];
+  while ((c = 2 * i + 1) < n) {
+    if (c + 1 < n && heap[c + 1] > heap[c]) {
+      c++;
+    }
+    if (heap[c] <= t) {
+      break;
+    }
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = t;
+} /* _db_trainheap() */
+
+/**
+ * Pick a random seed for the hash function of a new database, so that keys
+ * colliding in one database don't collide in another.
+ * @return random seed.
+ */
+static uint64_t _db_newseed(void) {
+  unsigned char buf[8];
+  uint64_t seed = 0;
+  int fd;
+
+  if ((fd = open("/dev/urandom", O_RDONLY)) >= 0) {
+    if (read(fd, buf, sizeof(buf)) == sizeof(buf)) {
+      seed = _db_get64(buf);
+    }
+    close(fd);
+  }
+  if (seed == 0) {
+    seed = ((uint64_t)time(NULL) << 32) ^ getpid();
+  }
+  return (seed);
+} /* _db_newseed() */
+
+/**
+ * Map a hash value to a bucket, using linear hashing.  With nbucket buckets,
+ * where nhash * 2^level <= nbucket < nhash * 2^(level+1), buckets below the
+ * split pointer (nbucket - nhash * 2^level) have already been split, and use
+ * one more bit of the hash value than those that haven't.  With a fixed size
+ * hash table this is just the remainder of dividing by nhash.
+ * @param db pointer to database structure.
+ * @param hval hash value from _db_hash().
+ * @return bucket number, 0 to db->nbucket - 1.
+ */
+static DBHASH _db_bucket(DB *db, DBHASH hval) {
+  DBHASH size, bucket;
+
+  for (size = db->nhash; size * 2 <= db->nbucket; size *= 2) {
+    ; /* size = nhash * 2^level */
+  }
+  bucket = hval % size;
+  if (bucket < db->nbucket - size) {
+    bucket = hval % (size * 2); /* bucket has been split */
+  }
+  return (bucket);
+} /* _db_bucket() */
+
+/**
+ * Calculate the offset in the index file of the chain ptr for a bucket.
+ * Buckets beyond the original hash table are in the hash table segments added
+ * by _db_split().
+ * @param db pointer to database structure.
+ * @param bucket bucket number.
+ * @return offset of the bucket's slot in the index file.
+ */
+static off_t _db_bucketoff(DB *db, DBHASH bucket) {
+  DBHASH size;
+  int k;
+
+  if (bucket < db->nhash) {
+    return (db->hashoff + bucket * db->slotsz);
+  }
+  for (k = 1, size = db->nhash; bucket >= size * 2; k++) {
+    size *= 2; /* segment k starts at bucket nhash * 2^(k-1) */
+  }
+  if (k >= BIN_NSEG) {
+    err_dump("_db_bucketoff(): invalid bucket");
+  }
+  if (db->segoff[k] == 0) {
+    _db_readsegs(db); /* segment added by another process */
+    if (db->segoff[k] == 0) {
+      err_dump("_db_bucketoff(): missing hash table segment");
+    }
+  }
+  return (db->segoff[k] + (bucket - size) * db->slotsz);
+} /* _db_bucketoff() */
+
+/**
+ * Read the current number of buckets from the binary index file header.
+ * @param db pointer to database structure.
+ * @return number of buckets.
+ */
+static DBHASH _db_readnbucket(DB *db) {
+  unsigned char buf[8];
+  const char *p;
+
+  if (db->mapped) {
+    if (_db_mapget(&db->idxmap, db->idxfd, HDR_NBUCKET, 8, &p) != 8) {
+      err_dump("_db_readnbucket(): header beyond end of index file");
+    }
+    return (_db_get64((const unsigned char *)p));
+  }
+  if (pread(db->idxfd, buf, 8, HDR_NBUCKET) != 8) {
+    err_dump("_db_readnbucket(): pread() error");
+  }
+  return (_db_get64(buf));
+} /* _db_readnbucket() */
+
+/**
+ * Add to the count of records kept in the binary index file header when the
+ * hash table can grow.  Called by db_store(), db_delete() and db_commit().
+ * @param db pointer to database structure.
+ * @param delta number of records added; negative for records deleted.
+ * @return new number of records.
+ */
+static uint64_t _db_addnrec(DB *db, long delta) {
+  unsigned char buf[8];
+  uint64_t nrec;
+
+  if (_db_writew_lock(db, db->idxfd, LCK_NREC, 1) < 0) {
+    err_dump("_db_addnrec(): writew_lock() error");
+  }
+  if (pread(db->idxfd, buf, 8, HDR_NREC) != 8) {
+    err_dump("_db_addnrec(): pread() error");
+  }
+  nrec = _db_get64(buf) + delta;
+  _db_put64(buf, nrec);
+  if (_db_pwrite(db, db->idxfd, buf, 8, HDR_NREC) != 8) {
+    err_dump("_db_addnrec(): pwrite() error");
+  }
+  if (_db_un_lock(db, db->idxfd, LCK_NREC, 1) < 0) {
+    err_dump("_db_addnrec(): un_lock() error");
+  }
+  return (nrec);
+} /* _db_addnrec() */
+
+/**
+ * Split the next bucket in linear hashing order, if the average chain length
+ * still exceeds maxload.  The records on the chain of bucket s are divided
+ * between bucket s and the new bucket nbucket, using one more bit of their
+ * hash values.  Only bucket s is locked while this is done, so the rest of the
+ * database stays available.  Processes that looked up the number of buckets
+ * before the split and are waiting for the lock on bucket s find, in
+ * _db_find_and_lock(), that the number has changed, and move on to the new
+ * bucket if their key now maps there.  Called by db_store() without any locks
+ * held.
+ * @param db pointer to database structure.
+ */
+static void _db_split(DB *db) {
+  unsigned char buf[8];
+  DBHASH size, s, n, nb;
+  off_t offset, cur, segoff, soff, noff, *keep, *move;
+  size_t nkeep, nmove, max, i, seglen, extlen;
+  unsigned char *seg;
+  int reused;
+
+  /*
+   * Only one process splits at a time, and it must look at the number of
+   * records and buckets again, now that it holds the split lock.
+   */
+  if (_db_writew_lock(db, db->idxfd, LCK_SPLIT, 1) < 0) {
+    err_dump("_db_split(): writew_lock() error");
+  }
+  if (pread(db->idxfd, buf, 8, HDR_NREC) != 8) {
+    err_dump("_db_split(): pread() error");
+  }
+  db->nbucket = nb = _db_readnbucket(db);
+  if (_db_get64(buf) <= (uint64_t)db->maxload * nb) {
+    goto doreturn; /* someone else has already split */
+  }
+  for (size = db->nhash; size * 2 <= nb; size *= 2) {
+    ; /* size = nhash * 2^level */
+  }
+  s = nb - size; /* bucket to split */
+  n = nb;        /* new bucket */
+
+  if (n == size) {
+    /*
+     * The new bucket is the first of a new hash table segment, of size
+     * buckets.  Append the segment to the index file, as a record without a
+     * key so that db_nextrec() can skip it, and record its offset in the
+     * header.  Give up splitting if the segment doesn't fit in a record.
+     */
+    for (i = 1; (db->nhash << (i - 1)) != size; i++) {
+      ;
+    }
+    seglen = BIN_REC_SZ + size * BIN_SLOT_SZ;
+    if (i >= BIN_NSEG || _db_extsize(seglen) > UINT32_MAX) {
+      goto doreturn;
+    }
+    if ((seg = calloc(1, seglen)) == NULL) {
+      err_dump("_db_split(): calloc() error");
+    }
+    _db_put32(seg + REC_MAGIC, BIN_REC_MAGIC);
+    _db_put32(seg + REC_LEN, seglen);
+    _db_put16(seg + REC_FLAGS, REC_F_SEGMENT);
+    if (db->features & F_ALLOC) {
+      /*
+       * The segment is an extent like any other index record, and may reuse
+       * free space.  Its slots must be zeroed, whatever was there before.
+       */
+      extlen = _db_extsize(seglen);
+      if (_db_writew_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+        err_dump("_db_split(): writew_lock() error");
+      }
+      segoff = _db_extalloc(db, HEAP_IDX, &extlen, &reused);
+      if (_db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+        err_dump("_db_split(): un_lock() error");
+      }
+      _db_put32(seg + REC_LEN, extlen);
+      if (_db_pwrite(db, db->idxfd, seg, seglen, segoff) != seglen) {
+        err_dump("_db_split(): pwrite() error of hash table segment");
+      }
+    } else {
+      if (_db_writew_lock(db, db->idxfd, LCK_APPEND, 1) < 0) {
+        err_dump("_db_split(): writew_lock() error");
+      }
+      if ((segoff = lseek(db->idxfd, 0, SEEK_END)) == -1) {
+        err_dump("_db_split(): lseek() error");
+      }
+      if (_db_pwrite(db, db->idxfd, seg, seglen, segoff) != seglen) {
+        err_dump("_db_split(): pwrite() error of hash table segment");
+      }
+      if (_db_un_lock(db, db->idxfd, LCK_APPEND, 1) < 0) {
+        err_dump("_db_split(): un_lock() error");
+      }
+    }
+    free(seg);
+    db->segoff[i] = segoff + BIN_REC_SZ;
+    _db_put64(buf, db->segoff[i]);
+    if (_db_pwrite(db, db->idxfd, buf, 8, HDR_SEGOFF + i * 8) != 8) {
+      err_dump("_db_split(): pwrite() error of segment offset");
+    }
+  }
+
+  soff = _db_bucketoff(db, s);
+  if (_db_writew_lock(db, db->idxfd, soff, 1) < 0) {
+    err_dump("_db_split(): writew_lock() error");
+  }
+
+  /*
+   * Divide the chain of bucket s, keeping the order of the records on each
+   * of the two chains.
+   */
+  max = 64;
+  nkeep = nmove = 0;
+  if ((keep = malloc(max * sizeof(off_t))) == NULL ||
+      (move = malloc(max * sizeof(off_t))) == NULL) {
+    err_dump("_db_split(): malloc() error");
+  }
+  for (offset = _db_readptr(db, soff); offset != 0;) {
+    if (nkeep == max || nmove == max) {
+      max *= 2;
+      if ((keep = realloc(keep, max * sizeof(off_t))) == NULL ||
+          (move = realloc(move, max * sizeof(off_t))) == NULL) {
+        err_dump("_db_split(): realloc() error");
+      }
+    }
+    cur = offset;
+    offset = _db_readidx(db, offset);
+    if (db->bad) {
+      break;
+    }
+    if (_db_hash(db, db->idxbuf) % (size * 2) == n) {
+      move[nmove++] = cur;
+    } else {
+      keep[nkeep++] = cur;
+    }
+  }
+
+  /*
+   * A chain with a bad record on it can't be divided; the hash table stops
+   * growing here.
+   */
+  if (db->bad) {
+    free(keep);
+    free(move);
+    if (_db_un_lock(db, db->idxfd, soff, 1) < 0) {
+      err_dump("_db_split(): un_lock() error");
+    }
+    goto doreturn;
+  }
+
+  /*
+   * Link the new chain first, then unlink the moved records from the old
+   * chain, and finally make the new bucket visible.
+   */
+  noff = _db_bucketoff(db, n);
+  for (i = 0; i < nmove; i++) {
+    _db_writeptr(db, move[i] + REC_PTR, i + 1 < nmove ? move[i + 1] : 0);
+  }
+  _db_writeptr(db, noff, nmove > 0 ? move[0] : 0);
+  if (nmove > 0) {
+    for (i = 0; i < nkeep; i++) {
+      _db_writeptr(db, keep[i] + REC_PTR, i + 1 < nkeep ? keep[i + 1] : 0);
+    }
+    _db_writeptr(db, soff, nkeep > 0 ? keep[0] : 0);
+    _db_bloomput(db, s, soff, NULL, BLM_BUILD);
+    _db_chaingen(db, soff);
+    if (db->blmfd >= 0) {
+      _db_bloomput(db, n, noff, NULL, BLM_BUILD); /* for generation 1 */
+      _db_chaingen(db, noff);
+    }
+  }
+  db->nbucket = nb + 1;
+  _db_put64(buf, db->nbucket);
+  if (_db_pwrite(db, db->idxfd, buf, 8, HDR_NBUCKET) != 8) {
+    err_dump("_db_split(): pwrite() error of number of buckets");
+  }
+  free(keep);
+  free(move);
+
+  if (_db_un_lock(db, db->idxfd, soff, 1) < 0) {
+    err_dump("_db_split(): un_lock() error");
+  }
+doreturn:
+  if (_db_un_lock(db, db->idxfd, LCK_SPLIT, 1) < 0) {
+    err_dump("_db_split(): un_lock() error");
+  }
+} /* _db_split() */
+
+/**
+ * Get a pointer to len bytes at offset in a mapped database file.  The file is
+ * mapped on first use, and remapped when a read goes past the end of the file
+ * as it was last seen and the file has since grown, e.g. because another
+ * process has appended records.  Callers must hold the appropriate record
+ * locks, exactly as for read(2).  The file must never shrink while mapped.
+ * @param map mapping of the index or data file.
+ * @param fd file descriptor of the mapped file.
+ * @param offset of first byte wanted.
+ * @param len number of bytes wanted.
+ * @param pp set to point to the bytes in the mapping.
+ * @return number of bytes available at *pp: len, or less at the end of the
+ * file; 0 if offset is at or beyond the end of the file.
+ */
+static size_t _db_mapget(DBMAP *map, int fd, off_t offset, size_t len,
+                         const char **pp) {
+  struct stat statbuff;
+  size_t maplen;
+  void *addr;
+
+  if (offset + len > map->size) {
+    if (fstat(fd, &statbuff) < 0) {
+      err_dump("_db_mapget(): fstat() error");
+    }
+    map->size = statbuff.st_size;
+    if (map->size > map->maplen) {
+      /*
+       * Leave room to grow, so appends by other processes don't force a
+       * remap on every read.
+       */
+      maplen = (map->size / MAP_CHUNK + 2) * MAP_CHUNK;
+      if ((addr = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, 0)) ==
+          MAP_FAILED) {
+        err_dump("_db_mapget(): mmap() error");
+      }
+      if (map->addr != NULL && map->pins > 0) {
+        /*
+         * Views still point into the old mapping, so keep it until they
+         * have all been released.
+         */
+        if ((map->old = realloc(map->old, (map->nold + 1) * sizeof(char *))) ==
+                NULL ||
+            (map->oldlen = realloc(map->oldlen,
+                                   (map->nold + 1) * sizeof(size_t))) == NULL) {
+          err_dump("_db_mapget(): realloc() error");
+        }
+        map->old[map->nold] = map->addr;
+        map->oldlen[map->nold++] = map->maplen;
+      } else if (map->addr != NULL) {
+        munmap(map->addr, map->maplen);
+      }
+      map->addr = addr;
+      map->maplen = maplen;
+    }
+  }
+  if (offset >= map->size) {
+    return (0);
+  }
+  *pp = map->addr + offset;
+  return (offset + len > map->size ? map->size - offset : len);
+} /* _db_mapget() */
+
+/**
+ * Drop a mapping, and the earlier mappings kept for views, if any.
+ * @param map mapping of the index or data file.
+ */
+static void _db_unmap(DBMAP *map) {
+  int i;
+
+  if (map->addr != NULL) {
+    munmap(map->addr, map->maplen);
+  }
+  for (i = 0; i < map->nold; i++) {
+    munmap(map->old[i], map->oldlen[i]);
+  }
+  if (map->old != NULL) {
+    free(map->old);
+  }
+  if (map->oldlen != NULL) {
+    free(map->oldlen);
+  }
+  memset(map, 0, sizeof(DBMAP));
+} /* _db_unmap() */
+
+/**
+ * Read a chain ptr field from anywhere in the index file: the free list
+ * pointer, a hash table chain ptr, or an index record chain ptr.  This function
+ * does not perform any locking of the database files.
+ * @param db pointer to database structure.
+ * @param offset pointer offset to start reading from.
+ * @return pointer read at the given offset, on success; core dump on failure.
+ */
+static off_t _db_readptr(DB *db, off_t offset) {
+  char asciiptr[PTR_SZ + 1];
+  unsigned char binptr[8];
+  const char *p;
+
+  if (db->format == DB_FMT_BINARY) {
+    if (db->mapped) {
+      if (_db_mapget(&db->idxmap, db->idxfd, offset, 8, &p) != 8) {
+        err_dump("_db_readptr(): ptr field beyond end of index file");
+      }
+      return ((off_t)_db_get64((const unsigned char *)p));
+    }
+    if (pread(db->idxfd, binptr, 8, offset) != 8) {
+      err_dump("_db_readptr(): pread() error of ptr field");
+    }
+    return ((off_t)_db_get64(binptr));
+  }
+  if (db->mapped) {
+    if (_db_mapget(&db->idxmap, db->idxfd, offset, PTR_SZ, &p) != PTR_SZ) {
+      err_dump("_db_readptr(): ptr field beyond end of index file");
+    }
+    memcpy(asciiptr, p, PTR_SZ);
+  } else if (pread(db->idxfd, asciiptr, PTR_SZ, offset) != PTR_SZ) {
+    err_dump("_db_readptr(): pread() error of ptr field");
+  }
+  asciiptr[PTR_SZ] = 0; /* null terminate */
+  return (atol(asciiptr));
+} /* _db_readptr() */
+
+/**
+ * Read the next index record, starting at the specified offset in the index
+ * file.  Read the index record into db->idxbuf and replace the separators with
+ * null bytes.  On success, set db->datoff and db->datlen to the offset and
+ * length of the corresponding data record in the data file.  A record that
+ * can't be read or isn't well formed sets db->bad to the error, EBADMSG unless
+ * the read itself failed, and ends the chain: db->idxbuf is left empty, so no
+ * key matches it.  db->bad is cleared when a record is read.
+ * @param db pointer to database structure.
+ * @param offset in the index file; 0 for the next sequential record.
+ * @return offset of the next record in the chain; 0 after a bad record; -1 on
+ * EOF, or after a bad record, for db_nextrec().
+ */
+static off_t _db_readidx(DB *db, off_t offset) {
+  ssize_t i;
+  char *ptr1, *ptr2;
+  char asciiptr[PTR_SZ + 1], asciilen[IDXLEN_SZ + 1];
+  struct iovec iov[2];
+  const char *p;
+  int scan = (offset == 0);
+
+  if (db->format == DB_FMT_BINARY) {
+    return (_db_readidx_bin(db, offset));
+  }
+  db->bad = 0;
+
+  /*
+   * db_nextrec() calls this function with offset == 0, meaning read the next
+   * record, at db->scanoff.  Since an index record will never be stored at
+   * offset 0 in the index file, the offset value 0 can be safely overloaded.
+   * The file offset isn't used, so that the reads of a handle don't depend on
+   * each other.
+   */
+  db->idxoff = (scan ? db->scanoff : offset);
+  db->idxlen = 0;
+  if (db->mapped) {
+    i = _db_mapget(&db->idxmap, db->idxfd, db->idxoff, PTR_SZ + IDXLEN_SZ, &p);
+    if (i != PTR_SZ + IDXLEN_SZ) {
+      if (i == 0 && scan) {
+        return (-1); /* EOF for db_nextrec() */
+      }
+      return (_db_badidx(db, scan, EBADMSG));
+    }
+    memcpy(asciiptr, p, PTR_SZ);
+    memcpy(asciilen, p + PTR_SZ, IDXLEN_SZ);
+  } else {
+    /*
+     * Read the ascii chain ptr and the ascii length at the front of the index
+     * record.  This provides the remaining size of the index record.
+     */
+    iov[0].iov_base = asciiptr;
+    iov[0].iov_len = PTR_SZ;
+    iov[1].iov_base = asciilen;
+    iov[1].iov_len = IDXLEN_SZ;
+    if ((i = preadv(db->idxfd, &iov[0], 2, db->idxoff)) !=
+        PTR_SZ + IDXLEN_SZ) {
+      if (i == 0 && scan) {
+        return (-1); /* EOF for db_nextrec() */
+      }
+      return (_db_badidx(db, scan, i < 0 ? errno : EBADMSG));
+    }
+  }
+
+  /*
+   * Return value; always >= 0
+   */
+  asciiptr[PTR_SZ] = 0;        /* null terminate */
+  db->ptrval = atol(asciiptr); /* offset of next key in chain */
+
+  asciilen[IDXLEN_SZ] = 0; /* null terminate */
+  if ((db->idxlen = atoi(asciilen)) < IDXLEN_MIN || db->idxlen > IDXLEN_MAX) {
+    db->idxlen = 0;
+    return (_db_badidx(db, scan, EBADMSG)); /* invalid length */
+  }
+
+  /*
+   * Now read the actual index record.  Read it into the key buffer that was
+   * malloced when the database was opened.
+   */
+  if (db->mapped) {
+    if (_db_mapget(&db->idxmap, db->idxfd, db->idxoff + PTR_SZ + IDXLEN_SZ,
+                   db->idxlen, &p) != db->idxlen) {
+      return (_db_badidx(db, scan, EBADMSG));
+    }
+    memcpy(db->idxbuf, p, db->idxlen);
+  } else if ((i = pread(db->idxfd, db->idxbuf, db->idxlen,
+                        db->idxoff + PTR_SZ + IDXLEN_SZ)) != db->idxlen) {
+    return (_db_badidx(db, scan, i < 0 ? errno : EBADMSG));
+  }
+  if (scan) {
+    db->scanoff = db->idxoff + PTR_SZ + IDXLEN_SZ + db->idxlen;
+  }
+  db->cnt_idxbytes += PTR_SZ + IDXLEN_SZ + db->idxlen;
+  if (db->idxbuf[db->idxlen - 1] != NEWLINE) { /* sanity check */
+    return (_db_badidx(db, scan, EBADMSG));
+  }
+  db->idxbuf[db->idxlen - 1] = 0; /* replace newline with null */
+
+  /*
+   * Find the separators in the index record.  Separate the index record into
+   * three fields:
+   *   1. key
+   *   2. offset of the corresponding data record.
+   *   3. length of the data record.
+   * The strchr() function finds the first occurrence of the specified character
+   * in the given string.  Here we look for the character that separates fields
+   * in the record (SEP, which is defined to be a colon).  A record with a
+   * separator missing, or one too many, is bad.
+   */
+  if ((ptr1 = strchr(db->idxbuf, SEP)) == NULL ||
+      (ptr2 = strchr(ptr1 + 1, SEP)) == NULL || strchr(ptr2 + 1, SEP) != NULL) {
+    return (_db_badidx(db, scan, EBADMSG));
+  }
+  *ptr1++ = 0; /* replace SEP with null */
+  *ptr2++ = 0; /* replace SEP with null */
+
+  /*
+   * Get the starting offset and length of the data record.
+   */
+  if ((db->datoff = atol(ptr1)) < 0 || (db->datlen = atol(ptr2)) <= 0 ||
+      db->datlen > DATLEN_MAX) {
+    return (_db_badidx(db, scan, EBADMSG));
+  }
+  return (db->ptrval); /* return offset of next key in chain */
+} /* _db_readidx() */
+
+/**
+ * Binary format version of _db_readidx().  The record header and the key are
+ * read with a single pread(), and no parsing is needed.  Offset 0 means read
+ * the record at db->scanoff, which db_nextrec() uses to step through the file.
+ * With F_CHECKSUM, the checksum of the record is checked, and its data record
+ * checksum is left in db->datsum.
+ * @param db pointer to database structure.
+ * @param offset in the index file; 0 for the next sequential record.
+ * @return offset of the next record in the chain; 0 after a bad record; -1 on
+ * EOF, or after a bad record, for db_nextrec().
+ */
+static off_t _db_readidx_bin(DB *db, off_t offset) {
+  ssize_t n;
+  size_t keylen, reclen;
+  int scan = (offset == 0);
+  unsigned char buf[BIN_REC_SZ + IDXLEN_MAX];
+  const unsigned char *rec;
+
+  db->bad = 0;
+  if (scan) {
+    offset = db->scanoff;
+  }
+
+again:
+  db->idxoff = offset;
+  db->idxlen = 0;
+
+  /*
+   * Read the record header and, speculatively, as much of the key as fits in
+   * the buffer.  Keys are short, so the whole record is read in one go.  When
+   * the index file is mapped, the record is decoded in place.
+   */
+  if (db->mapped) {
+    n = _db_mapget(&db->idxmap, db->idxfd, offset, sizeof(buf),
+                   (const char **)&rec);
+  } else {
+    n = pread(db->idxfd, buf, sizeof(buf), offset);
+    rec = buf;
+  }
+  if (n < BIN_REC_SZ) {
+    if (n == 0 && scan) {
+      return (-1); /* EOF for db_nextrec() */
+    }
+    return (_db_badidx(db, scan, n < 0 ? errno : EBADMSG));
+  }
+  reclen = _db_get32(rec + REC_LEN);
+  if (scan && _db_get32(rec + REC_MAGIC) == EXT_FREE_MAGIC &&
+      reclen >= EXT_MIN) {
+    offset += reclen; /* db_nextrec() skips free extents */
+    goto again;
+  }
+  if (_db_get32(rec + REC_MAGIC) != BIN_REC_MAGIC) { /* sanity check */
+    return (_db_badidx(db, scan, EBADMSG));
+  }
+  keylen = _db_get16(rec + REC_KEYLEN);
+  if (scan && reclen >= BIN_REC_SZ &&
+      ((_db_get16(rec + REC_FLAGS) & (REC_F_SEGMENT | REC_F_TREE)) ||
+       keylen == 0 ||
+       ((db->features & F_SNAPSHOT) && !_db_visible(rec, 0)))) {
+    /*
+     * db_nextrec() skips hash table segments, nodes of the ordered index,
+     * index records that have been allocated but not written yet, and dead
+     * records kept for snapshots.
+     */
+    offset += reclen;
+    goto again;
+  }
+  db->idxlen = reclen; /* so that db_nextrec() can step over a bad record */
+  if (keylen == 0 || keylen >= IDXLEN_MAX || reclen < BIN_REC_SZ + keylen ||
+      n < BIN_REC_SZ + keylen) {
+    return (_db_badidx(db, scan, EBADMSG)); /* invalid length */
+  }
+  if ((db->features & F_CHECKSUM) &&
+      _db_get32(rec + REC_SUM) != _db_recsum(rec, keylen)) {
+    return (_db_badidx(db, scan, EBADMSG));
+  }
+  db->ptrval = _db_get64(rec + REC_PTR);
+  db->datsum = _db_get32(rec + REC_DATSUM);
+  if ((db->datoff = _db_get64(rec + REC_DATOFF)) < 0 ||
+      (db->datlen = _db_get32(rec + REC_DATLEN)) <= 0 ||
+      db->datlen > DATLEN(db)) {
+    return (_db_badidx(db, scan, EBADMSG));
+  }
+  db->rawlen = 0;
+  if (_db_get16(rec + REC_FLAGS) & REC_F_PACKED) {
+    db->rawlen = _db_get32(rec + REC_RAWLEN);
+    if (!(db->features & F_PACKED) || db->rawlen < DATLEN_MIN ||
+        db->rawlen > DATLEN(db)) {
+      return (_db_badidx(db, scan, EBADMSG));
+    }
+  }
+  memcpy(db->idxbuf, rec + BIN_REC_SZ, keylen);
+  db->idxbuf[keylen] = 0;
+  db->cnt_idxbytes += reclen;
+
+  if (scan) {
+    db->scanoff = offset + reclen;
+  }
+  return (db->ptrval); /* return offset of next key in chain */
+} /* _db_readidx_bin() */
+
+/**
+ * Give up on the index record at db->idxoff: set db->bad and leave nothing in
+ * db->idxbuf.  db_nextrec() goes on after the record if its length is known,
+ * or else at the end of the file, since there's no telling where the next
+ * record starts.
+ * @param db pointer to database structure.
+ * @param scan nonzero if reading for db_nextrec().
+ * @param err errno for the caller.
+ * @return what _db_readidx() returns: -1 for db_nextrec(), or else 0.
+ */
+static off_t _db_badidx(DB *db, int scan, int err) {
+  off_t end;
+
+  db->bad = err;
+  db->idxbuf[0] = 0;
+  db->ptrval = 0;
+  db->datlen = 0;
+  db->rawlen = 0;
+  if (!scan) {
+    return (0);
+  }
+  if (db->format == DB_FMT_ASCII && db->idxlen != 0) {
+    db->scanoff = db->idxoff + PTR_SZ + IDXLEN_SZ + db->idxlen;
+  } else if (db->format == DB_FMT_BINARY && db->idxlen >= BIN_REC_SZ &&
+             (!(db->features & F_ALLOC) || db->idxlen % EXT_ALIGN == 0)) {
+    db->scanoff = db->idxoff + db->idxlen;
+  } else if ((end = lseek(db->idxfd, 0, SEEK_END)) > db->scanoff) {
+    db->scanoff = end;
+  }
+  return (-1);
+} /* _db_badidx() */
+
+/**
+ * Read the current data record into the data buffer.  Return a pointer to the
+ * null-terminated data buffer.
+ * @param db pointer to database structure.
+ * @return pointer to the null-terminated data buffer; NULL with db->bad set if
+ * the record is bad.
+ */
+static char *_db_readdat(DB *db) {
+  return (_db_readdatinto(db, _db_datbuf(db, RAWLEN(db) + 1)));
+} /* _db_readdat() */
+
+/**
+ * Read the current data record into a buffer, and null-terminate it.  The
+ * record must end with a newline and, with F_CHECKSUM, match db->datsum.  A
+ * packed record (REC_F_PACKED) is read into db->packbuf, or looked at in the
+ * mapping, and unpacked into the buffer.
+ * @param db pointer to database structure.
+ * @param buf buffer of at least RAWLEN(db) bytes.
+ * @return buf; NULL with db->bad set if the record can't be read or is bad.
+ */
+static char *_db_readdatinto(DB *db, char *buf) {
+  return (_db_readdatfrom(db, db->mapped ? -1 : db->datfd, buf));
+} /* _db_readdatinto() */
+
+/**
+ * Read the current data record into a buffer from a data file, as
+ * _db_readdatinto() does.
+ * @param db pointer to database structure.
+ * @param fd descriptor of the data file; -1 for the mapping of db->datfd.
+ * @param buf buffer of at least RAWLEN(db) bytes.
+ * @return buf; NULL with db->bad set if the record can't be read or is bad.
+ */
+static char *_db_readdatfrom(DB *db, int fd, char *buf) {
+  const char *p;
+  char *rec;
+  ssize_t n;
+
+  if (fd < 0) {
+    if (_db_mapget(&db->datmap, db->datfd, db->datoff, db->datlen, &p) !=
+        db->datlen) {
+      db->bad = EBADMSG; /* data record beyond end of data file */
+      return (NULL);
+    }
+    if (db->rawlen == 0) {
+      memcpy(buf, p, db->datlen);
+      p = buf;
+    }
+  } else {
+    rec = (db->rawlen != 0 ? _db_rawbuf(&db->packbuf, &db->packsize,
+                                        db->datlen)
+                           : buf);
+    if ((n = pread(fd, rec, db->datlen, db->datoff)) != db->datlen) {
+      db->bad = (n < 0 ? errno : EBADMSG);
+      return (NULL);
+    }
+    p = rec;
+  }
+  db->cnt_datbytes += db->datlen;
+  if (p[db->datlen - 1] != NEWLINE || /* sanity check */
+      ((db->features & F_CHECKSUM) &&
+       _db_crc32c(0, p, db->datlen) != db->datsum)) {
+    db->bad = EBADMSG;
+    return (NULL);
+  }
+  if (db->rawlen != 0) {
+    return (_db_unpack(db, p, buf));
+  }
+  buf[db->datlen - 1] = 0; /* replace newline with null */
+  return (buf);            /* return pointer to data record */
+} /* _db_readdatfrom() */
+
+/**
+ * Read part of the current data record into a buffer.  The part isn't checked
+ * against the checksum of the record, unless the record is packed: then the
+ * whole of it is read and unpacked, into the data buffer.
+ * @param db pointer to database structure.
+ * @param buf buffer for the bytes.
+ * @param nbytes number of bytes to read, all within the data record.
+ * @param offset offset of the first byte in the data record.
+ * @return 0 if OK; -1 with db->bad set if the bytes can't be read.
+ */
+static int _db_readpart(DB *db, char *buf, size_t nbytes, off_t offset) {
+  const char *p;
+  ssize_t n;
+
+  if (db->rawlen != 0) {
+    if ((p = _db_readdat(db)) == NULL) {
+      return (-1);
+    }
+    memcpy(buf, p + offset, nbytes);
+    return (0);
+  }
+  if (db->mapped) {
+    if (_db_mapget(&db->datmap, db->datfd, db->datoff + offset, nbytes, &p) !=
+        nbytes) {
+      db->bad = EBADMSG; /* data record beyond end of data file */
+      return (-1);
+    }
+    memcpy(buf, p, nbytes);
+  } else if ((n = pread(db->datfd, buf, nbytes, db->datoff + offset)) !=
+             nbytes) {
+    db->bad = (n < 0 ? errno : EBADMSG);
+    return (-1);
+  }
+  db->cnt_datbytes += nbytes;
+  return (0);
+} /* _db_readpart() */
+
+/**
+ * Make sure the data buffer can hold len bytes.  It only ever grows, so that
+ * records longer than DATLEN_MAX don't cost a malloc() each time they're read.
+ * @param db pointer to database structure.
+ * @param len bytes needed.
+ * @return pointer to the data buffer.
+ */
+static char *_db_datbuf(DB *db, size_t len) {
+  char *p;
+
+  if (len > db->datbufsize) {
+    if ((p = realloc(db->datbuf, len)) == NULL) {
+      err_dump("_db_datbuf(): realloc() error");
+    }
+    db->datbuf = p;
+    db->datbufsize = len;
+  }
+  return (db->datbuf);
+} /* _db_datbuf() */
+
+/**
+ * Delete the specified record.
+ * @param h database handle.
+ * @param key pointer to null-terminated key.
+ * @return 0 on success if record is found; -1 with errno set to ENOENT if
+ * record not found, to EBUSY if the handle holds mapped views from
+ * db_fetch_view(), or as for db_fetch() if a bad record on the chain kept the
+ * key from being looked for.
+ */
+int db_delete(DBHANDLE h, const char *key) {
+  DB *db = _db_cursor(h);
+  uint64_t start;
+  int rc = 0; /* assume record will be found */
+
+  if (db->inbatch) {
+    return (_db_stageop(db, key, NULL, 0));
+  }
+  if (db->datmap.pins > 0) {
+    errno = EBUSY;
+    return (-1);
+  }
+  start = _db_now();
+  _db_opbegin(db);
+
+  /* Determine whether the record exists in the database; request write lock */
+  if (_db_find_and_lock(db, key, 1) == 0) {
+    _db_dodelete(db); /* delete record */
+    _db_bloomput(db, db->bucket, db->chainoff, key, BLM_DEL);
+    _db_chaingen(db, db->chainoff);
+    if (db->features & F_ORDERED) {
+      _db_treeput(db, key, 0, 0);
+    }
+    _db_chgadd(db, CHG_DEL, key, NULL);
+    _db_chgflush(db);
+    db->cnt_delok++;
+    if (db->maxload != 0) {
+      _db_addnrec(db, -1);
+    }
+  } else {
+    rc = -1; /* record not found, or a bad record on the chain */
+    db->cnt_delerr++;
+  }
+  /* _db_find_and_lock() returns with lock still held; must release lock */
+  if (_db_un_lock(db, db->idxfd, db->chainoff, 1) < 0) {
+    err_dump("db_delete(): un_lock() error");
+  }
+  _db_opend(db);
+  _db_lat(&db->latdelete, start);
+  if (rc < 0) {
+    errno = (db->bad ? db->bad : ENOENT);
+  }
+  return (rc);
+} /* db_delete() */
+
+/**
+ * Delete the current record specified by the DB structure.  This function is
+ * called by db_delete() and db_store(), after the record has been located by
+ * _db_find_and_lock().
+ * @param db pointer to database structure.
+ */
+static void _db_dodelete(DB *db) {
+  int i;
+  char *ptr;
+  off_t freeptr, saveptr;
+
+  if (db->features & F_ALLOC) {
+    /*
+     * Unlink the index record from its hash chain, and give both extents back
+     * to the free space manager, or retire them while a snapshot may see
+     * them.  This is done with the free list locked, so that db_nextrec()
+     * never sees a record that is off its chain.
+     */
+    if (_db_writew_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+      err_dump("_db_dodelete(): writew_lock() error");
+    }
+    _db_writeptr(db, db->ptroff, db->ptrval);
+    if (db->cow) {
+      _db_retire(db, HEAP_IDX, db->idxoff);
+      _db_retire(db, HEAP_DAT, db->datoff - EXT_HDR_SZ);
+    } else {
+      _db_extfree(db, HEAP_IDX, db->idxoff);
+      _db_extfree(db, HEAP_DAT, db->datoff - EXT_HDR_SZ);
+    }
+    if (_db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+      err_dump("_db_dodelete(): un_lock() error");
+    }
+    return;
+  }
+
+  /*
+   * Set data buffer and key to all blanks.
+   */
+  for (ptr = db->datbuf, i = 0; i < db->datlen - 1; i++) {
+    *ptr++ = SPACE;
+  }
+  *ptr = 0; /* null terminate for _db_writedat() */
+  ptr = db->idxbuf;
+  while (*ptr) {
+    *ptr++ = SPACE;
+  }
+
+  /*
+   * Have to write lock the free list to prevent two processes that are deleting
+   * records at the same time, on two different hash chains, from interfering
+   * with each other.  Since the deleted record is added to the free list, which
+   * changes the free-list pointer, only one process at a time can be doing
+   * this.
+   */
+  if (_db_writew_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_dodelete(): writew_lock() error");
+  }
+
+  /*
+   * Write the data record with all blanks.  No need for _db_writedat() to lock
+   * the data file in this case, since db_delete() has write locked the hash
+   * chain for this record, therefore, no other process is reading or writing
+   * this particular data record.
+   */
+  _db_writedat(db, db->datbuf, db->datlen, db->datoff, SEEK_SET);
+
+  /*
+   * Read the free list pointer.  Its value becomes the chain ptr field of the
+   * deleted index record.  This means the deleted record becomes the head of
+   * the free list.
+   */
+  freeptr = _db_readptr(db, db->freeoff);
+
+  /*
+   * Save the contents of index record chain pointer, before it's rewritten by
+   * _db_writeidx().
+   */
+  saveptr = db->ptrval;
+
+  /*
+   * Rewrite the index record.  This also rewrites the length of the index
+   * record, the data offset, and the data length, none of which has changed,
+   * but that's OK.
+   */
+  _db_writeidx(db, db->idxbuf, db->idxoff, SEEK_SET, freeptr);
+
+  /*
+   * Write the new free list pointer.
+   */
+  _db_writeptr(db, db->freeoff, db->idxoff);
+
+  /*
+   * Rewrite the chain ptr that pointed to this record being deleted.
+   * _db_find_and_lock() sets db->ptroff to point to this chain ptr.  Set this
+   * chain ptr to the contents of the deleted record's chain ptr, saveptr.
+   */
+  _db_writeptr(db, db->ptroff, saveptr);
+  if (_db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_dodelete(): un_lock() error");
+  }
+}
+
+/**
+ * Write a data record, and set db->datsum to its checksum (F_CHECKSUM).  Called
+ * by _db_dodelete() (to write the record with blanks) and db_store().
+ * @param db pointer to database structure.
+ * @param data pointer to data to be written to db, packed (F_PACKED) or not.
+ * @param len length of the data record, including the newline written after
+ * the data.
+ * @param offset of data record to be written.
+ * @param whence flag controls append if set to SEEK_END.
+ */
+static void _db_writedat(DB *db, const char *data, size_t len, off_t offset,
+                         int whence) {
+  struct iovec iov[2];
+  static char newline = NEWLINE;
+
+  /*
+   * If appending, have to lock before doing the lseek() and write() to make the
+   * two operations atomic.  If overwriting an existing record, then no locking
+   * is necessary.
+   */
+  if (whence == SEEK_END) { /* appending, therefore lock entire file */
+    if (_db_writew_lock(db, db->datfd, 0, 0) < 0) {
+      err_dump("_db_writedat(): writew_lock() error");
+    }
+  }
+
+  if ((db->datoff = lseek(db->datfd, offset, whence)) == -1) {
+    err_dump("_db_writedat(): lseek() error");
+  }
+  db->datlen = len; /* datlen includes newline */
+  if (db->features & F_CHECKSUM) {
+    db->datsum = _db_datsum(data, db->datlen - 1);
+  }
+
+  iov[0].iov_base = (char *)data;
+  iov[0].iov_len = db->datlen - 1;
+  iov[1].iov_base = &newline;
+  iov[1].iov_len = 1;
+  if (_db_pwritev(db, db->datfd, &iov[0], 2, db->datoff) != db->datlen) {
+    err_dump("_db_writedat(): pwritev() error of data record");
+  }
+
+  /* Release write lock held for append operation */
+  if (whence == SEEK_END) {
+    if (_db_un_lock(db, db->datfd, 0, 0) < 0) {
+      err_dump("_db_writedat(): un_lock() error");
+    }
+  }
+}
+
+/**
+ * Write an index record.  _db_writedat() is called before this function to set
+ * the datoff and datlen fields in the DB structure, which is needed to write
+ * the index record.
+ * @param db pointer to database structure.
+ * @param key pointer to null-terminated key string.
+ * @param offset where to write the index record.
+ * @param whence flag controls append if set to SEEK_END.
+ * @param ptrval contents of chain ptr in index record.
+ */
+static void _db_writeidx(DB *db, const char *key, off_t offset, int whence,
+                         off_t ptrval) {
+  struct iovec iov[2];
+  char asciiptrlen[PTR_SZ + IDXLEN_SZ + 1];
+  int len;
+
+  if (db->format == DB_FMT_BINARY) {
+    _db_writeidx_bin(db, key, offset, whence, ptrval);
+    return;
+  }
+  if ((db->ptrval = ptrval) < 0 || ptrval > PTR_MAX) {
+    err_quit("_db_writeidx(): invalid ptr: %d", ptrval);
+  }
+  sprintf(db->idxbuf, "%s%c%lld%c%ld\n", key, SEP, (long long)db->datoff, SEP,
+          (long)db->datlen);
+  len = strlen(db->idxbuf);
+  if (len < IDXLEN_MIN || len > IDXLEN_MAX) {
+    err_dump("_db_writeidx(): invalid length");
+  }
+  /* First half of the of the index record */
+  sprintf(asciiptrlen, "%*lld%*d", PTR_SZ, (long long)ptrval, IDXLEN_SZ, len);
+
+  /*
+   * If we're appending, we have to lock before doing the lseek() and write() to
+   * make the two an atomic operation.  If we're overwriting an existing record,
+   * we don't have to lock.
+   */
+  if (whence == SEEK_END) { /* appending */
+    if (_db_writew_lock(db, db->idxfd, db->recoff, 0) < 0) {
+      err_dump("_db_writeidx(): writew_lock() error");
+    }
+  }
+
+  /*
+   * Position the index file and record the offset.
+   */
+  if ((db->idxoff = lseek(db->idxfd, offset, whence)) == -1) {
+    err_dump("_db_writeidx(): lseek() error");
+  }
+
+  iov[0].iov_base = asciiptrlen;
+  iov[0].iov_len = PTR_SZ + IDXLEN_SZ;
+  iov[1].iov_base = db->idxbuf;
+  iov[1].iov_len = len;
+  if (_db_pwritev(db, db->idxfd, &iov[0], 2, db->idxoff) !=
+      PTR_SZ + IDXLEN_SZ + len) {
+    err_dump("_db_writeidx(): pwritev() error of index record");
+  }
+
+  /* If appending, release lock */
+  if (whence == SEEK_END) {
+    if (_db_un_lock(db, db->idxfd, db->recoff, 0) < 0) {
+      err_dump("_db_writeidx(): un_lock() error");
+    }
+  }
+} /* _db_writeidx() */
+
+/**
+ * Binary format version of _db_writeidx().  The record header and key are
+ * built in one buffer and written with a single write.
+ * @param db pointer to database structure.
+ * @param key pointer to null-terminated key string.
+ * @param offset where to write the index record.
+ * @param whence flag controls append if set to SEEK_END.
+ * @param ptrval contents of chain ptr in index record.
+ */
+static void _db_writeidx_bin(DB *db, const char *key, off_t offset, int whence,
+                             off_t ptrval) {
+  unsigned char buf[BIN_REC_SZ + IDXLEN_MAX];
+  size_t keylen, reclen;
+
+  if ((db->ptrval = ptrval) < 0) {
+    err_quit("_db_writeidx_bin(): invalid ptr: %lld", (long long)ptrval);
+  }
+  keylen = strlen(key);
+  if (keylen == 0 || keylen >= IDXLEN_MAX) {
+    err_dump("_db_writeidx_bin(): invalid length");
+  }
+  reclen = BIN_REC_SZ + keylen;
+  memset(buf, 0, BIN_REC_SZ);
+  _db_put32(buf + REC_MAGIC, BIN_REC_MAGIC);
+  /* An index record allocated by _db_allocrec() fills its extent */
+  _db_put32(buf + REC_LEN, (db->features & F_ALLOC) ? db->idxlen : reclen);
+  _db_put64(buf + REC_PTR, ptrval);
+  _db_put64(buf + REC_DATOFF, db->datoff);
+  _db_put32(buf + REC_DATLEN, db->datlen);
+  _db_put16(buf + REC_KEYLEN, keylen);
+  if (db->rawlen != 0) {
+    _db_put16(buf + REC_FLAGS, REC_F_PACKED);
+    _db_put32(buf + REC_RAWLEN, db->rawlen);
+  }
+  if (db->features & F_SNAPSHOT) {
+    _db_put32(buf + REC_BIRTH, db->epoch);
+  }
+  memcpy(buf + BIN_REC_SZ, key, keylen);
+  if (db->features & F_CHECKSUM) {
+    _db_put32(buf + REC_DATSUM, db->datsum);
+    _db_put32(buf + REC_SUM, _db_recsum(buf, keylen));
+  }
+
+  if (whence == SEEK_END) {
+    /*
+     * Appending; take the append lock so that the lseek() and write() are
+     * atomic.
+     */
+    if (_db_writew_lock(db, db->idxfd, LCK_APPEND, 1) < 0) {
+      err_dump("_db_writeidx_bin(): writew_lock() error");
+    }
+    if ((db->idxoff = lseek(db->idxfd, 0, SEEK_END)) == -1) {
+      err_dump("_db_writeidx_bin(): lseek() error");
+    }
+    if (_db_pwrite(db, db->idxfd, buf, reclen, db->idxoff) != reclen) {
+      err_dump("_db_writeidx_bin(): pwrite() error of index record");
+    }
+    if (_db_un_lock(db, db->idxfd, LCK_APPEND, 1) < 0) {
+      err_dump("_db_writeidx_bin(): un_lock() error");
+    }
+  } else {
+    db->idxoff = offset;
+    if (_db_pwrite(db, db->idxfd, buf, reclen, offset) != reclen) {
+      err_dump("_db_writeidx_bin(): pwrite() error of index record");
+    }
+  }
+} /* _db_writeidx_bin() */
+
+/**
+ * Write a chain ptr field somewhere in the index file: the free list, the hash
+ * table, or in an index record.
+ * @param db pointer to database strucutre.
+ * @param offset of where to write the chain ptr field in the index file.
+ * @param ptrval contents of chain ptr in index record.
+ */
+static void _db_writeptr(DB *db, off_t offset, off_t ptrval) {
+  char asciiptr[PTR_SZ + 1];
+  unsigned char binptr[8];
+
+  if (db->format == DB_FMT_BINARY) {
+    if (ptrval < 0) {
+      err_quit("_db_writeptr(): invalid ptr: %lld", (long long)ptrval);
+    }
+    _db_put64(binptr, ptrval);
+    if (_db_pwrite(db, db->idxfd, binptr, 8, offset) != 8) {
+      err_dump("_db_writeptr(): pwrite() error of ptr field");
+    }
+    return;
+  }
+
+  /* Validate chain pointer is within bounds */
+  if (ptrval < 0 || ptrval > PTR_MAX) {
+    err_quit("_db_writeptr(): invalid ptr: %d", ptrval);
+  }
+  /* Convert chain pointer to ASCII string */
+  sprintf(asciiptr, "%*lld", PTR_SZ, (long long)ptrval);
+
+  /* Write the pointer in the index file */
+  if (_db_pwrite(db, db->idxfd, asciiptr, PTR_SZ, offset) != PTR_SZ) {
+    err_dump("_db_writeptr(): pwrite() error of ptr field");
+  }
+} /* _db_writeptr() */
+
+/**
+ * Advance the generation of a hash chain after changing the chain or one of
+ * its records, so that the record caches of all processes see that what they
+ * hold from the chain is out of date.  Called with the chain write locked.
+ * @param db pointer to database structure.
+ * @param chainoff offset of the hash chain.
+ */
+static void _db_chaingen(DB *db, off_t chainoff) {
+  if (db->features & F_CHAINGEN) {
+    _db_writeptr(db, chainoff + SLOT_GEN,
+                 _db_readptr(db, chainoff + SLOT_GEN) + 1);
+  }
+} /* _db_chaingen() */
+
+/**
+ * Store a record in the database.  Return 0 if OK, 1 if record exists and
+ * DB_INSERT specified, -1 on error.
+ * @param h database handle.
+ * @param key pointer to null-terminated string for key.
+ * @param data pointer to null-terminated string for data.
+ * @param flag used to control behaviour:
+ *   DB_INSERT to insert a new record only.
+ *   DB_STORE to replace or insert.
+ *   DB_REPLACE to replace an existing record.
+ * @return 0 on success; 1 if record exists & DB_INSERT specified; -1 on error
+ *   1. If flag is not valid, errno is set to EINVAL.
+ *   2. If record does not exist, errno is set to ENOENT.
+ *   3. If the handle holds mapped views from db_fetch_view(), errno is set to
+ *      EBUSY.
+ *   4. If a bad record on the chain keeps the key from being looked for, errno
+ *      is set as for db_fetch().
+ * If length of data record is not valid, this function drops core and the
+ * process is terminated.  The data can be up to DATLEN_MAX - 1 bytes long, or
+ * DATLEN_BIG - 1 bytes in a binary database created with F_BIGDATA.
+ */
+int db_store(DBHANDLE h, const char *key, const char *data, int flag) {
+  DB *db = _db_cursor(h);
+  int rc, keylen, datlen, rawlen, split = 0, blmop = BLM_KEEP;
+  const char *dat = data;
+  size_t packlen;
+  uint64_t start;
+  off_t ptrval;
+
+  /* Validate flag */
+  if (flag != DB_INSERT && flag != DB_REPLACE && flag != DB_STORE) {
+    errno = EINVAL;
+    return (-1);
+  }
+  keylen = strlen(key);
+  datlen = strlen(data) + 1; /* +1 for newline at end */
+  /* Validate length of data record */
+  if (datlen < DATLEN_MIN || datlen > DATLEN(db)) {
+    err_dump("db_store(): invalid data length");
+  }
+  if (db->inbatch) {
+    return (_db_stageop(db, key, data, flag));
+  }
+  if (db->datmap.pins > 0) {
+    errno = EBUSY;
+    return (-1);
+  }
+  start = _db_now();
+  rawlen = 0;
+  if ((packlen = _db_pack(db, data, datlen, 0)) != 0) {
+    dat = db->packbuf; /* write the data packed */
+    rawlen = datlen;
+    datlen = packlen;
+  }
+  _db_opbegin(db);
+
+  /*
+   * _db_find_and_lock() calculates which hash table this new record goes into
+   * (db->chainoff), regardless of whether it already exists or not.  The
+   * following calls to _db_writeptr() change the hash table entry for this
+   * chain to point to the new record.  The new record is added to the front of
+   * the hash chain.
+   */
+  if (_db_find_and_lock(db, key, 1) < 0) { /* write lock; record not found */
+    if (db->bad) {
+      rc = -1;
+      db->cnt_storerr++;
+      errno = db->bad; /* error, a bad record on the chain */
+      goto doreturn;
+    }
+    if (flag == DB_REPLACE) {
+      rc = -1;
+      db->cnt_storerr++;
+      errno = ENOENT; /* error, record does not exist */
+      goto doreturn;
+    }
+    if (db->features & F_ORDERED) {
+      _db_treeput(db, key, 1, 0); /* before the record, see TREE_NODE */
+    }
+    blmop = BLM_ADD;
+
+    /*
+     * _db_find_and_lock() locked the hash chain; read the chain ptr to the
+     * first index record on hash chain.
+     */
+    ptrval = _db_readptr(db, db->chainoff);
+
+    /*
+     * Search the free list for a deleted record with the same size key and same
+     * size data.  Four cases are possible.
+     */
+    if (db->features & F_ALLOC) {
+      /*
+       * Case 1 or 2, with the free space manager: allocate extents for the new
+       * records, reusing free space of any size if there is enough, and write
+       * the records in them.
+       */
+      if (_db_allocrec(db, keylen, datlen)) {
+        db->cnt_stor2++;
+      } else {
+        db->cnt_stor1++;
+      }
+      db->rawlen = rawlen;
+      _db_writedat(db, dat, datlen, db->datoff, SEEK_SET);
+      _db_writeidx(db, key, db->idxoff, SEEK_SET, ptrval);
+      _db_writeptr(db, db->chainoff, db->idxoff);
+    } else if (_db_findfree(db, keylen, datlen) < 0) {
+      /*
+       * Case 1: Can't find an empty record big enough.  Append the new record
+       * to the ends of the index and data files.
+       */
+      _db_writedat(db, data, datlen, 0, SEEK_END);
+      _db_writeidx(db, key, 0, SEEK_END, ptrval);
+
+      /*
+       * db->idxoff was set by _db_writeidx().  The new record goes to the front
+       * of the hash chain.
+       */
+      _db_writeptr(db, db->chainoff, db->idxoff);
+      db->cnt_stor1++;
+    } else {
+      /*
+       * Case 2: Reuse an empty record.  _db_freefind() removed it from the free
+       * list and set both db->datoff and db->idxoff.  Reused record goes to the
+       * front of the hash chain.
+       */
+      _db_writedat(db, data, datlen, db->datoff, SEEK_SET);
+      _db_writeidx(db, key, db->idxoff, SEEK_SET, ptrval);
+      _db_writeptr(db, db->chainoff, db->idxoff);
+      db->cnt_stor2++;
+    }
+
+    /*
+     * If the hash table can grow, count the new record, and split a bucket
+     * once the chain lock is released if the table has become too full.
+     */
+    if (db->maxload != 0 &&
+        _db_addnrec(db, 1) > (uint64_t)db->maxload * db->nbucket) {
+      split = 1;
+    }
+  } else { /* record found */
+    if (flag == DB_INSERT) {
+      rc = 1; /* error, record already in db */
+      db->cnt_storerr++;
+      goto doreturn;
+    }
+
+    /*
+     * Replacing an existing record.  The new key equals the existing
+     * key, but need to check if the data records are the same size.
+     */
+    if ((datlen != db->datlen || (db->features & (F_CHECKSUM | F_PACKED)) ||
+         db->cow) &&
+        (db->features & F_ALLOC)) {
+      /*
+       * Case 3 or 4, with the free space manager: the index record stays where
+       * it is, and only the data record moves if it doesn't fit its extent.
+       * Data of the same length goes this way too with checksums, which change
+       * with the data, and with compression, since the same length packed
+       * needn't be the same length unpacked, and while a snapshot is pinned,
+       * when both records are copied.
+       */
+      db->rawlen = rawlen;
+      if (_db_rewritedat(db, dat, datlen)) {
+        db->cnt_stor3++;
+      } else {
+        db->cnt_stor4++;
+      }
+    } else if (datlen != db->datlen) {
+      /*
+       * Case 3: Existing record is being replaced, and the length of the new
+       * data record differs from the length of the existing data record.
+       */
+      _db_dodelete(db); /* delete the existing record; deleted record placed
+                       at the head of the free list */
+
+      /*
+       * Reread the chain ptr in the hash table (it may change with the
+       * deletion).
+       */
+      ptrval = _db_readptr(db, db->chainoff);
+
+      /*
+       * Append new index and data records to end of files.
+       */
+      _db_writedat(db, data, datlen, 0, SEEK_END);
+      _db_writeidx(db, key, 0, SEEK_END, ptrval);
+
+      /*
+       * New record goes to the front of the hash chain.
+       */
+      _db_writeptr(db, db->chainoff, db->idxoff);
+      db->cnt_stor3++;
+    } else {
+      /*
+       * Case 4: Same size data, just replace data record.
+       */
+      _db_writedat(db, data, datlen, db->datoff, SEEK_SET);
+      db->cnt_stor4++;
+    }
+  }
+  _db_bloomput(db, db->bucket, db->chainoff, key, blmop);
+  _db_chaingen(db, db->chainoff);
+  _db_chgadd(db, CHG_PUT, key, data);
+  _db_chgflush(db);
+  rc = 0; /* OK */
+
+  /* Unlock hash chain locked by _db_find_and_lock() */
+doreturn:
+  if (_db_un_lock(db, db->idxfd, db->chainoff, 1) < 0) {
+    err_dump("db_store(): un_lock() error");
+  }
+  if (split) {
+    _db_split(db);
+  }
+  _db_opend(db);
+  _db_lat(&db->latstore, start);
+  return (rc);
+} /* db_store() */
+
+/**
+ * Start a batch of updates.  Until db_commit() or db_abort() is called,
+ * db_store() and db_delete() only check their arguments and stage the update
+ * in memory, returning 0.  db_commit() then applies the staged updates
+ * together: each hash chain they touch is locked once and walked once, and the
+ * new records for it are written with one write per file.  Reads through the
+ * handle don't see the staged updates until they are committed.  A batch is
+ * only atomic with a write-ahead log (DB_OPT_WAL), which logs and syncs it as
+ * one update; otherwise a crash during db_commit() can leave some of it
+ * applied.
+ * @param h database handle.
+ * @return 0 on success; -1 with errno set to EINVAL if a batch is already
+ * open.
+ */
+int db_begin(DBHANDLE h) {
+  DB *db = _db_cursor(h);
+
+  if (db->inbatch) {
+    errno = EINVAL;
+    return (-1);
+  }
+  db->inbatch = 1;
+  db->nops = 0;
+  return (0);
+} /* db_begin() */
+
+/**
+ * Discard the updates staged since db_begin(), and end the batch.
+ * @param h database handle.
+ */
+void db_abort(DBHANDLE h) {
+  _db_abort(_db_cursor(h));
+} /* db_abort() */
+
+/**
+ * Discard the staged updates of a cursor, and end its batch.
+ * @param db pointer to database structure.
+ */
+static void _db_abort(DB *db) {
+  long i;
+
+  for (i = 0; i < db->nops; i++) {
+    free(db->ops[i].key);
+  }
+  db->nops = 0;
+  db->inbatch = 0;
+} /* _db_abort() */
+
+/**
+ * Apply the updates staged since db_begin(), and end the batch.  Updates of
+ * the same key are applied in the order they were staged, with the same
+ * results as calling db_store() and db_delete() one at a time; those that
+ * would have failed, such as a DB_INSERT of an existing key or a delete of a
+ * missing one, are counted and otherwise ignored.  So are the updates of keys
+ * that a bad record on their hash chain keeps from being looked for.
+ * @param h database handle.
+ * @return number of staged updates that failed; -1 with errno set to EINVAL if
+ * no batch is open, or to EBUSY if the handle holds mapped views from
+ * db_fetch_view(), in which case the batch stays open.
+ */
+long db_commit(DBHANDLE h) {
+  return (db_commit_results(h, NULL));
+} /* db_commit() */
+
+/**
+ * Apply the updates staged since db_begin() as db_commit() does, and report
+ * which of them failed.
+ * @param h database handle.
+ * @param results array with an element for each update staged since
+ * db_begin(), in the order they were staged, set to 0 for each update that was
+ * applied, and for each that failed to the errno that db_store() or
+ * db_delete() would have failed with on its own: EEXIST for a DB_INSERT of an
+ * existing key, ENOENT for a DB_REPLACE or a delete of a missing one, and the
+ * error of db_fetch() for a key that a bad record kept from being looked for;
+ * NULL if not wanted.
+ * @return number of staged updates that failed; -1 on error, as for
+ * db_commit(), with results untouched.
+ */
+long db_commit_results(DBHANDLE h, int *results) {
+  DB *db = _db_cursor(h);
+  long nfail;
+
+  if (!db->inbatch) {
+    errno = EINVAL;
+    return (-1);
+  }
+  if (db->datmap.pins > 0) {
+    errno = EBUSY;
+    return (-1);
+  }
+  _db_opbegin(db);
+  nfail = _db_commitops(db, results);
+  _db_opend(db);
+  _db_abort(db);
+  return (nfail);
+} /* db_commit_results() */
+
+/**
+ * Apply the staged updates of a cursor for db_commit_results(), which has the
+ * same arguments, and db_applychanges().  Called between _db_walbegin() and
+ * _db_walend(); the batch is left open.
+ */
+static long _db_commitops(DB *db, int *results) {
+  DBOP *ops, **ins = NULL;
+  long i, j, k, n, nops, nins, nfail = 0, delta = 0;
+  DBHASH nbucket;
+  uint64_t nrec;
+
+  ops = db->ops;
+  nops = db->nops;
+  if (results != NULL) {
+    memset(results, 0, nops * sizeof(int));
+  }
+  db->results = results;
+  if (nops > 0 && (ins = malloc(nops * sizeof(DBOP *))) == NULL) {
+    err_dump("_db_commitops(): malloc() error");
+  }
+  for (i = 0; i < nops; i++) {
+    ops[i].hval = _db_hash(db, ops[i].key);
+    ops[i].chainoff = _db_bucketoff(db, _db_bucket(db, ops[i].hval));
+  }
+  qsort(ops, nops, sizeof(DBOP), _db_cmpop);
+
+  for (i = 0; i < nops; i = j) {
+    if (_db_writew_lock(db, db->idxfd, ops[i].chainoff, 1) < 0) {
+      err_dump("_db_commitops(): writew_lock() error");
+    }
+
+    /*
+     * As in _db_find_and_lock(), the files may have been replaced by
+     * db_compact(), or buckets split, since the chains were worked out.  If
+     * so, work out the chains of the updates that are left again.
+     */
+    if (_db_checkswap(db) ||
+        (db->maxload != 0 &&
+         (nbucket = _db_readnbucket(db)) != db->nbucket)) {
+      if (_db_un_lock(db, db->idxfd, ops[i].chainoff, 1) < 0) {
+        err_dump("_db_commitops(): un_lock() error");
+      }
+      if (db->maxload != 0) {
+        db->nbucket = _db_readnbucket(db);
+      }
+      for (k = i; k < nops; k++) {
+        ops[k].chainoff = _db_bucketoff(db, _db_bucket(db, ops[k].hval));
+      }
+      qsort(ops + i, nops - i, sizeof(DBOP), _db_cmpop);
+      j = i;
+      continue;
+    }
+    for (j = i + 1; j < nops && ops[j].chainoff == ops[i].chainoff; j++) {
+      ;
+    }
+
+    /*
+     * Walk the chain once, applying the updates of the keys that are on it.
+     */
+    for (k = i; k < j; k++) {
+      ops[k].found = 0;
+    }
+    _db_commitchain(db, ops + i, j - i, &nfail, &delta);
+
+    /*
+     * Then add the records of the keys that weren't on the chain, or were
+     * taken off it by _db_commitchain() to be written again, to its front.
+     */
+    for (nins = 0, k = i; k < j; k += n) {
+      for (n = 1; k + n < j && strcmp(ops[k + n].key, ops[k].key) == 0; n++) {
+        ;
+      }
+      if (ops[k].found == 0 &&
+          _db_opresult(db, ops + k, n, 0, &ops[k].newdata, &nfail) ==
+              OP_PUT) {
+        _db_chgadd(db, CHG_PUT, ops[k].key, ops[k].newdata);
+        ins[nins++] = ops + k;
+        delta++;
+        if (db->features & F_ORDERED) {
+          _db_treeput(db, ops[k].key, 1, 0);
+        }
+      } else if (ops[k].found == 2) {
+        ins[nins++] = ops + k;
+      }
+    }
+    if (nins > 0) {
+      _db_commitins(db, ops[i].chainoff, ins, nins);
+    }
+    _db_bloomput(db, _db_bucket(db, ops[i].hval), ops[i].chainoff, NULL,
+                 BLM_BUILD);
+    _db_chaingen(db, ops[i].chainoff);
+    _db_chgflush(db);
+    if (_db_un_lock(db, db->idxfd, ops[i].chainoff, 1) < 0) {
+      err_dump("_db_commitops(): un_lock() error");
+    }
+  }
+
+  /*
+   * Count the records added and deleted once, and split as many buckets as
+   * db_store() and db_delete() would have split one at a time.
+   */
+  if (db->maxload != 0 && delta != 0) {
+    nrec = _db_addnrec(db, delta);
+    while (nrec > (uint64_t)db->maxload * db->nbucket) {
+      nbucket = db->nbucket;
+      _db_split(db);
+      if (db->nbucket == nbucket) {
+        break; /* can't split any more */
+      }
+    }
+  }
+  free(ins);
+  db->results = NULL;
+  return (nfail);
+} /* _db_commitops() */
+
+/**
+ * Stage an update for db_commit().  The key and data are copied.
+ * @param db pointer to database structure.
+ * @param key pointer to null-terminated key.
+ * @param data pointer to null-terminated data; NULL for a delete.
+ * @param flag DB_INSERT, DB_REPLACE or DB_STORE; 0 for a delete.
+ * @return 0 on success; -1 with errno set to ENOMEM if memory can't be
+ * allocated.
+ */
+static int _db_stageop(DB *db, const char *key, const char *data, int flag) {
+  DBOP *op;
+  size_t keylen, datlen;
+
+  if (db->nops == db->maxops) {
+    if ((op = realloc(db->ops, (db->maxops * 2 + 64) * sizeof(DBOP))) ==
+        NULL) {
+      errno = ENOMEM;
+      return (-1);
+    }
+    db->ops = op;
+    db->maxops = db->maxops * 2 + 64;
+  }
+  op = db->ops + db->nops;
+  keylen = strlen(key) + 1;
+  datlen = (data == NULL ? 0 : strlen(data) + 1);
+  if ((op->key = malloc(keylen + datlen)) == NULL) {
+    errno = ENOMEM;
+    return (-1);
+  }
+  memcpy(op->key, key, keylen);
+  if (data != NULL) {
+    op->data = op->key + keylen;
+    memcpy(op->data, data, datlen);
+  } else {
+    op->data = NULL;
+  }
+  op->flag = flag;
+  op->seq = db->nops++;
+  return (0);
+} /* _db_stageop() */
+
+/**
+ * Work out the result of the staged updates of one key, applied in order to
+ * the record as it is in the database.
+ * @param db pointer to database structure.
+ * @param op first of the updates, in the order they were staged.
+ * @param n number of updates.
+ * @param exists 1 if the key is in the database; 0 if not.
+ * @param datap set to the data the record is left with for OP_PUT.
+ * @param nfailp incremented by the number of updates that fail.
+ * @return OP_NONE if the database doesn't change, OP_DELETE if the record must
+ * be deleted, or OP_PUT if the record must be written with *datap.
+ */
+static int _db_opresult(DB *db, const DBOP *op, long n, int exists,
+                        const char **datap, long *nfailp) {
+  int action = OP_NONE;
+  long i;
+
+  for (i = 0; i < n; i++, op++) {
+    if (op->data == NULL) { /* delete */
+      if (!exists) {
+        db->cnt_delerr++;
+        (*nfailp)++;
+        if (db->results != NULL) {
+          db->results[op->seq] = ENOENT;
+        }
+        continue;
+      }
+      db->cnt_delok++;
+      exists = 0;
+      action = OP_DELETE;
+    } else if ((op->flag == DB_INSERT && exists) ||
+               (op->flag == DB_REPLACE && !exists)) {
+      db->cnt_storerr++;
+      (*nfailp)++;
+      if (db->results != NULL) {
+        db->results[op->seq] = (op->flag == DB_INSERT ? EEXIST : ENOENT);
+      }
+    } else {
+      exists = 1;
+      *datap = op->data;
+      action = OP_PUT;
+    }
+  }
+  return (action);
+} /* _db_opresult() */
+
+/**
+ * Walk a hash chain for db_commit(), deleting or rewriting the records of the
+ * keys with staged updates that are on it.  Records whose data changes length
+ * without the free space manager are deleted here, and marked to be written
+ * again by _db_commitins().  A bad record ends the walk, and the updates of
+ * the keys not found before it fail, since their records may be further on.
+ * Called with the chain write locked.
+ * @param db pointer to database structure.
+ * @param ops the updates of the chain, sorted by key.
+ * @param nops number of updates.
+ * @param nfailp incremented by the number of updates that fail.
+ * @param deltap incremented by the number of records added, and decremented
+ * by the number deleted.
+ */
+static void _db_commitchain(DB *db, DBOP *ops, long nops, long *nfailp,
+                            long *deltap) {
+  DBOP *op, *end = ops + nops;
+  off_t offset, nextoffset, ptroff;
+  const char *data, *dat;
+  long i, n, nleft;
+  size_t datlen, rawlen, packlen;
+
+  for (nleft = 1, op = ops + 1; op < end; op++) {
+    if (strcmp(op->key, op[-1].key) != 0) {
+      nleft++; /* number of different keys */
+    }
+  }
+  ptroff = db->chainoff = ops->chainoff;
+  offset = _db_readptr(db, ptroff);
+  while (offset != 0 && nleft > 0) {
+    nextoffset = _db_readidx(db, offset);
+    if (db->bad) {
+      for (op = ops; op < end; op += n) {
+        for (n = 1; op + n < end && strcmp(op[n].key, op->key) == 0; n++) {
+          ;
+        }
+        if (op->found != 0) {
+          continue;
+        }
+        op->found = -1; /* not to be added by _db_commitins() either */
+        for (i = 0; i < n; i++) {
+          if (op[i].data == NULL) {
+            db->cnt_delerr++;
+          } else {
+            db->cnt_storerr++;
+          }
+          (*nfailp)++;
+          if (db->results != NULL) {
+            db->results[op[i].seq] = db->bad;
+          }
+        }
+      }
+      break;
+    }
+    if ((op = bsearch(db->idxbuf, ops, nops, sizeof(DBOP), _db_cmpopkey)) ==
+        NULL) {
+      ptroff = offset + db->recptr;
+      offset = nextoffset;
+      continue;
+    }
+    while (op > ops && strcmp(op[-1].key, op->key) == 0) {
+      op--; /* first update of the key */
+    }
+    for (n = 1; op + n < end && strcmp(op[n].key, op->key) == 0; n++) {
+      ;
+    }
+    op->found = 1;
+    nleft--;
+    db->ptroff = ptroff;
+    switch (_db_opresult(db, op, n, 1, &data, nfailp)) {
+    case OP_DELETE:
+      _db_chgadd(db, CHG_DEL, op->key, NULL);
+      _db_dodelete(db);
+      (*deltap)--;
+      if (db->features & F_ORDERED) {
+        _db_treeput(db, op->key, 0, 0);
+      }
+      offset = nextoffset; /* ptroff now points to the next record */
+      continue;
+
+    case OP_PUT:
+      _db_chgadd(db, CHG_PUT, op->key, data);
+      datlen = strlen(data) + 1;
+      dat = data;
+      rawlen = 0;
+      if ((packlen = _db_pack(db, data, datlen, 0)) != 0) {
+        dat = db->packbuf;
+        rawlen = datlen;
+        datlen = packlen;
+      }
+      if (datlen == db->datlen &&
+          !(db->features & (F_CHECKSUM | F_PACKED)) && !db->cow) {
+        _db_writedat(db, data, datlen, db->datoff, SEEK_SET);
+        db->cnt_stor4++;
+      } else if (db->features & F_ALLOC) {
+        db->rawlen = rawlen;
+        if (_db_rewritedat(db, dat, datlen)) {
+          db->cnt_stor3++;
+        } else {
+          db->cnt_stor4++;
+        }
+        offset = db->idxoff; /* copied on write to a new index record */
+      } else {
+        _db_dodelete(db);
+        op->found = 2;
+        op->newdata = data;
+        db->cnt_stor3++;
+        offset = nextoffset;
+        continue;
+      }
+      break;
+    }
+    ptroff = offset + db->recptr;
+    offset = nextoffset;
+  }
+} /* _db_commitchain() */
+
+/**
+ * Add new records to the front of a hash chain for db_commit().  Free space is
+ * reused as db_store() would, but the records that are appended to the files
+ * are formatted in memory, and written with one write to each file.  Called
+ * with the chain write locked.
+ * @param db pointer to database structure.
+ * @param chainoff offset of the hash chain.
+ * @param ins the first update of each key to add, with newdata set.
+ * @param nins number of keys to add.
+ */
+static void _db_commitins(DB *db, off_t chainoff, DBOP **ins, long nins) {
+  unsigned char heads[2 * EXT_NCLASS * 8];
+  off_t head, idxbase, datbase, *datoffs;
+  size_t idxlen, datlen, keylen, extlen, minidx, mindat, packoff;
+  int idxbulk, datbulk, reused;
+  long i, napp;
+  const char *dat;
+  DBOP *op;
+
+  head = _db_readptr(db, chainoff);
+  if ((datoffs = malloc(nins * sizeof(off_t))) == NULL) {
+    err_dump("_db_commitins(): malloc() error");
+  }
+  db->batchlen = 0;
+
+  if (db->features & F_ALLOC) {
+    /*
+     * Pack the data of the records first (F_PACKED), outside the free list
+     * lock, into one buffer that doesn't move once they are all in it.
+     */
+    for (packoff = 0, i = 0; i < nins; i++) {
+      op = ins[i];
+      op->newlen = strlen(op->newdata) + 1;
+      op->packoff = packoff;
+      op->rawlen = 0;
+      if ((datlen = _db_pack(db, op->newdata, op->newlen, packoff)) != 0) {
+        op->rawlen = op->newlen;
+        op->newlen = datlen;
+        packoff += datlen;
+      }
+    }
+
+    /*
+     * With the free space manager, allocate all the extents under one hold of
+     * the free list lock.  If no free extent of a heap is big enough for any of
+     * the records, they all go at the end of it, one after the other, and
+     * can be written together.
+     */
+    if (_db_writew_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+      err_dump("_db_commitins(): writew_lock() error");
+    }
+    if (pread(db->idxfd, heads, sizeof(heads), HDR_FREECLS) != sizeof(heads)) {
+      err_dump("_db_commitins(): pread() error of free lists");
+    }
+    minidx = mindat = (size_t)-1;
+    for (i = 0; i < nins; i++) {
+      idxlen = _db_extsize(BIN_REC_SZ + strlen(ins[i]->key));
+      datlen = _db_extsize(EXT_HDR_SZ + ins[i]->newlen);
+      minidx = (idxlen < minidx ? idxlen : minidx);
+      mindat = (datlen < mindat ? datlen : mindat);
+    }
+    idxbulk = _db_extnone(heads, minidx);
+    datbulk = _db_extnone(heads + EXT_NCLASS * 8, mindat);
+    if (datbulk && (datbase = lseek(db->datfd, 0, SEEK_END)) == -1) {
+      err_dump("_db_commitins(): lseek() error");
+    }
+    for (i = 0; i < nins; i++) {
+      op = ins[i];
+      dat = op->rawlen != 0 ? db->packbuf + op->packoff : op->newdata;
+      db->datlen = op->newlen;
+      extlen = _db_extsize(EXT_HDR_SZ + db->datlen);
+      reused = 0;
+      if (datbulk) {
+        datoffs[i] = datbase + db->batchlen + EXT_HDR_SZ;
+        _db_batchext(db, EXT_DAT_MAGIC, extlen, dat, db->datlen - 1, NEWLINE);
+      } else {
+        datoffs[i] = _db_extalloc(db, HEAP_DAT, &extlen, &reused) + EXT_HDR_SZ;
+        _db_writedat(db, dat, db->datlen, datoffs[i], SEEK_SET);
+      }
+      if (reused) {
+        db->cnt_stor2++;
+      } else {
+        db->cnt_stor1++;
+      }
+    }
+    if (datbulk && _db_pwrite(db, db->datfd, db->batchbuf, db->batchlen,
+                              datbase) != db->batchlen) {
+      err_dump("_db_commitins(): pwrite() error of data records");
+    }
+    db->batchlen = 0;
+    if (idxbulk && (idxbase = lseek(db->idxfd, 0, SEEK_END)) == -1) {
+      err_dump("_db_commitins(): lseek() error");
+    }
+    for (i = 0; i < nins; i++) {
+      op = ins[i];
+      dat = op->rawlen != 0 ? db->packbuf + op->packoff : op->newdata;
+      db->datoff = datoffs[i];
+      db->datlen = op->newlen;
+      db->rawlen = op->rawlen;
+      if (db->features & F_CHECKSUM) {
+        db->datsum = _db_datsum(dat, db->datlen - 1);
+      }
+      db->idxlen = _db_extsize(BIN_REC_SZ + strlen(op->key));
+      if (idxbulk) {
+        db->idxoff = idxbase + db->batchlen;
+        _db_batchidx(db, op->key, head);
+      } else {
+        db->idxoff = _db_extalloc(db, HEAP_IDX, &db->idxlen, &reused);
+        _db_writeidx(db, op->key, db->idxoff, SEEK_SET, head);
+      }
+      head = db->idxoff;
+    }
+    if (idxbulk && _db_pwrite(db, db->idxfd, db->batchbuf, db->batchlen,
+                              idxbase) != db->batchlen) {
+      err_dump("_db_commitins(): pwrite() error of index records");
+    }
+    if (_db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+      err_dump("_db_commitins(): un_lock() error");
+    }
+  } else {
+    /*
+     * Reuse deleted records of the right sizes, as db_store() does, if there
+     * are any; the free list is only searched if it isn't empty.  The rest are
+     * appended, the data records with one write under the data file append
+     * lock, then the index records with one write under the index file append
+     * lock.
+     */
+    for (napp = 0, i = 0; i < nins; i++) {
+      op = ins[i];
+      keylen = strlen(op->key);
+      datlen = strlen(op->newdata) + 1;
+      if (_db_readptr(db, db->freeoff) != 0 &&
+          _db_findfree(db, keylen, datlen) == 0) {
+        _db_writedat(db, op->newdata, datlen, db->datoff, SEEK_SET);
+        _db_writeidx(db, op->key, db->idxoff, SEEK_SET, head);
+        head = db->idxoff;
+        db->cnt_stor2++;
+      } else {
+        ins[napp++] = op;
+        db->cnt_stor1++;
+      }
+    }
+    if (napp > 0) {
+      if (_db_writew_lock(db, db->datfd, 0, 0) < 0) {
+        err_dump("_db_commitins(): writew_lock() error");
+      }
+      if ((datbase = lseek(db->datfd, 0, SEEK_END)) == -1) {
+        err_dump("_db_commitins(): lseek() error");
+      }
+      for (i = 0; i < napp; i++) {
+        datoffs[i] = datbase + db->batchlen;
+        _db_batchput(db, ins[i]->newdata, strlen(ins[i]->newdata));
+        *_db_batchput(db, NULL, 1) = NEWLINE;
+      }
+      if (_db_pwrite(db, db->datfd, db->batchbuf, db->batchlen, datbase) !=
+          db->batchlen) {
+        err_dump("_db_commitins(): pwrite() error of data records");
+      }
+      if (_db_un_lock(db, db->datfd, 0, 0) < 0) {
+        err_dump("_db_commitins(): un_lock() error");
+      }
+
+      db->batchlen = 0;
+      if (db->format == DB_FMT_BINARY) {
+        if (_db_writew_lock(db, db->idxfd, LCK_APPEND, 1) < 0) {
+          err_dump("_db_commitins(): writew_lock() error");
+        }
+      } else if (_db_writew_lock(db, db->idxfd, db->recoff, 0) < 0) {
+        err_dump("_db_commitins(): writew_lock() error");
+      }
+      if ((idxbase = lseek(db->idxfd, 0, SEEK_END)) == -1) {
+        err_dump("_db_commitins(): lseek() error");
+      }
+      for (i = 0; i < napp; i++) {
+        db->datoff = datoffs[i];
+        db->datlen = strlen(ins[i]->newdata) + 1;
+        db->idxoff = idxbase + db->batchlen;
+        _db_batchidx(db, ins[i]->key, head);
+        head = db->idxoff;
+      }
+      if (_db_pwrite(db, db->idxfd, db->batchbuf, db->batchlen, idxbase) !=
+          db->batchlen) {
+        err_dump("_db_commitins(): pwrite() error of index records");
+      }
+      if (db->format == DB_FMT_BINARY) {
+        if (_db_un_lock(db, db->idxfd, LCK_APPEND, 1) < 0) {
+          err_dump("_db_commitins(): un_lock() error");
+        }
+      } else if (_db_un_lock(db, db->idxfd, db->recoff, 0) < 0) {
+        err_dump("_db_commitins(): un_lock() error");
+      }
+    }
+  }
+
+  /*
+   * The new records become reachable all at once.
+   */
+  _db_writeptr(db, chainoff, head);
+  free(datoffs);
+} /* _db_commitins() */
+
+/**
+ * Check whether a heap has no free extent of at least a given size, from the
+ * heads of its free lists.
+ * @param heads heads of the free lists of the heap, as stored in the header.
+ * @param size extent size.
+ * @return 1 if every free list that could hold an extent of size is empty; 0
+ * otherwise.
+ */
+static int _db_extnone(const unsigned char *heads, size_t size) {
+  int c;
+
+  for (c = _db_extclass(size, 1); c < EXT_NCLASS; c++) {
+    if (_db_get64(heads + c * 8) != 0) {
+      return (0);
+    }
+  }
+  return (1);
+} /* _db_extnone() */
+
+/**
+ * Append bytes to the batch buffer, growing it as needed.
+ * @param db pointer to database structure.
+ * @param p bytes to append; NULL to append zeros.
+ * @param len number of bytes.
+ * @return pointer to where the bytes went in the buffer.
+ */
+static char *_db_batchput(DB *db, const void *p, size_t len) {
+  char *buf;
+  size_t size;
+
+  if (db->batchlen + len > db->batchsize) {
+    for (size = db->batchsize + 4096; size < db->batchlen + len; size *= 2) {
+      ;
+    }
+    if ((buf = realloc(db->batchbuf, size)) == NULL) {
+      err_dump("_db_batchput(): realloc() error");
+    }
+    db->batchbuf = buf;
+    db->batchsize = size;
+  }
+  buf = db->batchbuf + db->batchlen;
+  if (p != NULL) {
+    memcpy(buf, p, len);
+  } else {
+    memset(buf, 0, len);
+  }
+  db->batchlen += len;
+  return (buf);
+} /* _db_batchput() */
+
+/**
+ * Append an extent of the free space manager to the batch buffer: header,
+ * contents, a trailing byte, zeros up to the trailing size, and the size.
+ * @param db pointer to database structure.
+ * @param magic magic number of the extent.
+ * @param size size of the extent.
+ * @param p contents of the extent after the header.
+ * @param len length of the contents.
+ * @param last byte written after the contents.
+ */
+static void _db_batchext(DB *db, uint32_t magic, size_t size, const char *p,
+                         size_t len, int last) {
+  unsigned char *ext;
+
+  ext = (unsigned char *)_db_batchput(db, NULL, size);
+  _db_put32(ext, magic);
+  _db_put32(ext + 4, size);
+  memcpy(ext + EXT_HDR_SZ, p, len);
+  ext[EXT_HDR_SZ + len] = last;
+  _db_put32(ext + size - EXT_FTR_SZ, size);
+} /* _db_batchext() */
+
+/**
+ * Append an index record to the batch buffer, as _db_writeidx() would write
+ * it, for the data record given by db->datoff, db->datlen, db->datsum and
+ * db->rawlen.  With the free space manager, the record fills the extent of
+ * db->idxlen bytes.
+ * @param db pointer to database structure.
+ * @param key pointer to null-terminated key.
+ * @param ptrval contents of chain ptr in index record.
+ */
+static void _db_batchidx(DB *db, const char *key, off_t ptrval) {
+  char asciiptrlen[PTR_SZ + IDXLEN_SZ + 1];
+  unsigned char *rec;
+  size_t keylen, reclen;
+  int len;
+
+  if (db->format == DB_FMT_BINARY) {
+    keylen = strlen(key);
+    if (keylen == 0 || keylen >= IDXLEN_MAX) {
+      err_dump("_db_batchidx(): invalid length");
+    }
+    reclen = BIN_REC_SZ + keylen;
+    if (db->features & F_ALLOC) {
+      rec = (unsigned char *)_db_batchput(db, NULL, db->idxlen);
+      _db_put32(rec + db->idxlen - EXT_FTR_SZ, db->idxlen);
+      _db_put32(rec + REC_LEN, db->idxlen);
+    } else {
+      rec = (unsigned char *)_db_batchput(db, NULL, reclen);
+      _db_put32(rec + REC_LEN, reclen);
+    }
+    _db_put32(rec + REC_MAGIC, BIN_REC_MAGIC);
+    _db_put64(rec + REC_PTR, ptrval);
+    _db_put64(rec + REC_DATOFF, db->datoff);
+    _db_put32(rec + REC_DATLEN, db->datlen);
+    _db_put16(rec + REC_KEYLEN, keylen);
+    if (db->rawlen != 0) {
+      _db_put16(rec + REC_FLAGS, REC_F_PACKED);
+      _db_put32(rec + REC_RAWLEN, db->rawlen);
+    }
+    if (db->features & F_SNAPSHOT) {
+      _db_put32(rec + REC_BIRTH, db->epoch);
+    }
+    memcpy(rec + BIN_REC_SZ, key, keylen);
+    if (db->features & F_CHECKSUM) {
+      _db_put32(rec + REC_DATSUM, db->datsum);
+      _db_put32(rec + REC_SUM, _db_recsum(rec, keylen));
+    }
+    return;
+  }
+  if (ptrval < 0 || ptrval > PTR_MAX) {
+    err_quit("_db_batchidx(): invalid ptr: %d", ptrval);
+  }
+  sprintf(db->idxbuf, "%s%c%lld%c%ld\n", key, SEP, (long long)db->datoff, SEP,
+          (long)db->datlen);
+  len = strlen(db->idxbuf);
+  if (len < IDXLEN_MIN || len > IDXLEN_MAX) {
+    err_dump("_db_batchidx(): invalid length");
+  }
+  sprintf(asciiptrlen, "%*lld%*d", PTR_SZ, (long long)ptrval, IDXLEN_SZ, len);
+  _db_batchput(db, asciiptrlen, PTR_SZ + IDXLEN_SZ);
+  _db_batchput(db, db->idxbuf, len);
+} /* _db_batchidx() */
+
+/**
+ * qsort() comparison function that orders staged updates by hash chain, then
+ * by key, then in the order they were staged.
+ * @param a pointer to a DBOP.
+ * @param b pointer to a DBOP.
+ * @return negative, zero or positive as a is before, with or after b.
+ */
+static int _db_cmpop(const void *a, const void *b) {
+  const DBOP *oa = a, *ob = b;
+  int c;
+
+  if (oa->chainoff != ob->chainoff) {
+    return (oa->chainoff < ob->chainoff ? -1 : 1);
+  }
+  if ((c = strcmp(oa->key, ob->key)) != 0) {
+    return (c);
+  }
+  return (oa->seq < ob->seq ? -1 : oa->seq > ob->seq);
+} /* _db_cmpop() */
+
+/**
+ * bsearch() comparison function that finds a key among staged updates sorted
+ * by _db_cmpop().
+ * @param key pointer to null-terminated key.
+ * @param op pointer to a DBOP.
+ * @return negative, zero or positive as key is before, equal to or after the
+ * key of op.
+ */
+static int _db_cmpopkey(const void *key, const void *op) {
+  return (strcmp(key, ((const DBOP *)op)->key));
+} /* _db_cmpopkey() */
+
+/**
+ * Load records into a database from a file: lines of a key, a tab and the
+ * data, as written by t4dump.  A line replaces any earlier line with the same
+ * key.  An empty database, as left by db_openopt() with O_TRUNC, is written
+ * in one pass: the records are sorted by bucket, in memory or, if they take
+ * more than stats->memlimit bytes, by spooling them to temporary files, one
+ * per range of buckets, which are then sorted in turn.  The records of each
+ * chain are written next to each other, chain after chain, with large writes
+ * at the end of each file, and the hash table is written as it fills.  The
+ * hash table of a database with a maxload is first grown to the size that
+ * storing the records one at a time would have grown it to.  Other processes
+ * are locked out of the database until the load is done.  The load is not
+ * logged to the write-ahead log; if it is interrupted, create the database
+ * again and load it again.  With a change log, every record loaded is logged
+ * as stored once the load is done.  Records loaded into a database that is not
+ * empty are stored with db_store() in batches, as between db_begin() and
+ * db_commit().
+ * @param h database handle.
+ * @param fd file descriptor to read the records from.
+ * @param stats if not NULL, memlimit sets the memory to sort in, and the rest
+ * is filled in with the results.
+ * @return 0 if OK; -1 on error, with errno set to EINVAL if a line is not a
+ * valid record (stats->nline is its line number, and nothing has been stored
+ * in an empty database) or if a batch is open, to EBUSY if the handle holds
+ * mapped views from db_fetch_view(), to EFBIG if an ASCII index file would get
+ * too big, or as set by read(2).
+ */
+int db_bulkload(DBHANDLE h, int fd, DBBULK *stats) {
+  DB *db = _db_cursor(h);
+  DBLOAD ld;
+  DBBULK st;
+  struct stat statbuff;
+  char *line, *tab;
+  size_t len, keylen, datlen;
+  int rc, empty;
+
+  if (db->inbatch) {
+    errno = EINVAL;
+    return (-1);
+  }
+  if (db->datmap.pins > 0) {
+    errno = EBUSY;
+    return (-1);
+  }
+  memset(&st, 0, sizeof(st));
+  memset(&ld, 0, sizeof(ld));
+  ld.memlimit = (stats != NULL && stats->memlimit != 0 ? stats->memlimit
+                                                       : BULK_MEM);
+  ld.fd = fd;
+  if ((ld.inbuf = malloc(BULK_CHUNK + 1)) == NULL) { /* +1 for null */
+    err_dump("db_bulkload(): malloc() error");
+  }
+
+  /*
+   * Lock out every other process, and find out whether anything has been
+   * stored in the database since it was created.  Nothing is written to the
+   * write-ahead log: undoing the load would only empty the database again.
+   */
+  _db_checkswap(db);
+  _db_opbegin(db);
+  db->inop = 0;
+  if (_db_writew_lock(db, db->idxfd, 0, 0) < 0) {
+    err_dump("db_bulkload(): writew_lock() error");
+  }
+  if (db->maxload != 0) {
+    db->nbucket = _db_readnbucket(db);
+  }
+  empty = db->nbucket == db->nhash;
+  if (fstat(db->idxfd, &statbuff) < 0) {
+    err_dump("db_bulkload(): fstat() error");
+  }
+  empty = empty && statbuff.st_size == db->recoff;
+  ld.idxend = statbuff.st_size;
+  if (fstat(db->datfd, &statbuff) < 0) {
+    err_dump("db_bulkload(): fstat() error");
+  }
+  empty = empty &&
+          statbuff.st_size == ((db->features & F_ALLOC) ? DAT_HDR_SZ : 0);
+  ld.datend = statbuff.st_size;
+  if (!empty) {
+    if (_db_un_lock(db, db->idxfd, 0, 0) < 0) {
+      err_dump("db_bulkload(): un_lock() error");
+    }
+    _db_opend(db);
+  }
+
+  /*
+   * Read the records.  Into an empty database they go into memory, or the
+   * spool file once there are too many; otherwise they are staged in batches.
+   */
+  while ((rc = _db_bulkline(&ld, &line, &len)) > 0) {
+    st.nline++;
+    if ((tab = memchr(line, '\t', len)) == NULL) {
+      errno = EINVAL;
+      rc = -1;
+      break;
+    }
+    keylen = tab - line;
+    datlen = len - keylen - 1;
+    if (keylen == 0 || keylen + BULK_IDXEXTRA(db) > IDXLEN_MAX ||
+        datlen + 1 < DATLEN_MIN || datlen + 1 > DATLEN_MAX ||
+        memchr(line, 0, len) != NULL) {
+      errno = EINVAL;
+      rc = -1;
+      break;
+    }
+    *tab = 0;
+    line[len] = 0;
+    if (!empty) {
+      if (!db->inbatch) {
+        db_begin(db);
+      }
+      if (db_store(db, line, tab + 1, DB_STORE) < 0) {
+        err_dump("db_bulkload(): db_store() error");
+      }
+      if (db->nops == BULK_BATCH) {
+        st.nrec += db->nops - db_commit(db);
+      }
+    } else {
+      ld.nin++;
+      if (ld.spool != NULL) {
+        _db_bulkput(&ld, ld.spool, _db_hash(db, line), line, keylen, tab + 1,
+                    datlen);
+      } else {
+        _db_bulkadd(&ld, _db_hash(db, line), line, keylen, tab + 1, datlen);
+        if (ld.memused > ld.memlimit) {
+          _db_bulkspill(&ld);
+        }
+      }
+    }
+  }
+  free(ld.inbuf);
+  if (!empty) {
+    if (rc < 0) {
+      db_abort(db);
+    } else if (db->inbatch) {
+      st.nrec += db->nops - db_commit(db);
+    }
+    if (stats != NULL) {
+      st.memlimit = ld.memlimit;
+      *stats = st;
+    }
+    return (rc < 0 ? -1 : 0);
+  }
+
+  /*
+   * Lay out the hash table, then sort the records and write them chain by
+   * chain, all in memory or one spooled partition of the buckets at a time.
+   * The keys of an ordered database then go into its ordered index.
+   */
+  if (rc == 0 && ld.nin > 0) {
+    _db_bulktable(db, &ld);
+    if (ld.spool == NULL) {
+      rc = _db_bulkrecs(db, &ld);
+    } else {
+      rc = _db_bulkparts(db, &ld);
+      st.npart = ld.npart;
+    }
+    if (rc == 0 && ld.head != 0) {
+      _db_bulkslot(db, &ld, ld.bucket, ld.head);
+    }
+    while (ld.slotbase < ld.nslot) {
+      _db_bulkflush(db, &ld);
+    }
+    if (rc == 0 && (db->features & F_ORDERED)) {
+      _db_bulktree(db, db->recoff, ld.idxend);
+    }
+    if (db->maxload != 0) {
+      _db_addnrec(db, ld.nrec);
+    }
+    if (rc == 0) {
+      _db_chgfill(db);
+    }
+    if (db->walfd >= 0) {
+      _db_walckpt(db); /* syncs the files */
+    }
+  }
+  _db_bulkreset(&ld, 1);
+  if (ld.spool != NULL) {
+    fclose(ld.spool);
+  }
+  free(ld.heads);
+  free(ld.slotbuf);
+  if (_db_un_lock(db, db->idxfd, 0, 0) < 0) {
+    err_dump("db_bulkload(): un_lock() error");
+  }
+  _db_opend(db);
+  _db_bloomfill(db); /* the chains were written without their filters */
+  if (stats != NULL) {
+    st.memlimit = ld.memlimit;
+    st.nrec = ld.nrec;
+    st.ndup = ld.ndup;
+    *stats = st;
+  }
+  return (rc < 0 ? -1 : 0);
+} /* db_bulkload() */
+
+/**
+ * Read the next line for db_bulkload().  The line is left in ld->inbuf, with
+ * room after it for a null byte.
+ * @param ld load state.
+ * @param linep set to the start of the line.
+ * @param lenp set to the length of the line, without the newline.
+ * @return 1 if a line was read; 0 at end of file; -1 on a read error.
+ */
+static int _db_bulkline(DBLOAD *ld, char **linep, size_t *lenp) {
+  char *nl;
+  ssize_t n;
+
+  for (;;) {
+    if ((nl = memchr(ld->inbuf + ld->inpos, NEWLINE, ld->inlen - ld->inpos)) !=
+        NULL) {
+      *linep = ld->inbuf + ld->inpos;
+      *lenp = nl - *linep;
+      ld->inpos = nl + 1 - ld->inbuf;
+      return (1);
+    }
+    if (ld->inlen - ld->inpos > BULK_LINE) {
+      *linep = ld->inbuf + ld->inpos; /* too long to be a valid record */
+      *lenp = ld->inlen - ld->inpos;
+      return (1);
+    }
+    memmove(ld->inbuf, ld->inbuf + ld->inpos, ld->inlen - ld->inpos);
+    ld->inlen -= ld->inpos;
+    ld->inpos = 0;
+    if (ld->eof) {
+      if (ld->inlen == 0) {
+        return (0);
+      }
+      *linep = ld->inbuf; /* last line, without a newline */
+      *lenp = ld->inlen;
+      ld->inpos = ld->inlen;
+      return (1);
+    }
+    if ((n = read(ld->fd, ld->inbuf + ld->inlen, BULK_CHUNK - ld->inlen)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (-1);
+    }
+    if (n == 0) {
+      ld->eof = 1;
+    }
+    ld->inlen += n;
+  }
+} /* _db_bulkline() */
+
+/**
+ * Copy a record into memory for db_bulkload().  The records are copied into
+ * BULK_CHUNK sized buffers, to keep the number of malloc() calls down.
+ * @param ld load state.
+ * @param hval hash value of the key.
+ * @param key the key.
+ * @param keylen length of the key.
+ * @param data the data.
+ * @param datlen length of the data.
+ */
+static void _db_bulkadd(DBLOAD *ld, DBHASH hval, const char *key,
+                        size_t keylen, const char *data, size_t datlen) {
+  DBBREC *r;
+  char *p;
+  size_t need = keylen + datlen + 2; /* +2 for nulls */
+
+  if (ld->nchunks == 0 || ld->chunkused + need > BULK_CHUNK) {
+    if (ld->nchunks == ld->nalloc) {
+      if (ld->nalloc == ld->maxchunks) {
+        ld->maxchunks = ld->maxchunks * 2 + 16;
+        if ((ld->chunks = realloc(ld->chunks,
+                                  ld->maxchunks * sizeof(char *))) == NULL) {
+          err_dump("_db_bulkadd(): realloc() error");
+        }
+      }
+      if ((ld->chunks[ld->nalloc++] = malloc(BULK_CHUNK)) == NULL) {
+        err_dump("_db_bulkadd(): malloc() error");
+      }
+    }
+    ld->nchunks++;
+    ld->chunkused = 0;
+  }
+  if (ld->nrecs == ld->maxrecs) {
+    ld->maxrecs = ld->maxrecs * 2 + 1024;
+    if ((r = realloc(ld->recs, ld->maxrecs * sizeof(DBBREC))) == NULL) {
+      err_dump("_db_bulkadd(): realloc() error");
+    }
+    ld->recs = r;
+  }
+  p = ld->chunks[ld->nchunks - 1] + ld->chunkused;
+  ld->chunkused += need;
+  r = ld->recs + ld->nrecs;
+  r->key = p;
+  memcpy(p, key, keylen);
+  p[keylen] = 0;
+  r->data = p + keylen + 1;
+  memcpy(r->data, data, datlen);
+  r->data[datlen] = 0;
+  r->hval = hval;
+  r->seq = ld->nrecs++;
+  ld->memused += need + sizeof(DBBREC);
+} /* _db_bulkadd() */
+
+/**
+ * Forget the records db_bulkload() has in memory.  The memory they were in is
+ * kept for the next partition, which is quicker than getting new memory from
+ * the system each time, unless it is to be freed.
+ * @param ld load state.
+ * @param release 1 to free the memory.
+ */
+static void _db_bulkreset(DBLOAD *ld, int release) {
+  long i;
+
+  if (release) {
+    for (i = 0; i < ld->nalloc; i++) {
+      free(ld->chunks[i]);
+    }
+    free(ld->chunks);
+    free(ld->recs);
+    ld->chunks = NULL;
+    ld->recs = NULL;
+    ld->nalloc = ld->maxchunks = ld->maxrecs = 0;
+  }
+  ld->nchunks = ld->nrecs = 0;
+  ld->memused = 0;
+} /* _db_bulkreset() */
+
+/**
+ * Move the records db_bulkload() has in memory to a new spool file, where the
+ * rest of the records go as well.
+ * @param ld load state.
+ */
+static void _db_bulkspill(DBLOAD *ld) {
+  long i;
+
+  if ((ld->spool = tmpfile()) == NULL ||
+      setvbuf(ld->spool, NULL, _IOFBF, BULK_FILEBUF) != 0) {
+    err_dump("_db_bulkspill(): tmpfile() error");
+  }
+  for (i = 0; i < ld->nrecs; i++) {
+    _db_bulkput(ld, ld->spool, ld->recs[i].hval, ld->recs[i].key,
+                strlen(ld->recs[i].key), ld->recs[i].data,
+                strlen(ld->recs[i].data));
+  }
+  _db_bulkreset(ld, 0);
+} /* _db_bulkspill() */
+
+/**
+ * Append a record to a spool or partition file of db_bulkload(): the hash
+ * value, the lengths of the key and data, the key and the data.
+ * @param ld load state.
+ * @param fp file to append to.
+ * @param hval hash value of the key.
+ * @param key the key.
+ * @param keylen length of the key.
+ * @param data the data.
+ * @param datlen length of the data.
+ */
+static void _db_bulkput(DBLOAD *ld, FILE *fp, DBHASH hval, const char *key,
+                        size_t keylen, const char *data, size_t datlen) {
+  unsigned char hdr[BULK_HDR_SZ];
+
+  _db_put64(hdr, hval);
+  _db_put16(hdr + 8, keylen);
+  _db_put16(hdr + 10, datlen);
+  if (fwrite(hdr, BULK_HDR_SZ, 1, fp) != 1 ||
+      fwrite(key, 1, keylen, fp) != keylen ||
+      fwrite(data, 1, datlen, fp) != datlen) {
+    err_dump("_db_bulkput(): fwrite() error");
+  }
+  ld->spoolmem += keylen + datlen + 2 + sizeof(DBBREC);
+} /* _db_bulkput() */
+
+/**
+ * Read the next record from a spool or partition file of db_bulkload().
+ * @param fp file to read.
+ * @param hvalp set to the hash value of the key.
+ * @param buf set to the key, followed by the data, each of them null
+ * terminated; IDXLEN_MAX + DATLEN_MAX bytes.
+ * @param keylenp set to the length of the key.
+ * @param datlenp set to the length of the data.
+ * @return 1 if a record was read; 0 at end of file.
+ */
+static int _db_bulkget(FILE *fp, DBHASH *hvalp, char *buf, size_t *keylenp,
+                       size_t *datlenp) {
+  unsigned char hdr[BULK_HDR_SZ];
+
+  if (fread(hdr, BULK_HDR_SZ, 1, fp) != 1) {
+    if (ferror(fp)) {
+      err_dump("_db_bulkget(): fread() error");
+    }
+    return (0);
+  }
+  *hvalp = _db_get64(hdr);
+  *keylenp = _db_get16(hdr + 8);
+  *datlenp = _db_get16(hdr + 10);
+  if (fread(buf, 1, *keylenp, fp) != *keylenp ||
+      fread(buf + *keylenp + 1, 1, *datlenp, fp) != *datlenp) {
+    err_dump("_db_bulkget(): fread() error");
+  }
+  buf[*keylenp] = 0;
+  buf[*keylenp + 1 + *datlenp] = 0;
+  return (1);
+} /* _db_bulkget() */
+
+/**
+ * Lay out the hash table for db_bulkload(), for ld->nin records.  With a
+ * maxload, as many buckets are made as the records would have split to, up to
+ * the most that can be made, and the hash table segments they need are written
+ * first thing after the hash table, as _db_split() would have written them.
+ * The slots of every bucket are then written by _db_bulkflush().
+ * @param db pointer to database structure, with the index file write locked.
+ * @param ld load state.
+ */
+static void _db_bulktable(DB *db, DBLOAD *ld) {
+  unsigned char rec[BIN_REC_SZ];
+  DBHASH nb, size;
+  size_t seglen, extlen;
+  int k;
+
+  nb = db->nhash;
+  if (db->maxload != 0 &&
+      (DBHASH)(ld->nin + db->maxload - 1) / db->maxload > nb) {
+    nb = (ld->nin + db->maxload - 1) / db->maxload;
+  }
+  for (k = 1, size = db->nhash; size < nb; k++, size *= 2) {
+    seglen = BIN_REC_SZ + size * BIN_SLOT_SZ;
+    extlen = (db->features & F_ALLOC) ? _db_extsize(seglen) : seglen;
+    if (k >= BIN_NSEG || extlen > UINT32_MAX) {
+      nb = size; /* can't split any more */
+      break;
+    }
+    memset(rec, 0, BIN_REC_SZ);
+    _db_put32(rec + REC_MAGIC, BIN_REC_MAGIC);
+    _db_put32(rec + REC_LEN, extlen);
+    _db_put16(rec + REC_FLAGS, REC_F_SEGMENT);
+    if (_db_pwrite(db, db->idxfd, rec, BIN_REC_SZ, ld->idxend) != BIN_REC_SZ) {
+      err_dump("_db_bulktable(): pwrite() error of hash table segment");
+    }
+    if (db->features & F_ALLOC) {
+      _db_put32(rec, extlen);
+      if (_db_pwrite(db, db->idxfd, rec, EXT_FTR_SZ,
+                     ld->idxend + extlen - EXT_FTR_SZ) != EXT_FTR_SZ) {
+        err_dump("_db_bulktable(): pwrite() error of hash table segment");
+      }
+    }
+    db->segoff[k] = ld->idxend + BIN_REC_SZ;
+    _db_put64(rec, db->segoff[k]);
+    if (_db_pwrite(db, db->idxfd, rec, 8, HDR_SEGOFF + k * 8) != 8) {
+      err_dump("_db_bulktable(): pwrite() error of segment offset");
+    }
+    ld->idxend += extlen;
+  }
+  ld->nslot = (nb > db->nhash ? size : nb); /* slots in all the segments */
+  if (nb != db->nbucket) {
+    db->nbucket = nb;
+    _db_put64(rec, nb);
+    if (_db_pwrite(db, db->idxfd, rec, 8, HDR_NBUCKET) != 8) {
+      err_dump("_db_bulktable(): pwrite() error of number of buckets");
+    }
+  }
+  if ((ld->heads = calloc(BULK_SLOTS, sizeof(off_t))) == NULL ||
+      (ld->slotbuf = malloc(BULK_SLOTS * db->slotsz + 1)) == NULL) {
+    err_dump("_db_bulktable(): malloc() error");
+  }
+} /* _db_bulktable() */
+
+/**
+ * Set the chain ptr of a bucket for db_bulkload(), writing out the slots of
+ * the buckets before it as needed.  Buckets must be set in ascending order.
+ * @param db pointer to database structure.
+ * @param ld load state.
+ * @param bucket bucket number.
+ * @param ptrval chain ptr.
+ */
+static void _db_bulkslot(DB *db, DBLOAD *ld, DBHASH bucket, off_t ptrval) {
+  while (bucket >= ld->slotbase + BULK_SLOTS) {
+    _db_bulkflush(db, ld);
+  }
+  ld->heads[bucket - ld->slotbase] = ptrval;
+} /* _db_bulkslot() */
+
+/**
+ * Write the next BULK_SLOTS slots of the hash table for db_bulkload(), with a
+ * write for each hash table segment they are in.
+ * @param db pointer to database structure.
+ * @param ld load state.
+ */
+static void _db_bulkflush(DB *db, DBLOAD *ld) {
+  DBHASH b, end, segend, size;
+  unsigned char *slot;
+  size_t i, n;
+  off_t *head;
+
+  end = ld->slotbase + BULK_SLOTS;
+  if (end > ld->nslot) {
+    end = ld->nslot;
+  }
+  for (b = ld->slotbase, head = ld->heads; b < end; b = segend) {
+    if (b < db->nhash) {
+      segend = db->nhash;
+    } else {
+      for (size = db->nhash; b >= size * 2; size *= 2) {
+        ;
+      }
+      segend = size * 2;
+    }
+    if (segend > end) {
+      segend = end;
+    }
+    n = segend - b;
+    if (db->format == DB_FMT_BINARY) {
+      /*
+       * The chains of an empty database have never been changed, so they
+       * are all at generation 0 until now.
+       */
+      memset(ld->slotbuf, 0, n * BIN_SLOT_SZ);
+      for (i = 0; i < n; i++) {
+        slot = (unsigned char *)ld->slotbuf + i * BIN_SLOT_SZ;
+        _db_put64(slot + SLOT_PTR, head[i]);
+        if (db->features & F_CHAINGEN) {
+          _db_put64(slot + SLOT_GEN, 1);
+        }
+      }
+    } else {
+      for (i = 0; i < n; i++) {
+        sprintf(ld->slotbuf + i * PTR_SZ, "%*lld", PTR_SZ, (long long)head[i]);
+      }
+    }
+    if (_db_pwrite(db, db->idxfd, ld->slotbuf, n * db->slotsz,
+                   _db_bucketoff(db, b)) != n * db->slotsz) {
+      err_dump("_db_bulkflush(): pwrite() error of hash table");
+    }
+    head += n;
+  }
+  memset(ld->heads, 0, BULK_SLOTS * sizeof(off_t));
+  ld->slotbase += BULK_SLOTS;
+} /* _db_bulkflush() */
+
+/**
+ * Sort the records db_bulkload() has in memory by bucket, and write them
+ * chain by chain at the ends of the files, BULK_CHUNK bytes of data records at
+ * a time followed by their index records.  Of the records with the same key,
+ * only the last one read is written.  The chain being written when the records
+ * run out is carried on by the next call.
+ * @param db pointer to database structure.
+ * @param ld load state.
+ * @return 0 if OK; -1 with errno set to EFBIG if an ASCII index file gets too
+ * big for its chain ptrs.
+ */
+static int _db_bulkrecs(DB *db, DBLOAD *ld) {
+  DBBREC *r, *end;
+  long i, j;
+  const char *dat;
+  size_t packlen;
+
+  for (i = 0; i < ld->nrecs; i++) {
+    ld->recs[i].bucket = _db_bucket(db, ld->recs[i].hval);
+  }
+  qsort(ld->recs, ld->nrecs, sizeof(DBBREC), _db_cmpbrec);
+  end = ld->recs + ld->nrecs;
+  for (i = 0; i < ld->nrecs; i = j) {
+    db->batchlen = 0;
+    for (j = i; j < ld->nrecs && db->batchlen < BULK_CHUNK; j++) {
+      r = ld->recs + j;
+      if (r + 1 < end && r[1].bucket == r->bucket &&
+          strcmp(r[1].key, r->key) == 0) {
+        r->datoff = -1; /* replaced by a later record */
+        ld->ndup++;
+        continue;
+      }
+      r->datlen = strlen(r->data) + 1;
+      r->rawlen = 0;
+      dat = r->data;
+      if ((packlen = _db_pack(db, r->data, r->datlen, 0)) != 0) {
+        dat = db->packbuf;
+        r->rawlen = r->datlen;
+        r->datlen = packlen;
+      }
+      r->datsum = 0;
+      if (db->features & F_CHECKSUM) {
+        r->datsum = _db_datsum(dat, r->datlen - 1);
+      }
+      if (db->features & F_ALLOC) {
+        r->datoff = ld->datend + db->batchlen + EXT_HDR_SZ;
+        _db_batchext(db, EXT_DAT_MAGIC, _db_extsize(EXT_HDR_SZ + r->datlen),
+                     dat, r->datlen - 1, NEWLINE);
+      } else {
+        r->datoff = ld->datend + db->batchlen;
+        _db_batchput(db, r->data, r->datlen - 1);
+        *_db_batchput(db, NULL, 1) = NEWLINE;
+      }
+    }
+    if (_db_pwrite(db, db->datfd, db->batchbuf, db->batchlen, ld->datend) !=
+        db->batchlen) {
+      err_dump("_db_bulkrecs(): pwrite() error of data records");
+    }
+    ld->datend += db->batchlen;
+
+    db->batchlen = 0;
+    for (r = ld->recs + i; r < ld->recs + j; r++) {
+      if (r->datoff < 0) {
+        continue;
+      }
+      if (r->bucket != ld->bucket) {
+        if (ld->head != 0) {
+          _db_bulkslot(db, ld, ld->bucket, ld->head);
+        }
+        ld->bucket = r->bucket;
+        ld->head = 0;
+      }
+      db->datoff = r->datoff;
+      db->datlen = r->datlen;
+      db->rawlen = r->rawlen;
+      db->datsum = r->datsum;
+      db->idxoff = ld->idxend + db->batchlen;
+      if (db->format == DB_FMT_ASCII && db->idxoff > PTR_MAX) {
+        errno = EFBIG;
+        return (-1);
+      }
+      if (db->features & F_ALLOC) {
+        db->idxlen = _db_extsize(BIN_REC_SZ + strlen(r->key));
+      }
+      _db_batchidx(db, r->key, ld->head);
+      ld->head = db->idxoff;
+      ld->nrec++;
+    }
+    if (_db_pwrite(db, db->idxfd, db->batchbuf, db->batchlen, ld->idxend) !=
+        db->batchlen) {
+      err_dump("_db_bulkrecs(): pwrite() error of index records");
+    }
+    ld->idxend += db->batchlen;
+  }
+  db->batchlen = 0;
+  return (0);
+} /* _db_bulkrecs() */
+
+/**
+ * Write the spooled records for db_bulkload(): divide them among partition
+ * files by bucket, so that each partition fits in memory, then read the
+ * partitions in bucket order and write their records with _db_bulkrecs().
+ * @param db pointer to database structure.
+ * @param ld load state, with the records in the spool file.
+ * @return as for _db_bulkrecs().
+ */
+static int _db_bulkparts(DB *db, DBLOAD *ld) {
+  char buf[IDXLEN_MAX + DATLEN_MAX];
+  FILE **parts;
+  DBHASH hval, per;
+  size_t keylen, datlen;
+  long p;
+  int rc = 0;
+
+  ld->npart = ld->spoolmem / ld->memlimit + 1;
+  if (ld->npart > BULK_MAXPART) {
+    ld->npart = BULK_MAXPART; /* bigger partitions than asked for */
+  }
+  per = (db->nbucket + ld->npart - 1) / ld->npart;
+  if ((parts = malloc(ld->npart * sizeof(FILE *))) == NULL) {
+    err_dump("_db_bulkparts(): malloc() error");
+  }
+  for (p = 0; p < ld->npart; p++) {
+    if ((parts[p] = tmpfile()) == NULL ||
+        setvbuf(parts[p], NULL, _IOFBF, BULK_FILEBUF) != 0) {
+      err_dump("_db_bulkparts(): tmpfile() error");
+    }
+  }
+  rewind(ld->spool);
+  while (_db_bulkget(ld->spool, &hval, buf, &keylen, &datlen)) {
+    _db_bulkput(ld, parts[_db_bucket(db, hval) / per], hval, buf, keylen,
+                buf + keylen + 1, datlen);
+  }
+  fclose(ld->spool);
+  ld->spool = NULL;
+
+  for (p = 0; p < ld->npart; p++) {
+    if (rc == 0) {
+      rewind(parts[p]);
+      while (_db_bulkget(parts[p], &hval, buf, &keylen, &datlen)) {
+        _db_bulkadd(ld, hval, buf, keylen, buf + keylen + 1, datlen);
+      }
+      rc = _db_bulkrecs(db, ld);
+      _db_bulkreset(ld, 0);
+    }
+    fclose(parts[p]);
+  }
+  free(parts);
+  return (rc);
+} /* _db_bulkparts() */
+
+/**
+ * qsort() comparison function that orders the records of db_bulkload() by
+ * bucket, then by key, then in the order they were read.
+ * @param a pointer to a DBBREC.
+ * @param b pointer to a DBBREC.
+ * @return negative, zero or positive as a is before, with or after b.
+ */
+static int _db_cmpbrec(const void *a, const void *b) {
+  const DBBREC *ra = a, *rb = b;
+  int c;
+
+  if (ra->bucket != rb->bucket) {
+    return (ra->bucket < rb->bucket ? -1 : 1);
+  }
+  if ((c = strcmp(ra->key, rb->key)) != 0) {
+    return (c);
+  }
+  return (ra->seq < rb->seq ? -1 : ra->seq > rb->seq);
+} /* _db_cmpbrec() */
+
+/**
+ * Put the keys of the records written by db_bulkload() into the ordered index
+ * (F_ORDERED).  The index records are read back a chunk at a time, and the
+ * hash table segments among them are skipped.  Called with the whole index file
+ * write locked.
+ * @param db pointer to database structure.
+ * @param start offset of the first record written.
+ * @param end end of the records written.
+ */
+static void _db_bulktree(DB *db, off_t start, off_t end) {
+  unsigned char *buf;
+  char key[IDXLEN_MAX];
+  size_t len, pos, reclen, keylen;
+
+  if ((buf = malloc(BULK_CHUNK)) == NULL) {
+    err_dump("_db_bulktree(): malloc() error");
+  }
+  while (start < end) {
+    len = (end - start < BULK_CHUNK ? end - start : BULK_CHUNK);
+    if (pread(db->idxfd, buf, len, start) != len) {
+      err_dump("_db_bulktree(): pread() error");
+    }
+    for (pos = 0; pos + BIN_REC_SZ <= len; pos += reclen) {
+      reclen = _db_get32(buf + pos + REC_LEN);
+      if (_db_get32(buf + pos + REC_MAGIC) != BIN_REC_MAGIC ||
+          reclen < EXT_MIN) {
+        err_dump("_db_bulktree(): missing record magic");
+      }
+      if (pos + reclen > len) {
+        if (pos == 0) {
+          pos = reclen; /* only a hash table segment is bigger than a chunk */
+        }
+        break;
+      }
+      keylen = _db_get16(buf + pos + REC_KEYLEN);
+      if (!(_db_get16(buf + pos + REC_FLAGS) & (REC_F_SEGMENT | REC_F_TREE)) &&
+          keylen > 0 && keylen < IDXLEN_MAX) {
+        memcpy(key, buf + pos + BIN_REC_SZ, keylen);
+        key[keylen] = 0;
+        _db_treeput(db, key, 1, 1);
+      }
+    }
+    if (pos == 0) {
+      err_dump("_db_bulktree(): short index record");
+    }
+    start += pos;
+  }
+  free(buf);
+} /* _db_bulktree() */
+
+/**
+ * Try to find a free index record and accompanying data record of the correct
+ * sizes.  This function is only called by db_store().
+ * @param db pointer to database structure.
+ * @param keylen size of key.
+ * @param datlen size of data record.
+ * @return 0 on success; -1 if no match is found; dump core if write locking
+ * fails.
+ */
+static int _db_findfree(DB *db, int keylen, int datlen) {
+  int rc;
+  off_t offset, nextoffset, saveoffset;
+
+  /*
+   * Lock the free list to avoid interfering with any other processes using the
+   * free list.
+   */
+  if (_db_writew_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_findfree(): writew_lock() error");
+  }
+
+  /*
+   * Read the free list pointer at the head of the list.
+   */
+  saveoffset = db->freeoff;
+  offset = _db_readptr(db, saveoffset);
+
+  /*
+   * Iterate the free list to find a record with matching key and data sizes.
+   * This simple db library implementation only reuses deleted records if the
+   * key length and data length equal the lengths of the new record being
+   * inserted.
+   */
+  while (offset != 0) {
+    nextoffset = _db_readidx(db, offset);
+    if (strlen(db->idxbuf) == keylen && db->datlen == datlen) {
+      break; /* found a match for key size & data size */
+    }
+    saveoffset = offset + db->recptr;
+    offset = nextoffset;
+  }
+
+  if (offset == 0) {
+    rc = -1; /* no match found */
+  } else {
+    /*
+     * Found a free record with matching key an data sizes.  The index record
+     * was read in by _db_readidx() above, which sets db->ptrval.  Also,
+     * saveoffset points to the chain ptr that pointed to this empty record on
+     * the free list.  Set this chain ptr to db->ptrval, which removes the empty
+     * record from the free list.  By writing the previous record's chain ptr
+     * to point to the next chain pointer value of the record that was found,
+     * it removes the record from the free list.
+     */
+    _db_writeptr(db, saveoffset, db->ptrval);
+    rc = 0;
+
+    /*
+     * Note: _db_readidx() set both db->idxoff and db->datoff.  This is used by
+     * the caller, db_store(), to write the new index record and data record.
+     */
+  }
+
+  /*
+   * Unlock the free list.
+   */
+  if (_db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_findfree(): un_lock() error");
+  }
+  return (rc);
+} /* _db_findfree() */
+
+/**
+ * Allocate the extents for a new index record and its data record, with the
+ * free space manager (F_ALLOC).  Only called by db_store(), with the hash chain
+ * write locked.  Sets db->idxoff and db->idxlen to the index record extent, and
+ * db->datoff to where the data record goes in its extent.
+ * @param db pointer to database structure.
+ * @param keylen size of key.
+ * @param datlen size of data record, including the newline.
+ * @return 1 if free space was reused; 0 if the records were appended.
+ */
+static int _db_allocrec(DB *db, int keylen, int datlen) {
+  size_t size;
+  int reused = 0;
+
+  if (_db_writew_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_allocrec(): writew_lock() error");
+  }
+  db->idxlen = _db_extsize(BIN_REC_SZ + keylen);
+  db->idxoff = _db_extalloc(db, HEAP_IDX, &db->idxlen, &reused);
+  size = _db_extsize(EXT_HDR_SZ + datlen);
+  db->datoff = _db_extalloc(db, HEAP_DAT, &size, &reused) + EXT_HDR_SZ;
+  if (_db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_allocrec(): un_lock() error");
+  }
+  return (reused);
+} /* _db_allocrec() */
+
+/**
+ * Replace the data of the current record with data of a different length, with
+ * the free space manager (F_ALLOC), or of any length with checksums
+ * (F_CHECKSUM) or compression (F_PACKED).  The data is rewritten in place if it
+ * fits the extent of the old data and doesn't leave more than half of it
+ * unused; otherwise it's written to a new extent, and the old one is freed.
+ * Either way, the index record is updated in place and stays on its hash
+ * chain.  In an update that copies on write, both records are written to new
+ * extents instead, the new index record takes the place of the old one on the
+ * chain, and the old ones are retired; db->idxoff is then the new index
+ * record.  Only called by db_store() and db_commit(), with the hash chain
+ * write locked, the key of the record in db->idxbuf, db->ptroff and
+ * db->ptrval set by the chain walk, and db->rawlen set for the new data.
+ * @param db pointer to database structure.
+ * @param data pointer to the data, packed if db->rawlen isn't 0.
+ * @param datlen size of data record, including the newline.
+ * @return 1 if the data record was moved; 0 if it was rewritten in place.
+ */
+static int _db_rewritedat(DB *db, const char *data, int datlen) {
+  unsigned char buf[BIN_REC_SZ + IDXLEN_MAX];
+  off_t oldoff, oldidx;
+  size_t size, keylen, len;
+  int reused, moved = 0;
+
+  oldoff = db->datoff - EXT_HDR_SZ;
+  if (pread(db->datfd, buf, EXT_HDR_SZ, oldoff) != EXT_HDR_SZ ||
+      _db_get32(buf) != EXT_DAT_MAGIC) {
+    err_dump("_db_rewritedat(): missing data extent");
+  }
+
+  /*
+   * The free list lock also keeps db_nextrec() from reading the record while
+   * the data and its length don't match.
+   */
+  if (_db_writew_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_rewritedat(): writew_lock() error");
+  }
+  if (db->cow) {
+    oldidx = db->idxoff;
+    db->idxlen = _db_extsize(BIN_REC_SZ + strlen(db->idxbuf));
+    db->idxoff = _db_extalloc(db, HEAP_IDX, &db->idxlen, &reused);
+    size = _db_extsize(EXT_HDR_SZ + datlen);
+    db->datoff = _db_extalloc(db, HEAP_DAT, &size, &reused) + EXT_HDR_SZ;
+    _db_writedat(db, data, datlen, db->datoff, SEEK_SET);
+    _db_writeidx(db, db->idxbuf, db->idxoff, SEEK_SET, db->ptrval);
+    _db_writeptr(db, db->ptroff, db->idxoff);
+    _db_retire(db, HEAP_IDX, oldidx);
+    _db_retire(db, HEAP_DAT, oldoff);
+    if (_db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+      err_dump("_db_rewritedat(): un_lock() error");
+    }
+    return (1);
+  }
+  size = _db_extsize(EXT_HDR_SZ + datlen);
+  if (size > _db_get32(buf + 4) || size * 2 < _db_get32(buf + 4)) {
+    moved = 1;
+    db->datoff = _db_extalloc(db, HEAP_DAT, &size, &reused) + EXT_HDR_SZ;
+  }
+  _db_writedat(db, data, datlen, db->datoff, SEEK_SET);
+
+  /*
+   * Point the index record at the new data before the old data is freed.  With
+   * checksums or compression, the rest of the header after the chain ptr is
+   * written as well.
+   */
+  memset(buf, 0, BIN_REC_SZ);
+  _db_put64(buf + REC_DATOFF, db->datoff);
+  _db_put32(buf + REC_DATLEN, db->datlen);
+  len = REC_KEYLEN - REC_DATOFF;
+  if (db->features & (F_CHECKSUM | F_PACKED)) {
+    keylen = strlen(db->idxbuf);
+    _db_put32(buf + REC_MAGIC, BIN_REC_MAGIC);
+    _db_put32(buf + REC_LEN, db->idxlen);
+    _db_put16(buf + REC_KEYLEN, keylen);
+    if (db->rawlen != 0) {
+      _db_put16(buf + REC_FLAGS, REC_F_PACKED);
+      _db_put32(buf + REC_RAWLEN, db->rawlen);
+    }
+    if (db->features & F_SNAPSHOT) {
+      _db_put32(buf + REC_BIRTH, db->epoch);
+    }
+    if (db->features & F_CHECKSUM) {
+      _db_put32(buf + REC_DATSUM, db->datsum);
+      memcpy(buf + BIN_REC_SZ, db->idxbuf, keylen);
+      _db_put32(buf + REC_SUM, _db_recsum(buf, keylen));
+    }
+    len = BIN_REC_SZ - REC_DATOFF;
+  }
+  if (_db_pwrite(db, db->idxfd, buf + REC_DATOFF, len,
+                 db->idxoff + REC_DATOFF) != len) {
+    err_dump("_db_rewritedat(): pwrite() error of index record");
+  }
+  if (moved) {
+    _db_extfree(db, HEAP_DAT, oldoff);
+  }
+  if (_db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_rewritedat(): un_lock() error");
+  }
+  return (moved);
+} /* _db_rewritedat() */
+
+/**
+ * Size of the extent needed to hold len bytes, including the extent header.
+ * @param len number of bytes, including the extent header.
+ * @return extent size.
+ */
+static size_t _db_extsize(size_t len) {
+  len = (len + EXT_FTR_SZ + EXT_ALIGN - 1) & ~(size_t)(EXT_ALIGN - 1);
+  return (len < EXT_MIN ? EXT_MIN : len);
+} /* _db_extsize() */
+
+/**
+ * Size class of an extent.  Class 4 * (p - 5) + q holds the extents of (4 + q)
+ * * 2^(p-2) up to (5 + q) * 2^(p-2) - 1 bytes.
+ * @param size extent size, at least EXT_MIN.
+ * @param roundup 0 for the class that a free extent of this size goes in; 1 for
+ * the first class where every extent has at least this size.
+ * @return size class; EXT_NCLASS if roundup is set and there is no such class.
+ */
+static int _db_extclass(size_t size, int roundup) {
+  int p, q;
+
+  for (p = 5; p < 32 && (size >> (p + 1)) != 0; p++) {
+    ; /* p = log2(size), rounded down */
+  }
+  q = (size >> (p - 2)) & 3;
+  if (roundup && size > ((size_t)(4 + q) << (p - 2))) {
+    return (4 * (p - 5) + q + 1);
+  }
+  return (4 * (p - 5) + q);
+} /* _db_extclass() */
+
+/**
+ * Allocate an extent from one of the heaps, taking the first free extent from
+ * the smallest size class that is big enough.  A free extent that is bigger
+ * than needed is split, unless the rest would be too small to be an extent.
+ * If there is no free extent big enough, the extent is appended to the file.
+ * The extent is marked as used; an index record extent gets a zeroed record
+ * header, which db_nextrec() skips until the record is written.  The caller
+ * must hold the free list lock.
+ * @param db pointer to database structure.
+ * @param heap HEAP_IDX or HEAP_DAT.
+ * @param sizep size of the extent wanted, from _db_extsize(); set to the size
+ * actually allocated, which may be a little more.
+ * @param reused set to 1 if free space was used; unchanged otherwise.
+ * @return offset of the extent.
+ */
+static off_t _db_extalloc(DB *db, int heap, size_t *sizep, int *reused) {
+  unsigned char heads[EXT_NCLASS * 8], ext[EXT_FREE_SZ];
+  int fd = (heap == HEAP_IDX ? db->idxfd : db->datfd);
+  int c;
+  off_t off = 0;
+  size_t size;
+
+  if (pread(db->idxfd, heads, sizeof(heads),
+            HDR_FREECLS + heap * EXT_NCLASS * 8) != sizeof(heads)) {
+    err_dump("_db_extalloc(): pread() error of free lists");
+  }
+  for (c = _db_extclass(*sizep, 1); c < EXT_NCLASS; c++) {
+    if ((off = _db_get64(heads + c * 8)) != 0) {
+      break;
+    }
+  }
+  if (c < EXT_NCLASS) {
+    if (pread(fd, ext, EXT_FREE_SZ, off) != EXT_FREE_SZ ||
+        _db_get32(ext) != EXT_FREE_MAGIC) {
+      err_dump("_db_extalloc(): missing free extent");
+    }
+    _db_extunlink(db, heap, ext);
+    size = _db_get32(ext + 4);
+    if (size - *sizep >= EXT_MIN) {
+      _db_extlink(db, heap, off + *sizep, size - *sizep);
+    } else {
+      *sizep = size;
+    }
+    *reused = 1;
+  } else if ((off = lseek(fd, 0, SEEK_END)) == -1) {
+    err_dump("_db_extalloc(): lseek() error");
+  }
+  _db_extput(db, heap, off,
+             heap == HEAP_IDX ? BIN_REC_MAGIC : EXT_DAT_MAGIC, *sizep, 0);
+  return (off);
+} /* _db_extalloc() */
+
+/**
+ * Free an extent, merging it with the free extents before and after it, if
+ * any.  The caller must hold the free list lock.
+ * @param db pointer to database structure.
+ * @param heap HEAP_IDX or HEAP_DAT.
+ * @param off offset of the extent.
+ */
+static void _db_extfree(DB *db, int heap, off_t off) {
+  unsigned char ext[EXT_FREE_SZ];
+  int fd = (heap == HEAP_IDX ? db->idxfd : db->datfd);
+  off_t base = (heap == HEAP_IDX ? db->recoff : DAT_HDR_SZ);
+  size_t size, prevsize, origsize;
+
+  if (pread(fd, ext, EXT_HDR_SZ, off) != EXT_HDR_SZ) {
+    err_dump("_db_extfree(): pread() error");
+  }
+  size = origsize = _db_get32(ext + 4);
+
+  /*
+   * The size at the end of the extent before this one tells where it starts.
+   */
+  if (off > base) {
+    if (pread(fd, ext, EXT_FTR_SZ, off - EXT_FTR_SZ) != EXT_FTR_SZ) {
+      err_dump("_db_extfree(): pread() error");
+    }
+    prevsize = _db_get32(ext);
+    if (prevsize < EXT_MIN || prevsize > off - base ||
+        pread(fd, ext, EXT_FREE_SZ, off - prevsize) != EXT_FREE_SZ) {
+      err_dump("_db_extfree(): invalid extent before %lld", (long long)off);
+    }
+    if (_db_get32(ext) == EXT_FREE_MAGIC) {
+      _db_extunlink(db, heap, ext);
+      off -= prevsize;
+      size += prevsize;
+    }
+  }
+
+  /*
+   * Nothing follows the last extent in the file.
+   */
+  if (pread(fd, ext, EXT_FREE_SZ, off + size) == EXT_FREE_SZ &&
+      _db_get32(ext) == EXT_FREE_MAGIC) {
+    _db_extunlink(db, heap, ext);
+    size += _db_get32(ext + 4);
+  }
+  if (heap == HEAP_IDX && size != origsize) {
+    _db_put64(ext, _db_readmerges(db) + 1);
+    if (_db_pwrite(db, db->idxfd, ext, 8, HDR_MERGES) != 8) {
+      err_dump("_db_extfree(): pwrite() error of merge count");
+    }
+  }
+  _db_extlink(db, heap, off, size);
+} /* _db_extfree() */
+
+/**
+ * Read the number of index extent merges from the index file header.  The
+ * caller must hold the free list lock.
+ * @param db pointer to database structure.
+ * @return number of merges.
+ */
+static uint64_t _db_readmerges(DB *db) {
+  unsigned char buf[8];
+
+  if (pread(db->idxfd, buf, 8, HDR_MERGES) != 8) {
+    err_dump("_db_readmerges(): pread() error");
+  }
+  return (_db_get64(buf));
+} /* _db_readmerges() */
+
+/**
+ * Find the place of db_nextrec() again after extents have been merged, which
+ * may have left db->scanoff inside a free extent.  Step through the index file
+ * from the first index record to the first extent at or after db->scanoff.
+ * The caller must hold the free list lock.
+ * @param db pointer to database structure.
+ */
+static void _db_rescan(DB *db) {
+  unsigned char ext[EXT_HDR_SZ];
+  off_t off;
+  size_t size;
+
+  for (off = db->recoff; off < db->scanoff; off += size) {
+    if (pread(db->idxfd, ext, EXT_HDR_SZ, off) != EXT_HDR_SZ) {
+      break; /* end of file */
+    }
+    if ((size = _db_get32(ext + 4)) < EXT_MIN) {
+      err_dump("_db_rescan(): invalid extent at %lld", (long long)off);
+    }
+  }
+  db->scanoff = off;
+} /* _db_rescan() */
+
+/**
+ * Turn an extent into a free extent, and put it at the head of the list of its
+ * size class.  The caller must hold the free list lock.
+ * @param db pointer to database structure.
+ * @param heap HEAP_IDX or HEAP_DAT.
+ * @param off offset of the extent.
+ * @param size size of the extent.
+ */
+static void _db_extlink(DB *db, int heap, off_t off, size_t size) {
+  unsigned char buf[8];
+  int fd = (heap == HEAP_IDX ? db->idxfd : db->datfd);
+  off_t headoff, next;
+
+  headoff = HDR_FREECLS + (heap * EXT_NCLASS + _db_extclass(size, 0)) * 8;
+  if (pread(db->idxfd, buf, 8, headoff) != 8) {
+    err_dump("_db_extlink(): pread() error of free list");
+  }
+  next = _db_get64(buf);
+  _db_extput(db, heap, off, EXT_FREE_MAGIC, size, next);
+  _db_put64(buf, off);
+  if (next != 0 && _db_pwrite(db, fd, buf, 8, next + EXT_PREV) != 8) {
+    err_dump("_db_extlink(): pwrite() error of free extent");
+  }
+  if (_db_pwrite(db, db->idxfd, buf, 8, headoff) != 8) {
+    err_dump("_db_extlink(): pwrite() error of free list");
+  }
+} /* _db_extlink() */
+
+/**
+ * Take a free extent off the list of its size class.  The caller must hold the
+ * free list lock.
+ * @param db pointer to database structure.
+ * @param heap HEAP_IDX or HEAP_DAT.
+ * @param ext the EXT_FREE_SZ byte header of the free extent.
+ */
+static void _db_extunlink(DB *db, int heap, const unsigned char *ext) {
+  unsigned char buf[8];
+  int fd = (heap == HEAP_IDX ? db->idxfd : db->datfd);
+  off_t next, prev, headoff;
+
+  next = _db_get64(ext + EXT_NEXT);
+  prev = _db_get64(ext + EXT_PREV);
+  _db_put64(buf, next);
+  if (prev != 0) {
+    if (_db_pwrite(db, fd, buf, 8, prev + EXT_NEXT) != 8) {
+      err_dump("_db_extunlink(): pwrite() error of free extent");
+    }
+  } else {
+    headoff = HDR_FREECLS +
+              (heap * EXT_NCLASS + _db_extclass(_db_get32(ext + 4), 0)) * 8;
+    if (_db_pwrite(db, db->idxfd, buf, 8, headoff) != 8) {
+      err_dump("_db_extunlink(): pwrite() error of free list");
+    }
+  }
+  _db_put64(buf, prev);
+  if (next != 0 && _db_pwrite(db, fd, buf, 8, next + EXT_PREV) != 8) {
+    err_dump("_db_extunlink(): pwrite() error of free extent");
+  }
+} /* _db_extunlink() */
+
+/**
+ * Write the header and the trailing size of an extent.  A used index record
+ * extent gets a zeroed index record header, but for the epoch of the update in
+ * a database that copies on write; a free extent gets the list links.
+ * @param db pointer to database structure.
+ * @param heap HEAP_IDX or HEAP_DAT.
+ * @param off offset of the extent.
+ * @param magic BIN_REC_MAGIC, EXT_DAT_MAGIC or EXT_FREE_MAGIC.
+ * @param size size of the extent.
+ * @param next next free extent in the same class (free extents only).
+ */
+static void _db_extput(DB *db, int heap, off_t off, uint32_t magic,
+                       size_t size, off_t next) {
+  unsigned char buf[BIN_REC_SZ];
+  int fd = (heap == HEAP_IDX ? db->idxfd : db->datfd);
+  size_t len;
+
+  memset(buf, 0, sizeof(buf));
+  _db_put32(buf, magic);
+  _db_put32(buf + 4, size);
+  if (magic == BIN_REC_MAGIC && (db->features & F_SNAPSHOT)) {
+    _db_put32(buf + REC_BIRTH, db->epoch); /* no snapshot sees it */
+  }
+  if (magic == EXT_FREE_MAGIC) {
+    _db_put64(buf + EXT_NEXT, next);
+    len = EXT_FREE_SZ;
+  } else {
+    len = (magic == BIN_REC_MAGIC ? BIN_REC_SZ : EXT_HDR_SZ);
+  }
+  if (_db_pwrite(db, fd, buf, len, off) != len) {
+    err_dump("_db_extput(): pwrite() error of extent header");
+  }
+  if (_db_pwrite(db, fd, buf + 4, EXT_FTR_SZ, off + size - EXT_FTR_SZ) !=
+      EXT_FTR_SZ) {
+    err_dump("_db_extput(): pwrite() error of extent trailer");
+  }
+} /* _db_extput() */
+
+/**
+ * Put the extent of a record that a snapshot may still see on the retire list
+ * of its heap, instead of freeing it, in an update that copies on write.  An
+ * index record is first marked dead in the epoch of the update.  The blocks of
+ * a list are index extents of RB_SIZE bytes without a key, linked through
+ * their chain ptrs, and hold the offset of each extent retired with the epoch
+ * it was retired in.  The caller must hold the free list lock.
+ * @param db pointer to database structure.
+ * @param heap HEAP_IDX or HEAP_DAT.
+ * @param off offset of the extent.
+ */
+static void _db_retire(DB *db, int heap, off_t off) {
+  unsigned char list[24], buf[RB_ENT];
+  off_t listoff = HDR_RETIRE + heap * 24, last, blk;
+  size_t size = RB_SIZE;
+  uint32_t count = 0;
+  int reused;
+
+  if (heap == HEAP_IDX) {
+    _db_put64(buf, REC_DEAD | db->epoch);
+    if (_db_pwrite(db, db->idxfd, buf, 8, off + REC_PTR) != 8) {
+      err_dump("_db_retire(): pwrite() error of chain ptr");
+    }
+  }
+  if (pread(db->idxfd, list, 24, listoff) != 24) {
+    err_dump("_db_retire(): pread() error of retire list");
+  }
+  if ((last = _db_get64(list + 8)) != 0) {
+    if (pread(db->idxfd, buf, RB_ENT, last) != RB_ENT) {
+      err_dump("_db_retire(): pread() error of retire list block");
+    }
+    count = _db_get32(buf + RB_COUNT);
+  }
+
+  /*
+   * Start a new block once the last one is full.
+   */
+  if (last == 0 || count == RB_NENT) {
+    blk = _db_extalloc(db, HEAP_IDX, &size, &reused);
+    memset(buf, 0, RB_ENT);
+    _db_put16(buf + REC_FLAGS, REC_F_RETIRE);
+    if (_db_pwrite(db, db->idxfd, buf + REC_FLAGS, RB_ENT - REC_FLAGS,
+                   blk + REC_FLAGS) != RB_ENT - REC_FLAGS) {
+      err_dump("_db_retire(): pwrite() error of retire list block");
+    }
+    _db_put64(buf, blk);
+    if (last != 0) {
+      if (_db_pwrite(db, db->idxfd, buf, 8, last + REC_PTR) != 8) {
+        err_dump("_db_retire(): pwrite() error of retire list block");
+      }
+    } else {
+      _db_put64(list, blk);
+    }
+    _db_put64(list + 8, blk);
+    last = blk;
+    count = 0;
+  }
+  _db_put64(buf, off);
+  _db_put64(buf + 8, db->epoch);
+  _db_put32(buf + 16, count + 1);
+  if (_db_pwrite(db, db->idxfd, buf, 16, last + RB_ENT + count * 16) != 16 ||
+      _db_pwrite(db, db->idxfd, buf + 16, 4, last + RB_COUNT) != 4) {
+    err_dump("_db_retire(): pwrite() error of retire list block");
+  }
+  if (_db_get64(list + 16) == 0) {
+    _db_put64(list + 16, db->epoch);
+  }
+  if (_db_pwrite(db, db->idxfd, list, 24, listoff) != 24) {
+    err_dump("_db_retire(): pwrite() error of retire list");
+  }
+} /* _db_retire() */
+
+/**
+ * Free some of the retired extents that no snapshot can see any more, at the
+ * start of an update of a database that copies on write: data records retired
+ * before the oldest snapshot pinned, and index records once no snapshot is
+ * pinned at all, since db_nextrec() finds its way through the index file of a
+ * snapshot by the extents that were there when it was taken.  At most
+ * SNP_RECLAIM extents are freed, oldest first.  Also records the epoch of the
+ * update in the index file header, for a new snapshot file to start after.
+ * @param db pointer to database structure, with the epoch of the update found.
+ */
+static void _db_reclaim(DB *db) {
+  unsigned char hdr[HDR_RETIRE + 48 - HDR_EPOCH], *list, buf[RB_SIZE];
+  unsigned char ext[16], *ent;
+  off_t blk, off;
+  uint64_t oldest;
+  uint32_t first, count;
+  int heap, n = 0;
+
+  if (pread(db->idxfd, hdr, sizeof(hdr), HDR_EPOCH) != sizeof(hdr)) {
+    err_dump("_db_reclaim(): pread() error");
+  }
+  if (db->epoch > _db_get32(hdr)) {
+    _db_put32(hdr, db->epoch);
+    if (_db_pwrite(db, db->idxfd, hdr, 4, HDR_EPOCH) != 4) {
+      err_dump("_db_reclaim(): pwrite() error of epoch");
+    }
+  }
+  list = hdr + HDR_RETIRE - HDR_EPOCH;
+  oldest = _db_get64(list + HEAP_DAT * 24 + 16);
+  if ((oldest == 0 || (db->cow && oldest >= db->snapmin)) &&
+      (db->cow || _db_get64(list + HEAP_IDX * 24 + 16) == 0)) {
+    return; /* nothing to free yet */
+  }
+
+  if (_db_writew_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_reclaim(): writew_lock() error");
+  }
+  for (heap = HEAP_DAT; heap >= HEAP_IDX && !(heap == HEAP_IDX && db->cow);
+       heap--) {
+    list = hdr + HDR_RETIRE - HDR_EPOCH + heap * 24;
+    if (pread(db->idxfd, list, 24, HDR_RETIRE + heap * 24) != 24) {
+      err_dump("_db_reclaim(): pread() error of retire list");
+    }
+    while ((blk = _db_get64(list)) != 0 && n < SNP_RECLAIM) {
+      if (pread(db->idxfd, buf, RB_SIZE, blk) != RB_SIZE ||
+          _db_get32(buf + REC_MAGIC) != BIN_REC_MAGIC ||
+          _db_get16(buf + REC_FLAGS) != REC_F_RETIRE ||
+          (count = _db_get32(buf + RB_COUNT)) > RB_NENT ||
+          (first = _db_get32(buf + RB_FIRST)) > count) {
+        err_dump("_db_reclaim(): invalid retire list block at %lld",
+                 (long long)blk);
+      }
+
+      /*
+       * Free the extents of the block that are old enough.  One that isn't
+       * what it was when it was retired is left alone.
+       */
+      for (ent = buf + RB_ENT + first * 16;
+           first < count && n < SNP_RECLAIM &&
+           (!db->cow || _db_get64(ent + 8) < db->snapmin);
+           first++, n++, ent += 16) {
+        off = _db_get64(ent);
+        if (pread(heap == HEAP_IDX ? db->idxfd : db->datfd, ext, 16, off) !=
+            16) {
+          continue;
+        }
+        if (heap == HEAP_IDX ? _db_get32(ext) == BIN_REC_MAGIC &&
+                                   (_db_get64(ext + REC_PTR) & REC_DEAD)
+                             : _db_get32(ext) == EXT_DAT_MAGIC) {
+          _db_extfree(db, heap, off);
+        }
+      }
+      _db_put32(buf + RB_FIRST, first);
+      if (first < count || blk == _db_get64(list + 8)) {
+        /*
+         * Stop at the block that still holds extents, or at the last one,
+         * which is kept, emptied, for the next extents retired.
+         */
+        if (first == count) {
+          _db_put32(buf + RB_COUNT, 0);
+          _db_put32(buf + RB_FIRST, 0);
+        }
+        if (_db_pwrite(db, db->idxfd, buf + RB_FIRST, 8, blk + RB_FIRST) !=
+            8) {
+          err_dump("_db_reclaim(): pwrite() error of retire list block");
+        }
+        break;
+      }
+
+      /*
+       * The block is done with: take it off the list, and retire it too, or
+       * free it.
+       */
+      memcpy(list, buf + REC_PTR, 8);
+      if (db->cow) {
+        _db_retire(db, HEAP_IDX, blk);
+      } else {
+        _db_extfree(db, HEAP_IDX, blk);
+      }
+    }
+
+    /*
+     * The oldest entry left is the first of the first block.
+     */
+    oldest = 0;
+    if ((blk = _db_get64(list)) != 0) {
+      if (pread(db->idxfd, buf, RB_ENT, blk) != RB_ENT) {
+        err_dump("_db_reclaim(): pread() error of retire list block");
+      }
+      first = _db_get32(buf + RB_FIRST);
+      if (first < _db_get32(buf + RB_COUNT) &&
+          pread(db->idxfd, ext, 16, blk + RB_ENT + first * 16) == 16) {
+        oldest = _db_get64(ext + 8);
+      }
+    }
+    _db_put64(list + 16, oldest);
+    if (_db_pwrite(db, db->idxfd, list, 24, HDR_RETIRE + heap * 24) != 24) {
+      err_dump("_db_reclaim(): pwrite() error of retire list");
+    }
+  }
+  if (_db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_reclaim(): un_lock() error");
+  }
+} /* _db_reclaim() */
+
+/**
+ * Rewind the index file for db_nextrec().  Automatically called by db_open().
+ * Must be called before first db_nextrec().  A scan that is under way when
+ * db_compact() replaces the files carries on through the old files; the next
+ * db_rewind() moves to the new ones.
+ * @param h database handle.
+ */
+void db_rewind(DBHANDLE h) {
+  DB *db = _db_cursor(h);
+
+  /*
+   * The offset of the next record is kept in the DB structure, instead of
+   * relying on the file offset; no need to lock.  recoff includes the newline
+   * at the end of an ASCII hash table.
+   */
+  _db_checkswap(db);
+  db->scanoff = db->idxoff = db->recoff;
+  if (db->snapslot >= 0) {
+    db->snapoff = db->snaprecoff;
+    db->snapblen = 0;
+  }
+} /* db_rewind() */
+
+/**
+ * Return the next sequential record.  This function steps through the index
+ * file, ignoring deleted records.  db_rewind() must be called before this
+ * function is called the first time.
+ * @param h database handle.
+ * @param key if caller provides a non-null pointer, the corresponding key is
+ * copied to the address pointed to by the pointer.  The caller is responsible
+ * for allocating a buffer large enough to store the key.  A buffer whose size
+ * is IDXLEN_MAX bytes is large enough to hold any key.
+ * @return pointer to data buffer for data record.  Records are returned
+ * sequentially in the order they happen to be stored in the database file.
+ * The records are not sorted by key value.  Also, because hash chains are not
+ * followed, deleted records can be found, however deleted records will not be
+ * returned to the caller.  This function can dump core and terminate the
+ * calling process if the index file lock request fails.  NULL is also returned
+ * for a bad record, with errno set as for db_fetch(); the next call goes on
+ * after it, if the record can be stepped over.  To tell the end of the records
+ * from a bad one, set errno to 0 before the call, as for readdir(3).  With a
+ * snapshot (db_snapshot()), the records are those the snapshot sees, and no
+ * lock is held from one call to the next.
+ */
+char *db_nextrec(DBHANDLE h, char *key) {
+  DB *db = _db_cursor(h);
+  char c;
+  char *ptr;
+  uint64_t merges;
+
+  if (db->snapslot >= 0) {
+    return (_db_snapnext(db, key));
+  }
+
+  /*
+   * Read lock the free list so that a record is not read in the middle of it
+   * being deleted by another process.
+   */
+  if (_db_readw_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("db_nextrec(): readw_lock() error");
+  }
+  if (db->features & F_ALLOC) {
+    merges = _db_readmerges(db);
+    if (db->scanoff != db->recoff && merges != db->scanmerges) {
+      _db_rescan(db);
+    }
+    db->scanmerges = merges;
+  }
+
+  do {
+    /*
+     * Read next sequential index record; starting from the current offset.
+     */
+    if (_db_readidx(db, 0) < 0) {
+      ptr = NULL; /* end of index file, EOF */
+      goto doreturn;
+    }
+
+    /*
+     * Check if key is all blank (empty record).  While reading the index file
+     * sequentially, it is possible to find records that have been deleted.
+     * In order to return only valid records, any record whose key is all
+     * spaces is skipped (_db_dodelete() clears a key by setting it to all
+     * blanks).
+     */
+    ptr = db->idxbuf;
+    while ((c = *ptr++) != 0 && c == SPACE) {
+      ; /* skip until null byte or nonblank */
+    }
+  } while (c == 0); /* loop until a nonblank key is found */
+
+  /* Check if caller provided a non-null key buffer */
+  if (key != NULL) {
+    strcpy(key, db->idxbuf); /* return key copied to caller's buffer */
+  }
+  /*
+   * Read data record and set return value to point to the internal buffer
+   * containing the data record.
+   */
+  if ((ptr = _db_readdat(db)) != NULL) { /* return pointer to data buffer */
+    db->cnt_nextrec++;
+  }
+
+doreturn:
+  /* Unlock the free list */
+  if (_db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("db_nextrec(): un_lock() error");
+  }
+  if (ptr == NULL && db->bad) {
+    errno = db->bad;
+  }
+  return (ptr);
+} /* db_nextrec() */
+
+/**
+ * Whether a scan sees an index record: a snapshot sees the records written
+ * before it was taken that were still live then, and a scan of the latest
+ * records those that aren't dead.
+ * @param rec header of the index record.
+ * @param epoch epoch of the snapshot; 0 for the latest records.
+ * @return nonzero if the record is seen.
+ */
+static int _db_visible(const unsigned char *rec, uint32_t epoch) {
+  uint64_t ptr = _db_get64(rec + REC_PTR);
+
+  if (epoch == 0) {
+    return (!(ptr & REC_DEAD));
+  }
+  return (_db_get32(rec + REC_BIRTH) < epoch &&
+          (!(ptr & REC_DEAD) || (uint32_t)ptr >= epoch));
+} /* _db_visible() */
+
+/**
+ * db_nextrec() of a handle with a snapshot: step through the extents that
+ * were in the index file when the snapshot was taken, reading them SCAN_BLOCK
+ * bytes at a time, and return the next record the snapshot sees.  The free
+ * list is only read locked while a block is read, so that no extent header is
+ * read while it's being written: the records the snapshot sees don't change,
+ * and no index extent is merged while it's pinned.
+ * @param db pointer to database structure, with a snapshot.
+ * @param key buffer for the key, or NULL.
+ * @return as for db_nextrec().
+ */
+static char *_db_snapnext(DB *db, char *key) {
+  int fd = (db->snapidxfd >= 0 ? db->snapidxfd : db->idxfd);
+  const unsigned char *rec;
+  size_t avail, keylen, reclen, want;
+  uint32_t magic;
+  off_t off;
+  ssize_t n;
+  char *ptr;
+
+  if (db->snapbuf == NULL && (db->snapbuf = malloc(SCAN_BLOCK)) == NULL) {
+    err_dump("_db_snapnext(): malloc() error");
+  }
+  db->bad = 0;
+  db->idxbuf[0] = 0;
+  for (;;) {
+    if ((off = db->snapoff) >= db->snapend) {
+      return (NULL);
+    }
+
+    /*
+     * Read the next block once the buffer may not hold the whole record.
+     */
+    avail = (off >= db->snapboff && off < db->snapboff + db->snapblen
+                 ? db->snapboff + db->snapblen - off
+                 : 0);
+    if (avail == 0 || (avail < BIN_REC_SZ + IDXLEN_MAX &&
+                       db->snapboff + db->snapblen < db->snapend)) {
+      want = (db->snapend - off < SCAN_BLOCK ? db->snapend - off : SCAN_BLOCK);
+      if (db->snapidxfd < 0 &&
+          _db_readw_lock(db, fd, db->freeoff, 1) < 0) {
+        err_dump("_db_snapnext(): readw_lock() error");
+      }
+      n = pread(fd, db->snapbuf, want, off);
+      db->bad = (n < 0 ? errno : EBADMSG);
+      if (db->snapidxfd < 0 && _db_un_lock(db, fd, db->freeoff, 1) < 0) {
+        err_dump("_db_snapnext(): un_lock() error");
+      }
+      if (n < BIN_REC_SZ) {
+        db->snapoff = db->snapend;
+        errno = db->bad;
+        return (NULL);
+      }
+      db->bad = 0;
+      db->snapboff = off;
+      db->snapblen = avail = n;
+    }
+    rec = (const unsigned char *)db->snapbuf + (off - db->snapboff);
+    magic = _db_get32(rec + REC_MAGIC);
+    reclen = _db_get32(rec + REC_LEN);
+    if (avail < BIN_REC_SZ || reclen < EXT_MIN || reclen % EXT_ALIGN != 0 ||
+        reclen > db->snapend - off) {
+      db->snapoff = db->snapend; /* no telling where the next record starts */
+      db->bad = EBADMSG;
+      errno = db->bad;
+      return (NULL);
+    }
+    db->snapoff = off + reclen;
+    keylen = _db_get16(rec + REC_KEYLEN);
+    if (magic == EXT_FREE_MAGIC ||
+        (magic == BIN_REC_MAGIC &&
+         ((_db_get16(rec + REC_FLAGS) & (REC_F_SEGMENT | REC_F_TREE)) ||
+          keylen == 0 || !_db_visible(rec, db->snapepoch)))) {
+      continue;
+    }
+    break;
+  }
+
+  /*
+   * Check the record as _db_readidx_bin() does.
+   */
+  db->idxoff = off;
+  db->idxlen = reclen;
+  if (magic != BIN_REC_MAGIC || keylen >= IDXLEN_MAX ||
+      reclen < BIN_REC_SZ + keylen || avail < BIN_REC_SZ + keylen ||
+      ((db->features & F_CHECKSUM) &&
+       _db_get32(rec + REC_SUM) != _db_recsum(rec, keylen)) ||
+      (db->datoff = _db_get64(rec + REC_DATOFF)) < 0 ||
+      (db->datlen = _db_get32(rec + REC_DATLEN)) <= 0 ||
+      db->datlen > DATLEN(db)) {
+    db->bad = EBADMSG;
+    errno = db->bad;
+    return (NULL);
+  }
+  db->ptrval = _db_get64(rec + REC_PTR);
+  db->datsum = _db_get32(rec + REC_DATSUM);
+  db->rawlen = 0;
+  if (_db_get16(rec + REC_FLAGS) & REC_F_PACKED) {
+    db->rawlen = _db_get32(rec + REC_RAWLEN);
+    if (!(db->features & F_PACKED) || db->rawlen < DATLEN_MIN ||
+        db->rawlen > DATLEN(db)) {
+      db->bad = EBADMSG;
+      errno = db->bad;
+      return (NULL);
+    }
+  }
+  memcpy(db->idxbuf, rec + BIN_REC_SZ, keylen);
+  db->idxbuf[keylen] = 0;
+  db->cnt_idxbytes += reclen;
+  if (key != NULL) {
+    strcpy(key, db->idxbuf);
+  }
+
+  /*
+   * The data of the old files is read from them; otherwise it's read as
+   * _db_readdat() would.
+   */
+  fd = (db->snapdatfd >= 0 ? db->snapdatfd : db->mapped ? -1 : db->datfd);
+  if ((ptr = _db_readdatfrom(db, fd, _db_datbuf(db, RAWLEN(db) + 1))) ==
+      NULL) {
+    errno = db->bad;
+    return (NULL);
+  }
+  db->cnt_nextrec++;
+  return (ptr);
+} /* _db_snapnext() */
+
+/**
+ * Position the ordered scan of db_next() before the first key that is equal to
+ * or greater than a key, as strcmp() compares keys.  To scan the keys that
+ * start with a prefix, seek to the prefix and stop at the first key that
+ * doesn't start with it.  Only a database created with DB_OPT_ORDERED keeps its
+ * keys in order.
+ * @param h database handle.
+ * @param key key to start from; NULL or "" for the first key.
+ * @return 0 if OK; -1 with errno set to EINVAL if the database has no ordered
+ * index, or the key is too long.
+ */
+int db_seek(DBHANDLE h, const char *key) {
+  DB *db = _db_cursor(h);
+  size_t len = (key == NULL ? 0 : strlen(key));
+
+  if (!(db->features & F_ORDERED) || len >= IDXLEN_MAX) {
+    errno = EINVAL;
+    return (-1);
+  }
+  _db_treebuf(db);
+  memcpy(db->seekkey, key, len);
+  db->seeklen = len;
+  db->seekfrom = 1;
+  db->treevalid = 0;
+  return (0);
+} /* db_seek() */
+
+/**
+ * Return the record with the next key in order, starting from the position set
+ * by db_seek(), or from the first key if db_seek() hasn't been called.  Keys
+ * stored and deleted by other processes during the scan are returned, or not,
+ * according to where they fall: the scan carries on from the last key it
+ * returned.
+ * @param h database handle.
+ * @param key if not NULL, the key is copied to this buffer, which must be large
+ * enough for any key: IDXLEN_MAX bytes.
+ * @return pointer to the data, in the data buffer of the handle as for
+ * db_fetch(); NULL at the end of the keys, or with errno set to EINVAL if the
+ * database has no ordered index, or as for db_fetch() if the record of the
+ * key, which is still copied to key, is bad; the next call goes on after it.
+ */
+char *db_next(DBHANDLE h, char *key) {
+  DB *db = _db_cursor(h);
+  unsigned char hdr[16];
+  char *ptr;
+  off_t off;
+  size_t len;
+  int eq;
+
+  if (!(db->features & F_ORDERED)) {
+    errno = EINVAL;
+    return (NULL);
+  }
+  _db_treebuf(db);
+  _db_checkswap(db);
+  for (;;) {
+    /*
+     * Carry on in the leaf read by the last call if the tree hasn't changed
+     * since; otherwise look for the last key returned again.
+     */
+    if (_db_readw_lock(db, db->idxfd, LCK_TREE, 1) < 0) {
+      err_dump("db_next(): readw_lock() error");
+    }
+    if (pread(db->idxfd, hdr, sizeof(hdr), HDR_TREE) != sizeof(hdr)) {
+      err_dump("db_next(): pread() error");
+    }
+    if (!db->treevalid || _db_get64(hdr + 8) != db->treegen) {
+      db->treegen = _db_get64(hdr + 8);
+      db->treevalid = 1;
+      memset(db->treebuf, 0, TN_ENT); /* an empty tree: no keys, no next */
+      for (off = _db_get64(hdr); off != 0;) {
+        _db_treeread(db, off, db->treebuf);
+        if (_db_get16(db->treebuf + TN_LEVEL) == 0) {
+          break;
+        }
+        off = _db_treechild(db->treebuf, db->seekkey, db->seeklen);
+      }
+      db->treepos = _db_treepos(db->treebuf, db->seekkey, db->seeklen, &eq);
+      if (eq && !db->seekfrom) {
+        db->treepos += TN_ENTSZ(0, _db_get16(db->treebuf + db->treepos));
+      }
+    }
+    while (db->treepos >= TN_ENT + _db_get16(db->treebuf + TN_USED) &&
+           (off = _db_get64(db->treebuf + TN_NEXT)) != 0) {
+      _db_treeread(db, off, db->treebuf);
+      db->treepos = TN_ENT;
+    }
+    if (db->treepos < TN_ENT + _db_get16(db->treebuf + TN_USED)) {
+      len = _db_get16(db->treebuf + db->treepos);
+      memcpy(db->seekkey, db->treebuf + db->treepos + 2, len);
+      db->seekkey[len] = 0;
+      db->seeklen = len;
+      db->seekfrom = 0;
+      db->treepos += TN_ENTSZ(0, len);
+    } else {
+      len = 0; /* end of the keys */
+    }
+    if (_db_un_lock(db, db->idxfd, LCK_TREE, 1) < 0) {
+      err_dump("db_next(): un_lock() error");
+    }
+    if (len == 0) {
+      return (NULL);
+    }
+
+    /*
+     * Skip keys whose records have been deleted, but not yet taken out of the
+     * tree.
+     */
+    ptr = (_db_fetch(db, db->seekkey, NULL, 0) < 0 ? NULL : db->datbuf);
+    _db_unlockchains(db, db->chainoff, 1);
+    if (ptr != NULL || db->bad) {
+      if (key != NULL) {
+        strcpy(key, db->seekkey);
+      }
+      if (ptr == NULL) {
+        errno = db->bad;
+      }
+      return (ptr);
+    }
+  }
+} /* db_next() */
+
+/**
+ * Allocate the buffer for the leaf and the key of the ordered scan of
+ * db_next(), if not done yet.
+ * @param db pointer to database structure.
+ */
+static void _db_treebuf(DB *db) {
+  if (db->treebuf != NULL) {
+    return;
+  }
+  if ((db->treebuf = malloc(TREE_NODE + IDXLEN_MAX)) == NULL) {
+    err_dump("_db_treebuf(): malloc() error");
+  }
+  db->seekkey = (char *)db->treebuf + TREE_NODE;
+  db->seeklen = 0;
+} /* _db_treebuf() */
+
+/**
+ * Put a key into the ordered index (F_ORDERED), or take it out.  The key goes
+ * into its leaf in order; a node that overflows is split in two by bytes, and
+ * the first key of the new right leaf, or the middle key of an interior node,
+ * goes up to the parent, up to a new root if the root splits.  Taking a key out
+ * leaves its leaf in place even if it's empty.  The caller holds the write lock
+ * of the key's hash chain, so the key isn't being put or taken out by anyone
+ * else.
+ * @param db pointer to database structure.
+ * @param key null-terminated key.
+ * @param insert 1 to put the key in, if it isn't there already; 0 to take it
+ * out, if it's there.
+ * @param locked nonzero if the caller has the whole index file write locked;
+ * the tree lock and the free list lock are then not taken.
+ */
+static void _db_treeput(DB *db, const char *key, int insert, int locked) {
+  unsigned char node[2 * TREE_NODE], right[TREE_NODE], hdr[16];
+  char sep[IDXLEN_MAX];
+  off_t path[TREE_DEPTH], off, child = 0;
+  size_t keylen = strlen(key), seplen, used, esz, pos, m;
+  int depth = 0, level, eq;
+
+  if (!locked && _db_writew_lock(db, db->idxfd, LCK_TREE, 1) < 0) {
+    err_dump("_db_treeput(): writew_lock() error");
+  }
+  if (pread(db->idxfd, hdr, sizeof(hdr), HDR_TREE) != sizeof(hdr)) {
+    err_dump("_db_treeput(): pread() error");
+  }
+
+  /*
+   * Find the leaf of the key, remembering the nodes on the way down.
+   */
+  if ((off = _db_get64(hdr)) == 0) {
+    if (!insert) {
+      goto doreturn;
+    }
+    off = _db_treenew(db, node, 0, locked); /* the first leaf is the root */
+    _db_put16(node + TN_ENT, keylen);
+    memcpy(node + TN_ENT + 2, key, keylen);
+    _db_put16(node + TN_USED, TN_ENTSZ(0, keylen));
+    _db_treewrite(db, off, node);
+    _db_put64(hdr, off);
+    if (_db_pwrite(db, db->idxfd, hdr, 8, HDR_TREE) != 8) {
+      err_dump("_db_treeput(): pwrite() error");
+    }
+    goto dogen;
+  }
+  for (;;) {
+    if (depth == TREE_DEPTH) {
+      err_dump("_db_treeput(): ordered index too deep");
+    }
+    _db_treeread(db, off, node);
+    path[depth++] = off;
+    if (_db_get16(node + TN_LEVEL) == 0) {
+      break;
+    }
+    off = _db_treechild(node, key, keylen);
+  }
+  pos = _db_treepos(node, key, keylen, &eq);
+  if (!insert) {
+    if (eq) {
+      esz = TN_ENTSZ(0, keylen);
+      used = _db_get16(node + TN_USED);
+      memmove(node + pos, node + pos + esz, TN_ENT + used - pos - esz);
+      _db_put16(node + TN_USED, used - esz);
+      _db_treewrite(db, off, node);
+    }
+    goto dogen;
+  }
+  if (eq) {
+    goto doreturn;
+  }
+
+  /*
+   * Put the entry into the node; if it overflows, split it and put an entry
+   * for the new right node into the parent, and so on up.
+   */
+  memcpy(sep, key, keylen);
+  seplen = keylen;
+  for (;;) {
+    level = _db_get16(node + TN_LEVEL);
+    used = _db_get16(node + TN_USED);
+    esz = TN_ENTSZ(level, seplen);
+    memmove(node + pos + esz, node + pos, TN_ENT + used - pos);
+    _db_put16(node + pos, seplen);
+    memcpy(node + pos + 2, sep, seplen);
+    if (level != 0) {
+      _db_put64(node + pos + 2 + seplen, child);
+    }
+    used += esz;
+    if (used <= TN_ROOM) {
+      _db_put16(node + TN_USED, used);
+      _db_treewrite(db, path[depth - 1], node);
+      break;
+    }
+
+    /*
+     * Keep at least one entry, and at most half the bytes, on the left.
+     */
+    m = TN_ENT + TN_ENTSZ(level, _db_get16(node + TN_ENT));
+    while (m - TN_ENT + TN_ENTSZ(level, _db_get16(node + m)) <= used / 2) {
+      m += TN_ENTSZ(level, _db_get16(node + m));
+    }
+    child = _db_treenew(db, right, level, locked);
+    seplen = _db_get16(node + m);
+    memcpy(sep, node + m + 2, seplen);
+    if (level == 0) {
+      _db_put64(right + TN_NEXT, _db_get64(node + TN_NEXT));
+      _db_put64(node + TN_NEXT, child);
+      pos = m;
+    } else {
+      _db_put64(right + TN_FIRST, _db_get64(node + m + 2 + seplen));
+      pos = m + TN_ENTSZ(level, seplen); /* the middle key goes up */
+    }
+    memcpy(right + TN_ENT, node + pos, TN_ENT + used - pos);
+    _db_put16(right + TN_USED, TN_ENT + used - pos);
+    _db_put16(node + TN_USED, m - TN_ENT);
+    _db_treewrite(db, child, right);
+    _db_treewrite(db, path[depth - 1], node);
+    if (--depth == 0) {
+      /*
+       * The root split: the tree grows a level.
+       */
+      off = _db_treenew(db, node, level + 1, locked);
+      _db_put64(node + TN_FIRST, path[0]);
+      _db_put16(node + TN_ENT, seplen);
+      memcpy(node + TN_ENT + 2, sep, seplen);
+      _db_put64(node + TN_ENT + 2 + seplen, child);
+      _db_put16(node + TN_USED, TN_ENTSZ(level + 1, seplen));
+      _db_treewrite(db, off, node);
+      _db_put64(hdr, off);
+      if (_db_pwrite(db, db->idxfd, hdr, 8, HDR_TREE) != 8) {
+        err_dump("_db_treeput(): pwrite() error");
+      }
+      break;
+    }
+    _db_treeread(db, path[depth - 1], node);
+    pos = _db_treepos(node, sep, seplen, &eq);
+  }
+
+dogen:
+  _db_put64(hdr + 8, _db_get64(hdr + 8) + 1);
+  if (_db_pwrite(db, db->idxfd, hdr + 8, 8, HDR_TREEGEN) != 8) {
+    err_dump("_db_treeput(): pwrite() error");
+  }
+
+doreturn:
+  if (!locked && _db_un_lock(db, db->idxfd, LCK_TREE, 1) < 0) {
+    err_dump("_db_treeput(): un_lock() error");
+  }
+} /* _db_treeput() */
+
+/**
+ * Allocate a node of the ordered index, and set up its header in a buffer.
+ * @param db pointer to database structure.
+ * @param node buffer of TREE_NODE bytes for the node.
+ * @param level height of the node above the leaves.
+ * @param locked nonzero if the caller has the whole index file write locked.
+ * @return offset of the node.
+ */
+static off_t _db_treenew(DB *db, unsigned char *node, int level, int locked) {
+  size_t size = _db_extsize(TREE_NODE);
+  int reused;
+  off_t off;
+
+  if (!locked && _db_writew_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_treenew(): writew_lock() error");
+  }
+  off = _db_extalloc(db, HEAP_IDX, &size, &reused);
+  if (!locked && _db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("_db_treenew(): un_lock() error");
+  }
+  memset(node, 0, TN_ENT);
+  _db_put32(node + REC_MAGIC, BIN_REC_MAGIC);
+  _db_put32(node + REC_LEN, size);
+  _db_put16(node + REC_FLAGS, REC_F_TREE);
+  _db_put16(node + TN_LEVEL, level);
+  return (off);
+} /* _db_treenew() */
+
+/**
+ * Read a node of the ordered index.
+ * @param db pointer to database structure.
+ * @param off offset of the node.
+ * @param node buffer of TREE_NODE bytes for the node.
+ */
+static void _db_treeread(DB *db, off_t off, unsigned char *node) {
+  if (pread(db->idxfd, node, TREE_NODE, off) != TREE_NODE ||
+      _db_get32(node + REC_MAGIC) != BIN_REC_MAGIC ||
+      !(_db_get16(node + REC_FLAGS) & REC_F_TREE) ||
+      _db_get16(node + TN_USED) > TN_ROOM) {
+    err_dump("_db_treeread(): invalid ordered index node");
+  }
+} /* _db_treeread() */
+
+/**
+ * Write a node of the ordered index.
+ * @param db pointer to database structure.
+ * @param off offset of the node.
+ * @param node the node.
+ */
+static void _db_treewrite(DB *db, off_t off, const unsigned char *node) {
+  if (_db_pwrite(db, db->idxfd, node, TREE_NODE, off) != TREE_NODE) {
+    err_dump("_db_treewrite(): pwrite() error");
+  }
+} /* _db_treewrite() */
+
+/**
+ * Find where a key goes in a node of the ordered index.
+ * @param node the node.
+ * @param key the key, not necessarily null-terminated.
+ * @param keylen length of the key.
+ * @param eqp set to 1 if the entry found holds the key; 0 if not.
+ * @return offset in the node of the first entry whose key is equal to or
+ * greater than the key; the end of the entries if there is none.
+ */
+static size_t _db_treepos(const unsigned char *node, const char *key,
+                          size_t keylen, int *eqp) {
+  int level = _db_get16(node + TN_LEVEL), c;
+  size_t pos, end = TN_ENT + _db_get16(node + TN_USED), len;
+
+  *eqp = 0;
+  for (pos = TN_ENT; pos < end; pos += TN_ENTSZ(level, len)) {
+    len = _db_get16(node + pos);
+    if ((c = _db_treecmp(node + pos + 2, len, key, keylen)) >= 0) {
+      *eqp = (c == 0);
+      break;
+    }
+  }
+  return (pos);
+} /* _db_treepos() */
+
+/**
+ * Find the child of an interior node of the ordered index that holds a key:
+ * the child of the last separator not greater than the key, or the first child.
+ * @param node the node.
+ * @param key the key, not necessarily null-terminated.
+ * @param keylen length of the key.
+ * @return offset of the child.
+ */
+static off_t _db_treechild(const unsigned char *node, const char *key,
+                           size_t keylen) {
+  size_t pos, end = TN_ENT + _db_get16(node + TN_USED), len;
+  off_t child = _db_get64(node + TN_FIRST);
+
+  for (pos = TN_ENT; pos < end; pos += TN_ENTSZ(1, len)) {
+    len = _db_get16(node + pos);
+    if (_db_treecmp(node + pos + 2, len, key, keylen) > 0) {
+      break;
+    }
+    child = _db_get64(node + pos + 2 + len);
+  }
+  return (child);
+} /* _db_treechild() */
+
+/**
+ * Compare a key of the ordered index with another key, as strcmp() would.
+ * @param a key in a node.
+ * @param alen length of a.
+ * @param b other key.
+ * @param blen length of b.
+ * @return less than, equal to or greater than 0 as a sorts before, with or
+ * after b.
+ */
+static int _db_treecmp(const unsigned char *a, size_t alen, const char *b,
+                       size_t blen) {
+  int c;
+
+  if ((c = memcmp(a, b, alen < blen ? alen : blen)) != 0) {
+    return (c);
+  }
+  return (alen < blen ? -1 : alen > blen);
+} /* _db_treecmp() */
+
+/**
+ * Pass every record of the database to a callback, reading the index file with
+ * several threads at once.  The index file is split into byte ranges, one per
+ * thread, that start at index records found on the hash chains; each thread
+ * reads its range in large blocks, and the data through a window of the data
+ * file, so a record seldom costs a system call of its own.  The free list is
+ * read locked for the whole scan, which keeps the records in place: updates
+ * that allocate or free space wait until it's done, while fetches and updates
+ * in place carry on.  With a snapshot (db_snapshot()), the records are those
+ * the snapshot sees, and the free list is only read locked while each block
+ * is read, so updates carry on.  An ASCII database is scanned by the calling
+ * thread alone, as db_nextrec() would, without changing the position of
+ * db_nextrec().  Records are passed in no particular order.
+ * @param h database handle.
+ * @param nthreads number of threads to scan with, including the calling
+ * thread; fewer are used if the database is small.
+ * @param fn callback, called with arg, the null-terminated key and the
+ * null-terminated data of each record, from all the threads at once; it must
+ * not use the handle.  If it returns nonzero, the scan stops, once the other
+ * threads are done with the block they are in.
+ * @param arg first argument of fn.
+ * @return number of records passed to fn; -1 with errno set to EINVAL if
+ * nthreads is less than 1, or to EBADMSG if a bad record, or one whose checksum
+ * doesn't match, stopped the scan.
+ */
+long db_scan(DBHANDLE h, int nthreads,
+             int (*fn)(void *, const char *, const char *), void *arg) {
+  DB *db = _db_cursor(h);
+  DBSCAN *sc;
+  pthread_mutex_t mutex;
+  struct stat statbuff;
+  off_t *splits, scanoff;
+  uint64_t scanmerges;
+  char key[IDXLEN_MAX], *data;
+  long i, n, nrec = 0;
+  int stop = 0;
+
+  if (nthreads < 1) {
+    errno = EINVAL;
+    return (-1);
+  }
+  _db_checkswap(db);
+  if (db->format == DB_FMT_ASCII) {
+    scanoff = db->scanoff;
+    scanmerges = db->scanmerges;
+    db->scanoff = db->recoff;
+    while ((data = db_nextrec(db, key)) != NULL) {
+      nrec++;
+      if ((*fn)(arg, key, data) != 0) {
+        break;
+      }
+    }
+    db->scanoff = scanoff;
+    db->scanmerges = scanmerges;
+    if (data == NULL && db->bad) {
+      errno = db->bad;
+      return (-1);
+    }
+    return (nrec);
+  }
+
+  if ((splits = malloc((nthreads + 1) * sizeof(off_t))) == NULL ||
+      (sc = calloc(nthreads, sizeof(DBSCAN))) == NULL) {
+    err_dump("db_scan(): malloc() error");
+  }
+  if (db->snapslot >= 0 && db->snapidxfd >= 0) {
+    /*
+     * The old files of a snapshot aren't changed any more, but their hash
+     * table may no longer be what the header says; read them in one range.
+     */
+    splits[0] = db->snaprecoff;
+    splits[1] = db->snapend;
+    n = 1;
+  } else {
+    if (_db_readw_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+      err_dump("db_scan(): readw_lock() error");
+    }
+    if (db->snapslot >= 0) {
+      n = _db_scansplit(db, db->snapend, nthreads, splits);
+      if (_db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+        err_dump("db_scan(): un_lock() error");
+      }
+    } else {
+      if (fstat(db->idxfd, &statbuff) < 0) {
+        err_dump("db_scan(): fstat() error");
+      }
+      n = _db_scansplit(db, statbuff.st_size, nthreads, splits);
+    }
+  }
+  pthread_mutex_init(&mutex, NULL);
+  for (i = 0; i < n; i++) {
+    sc[i].db = db;
+    sc[i].start = splits[i];
+    sc[i].end = splits[i + 1];
+    if (db->snapslot >= 0) {
+      sc[i].idxfd = (db->snapidxfd >= 0 ? db->snapidxfd : db->idxfd);
+      sc[i].datfd = (db->snapdatfd >= 0 ? db->snapdatfd : db->datfd);
+      sc[i].epoch = db->snapepoch;
+      sc[i].lockblk = (db->snapidxfd < 0);
+    } else {
+      sc[i].idxfd = db->idxfd;
+      sc[i].datfd = db->datfd;
+    }
+    sc[i].fn = fn;
+    sc[i].arg = arg;
+    sc[i].mutex = &mutex;
+    sc[i].stop = &stop;
+    if (i > 0 && pthread_create(&sc[i].tid, NULL, _db_scanrange, sc + i) == 0) {
+      sc[i].started = 1;
+    }
+  }
+
+  /*
+   * The calling thread scans the first range, and any range that no thread
+   * could be created for.
+   */
+  for (i = 0; i < n; i++) {
+    if (!sc[i].started) {
+      _db_scanrange(sc + i);
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (sc[i].started) {
+      pthread_join(sc[i].tid, NULL);
+    }
+    nrec += sc[i].nrec;
+  }
+  for (i = 0; i < n && !sc[i].bad; i++) {
+    ;
+  }
+  pthread_mutex_destroy(&mutex);
+  if (db->snapslot < 0 && _db_un_lock(db, db->idxfd, db->freeoff, 1) < 0) {
+    err_dump("db_scan(): un_lock() error");
+  }
+  if (i < n) {
+    nrec = -1;
+    errno = sc[i].bad;
+  }
+  free(sc);
+  free(splits);
+  return (nrec);
+} /* db_scan() */
+
+/**
+ * Split the index records of a binary database into byte ranges for db_scan().
+ * The heads of hash chains are index records, so they start ranges that fall
+ * on record boundaries; the range of each thread starts at the first head
+ * found at or after its share of the file.  Called with the free list read
+ * locked, so that the records stay where they are.
+ * @param db pointer to database structure.
+ * @param end size of the index file, or where the records of a snapshot end.
+ * @param nthreads number of ranges wanted.
+ * @param splits filled in with the start of each range, then end.
+ * @return number of ranges, from 1 to nthreads.
+ */
+static long _db_scansplit(DB *db, off_t end, int nthreads, off_t *splits) {
+  off_t *heads, off, want;
+  DBHASH b, nsample, step;
+  long i, j, n, nheads = 0;
+
+  if (db->maxload != 0) {
+    db->nbucket = _db_readnbucket(db);
+  }
+  nsample = (DBHASH)nthreads * SCAN_SAMPLES;
+  if (nthreads == 1 || nsample > db->nbucket) {
+    nsample = (nthreads == 1 ? 0 : db->nbucket);
+  }
+  if ((heads = malloc((nsample + 1) * sizeof(off_t))) == NULL) {
+    err_dump("_db_scansplit(): malloc() error");
+  }
+  step = (nsample == 0 ? 0 : db->nbucket / nsample);
+  for (b = 0; b < nsample; b++) {
+    off = _db_readptr(db, _db_bucketoff(db, b * step));
+    if (off > db->recoff && off < end) {
+      heads[nheads++] = off;
+    }
+  }
+  qsort(heads, nheads, sizeof(off_t), _db_cmpoff);
+
+  splits[0] = db->recoff;
+  for (n = 1, i = 1, j = 0; i < nthreads; i++) {
+    want = db->recoff + (end - db->recoff) / nthreads * i;
+    while (j < nheads && (heads[j] < want || heads[j] <= splits[n - 1])) {
+      j++;
+    }
+    if (j == nheads) {
+      break;
+    }
+    splits[n++] = heads[j];
+  }
+  splits[n] = end;
+  free(heads);
+  return (n);
+} /* _db_scansplit() */
+
+/**
+ * Scan a byte range of the index file for db_scan(): read it a block at a
+ * time, and pass the records in each block to the callback.  Free extents,
+ * hash table segments, nodes of the ordered index, deleted records and those
+ * that the scan doesn't see are skipped.  A bad record, or one whose checksum
+ * doesn't match, stops the whole scan with sc->bad set.  Runs in a thread of
+ * its own, or in the calling thread.
+ * @param arg pointer to the DBSCAN structure of the range.
+ * @return NULL.
+ */
+static void *_db_scanrange(void *arg) {
+  DBSCAN *sc = arg;
+  DB *db = sc->db;
+  const unsigned char *rec;
+  char key[IDXLEN_MAX], *data;
+  off_t pos = sc->start;
+  ssize_t n;
+  size_t q, size, keylen, datlen, rawlen;
+  int stop;
+
+  if ((sc->ibuf = malloc(SCAN_BLOCK)) == NULL ||
+      (sc->dbuf = malloc(SCAN_BLOCK)) == NULL) {
+    err_dump("_db_scanrange(): malloc() error");
+  }
+  while (pos < sc->end) {
+    pthread_mutex_lock(sc->mutex);
+    stop = *sc->stop;
+    pthread_mutex_unlock(sc->mutex);
+    if (stop) {
+      break;
+    }
+    if ((n = _db_scanblock(sc, pos)) < 0) {
+      sc->bad = errno;
+      goto stopall;
+    }
+    for (q = 0; q + BIN_REC_SZ <= n && pos + q < sc->end; q += size) {
+      rec = (const unsigned char *)sc->ibuf + q;
+      size = _db_get32(rec + REC_LEN);
+      if ((_db_get32(rec + REC_MAGIC) != BIN_REC_MAGIC &&
+           (_db_get32(rec + REC_MAGIC) != EXT_FREE_MAGIC ||
+            !(db->features & F_ALLOC))) ||
+          size < EXT_MIN) {
+        sc->bad = EBADMSG; /* missing record magic */
+        goto stopall;
+      }
+      keylen = _db_get16(rec + REC_KEYLEN);
+      if (_db_get32(rec + REC_MAGIC) == EXT_FREE_MAGIC ||
+          (_db_get16(rec + REC_FLAGS) & (REC_F_SEGMENT | REC_F_TREE)) ||
+          keylen == 0 ||
+          ((db->features & F_SNAPSHOT) && !_db_visible(rec, sc->epoch))) {
+        continue; /* may be bigger than a block; only its header is needed */
+      }
+      if (q + size > n) {
+        break; /* read it again at the start of the next block */
+      }
+      if (keylen >= IDXLEN_MAX || size < BIN_REC_SZ + keylen ||
+          ((db->features & F_CHECKSUM) &&
+           _db_get32(rec + REC_SUM) != _db_recsum(rec, keylen))) {
+        sc->bad = EBADMSG;
+        goto stopall;
+      }
+      memcpy(key, rec + BIN_REC_SZ, keylen);
+      key[keylen] = 0;
+      if (strspn(key, " ") == keylen) {
+        continue; /* deleted, in an index file without F_ALLOC */
+      }
+      if ((datlen = _db_get32(rec + REC_DATLEN)) == 0 || datlen > DATLEN(db) ||
+          (data = _db_scandat(sc, _db_get64(rec + REC_DATOFF), datlen,
+                              _db_get32(rec + REC_DATSUM))) == NULL) {
+        sc->bad = (sc->bad ? sc->bad : EBADMSG);
+        goto stopall;
+      }
+      if (_db_get16(rec + REC_FLAGS) & REC_F_PACKED) {
+        rawlen = _db_get32(rec + REC_RAWLEN);
+        if (!(db->features & F_PACKED) || rawlen < DATLEN_MIN ||
+            rawlen > DATLEN(db) ||
+            _db_lzunpack(db, (unsigned char *)data, datlen - 1,
+                         (unsigned char *)_db_rawbuf(&sc->rawbuf, &sc->rawsize,
+                                                     rawlen),
+                         rawlen - 1) < 0) {
+          sc->bad = EBADMSG;
+          goto stopall;
+        }
+        data = sc->rawbuf;
+        data[rawlen - 1] = 0;
+      }
+      sc->nrec++;
+      if ((*sc->fn)(sc->arg, key, data) != 0) {
+        goto stopall;
+      }
+    }
+    if (q == 0) {
+      break; /* end of file: the last record is still being appended */
+    }
+    pos += q;
+  }
+  goto doreturn;
+
+stopall:
+  pthread_mutex_lock(sc->mutex);
+  *sc->stop = 1;
+  pthread_mutex_unlock(sc->mutex);
+
+doreturn:
+  free(sc->ibuf);
+  free(sc->dbuf);
+  if (sc->bigbuf != NULL) {
+    free(sc->bigbuf);
+  }
+  free(sc->rawbuf);
+  return (NULL);
+} /* _db_scanrange() */
+
+/**
+ * Read a block of the index file for _db_scanrange().  A snapshot of the files
+ * in use read locks the free list while the block is read, so that no extent
+ * header is read while it's being written; the threads of the scan take turns
+ * with the lock, which they share.
+ * @param sc the range being scanned.
+ * @param pos offset of the block.
+ * @return bytes read; -1 on error, with errno set.
+ */
+static ssize_t _db_scanblock(DBSCAN *sc, off_t pos) {
+  ssize_t n;
+  int err;
+
+  if (!sc->lockblk) {
+    return (pread(sc->idxfd, sc->ibuf, SCAN_BLOCK, pos));
+  }
+  pthread_mutex_lock(sc->mutex);
+  if (_db_readw_lock(sc->db, sc->idxfd, sc->db->freeoff, 1) < 0) {
+    err_dump("_db_scanblock(): readw_lock() error");
+  }
+  n = pread(sc->idxfd, sc->ibuf, SCAN_BLOCK, pos);
+  err = errno;
+  if (_db_un_lock(sc->db, sc->idxfd, sc->db->freeoff, 1) < 0) {
+    err_dump("_db_scanblock(): un_lock() error");
+  }
+  pthread_mutex_unlock(sc->mutex);
+  errno = err;
+  return (n);
+} /* _db_scanblock() */
+
+/**
+ * Read a data record for _db_scanrange(), through the window of the data file,
+ * which is moved to the record if the record isn't in it.  Records that don't
+ * fit in the window are read on their own.
+ * @param sc the range being scanned.
+ * @param off offset of the data record.
+ * @param len length of the data record, including the newline.
+ * @param sum checksum of the data record, checked if the database has them.
+ * @return pointer to the null-terminated data; NULL with sc->bad set if the
+ * record can't be read or is bad.
+ */
+static char *_db_scandat(DBSCAN *sc, off_t off, size_t len, uint32_t sum) {
+  char *p;
+  ssize_t n;
+
+  if (off >= sc->dwin && off + len <= sc->dwin + sc->dlen) {
+    p = sc->dbuf + (off - sc->dwin);
+  } else if (len <= SCAN_BLOCK) {
+    if ((n = pread(sc->datfd, sc->dbuf, SCAN_BLOCK, off)) < (ssize_t)len) {
+      sc->bad = (n < 0 ? errno : EBADMSG);
+      return (NULL);
+    }
+    sc->dwin = off;
+    sc->dlen = n;
+    p = sc->dbuf;
+  } else {
+    if (len > sc->bigsize) {
+      if ((sc->bigbuf = realloc(sc->bigbuf, len)) == NULL) {
+        err_dump("_db_scandat(): realloc() error");
+      }
+      sc->bigsize = len;
+    }
+    if ((n = pread(sc->datfd, sc->bigbuf, len, off)) != len) {
+      sc->bad = (n < 0 ? errno : EBADMSG);
+      return (NULL);
+    }
+    p = sc->bigbuf;
+  }
+  if (p[len - 1] != NEWLINE || ((sc->db->features & F_CHECKSUM) &&
+                                _db_crc32c(0, p, len) != sum)) {
+    sc->bad = EBADMSG;
+    return (NULL);
+  }
+  p[len - 1] = 0;
+  return (p);
+} /* _db_scandat() */
+
+/**
+ * Compare two file offsets, for qsort().
+ * @param a pointer to an off_t.
+ * @param b pointer to an off_t.
+ * @return -1, 0 or 1 as a is before, at or after b.
+ */
+static int _db_cmpoff(const void *a, const void *b) {
+  off_t oa = *(const off_t *)a, ob = *(const off_t *)b;
+
+  return (oa < ob ? -1 : oa > ob);
+} /* _db_cmpoff() */
+
+/**
+ * Decode a 16-bit little-endian integer.
+ * @param p pointer to the encoded integer.
+ * @return decoded value.
+ */
+static uint16_t _db_get16(const unsigned char *p) {
+  return ((uint16_t)(p[0] | (p[1] << 8)));
+}
+
+/**
+ * Decode a 32-bit little-endian integer.
+ * @param p pointer to the encoded integer.
+ * @return decoded value.
+ */
+static uint32_t _db_get32(const unsigned char *p) {
+  return ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+          ((uint32_t)p[3] << 24));
+}
+
+/**
+ * Decode a 64-bit little-endian integer.
+ * @param p pointer to the encoded integer.
+ * @return decoded value.
+ */
+static uint64_t _db_get64(const unsigned char *p) {
+  return ((uint64_t)_db_get32(p) | ((uint64_t)_db_get32(p + 4) << 32));
+}
+
+/**
+ * Encode a 16-bit integer in little-endian byte order.
+ * @param p pointer to where the encoded integer is stored.
+ * @param v value to encode.
+ */
+static void _db_put16(unsigned char *p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+}
+
+/**
+ * Encode a 32-bit integer in little-endian byte order.
+ * @param p pointer to where the encoded integer is stored.
+ * @param v value to encode.
+ */
+static void _db_put32(unsigned char *p, uint32_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+/**
+ * Encode a 64-bit integer in little-endian byte order.
+ * @param p pointer to where the encoded integer is stored.
+ * @param v value to encode.
+ */
+static void _db_put64(unsigned char *p, uint64_t v) {
+  _db_put32(p, (uint32_t)v);
+  _db_put32(p + 4, (uint32_t)(v >> 32));
+}
+
+/**
+ * Return information about how the database was created, the current size
+ * of its hash table, and how far its change log goes.
+ * @param h database handle.
+ * @param info filled in with the database information.
+ */
+void db_info(DBHANDLE h, DBINFO *info) {
+  DB *db = _db_cursor(h);
+  unsigned char hdr[CHG_HDR_SZ];
+
+  if (db->maxload != 0) {
+    db->nbucket = _db_readnbucket(db);
+  }
+  info->format = db->format;
+  info->hashfn = db->hashid;
+  info->seed = db->seed;
+  info->nhash = db->nhash;
+  info->nbucket = db->nbucket;
+  info->maxload = db->maxload;
+  info->ordered = (db->features & F_ORDERED) != 0;
+  info->checksum = (db->features & F_CHECKSUM) != 0;
+  info->compress = (db->features & F_PACKED) != 0;
+  info->snapshot = (db->features & F_SNAPSHOT) != 0;
+  info->dictlen = db->dictlen;
+  info->maxkey = IDXLEN_MAX - BULK_IDXEXTRA(db);
+  info->maxdata = DATLEN(db) - 1;
+  info->chgfirst = info->chgnext = info->chgseq = 0;
+  if (db->chgfd >= 0) {
+    _db_chglock(db, F_RDLCK, hdr);
+    if (_db_un_lock(db, db->chgfd, CHG_LCK, 1) < 0) {
+      err_dump("db_info(): un_lock() error");
+    }
+    info->chgfirst = _db_get64(hdr + CHG_FIRST);
+    info->chgnext = _db_get64(hdr + CHG_NEXT);
+  }
+  if (db->format == DB_FMT_BINARY) {
+    if (pread(db->idxfd, hdr, 8, HDR_CHGSEQ) != 8) {
+      err_dump("db_info(): pread() error");
+    }
+    info->chgseq = _db_get64(hdr);
+  }
+} /* db_info() */
+
+/**
+ * Count the records on the hash chain of a bucket.  Useful to check how evenly
+ * the hash function distributes keys.
+ * @param h database handle.
+ * @param bucket bucket number, from 0 to DBINFO.nbucket - 1.
+ * @return number of records on the chain; -1 with errno set to EINVAL if the
+ * bucket doesn't exist, or to EBADMSG if a record on the chain is bad.
+ */
+long db_chainlen(DBHANDLE h, long bucket) {
+  DB *db = _db_cursor(h);
+  off_t offset;
+  long len;
+
+  if (db->maxload != 0) {
+    db->nbucket = _db_readnbucket(db);
+  }
+  if (bucket < 0 || bucket >= db->nbucket) {
+    errno = EINVAL;
+    return (-1);
+  }
+  db->chainoff = _db_bucketoff(db, bucket);
+  if (_db_readw_lock(db, db->idxfd, db->chainoff, 1) < 0) {
+    err_dump("db_chainlen(): readw_lock() error");
+  }
+  len = 0;
+  db->bad = 0;
+  for (offset = _db_readptr(db, db->chainoff); offset != 0 && !db->bad;
+       len++) {
+    offset = _db_readidx(db, offset);
+  }
+  _db_unlockchains(db, db->chainoff, 1);
+  if (db->bad) {
+    errno = db->bad;
+    return (-1);
+  }
+  return (len);
+} /* db_chainlen() */
+
+/**
+ * Check a database from end to end, reading its files about as fast as the
+ * disk can deliver them.  In a binary database, every extent of the two heaps
+ * must have a valid header and trailing size; every index record valid lengths,
+ * zero reserved bytes and, with DB_OPT_CHECKSUM, a matching checksum; and every
+ * data record a newline at the end and a matching checksum.  Then every hash
+ * chain is followed in memory: each index record must be on the chain of the
+ * bucket of its key, on one chain only, and every index record and data record
+ * must be in use.  Last, every free list is followed: each free extent must be
+ * on the list of its size class, linked both ways.  The heaps are read by
+ * several threads at once, in ranges that start at records found on the hash
+ * chains, as db_scan() reads them.  The whole index file is read locked
+ * meanwhile, so fetches carry on and updates wait.  An ASCII database, or a
+ * binary one without the heaps of F_ALLOC, is checked by the calling thread
+ * alone, along its hash chains and its free list.  The ordered index, the Bloom
+ * filters, the write-ahead log and the change log aren't checked.  With
+ * DB_OPT_SNAPSHOT, dead index records and the data records on the retire list
+ * are left for snapshots, and need not be in use.
+ * @param h database handle.
+ * @param nthreads number of threads to read with, including the calling
+ * thread; fewer are used if the database is small.
+ * @param vr if not NULL, filled in with what was found.
+ * @param report if not NULL, called with arg, the name of the file, an offset
+ * in it and a description of each problem found, from one thread at a time.
+ * @param arg first argument of report.
+ * @return 0 if no problem was found; -1 with errno set to EBADMSG if some
+ * were, or to EINVAL if nthreads is less than 1.
+ */
+int db_verify(DBHANDLE h, int nthreads, DBVERIFY *vr,
+              void (*report)(void *, const char *, off_t, const char *),
+              void *arg) {
+  DB *db = _db_cursor(h);
+  DBVCHECK vc;
+  DBVERIFY res;
+  DBVRANGE *r;
+  DBVREC *recs, **refs;
+  DBVFREE *frees[2], *f;
+  struct stat statbuff;
+  off_t *heads, *cands, *splits, *segs, segoff[BIN_NSEG];
+  long i, j, k, n, step, nrec, nref, ncand, nseg, nfree[2];
+  int heap;
+
+  if (nthreads < 1) {
+    errno = EINVAL;
+    return (-1);
+  }
+  _db_checkswap(db);
+  memset(&vc, 0, sizeof(vc));
+  memset(&res, 0, sizeof(res));
+  vc.db = db;
+  vc.report = report;
+  vc.arg = arg;
+  pthread_mutex_init(&vc.mutex, NULL);
+  for (heap = HEAP_IDX; heap <= HEAP_DAT; heap++) {
+    if ((vc.name[heap] = malloc(db->namelen + 5)) == NULL) {
+      err_dump("db_verify(): malloc() error");
+    }
+    memcpy(vc.name[heap], db->name, db->namelen);
+    strcpy(vc.name[heap] + db->namelen, heap == HEAP_IDX ? ".idx" : ".dat");
+  }
+
+  /*
+   * Read lock the whole index file, as db_compact() does: nothing can be
+   * changed, in either file, while it's checked.
+   */
+  if (_db_readw_lock(db, db->idxfd, 0, 0) < 0) {
+    err_dump("db_verify(): readw_lock() error");
+  }
+  if (fstat(db->idxfd, &statbuff) < 0) {
+    err_dump("db_verify(): fstat() error");
+  }
+  res.idxsize = vc.size[HEAP_IDX] = statbuff.st_size;
+  if (fstat(db->datfd, &statbuff) < 0) {
+    err_dump("db_verify(): fstat() error");
+  }
+  res.datsize = vc.size[HEAP_DAT] = statbuff.st_size;
+  if (db->format == DB_FMT_ASCII || !(db->features & F_ALLOC)) {
+    _db_vascii(&vc, &res);
+    goto doreturn;
+  }
+
+  if ((r = calloc(nthreads, sizeof(DBVRANGE))) == NULL ||
+      (splits = malloc((nthreads + 1) * sizeof(off_t))) == NULL) {
+    err_dump("db_verify(): malloc() error");
+  }
+  for (i = 0; i < nthreads; i++) {
+    r[i].vc = &vc;
+    if ((r[i].buf = malloc(SCAN_BLOCK)) == NULL) {
+      err_dump("db_verify(): malloc() error");
+    }
+  }
+
+  /*
+   * Read the hash table, and check the heap of index records in ranges that
+   * start at the heads of some of the chains.
+   */
+  heads = _db_vheads(&vc, segoff);
+  step = db->nbucket / ((long)nthreads * SCAN_SAMPLES) + 1;
+  if ((cands = malloc((db->nbucket / step + 1) * sizeof(off_t))) == NULL) {
+    err_dump("db_verify(): malloc() error");
+  }
+  for (ncand = 0, i = 0; i < (long)db->nbucket; i += step) {
+    if (heads[i] >= db->recoff && heads[i] < vc.size[HEAP_IDX]) {
+      cands[ncand++] = heads[i];
+    }
+  }
+  qsort(cands, ncand, sizeof(off_t), _db_cmpoff);
+  r[0].heap = HEAP_IDX;
+  n = _db_vsplit(r, cands, ncand, nthreads, splits);
+  for (i = 0; i < n; i++) {
+    r[i].heap = HEAP_IDX;
+    r[i].start = splits[i];
+    r[i].end = splits[i + 1];
+  }
+  _db_vrun(r, n);
+  free(cands);
+
+  /*
+   * The ranges found their records in order of offset, so the arrays of all
+   * the ranges put together are sorted.
+   */
+  for (nrec = nseg = nfree[HEAP_IDX] = 0, i = 0; i < n; i++) {
+    nrec += r[i].nrec;
+    nseg += r[i].nseg;
+    nfree[HEAP_IDX] += r[i].nfree;
+  }
+  if ((recs = malloc((nrec + 1) * sizeof(DBVREC))) == NULL ||
+      (segs = malloc((nseg + 1) * sizeof(off_t))) == NULL ||
+      (frees[HEAP_IDX] = malloc((nfree[HEAP_IDX] + 1) * sizeof(DBVFREE))) ==
+          NULL) {
+    err_dump("db_verify(): malloc() error");
+  }
+  for (nrec = nseg = nfree[HEAP_IDX] = 0, i = 0; i < n; i++) {
+    memcpy(recs + nrec, r[i].recs, r[i].nrec * sizeof(DBVREC));
+    nrec += r[i].nrec;
+    memcpy(segs + nseg, r[i].segs, r[i].nseg * sizeof(off_t));
+    nseg += r[i].nseg;
+    memcpy(frees[HEAP_IDX] + nfree[HEAP_IDX], r[i].frees,
+           r[i].nfree * sizeof(DBVFREE));
+    nfree[HEAP_IDX] += r[i].nfree;
+    free(r[i].recs);
+    free(r[i].segs);
+    free(r[i].frees);
+    r[i].recs = NULL;
+    r[i].segs = NULL;
+    r[i].frees = NULL;
+    r[i].nrec = r[i].nseg = r[i].nfree = r[i].maxrec = r[i].maxseg =
+        r[i].maxfree = 0;
+  }
+
+  /*
+   * Each hash table segment in use must be a segment record, and each segment
+   * record in use.
+   */
+  for (k = 1; k < BIN_NSEG; k++) {
+    if (segoff[k] != 0 &&
+        _db_vfind(segs, nseg, sizeof(off_t), segoff[k] - BIN_REC_SZ) == NULL) {
+      _db_vreport(&vc, HEAP_IDX, HDR_SEGOFF + k * 8,
+                  "hash table segment %ld is not a segment record", k);
+    }
+  }
+  for (i = 0; i < nseg; i++) {
+    for (k = 1; k < BIN_NSEG && segoff[k] != segs[i] + BIN_REC_SZ; k++) {
+      ;
+    }
+    if (k == BIN_NSEG) {
+      _db_vreport(&vc, HEAP_IDX, segs[i],
+                  "segment record not in use by the hash table");
+    }
+  }
+  _db_vchains(&vc, heads, segoff, recs, nrec, &res);
+
+  /*
+   * Check the heap of data records in ranges that start at data records of
+   * some of the index records, each range against the index records whose
+   * data is in it.
+   */
+  if ((refs = malloc((nrec + 1) * sizeof(DBVREC *))) == NULL) {
+    err_dump("db_verify(): malloc() error");
+  }
+  for (nref = 0, i = 0; i < nrec; i++) {
+    if (recs[i].datlen != 0) {
+      refs[nref++] = recs + i;
+    }
+  }
+  qsort(refs, nref, sizeof(DBVREC *), _db_cmpvref);
+  step = nref / ((long)nthreads * SCAN_SAMPLES) + 1;
+  if ((cands = malloc((nref / step + 1) * sizeof(off_t))) == NULL) {
+    err_dump("db_verify(): malloc() error");
+  }
+  for (ncand = 0, i = 0; i < nref; i += step) {
+    cands[ncand++] = refs[i]->datoff - EXT_HDR_SZ;
+  }
+  for (i = 0; i < nthreads; i++) {
+    r[i].heap = HEAP_DAT;
+    r[i].boff = r[i].blen = 0;
+  }
+  if (db->features & F_SNAPSHOT) {
+    _db_vretired(&vc);
+  }
+  n = _db_vsplit(r, cands, ncand, nthreads, splits);
+  for (i = 0, j = 0; i < n; i++) {
+    r[i].start = splits[i];
+    r[i].end = splits[i + 1];
+    r[i].refs = refs + j;
+    while (j < nref && (i == n - 1 || refs[j]->datoff < splits[i + 1])) {
+      j++;
+    }
+    r[i].nref = refs + j - r[i].refs;
+  }
+  _db_vrun(r, n);
+  free(cands);
+  for (nfree[HEAP_DAT] = 0, i = 0; i < n; i++) {
+    nfree[HEAP_DAT] += r[i].nfree;
+  }
+  if ((frees[HEAP_DAT] = malloc((nfree[HEAP_DAT] + 1) * sizeof(DBVFREE))) ==
+      NULL) {
+    err_dump("db_verify(): malloc() error");
+  }
+  for (nfree[HEAP_DAT] = 0, i = 0; i < n; i++) {
+    memcpy(frees[HEAP_DAT] + nfree[HEAP_DAT], r[i].frees,
+           r[i].nfree * sizeof(DBVFREE));
+    nfree[HEAP_DAT] += r[i].nfree;
+    free(r[i].frees);
+  }
+
+  _db_vfreelists(&vc, frees, nfree);
+  for (heap = HEAP_IDX; heap <= HEAP_DAT; heap++) {
+    for (f = frees[heap]; f < frees[heap] + nfree[heap]; f++) {
+      res.nfree++;
+      res.freebytes += f->size;
+    }
+    free(frees[heap]);
+  }
+  for (i = 0; i < nthreads; i++) {
+    free(r[i].buf);
+    free(r[i].rawbuf);
+    if (r[i].bigbuf != NULL) {
+      free(r[i].bigbuf);
+    }
+  }
+  free(r);
+  free(splits);
+  free(heads);
+  free(recs);
+  free(segs);
+  free(refs);
+  free(vc.retired);
+
+doreturn:
+  if (_db_un_lock(db, db->idxfd, 0, 0) < 0) {
+    err_dump("db_verify(): un_lock() error");
+  }
+  pthread_mutex_destroy(&vc.mutex);
+  free(vc.name[HEAP_IDX]);
+  free(vc.name[HEAP_DAT]);
+  res.nbad = vc.nbad;
+  if (vr != NULL) {
+    *vr = res;
+  }
+  if (res.nbad > 0) {
+    errno = EBADMSG;
+    return (-1);
+  }
+  return (0);
+} /* db_verify() */
+
+/**
+ * Check an ASCII database, or a binary one without F_ALLOC, for db_verify():
+ * follow every hash chain and the free list with _db_readidx() and
+ * _db_readdat(), as a fetch would.  These files don't say where their records
+ * start, so records that are on no chain can't be told from lost space, and
+ * aren't looked for.
+ * @param vc state of db_verify().
+ * @param res filled in with what was found.
+ */
+static void _db_vascii(DBVCHECK *vc, DBVERIFY *res) {
+  DB *db = vc->db;
+  off_t offset, next, maxlen;
+  DBHASH b;
+  long len;
+
+  if (db->maxload != 0) {
+    db->nbucket = _db_readnbucket(db);
+  }
+  maxlen = vc->size[HEAP_IDX] / IDXLEN_MIN + 1; /* more than can fit */
+  for (b = 0; b <= db->nbucket; b++) { /* the free list last */
+    offset = _db_readptr(db, b < db->nbucket ? _db_bucketoff(db, b)
+                                             : db->freeoff);
+    for (len = 0; offset != 0; len++, offset = next) {
+      if (len >= maxlen) {
+        _db_vreport(vc, HEAP_IDX, offset, b < db->nbucket
+                                              ? "chain of bucket %lu loops"
+                                              : "free list loops",
+                    b);
+        break;
+      }
+      next = _db_readidx(db, offset);
+      if (db->bad) {
+        _db_vreport(vc, HEAP_IDX, offset, db->bad == EBADMSG
+                                              ? "bad index record"
+                                              : "can't read index record");
+        break;
+      }
+      if (b == db->nbucket) {
+        res->nfree++;
+        res->freebytes += db->idxlen + db->datlen +
+                          (db->format == DB_FMT_ASCII ? PTR_SZ + IDXLEN_SZ : 0);
+        continue;
+      }
+      if (_db_bucket(db, _db_hash(db, db->idxbuf)) != b) {
+        _db_vreport(vc, HEAP_IDX, offset,
+                    "key of bucket %lu on the chain of bucket %lu",
+                    _db_bucket(db, _db_hash(db, db->idxbuf)), b);
+      }
+      if (_db_readdat(db) == NULL) {
+        _db_vreport(vc, HEAP_DAT, db->datoff, db->bad == EBADMSG
+                                                  ? "bad data record"
+                                                  : "can't read data record");
+      }
+    }
+    if (b < db->nbucket) {
+      res->nrec += len;
+      res->nchain += (len > 0);
+      if (len > res->maxchain) {
+        res->maxchain = len;
+      }
+    }
+  }
+} /* _db_vascii() */
+
+/**
+ * Read the chain ptrs of all the buckets for db_verify(), from the hash table
+ * created with the index file and the segments added to it.  The number of
+ * buckets and the segments must fit in the index file.
+ * @param vc state of db_verify().
+ * @param segoff filled in with the offset of the slots of each segment in use;
+ * 0 for segments not in use, or not in the file.
+ * @return malloc'ed array of the chain ptr of each bucket, 0 for the buckets of
+ * a segment not in the file.
+ */
+static off_t *_db_vheads(DBVCHECK *vc, off_t *segoff) {
+  DB *db = vc->db;
+  unsigned char segs[BIN_NSEG * 8], *buf;
+  off_t *heads, off;
+  DBHASH first, count, i, j, n;
+  int k;
+
+  if ((db->nbucket = _db_readnbucket(db)) < db->nhash) {
+    db->nbucket = db->nhash;
+  }
+  if (db->nbucket - db->nhash > (DBHASH)vc->size[HEAP_IDX] / BIN_SLOT_SZ) {
+    _db_vreport(vc, HEAP_IDX, HDR_NBUCKET,
+                "%lu buckets don't fit in the index file", db->nbucket);
+    db->nbucket = db->nhash;
+  }
+  if (pread(db->idxfd, segs, sizeof(segs), HDR_SEGOFF) != sizeof(segs)) {
+    err_dump("_db_vheads(): pread() error");
+  }
+  if ((heads = malloc(db->nbucket * sizeof(off_t))) == NULL ||
+      (buf = malloc(SCAN_BLOCK)) == NULL) {
+    err_dump("_db_vheads(): malloc() error");
+  }
+  memset(segoff, 0, BIN_NSEG * sizeof(off_t));
+  for (k = 0, first = 0; first < db->nbucket; k++, first += count) {
+    count = (k == 0 ? db->nhash : db->nhash << (k - 1));
+    if (k >= BIN_NSEG || count > db->nbucket - first) {
+      count = db->nbucket - first;
+    }
+    off = (k == 0 ? db->hashoff
+                  : k < BIN_NSEG ? (off_t)_db_get64(segs + k * 8) : 0);
+    if (k >= BIN_NSEG || (k > 0 && off < db->recoff + BIN_REC_SZ) ||
+        off > vc->size[HEAP_IDX] - (off_t)(count * BIN_SLOT_SZ)) {
+      _db_vreport(vc, HEAP_IDX, k < BIN_NSEG ? HDR_SEGOFF + k * 8 : HDR_NBUCKET,
+                  "hash table segment %d is not in the index file", k);
+      memset(heads + first, 0, count * sizeof(off_t));
+      continue;
+    }
+    segoff[k] = off;
+    for (i = 0; i < count; i += n) {
+      n = (count - i < SCAN_BLOCK / BIN_SLOT_SZ ? count - i
+                                                : SCAN_BLOCK / BIN_SLOT_SZ);
+      if (pread(db->idxfd, buf, n * BIN_SLOT_SZ, off + i * BIN_SLOT_SZ) !=
+          n * BIN_SLOT_SZ) {
+        err_dump("_db_vheads(): pread() error");
+      }
+      for (j = 0; j < n; j++) {
+        heads[first + i + j] = _db_get64(buf + j * BIN_SLOT_SZ + SLOT_PTR);
+      }
+    }
+  }
+  free(buf);
+  return (heads);
+} /* _db_vheads() */
+
+/**
+ * Read the retire list of the data heap for db_verify(): the data records on
+ * it that aren't freed yet may still be read by snapshots.  A block that isn't
+ * a valid retire list block ends the list.
+ * @param vc state of db_verify(); retired and nretired are filled in.
+ */
+static void _db_vretired(DBVCHECK *vc) {
+  DB *db = vc->db;
+  unsigned char list[8], buf[RB_SIZE];
+  off_t blk;
+  long nblk, max = 0;
+  uint32_t first, count;
+
+  if (pread(db->idxfd, list, 8, HDR_RETIRE + HEAP_DAT * 24) != 8) {
+    err_dump("_db_vretired(): pread() error");
+  }
+  for (blk = _db_get64(list), nblk = 0; blk != 0;
+       blk = _db_get64(buf + REC_PTR), nblk++) {
+    if (nblk > vc->size[HEAP_IDX] / RB_SIZE) {
+      _db_vreport(vc, HEAP_IDX, HDR_RETIRE + HEAP_DAT * 24,
+                  "retire list loops");
+      break;
+    }
+    if (blk < db->recoff || blk > vc->size[HEAP_IDX] - RB_SIZE ||
+        pread(db->idxfd, buf, RB_SIZE, blk) != RB_SIZE ||
+        _db_get32(buf + REC_MAGIC) != BIN_REC_MAGIC ||
+        _db_get16(buf + REC_FLAGS) != REC_F_RETIRE ||
+        (count = _db_get32(buf + RB_COUNT)) > RB_NENT ||
+        (first = _db_get32(buf + RB_FIRST)) > count) {
+      _db_vreport(vc, HEAP_IDX, blk, "invalid retire list block");
+      break;
+    }
+    for (; first < count; first++) {
+      vc->retired = _db_vgrow(vc->retired, vc->nretired, &max, sizeof(off_t));
+      vc->retired[vc->nretired++] = _db_get64(buf + RB_ENT + first * 16);
+    }
+  }
+  if (vc->nretired > 0) {
+    qsort(vc->retired, vc->nretired, sizeof(off_t), _db_cmpoff);
+  }
+} /* _db_vretired() */
+
+/**
+ * Split a heap into byte ranges for db_verify().  The ranges start at extents
+ * known to be in use, as the ranges of db_scan() do, so that they fall on
+ * extent boundaries: the first of the candidates at or after each share of the
+ * heap that looks like a whole extent, and not a free one, since the old
+ * extents that free extents are merged from are still there inside them.
+ * @param r range to read the heap with, HEAP_IDX or HEAP_DAT.
+ * @param cands offsets of the candidates, sorted.
+ * @param ncand number of candidates.
+ * @param nthreads number of ranges wanted.
+ * @param splits filled in with the start of each range, then end.
+ * @return number of ranges, from 1 to nthreads.
+ */
+static long _db_vsplit(DBVRANGE *r, const off_t *cands, long ncand,
+                       int nthreads, off_t *splits) {
+  off_t start, end, want;
+  uint32_t magic;
+  long i, j, n;
+
+  start = (r->heap == HEAP_IDX ? r->vc->db->recoff : DAT_HDR_SZ);
+  if ((end = r->vc->size[r->heap]) < start) {
+    end = start;
+  }
+  splits[0] = start;
+  for (n = 1, i = 1, j = 0; i < nthreads; i++) {
+    want = start + (end - start) / nthreads * i;
+    while (j < ncand && (cands[j] < want || cands[j] <= splits[n - 1] ||
+                         _db_vextent(r, cands[j], &magic) == 0 ||
+                         magic == EXT_FREE_MAGIC)) {
+      j++;
+    }
+    if (j == ncand) {
+      break;
+    }
+    splits[n++] = cands[j];
+  }
+  splits[n] = end;
+  return (n);
+} /* _db_vsplit() */
+
+/**
+ * Check the ranges of a heap for db_verify(), a thread for each.  The calling
+ * thread checks the first range, and any range that no thread could be created
+ * for.
+ * @param r the ranges.
+ * @param n number of ranges.
+ */
+static void _db_vrun(DBVRANGE *r, long n) {
+  long i;
+
+  for (i = 1; i < n; i++) {
+    r[i].started = (pthread_create(&r[i].tid, NULL, _db_vrange, r + i) == 0);
+  }
+  for (i = 0; i < n; i++) {
+    if (!r[i].started) {
+      _db_vrange(r + i);
+    }
+  }
+  for (i = 0; i < n; i++) {
+    if (r[i].started) {
+      pthread_join(r[i].tid, NULL);
+      r[i].started = 0;
+    }
+  }
+} /* _db_vrun() */
+
+/**
+ * Check a range of a heap for db_verify(): read it a block at a time, extent by
+ * extent.  Where there is no valid extent, the range is searched for the next
+ * one.  Runs in a thread of its own, or in the calling thread.
+ * @param arg pointer to the DBVRANGE structure of the range.
+ * @return NULL.
+ */
+static void *_db_vrange(void *arg) {
+  DBVRANGE *r = arg;
+  DBVCHECK *vc = r->vc;
+  const unsigned char *p;
+  DBVFREE *f;
+  off_t pos, skip;
+  uint32_t magic, size;
+  long j = 0, used;
+  int prevfree = 0;
+
+  pos = r->start;
+  while (pos < r->end) {
+    if ((size = _db_vextent(r, pos, &magic)) == 0) {
+      for (skip = pos + EXT_ALIGN;
+           skip < r->end && _db_vextent(r, skip, &magic) == 0;
+           skip += EXT_ALIGN) {
+        ;
+      }
+      _db_vreport(vc, r->heap, pos, "not a valid extent; %lld bytes skipped",
+                  (long long)(skip - pos));
+      pos = skip;
+      prevfree = 0;
+      continue;
+    }
+
+    /*
+     * A data record must be used by exactly one index record.  Those whose
+     * data offset comes before the extent missed the start of every extent.
+     */
+    if (r->heap == HEAP_DAT) {
+      for (; j < r->nref && r->refs[j]->datoff < pos + EXT_HDR_SZ; j++) {
+        _db_vreport(vc, HEAP_IDX, r->refs[j]->off,
+                    "data offset %lld is not at a data record",
+                    (long long)r->refs[j]->datoff);
+      }
+      for (used = 0; j < r->nref && r->refs[j]->datoff == pos + EXT_HDR_SZ;
+           j++, used++) {
+        if (magic == EXT_FREE_MAGIC) {
+          _db_vreport(vc, HEAP_IDX, r->refs[j]->off,
+                      "data record at %lld is free space", (long long)pos);
+        } else if (used > 0) {
+          _db_vreport(vc, HEAP_IDX, r->refs[j]->off,
+                      "data record at %lld is used by another index record",
+                      (long long)pos);
+        } else {
+          _db_vdatrec(r, pos, size, r->refs[j]);
+        }
+      }
+      if (magic == EXT_DAT_MAGIC && used == 0 &&
+          _db_vfind(vc->retired, vc->nretired, sizeof(off_t), pos) == NULL) {
+        _db_vreport(vc, HEAP_DAT, pos,
+                    "data record not used by any index record");
+      }
+    }
+
+    if (magic == EXT_FREE_MAGIC) {
+      if (prevfree) {
+        _db_vreport(vc, r->heap, pos, "free extent after a free extent");
+      }
+      p = _db_vread(r, pos, EXT_FREE_SZ);
+      r->frees = _db_vgrow(r->frees, r->nfree, &r->maxfree, sizeof(DBVFREE));
+      f = r->frees + r->nfree++;
+      f->off = pos;
+      f->next = _db_get64(p + EXT_NEXT);
+      f->prev = _db_get64(p + EXT_PREV);
+      f->size = size;
+      f->listed = 0;
+    } else if (r->heap == HEAP_IDX) {
+      _db_vidxrec(r, pos, size);
+    }
+    prevfree = (magic == EXT_FREE_MAGIC);
+    pos += size;
+  }
+  for (; j < r->nref; j++) {
+    _db_vreport(vc, HEAP_IDX, r->refs[j]->off,
+                "data offset %lld is not at a data record",
+                (long long)r->refs[j]->datoff);
+  }
+  return (NULL);
+} /* _db_vrange() */
+
+/**
+ * Check an index record extent for db_verify(), and add a record with a key to
+ * those of the range, and a hash table segment to its segments.  Nodes of the
+ * ordered index, the compression dictionary, which db_openopt() has checked,
+ * blocks of the retire lists and dead records are skipped.
+ * @param r the range.
+ * @param pos offset of the extent.
+ * @param size size of the extent.
+ */
+static void _db_vidxrec(DBVRANGE *r, off_t pos, uint32_t size) {
+  DBVCHECK *vc = r->vc;
+  DB *db = vc->db;
+  const unsigned char *p;
+  DBVREC *e;
+  char key[IDXLEN_MAX];
+  size_t keylen;
+  int flags, i;
+
+  if (size < BIN_REC_SZ + EXT_FTR_SZ ||
+      (p = _db_vread(r, pos, BIN_REC_SZ)) == NULL) {
+    _db_vreport(vc, HEAP_IDX, pos, "index record shorter than its header");
+    return;
+  }
+  flags = _db_get16(p + REC_FLAGS);
+  keylen = _db_get16(p + REC_KEYLEN);
+  if (flags & REC_F_SEGMENT) {
+    r->segs = _db_vgrow(r->segs, r->nseg, &r->maxseg, sizeof(off_t));
+    r->segs[r->nseg++] = pos;
+    return;
+  } else if (flags & REC_F_TREE) {
+    return;
+  } else if (flags == REC_F_DICT && keylen == 0 &&
+             (db->features & F_PACKED)) {
+    return;
+  } else if (flags == REC_F_RETIRE && keylen == 0 &&
+             (db->features & F_SNAPSHOT)) {
+    return;
+  } else if (flags != 0 &&
+             (flags != REC_F_PACKED || !(db->features & F_PACKED))) {
+    _db_vreport(vc, HEAP_IDX, pos, "unknown index record flags %#x", flags);
+  }
+  if (keylen == 0) {
+    _db_vreport(vc, HEAP_IDX, pos, "index record without a key");
+    return;
+  }
+  if ((db->features & F_SNAPSHOT) && (_db_get64(p + REC_PTR) & REC_DEAD)) {
+    return;
+  }
+
+  r->recs = _db_vgrow(r->recs, r->nrec, &r->maxrec, sizeof(DBVREC));
+  e = r->recs + r->nrec++;
+  e->off = pos;
+  e->next = _db_get64(p + REC_PTR);
+  e->datoff = _db_get64(p + REC_DATOFF);
+  e->datlen = _db_get32(p + REC_DATLEN);
+  e->datsum = _db_get32(p + REC_DATSUM);
+  e->rawlen = (flags & REC_F_PACKED ? _db_get32(p + REC_RAWLEN) : 0);
+  e->bucket = VRF_NOBUCKET;
+  e->chain = 0;
+  if (keylen >= IDXLEN_MAX || BIN_REC_SZ + keylen + EXT_FTR_SZ > size ||
+      (p = _db_vread(r, pos, BIN_REC_SZ + keylen)) == NULL) {
+    _db_vreport(vc, HEAP_IDX, pos, "invalid key length %lu",
+                (unsigned long)keylen);
+    e->datlen = 0;
+    return;
+  }
+  memcpy(key, p + BIN_REC_SZ, keylen);
+  key[keylen] = 0;
+  if (strlen(key) != keylen) {
+    _db_vreport(vc, HEAP_IDX, pos, "key holds a null byte");
+  } else {
+    e->bucket = _db_bucket(db, _db_hash(db, key));
+  }
+  for (i = (db->features & F_CHECKSUM ? REC_DATSUM + 4 : REC_SUM);
+       i < BIN_REC_SZ &&
+       (p[i] == 0 ||
+        ((flags & REC_F_PACKED) && i >= REC_RAWLEN && i < REC_RAWLEN + 4) ||
+        ((db->features & F_SNAPSHOT) && i >= REC_BIRTH && i < REC_BIRTH + 4));
+       i++) {
+    ;
+  }
+  if (i < BIN_REC_SZ) {
+    _db_vreport(vc, HEAP_IDX, pos, "reserved bytes of index record not zero");
+  }
+  if ((db->features & F_CHECKSUM) &&
+      _db_get32(p + REC_SUM) != _db_recsum(p, keylen)) {
+    _db_vreport(vc, HEAP_IDX, pos, "index record checksum doesn't match");
+  }
+  if (e->datlen == 0 || e->datlen > DATLEN(db)) {
+    _db_vreport(vc, HEAP_IDX, pos, "invalid data length %lu",
+                (unsigned long)e->datlen);
+    e->datlen = 0;
+  } else if ((flags & REC_F_PACKED) &&
+             (e->rawlen < DATLEN_MIN || e->rawlen > DATLEN(db))) {
+    _db_vreport(vc, HEAP_IDX, pos, "invalid unpacked data length %lu",
+                (unsigned long)e->rawlen);
+    e->datlen = 0;
+  }
+} /* _db_vidxrec() */
+
+/**
+ * Check a data record for db_verify(), against the index record that uses it.
+ * A packed record must unpack to the length the index record gives.
+ * @param r the range.
+ * @param pos offset of the extent.
+ * @param size size of the extent.
+ * @param e the index record.
+ */
+static void _db_vdatrec(DBVRANGE *r, off_t pos, uint32_t size,
+                        const DBVREC *e) {
+  const unsigned char *p;
+
+  if (EXT_HDR_SZ + e->datlen + EXT_FTR_SZ > size) {
+    _db_vreport(r->vc, HEAP_DAT, pos, "data record of %lu bytes overruns its "
+                "extent", (unsigned long)e->datlen);
+  } else if ((p = _db_vread(r, pos + EXT_HDR_SZ, e->datlen)) == NULL) {
+    _db_vreport(r->vc, HEAP_DAT, pos, "can't read data record");
+  } else if (p[e->datlen - 1] != NEWLINE) {
+    _db_vreport(r->vc, HEAP_DAT, pos, "data record without a newline");
+  } else if ((r->vc->db->features & F_CHECKSUM) &&
+             _db_crc32c(0, p, e->datlen) != e->datsum) {
+    _db_vreport(r->vc, HEAP_DAT, pos, "data record checksum doesn't match");
+  } else if (e->rawlen != 0 &&
+             _db_lzunpack(r->vc->db, p, e->datlen - 1,
+                          (unsigned char *)_db_rawbuf(&r->rawbuf, &r->rawsize,
+                                                      e->rawlen),
+                          e->rawlen - 1) < 0) {
+    _db_vreport(r->vc, HEAP_DAT, pos, "packed data record doesn't unpack");
+  }
+} /* _db_vdatrec() */
+
+/**
+ * Check for a whole extent, in use or free, for db_verify(): a valid magic
+ * number and size, in the file, and the same size at the end.
+ * @param r range of the heap.
+ * @param pos offset of the extent.
+ * @param magicp set to the magic number of the extent.
+ * @return size of the extent; 0 if there is no valid extent at pos.
+ */
+static uint32_t _db_vextent(DBVRANGE *r, off_t pos, uint32_t *magicp) {
+  const unsigned char *p;
+  unsigned char ftr[EXT_FTR_SZ];
+  uint32_t magic, size;
+
+  if ((p = _db_vread(r, pos, EXT_HDR_SZ)) == NULL) {
+    return (0);
+  }
+  magic = _db_get32(p);
+  size = _db_get32(p + 4);
+  if ((magic != EXT_FREE_MAGIC &&
+       magic != (r->heap == HEAP_IDX ? BIN_REC_MAGIC : EXT_DAT_MAGIC)) ||
+      size < EXT_MIN || size % EXT_ALIGN != 0 ||
+      size > r->vc->size[r->heap] - pos) {
+    return (0);
+  }
+  if (size <= SCAN_BLOCK) {
+    if ((p = _db_vread(r, pos, size)) == NULL) {
+      return (0);
+    }
+    p += size - EXT_FTR_SZ;
+  } else if (pread(r->heap == HEAP_IDX ? r->vc->db->idxfd : r->vc->db->datfd,
+                   ftr, EXT_FTR_SZ, pos + size - EXT_FTR_SZ) == EXT_FTR_SZ) {
+    p = ftr;
+  } else {
+    return (0);
+  }
+  if (_db_get32(p) != size) {
+    return (0);
+  }
+  *magicp = magic;
+  return (size);
+} /* _db_vextent() */
+
+/**
+ * Read bytes of a heap for db_verify(), from the block of the range if they are
+ * in it; if not, the block is read again starting with them.  Bytes that don't
+ * fit in a block are read on their own.
+ * @param r range of the heap.
+ * @param off offset of the bytes.
+ * @param len number of bytes.
+ * @return pointer to the bytes; NULL if they can't all be read.
+ */
+static const unsigned char *_db_vread(DBVRANGE *r, off_t off, size_t len) {
+  int fd = (r->heap == HEAP_IDX ? r->vc->db->idxfd : r->vc->db->datfd);
+  ssize_t n;
+
+  if (off >= r->boff && off + len <= r->boff + r->blen) {
+    return ((const unsigned char *)r->buf + (off - r->boff));
+  }
+  if (len > SCAN_BLOCK) {
+    if (len > r->bigsize) {
+      if ((r->bigbuf = realloc(r->bigbuf, len)) == NULL) {
+        err_dump("_db_vread(): realloc() error");
+      }
+      r->bigsize = len;
+    }
+    if (pread(fd, r->bigbuf, len, off) != len) {
+      return (NULL);
+    }
+    return ((const unsigned char *)r->bigbuf);
+  }
+  if ((n = pread(fd, r->buf, SCAN_BLOCK, off)) < 0) {
+    n = 0;
+  }
+  r->boff = off;
+  r->blen = n;
+  return (n < (ssize_t)len ? NULL : (const unsigned char *)r->buf);
+} /* _db_vread() */
+
+/**
+ * Follow the hash chains for db_verify(), through the index records found in
+ * the heap.  Each record must be on the chain of the bucket of its key, and on
+ * no other chain, and every record must be on a chain.  If the hash table can
+ * grow, the header must count the records on the chains.
+ * @param vc state of db_verify().
+ * @param heads chain ptr of each bucket.
+ * @param segoff offset of the slots of each hash table segment in use.
+ * @param recs index records, sorted by offset.
+ * @param nrec number of index records.
+ * @param res filled in with the number and length of the chains.
+ */
+static void _db_vchains(DBVCHECK *vc, const off_t *heads, const off_t *segoff,
+                        DBVREC *recs, long nrec, DBVERIFY *res) {
+  DB *db = vc->db;
+  DBVREC *e;
+  unsigned char buf[8];
+  off_t offset, from;
+  DBHASH b, segend;
+  long i, len;
+  int k;
+
+  for (b = 0, k = 0, segend = db->nhash, from = db->hashoff; b < db->nbucket;
+       b++, from += BIN_SLOT_SZ) {
+    if (b == segend) {
+      segend *= 2; /* segment k holds nhash * 2^(k-1) buckets */
+      from = (++k < BIN_NSEG ? segoff[k] : 0);
+    }
+    for (len = 0, offset = heads[b]; offset != 0; len++) {
+      if ((e = _db_vfind(recs, nrec, sizeof(DBVREC), offset)) == NULL) {
+        _db_vreport(vc, HEAP_IDX, from,
+                    "chain of bucket %lu goes to %lld, not an index record", b,
+                    (long long)offset);
+        break;
+      }
+      if (e->chain != 0) {
+        _db_vreport(vc, HEAP_IDX, from,
+                    e->chain == b + 1
+                        ? "chain of bucket %lu loops back to %lld"
+                        : "chain of bucket %lu joins another chain at %lld",
+                    b, (long long)offset);
+        break;
+      }
+      e->chain = b + 1;
+      if (e->bucket != b && e->bucket != VRF_NOBUCKET) {
+        _db_vreport(vc, HEAP_IDX, offset,
+                    "key of bucket %lu on the chain of bucket %lu", e->bucket,
+                    b);
+      }
+      from = offset + REC_PTR;
+      offset = e->next;
+    }
+    res->nrec += len;
+    res->nchain += (len > 0);
+    if (len > res->maxchain) {
+      res->maxchain = len;
+    }
+  }
+  for (i = 0; i < nrec; i++) {
+    if (recs[i].chain == 0) {
+      _db_vreport(vc, HEAP_IDX, recs[i].off, "index record not on any chain");
+    }
+  }
+  if (db->maxload != 0) {
+    if (pread(db->idxfd, buf, 8, HDR_NREC) != 8) {
+      err_dump("_db_vchains(): pread() error");
+    }
+    if (_db_get64(buf) != (uint64_t)res->nrec) {
+      _db_vreport(vc, HEAP_IDX, HDR_NREC,
+                  "header counts %lu records, the chains hold %ld",
+                  (unsigned long)_db_get64(buf), res->nrec);
+    }
+  }
+} /* _db_vchains() */
+
+/**
+ * Follow the free lists of both heaps for db_verify(), through the free extents
+ * found in them.  Each free extent must be on the list of its size class, with
+ * a link back to the extent before it, and on no other list.
+ * @param vc state of db_verify().
+ * @param frees free extents of each heap, sorted by offset.
+ * @param nfree number of free extents of each heap.
+ */
+static void _db_vfreelists(DBVCHECK *vc, DBVFREE **frees, const long *nfree) {
+  unsigned char heads[2 * EXT_NCLASS * 8];
+  DBVFREE *f;
+  off_t offset, prev, from;
+  long i;
+  int heap, c, fromheap;
+
+  if (pread(vc->db->idxfd, heads, sizeof(heads), HDR_FREECLS) !=
+      sizeof(heads)) {
+    err_dump("_db_vfreelists(): pread() error");
+  }
+  for (heap = HEAP_IDX; heap <= HEAP_DAT; heap++) {
+    for (c = 0; c < EXT_NCLASS; c++) {
+      from = HDR_FREECLS + (heap * EXT_NCLASS + c) * 8;
+      fromheap = HEAP_IDX;
+      offset = _db_get64(heads + (heap * EXT_NCLASS + c) * 8);
+      for (prev = 0; offset != 0; prev = offset, offset = f->next) {
+        if ((f = _db_vfind(frees[heap], nfree[heap], sizeof(DBVFREE),
+                           offset)) == NULL) {
+          _db_vreport(vc, fromheap, from,
+                      "free list %d goes to %lld, not a free extent", c,
+                      (long long)offset);
+          break;
+        }
+        if (f->listed) {
+          _db_vreport(vc, fromheap, from,
+                      "free list %d loops, or joins another, at %lld", c,
+                      (long long)offset);
+          break;
+        }
+        f->listed = 1;
+        if (f->prev != prev) {
+          _db_vreport(vc, heap, offset, "free extent links back to %lld, "
+                      "not %lld", (long long)f->prev, (long long)prev);
+        }
+        if (_db_extclass(f->size, 0) != c) {
+          _db_vreport(vc, heap, offset,
+                      "free extent of %lu bytes on free list %d",
+                      (unsigned long)f->size, c);
+        }
+        from = offset + EXT_NEXT;
+        fromheap = heap;
+      }
+    }
+    for (i = 0; i < nfree[heap]; i++) {
+      if (!frees[heap][i].listed) {
+        _db_vreport(vc, heap, frees[heap][i].off,
+                    "free extent not on any free list");
+      }
+    }
+  }
+} /* _db_vfreelists() */
+
+/**
+ * Find an element of an array sorted by offset for db_verify(), by binary
+ * search.
+ * @param base the array, of structures that start with their offset.
+ * @param n number of elements.
+ * @param size size of an element.
+ * @param off offset to find.
+ * @return pointer to the element; NULL if there is none at off.
+ */
+static void *_db_vfind(const void *base, long n, size_t size, off_t off) {
+  const char *p;
+  long lo, hi, mid;
+
+  for (lo = 0, hi = n; lo < hi;) {
+    mid = lo + (hi - lo) / 2;
+    p = (const char *)base + mid * size;
+    if (*(const off_t *)p == off) {
+      return ((void *)p);
+    } else if (*(const off_t *)p < off) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return (NULL);
+} /* _db_vfind() */
+
+/**
+ * Make room for one more element in a malloc'ed array of db_verify().
+ * @param a the array; NULL if none yet.
+ * @param n number of elements in it.
+ * @param maxp pointer to the size of the array, updated if it grows.
+ * @param size size of an element.
+ * @return the array, moved if it grew.
+ */
+static void *_db_vgrow(void *a, long n, long *maxp, size_t size) {
+  if (n < *maxp) {
+    return (a);
+  }
+  *maxp = (*maxp == 0 ? 1024 : *maxp * 2);
+  if ((a = realloc(a, *maxp * size)) == NULL) {
+    err_dump("_db_vgrow(): realloc() error");
+  }
+  return (a);
+} /* _db_vgrow() */
+
+/**
+ * Report a problem found by db_verify() to its callback, and count it.
+ * @param vc state of db_verify().
+ * @param heap HEAP_IDX or HEAP_DAT: the file the problem is in.
+ * @param off offset of the problem in the file.
+ * @param fmt printf(3) format of the description; it must be short.
+ * @param ... arguments of fmt.
+ */
+static void _db_vreport(DBVCHECK *vc, int heap, off_t off, const char *fmt,
+                        ...) {
+  va_list ap;
+  char msg[256];
+
+  va_start(ap, fmt);
+  vsprintf(msg, fmt, ap);
+  va_end(ap);
+  pthread_mutex_lock(&vc->mutex);
+  vc->nbad++;
+  if (vc->report != NULL) {
+    (*vc->report)(vc->arg, vc->name[heap], off, msg);
+  }
+  pthread_mutex_unlock(&vc->mutex);
+} /* _db_vreport() */
+
+/**
+ * Compare two index records found by db_verify() by the offset of their data,
+ * for qsort().
+ * @param a pointer to a pointer to a DBVREC.
+ * @param b pointer to a pointer to a DBVREC.
+ * @return -1, 0 or 1 as the data of a is before, at or after that of b.
+ */
+static int _db_cmpvref(const void *a, const void *b) {
+  off_t oa = (*(DBVREC *const *)a)->datoff, ob = (*(DBVREC *const *)b)->datoff;
+
+  return (oa < ob ? -1 : oa > ob);
+} /* _db_cmpvref() */
+
+/**
+ * Return the statistics of the handle: how many of each operation it has done,
+ * how long the lookups took to find their keys, and the latencies of fetches,
+ * stores and deletes.  The average number of records compared per lookup,
+ * hops / lookups, shows whether the hash table is too small for the records,
+ * and the lock wait shows contention with other processes and threads.  With
+ * DB_OPT_THREADS, the statistics are summed over the cursors of all the
+ * threads, which keep counting meanwhile.
+ * @param h database handle.
+ * @param st filled in with the statistics.
+ */
+void db_stats(DBHANDLE h, DBSTATS *st) {
+  DB *db = h;
+  DBSHARE *sh = db->share;
+  long i;
+
+  memset(st, 0, sizeof(DBSTATS));
+  if (sh == NULL) {
+    _db_statsadd(st, db);
+  } else {
+    pthread_mutex_lock(&sh->mutex);
+    _db_statsadd(st, sh->leader);
+    for (i = 0; i < sh->ncursors; i++) {
+      _db_statsadd(st, sh->cursors[i]);
+    }
+    pthread_mutex_unlock(&sh->mutex);
+  }
+  _db_latfinish(&st->fetch);
+  _db_latfinish(&st->store);
+  _db_latfinish(&st->delete);
+} /* db_stats() */
+
+/**
+ * Return the lowest latency counted in a bucket of a DBLAT histogram.
+ * @param bucket bucket number, from 0 to DB_NLAT.
+ * @return the lowest latency in nanoseconds; for DB_NLAT, the upper bound of
+ * the last bucket but one.
+ */
+double db_latbound(int bucket) {
+  int e;
+
+  if (bucket < 16) {
+    return (bucket < 0 ? 0.0 : (double)bucket);
+  }
+  if (bucket > DB_NLAT) {
+    bucket = DB_NLAT;
+  }
+  e = 4 + (bucket - 16) / 8;
+  return ((double)(8 + (bucket - 16) % 8) * (double)((uint64_t)1 << (e - 3)));
+} /* db_latbound() */
+
+/**
+ * Return the current time for the latencies of db_stats().
+ * @return nanoseconds from an arbitrary starting point.
+ */
+static uint64_t _db_now(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+    err_dump("_db_now(): clock_gettime() error");
+  }
+  return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+} /* _db_now() */
+
+/**
+ * Count an operation in a latency histogram.
+ * @param lh the histogram.
+ * @param start time the operation started, from _db_now().
+ */
+static void _db_lat(DBHIST *lh, uint64_t start) {
+  uint64_t ns = _db_now() - start;
+
+  if (lh->count == 0 || ns < lh->min) {
+    lh->min = ns;
+  }
+  if (ns > lh->max) {
+    lh->max = ns;
+  }
+  lh->count++;
+  lh->total += ns;
+  lh->hist[_db_latbucket(ns)]++;
+} /* _db_lat() */
+
+/**
+ * Find the bucket of a latency histogram that counts a latency.  Latencies
+ * below 16 ns have a bucket each; above, each power of 2 is cut into eight
+ * buckets by the three bits below the highest bit set, as HdrHistogram does.
+ * Latencies of 2^41 ns (about 37 minutes) and more go in the last bucket.
+ * @param ns the latency in nanoseconds.
+ * @return bucket number, from 0 to DB_NLAT - 1.
+ */
+static int _db_latbucket(uint64_t ns) {
+  int e;
+
+  if (ns < 16) {
+    return ((int)ns);
+  }
+  if (ns >= (uint64_t)1 << 41) {
+    return (DB_NLAT - 1);
+  }
+  for (e = 4; ns >> (e + 1) != 0; e++) {
+    ;
+  }
+  return (16 + (e - 4) * 8 + (int)((ns >> (e - 3)) & 7));
+} /* _db_latbucket() */
+
+/**
+ * Add the counters of a cursor to the statistics of db_stats().
+ * @param st the statistics.
+ * @param db pointer to database structure: the cursor.
+ */
+static void _db_statsadd(DBSTATS *st, const DB *db) {
+  st->fetchok += db->cnt_fetchok;
+  st->fetcherr += db->cnt_fetcherr;
+  st->cachehit += db->cnt_cachehit;
+  st->nextrec += db->cnt_nextrec;
+  st->stor1 += db->cnt_stor1;
+  st->stor2 += db->cnt_stor2;
+  st->stor3 += db->cnt_stor3;
+  st->stor4 += db->cnt_stor4;
+  st->storerr += db->cnt_storerr;
+  st->delok += db->cnt_delok;
+  st->delerr += db->cnt_delerr;
+  st->lookups += db->cnt_lookup;
+  st->hops += db->cnt_hops;
+  st->bloomneg += db->cnt_bloomneg;
+  st->idxbytes += db->cnt_idxbytes;
+  st->datbytes += db->cnt_datbytes;
+  st->locks += db->cnt_lock;
+  st->lockwait += (double)db->lockns;
+  if ((double)db->lockmax > st->lockmax) {
+    st->lockmax = (double)db->lockmax;
+  }
+  _db_latsum(&st->fetch, &db->latfetch);
+  _db_latsum(&st->store, &db->latstore);
+  _db_latsum(&st->delete, &db->latdelete);
+} /* _db_statsadd() */
+
+/**
+ * Add a latency histogram of a cursor to the latencies of db_stats().
+ * _db_latfinish() then works out the percentiles.
+ * @param lat the latencies; total, min and max in nanoseconds.
+ * @param lh the histogram.
+ */
+static void _db_latsum(DBLAT *lat, const DBHIST *lh) {
+  int i;
+
+  if (lh->count == 0) {
+    return;
+  }
+  if (lat->count == 0 || (double)lh->min < lat->min) {
+    lat->min = (double)lh->min;
+  }
+  if ((double)lh->max > lat->max) {
+    lat->max = (double)lh->max;
+  }
+  lat->count += lh->count;
+  lat->total += (double)lh->total;
+  for (i = 0; i < DB_NLAT; i++) {
+    lat->hist[i] += lh->hist[i];
+  }
+} /* _db_latsum() */
+
+/**
+ * Work out the percentiles of the latencies of db_stats() from the histogram.
+ * Each is the highest latency of the bucket it falls in, but no more than the
+ * slowest operation.
+ * @param lat the latencies.
+ */
+static void _db_latfinish(DBLAT *lat) {
+  static const double q[] = {0.5, 0.9, 0.99, 0.999};
+  double *p[4];
+  unsigned long sum, rank;
+  int i, j;
+
+  p[0] = &lat->p50;
+  p[1] = &lat->p90;
+  p[2] = &lat->p99;
+  p[3] = &lat->p999;
+  sum = 0;
+  for (i = 0, j = 0; i < DB_NLAT && j < 4; i++) {
+    sum += lat->hist[i];
+    for (; j < 4; j++) {
+      rank = (unsigned long)(q[j] * lat->count); /* rounded up, from 1 */
+      if (rank == 0 || rank < q[j] * lat->count) {
+        rank++;
+      }
+      if (sum < rank) {
+        break;
+      }
+      *p[j] = db_latbound(i + 1) - 1;
+      if (*p[j] > lat->max) {
+        *p[j] = lat->max;
+      }
+    }
+  }
+} /* _db_latfinish() */
+
+/**
+ * Compact the database: copy the live records, chain by chain, into new index
+ * and data files, and rename the new files into place, leaving behind the space
+ * of deleted records, records replaced by records of a different size, and
+ * free space in general.  The hash table of the new files is sized for the
+ * current number of buckets, and a binary database is rewritten in the current
+ * binary format.  Other processes can keep reading the database while it is
+ * copied; updates wait until the new files are in place.  Every process notices
+ * on its next db_fetch(), db_store(), db_delete() or db_rewind() that the files
+ * have been replaced, and opens the new ones.  The new data file is renamed
+ * first; if the system crashes before the new index file follows it,
+ * db_open() completes the swap.
+ * @param h database handle.
+ * @param stats if not NULL, filled in with the number of records copied and
+ * the file sizes before and after.
+ * @param progress if not NULL, called with the progress so far after every 1%
+ * of the hash chains has been copied, and when done.
+ * @return 0 if OK; -1 on error, with errno set to EBUSY if another compaction
+ * of the database is under way or the handle holds mapped views from
+ * db_fetch_view(), to EBADMSG if a bad record was found, which leaves the
+ * database as it was, or as set by open(2).
+ */
+int db_compact(DBHANDLE h, DBCOMPACT *stats,
+               void (*progress)(const DBCOMPACT *)) {
+  DB *db = _db_cursor(h), *newdb;
+  DBOPTS o;
+  DBCOMPACT st;
+  DBHASH b, step;
+  struct stat statbuff;
+  unsigned char seqbuf[8];
+  char *tmpname, *data;
+  size_t tmplen;
+  off_t offset;
+  int lockfd, mode, err;
+
+  if (db->datmap.pins > 0) {
+    errno = EBUSY;
+    return (-1);
+  }
+  _db_checkswap(db);
+  memset(&st, 0, sizeof(st));
+  if (fstat(db->idxfd, &statbuff) < 0) {
+    err_dump("db_compact(): fstat() error");
+  }
+  mode = statbuff.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+  tmplen = db->namelen + strlen(COMPACT_SUFFIX);
+  if ((tmpname = malloc(tmplen + 5)) == NULL) { /* +5 for ".idx" and null */
+    err_dump("db_compact(): malloc() error");
+  }
+  memcpy(tmpname, db->name, db->namelen);
+  strcpy(tmpname + db->namelen, COMPACT_SUFFIX ".dat");
+
+  /*
+   * Create the new data file before the new index file, so that the index file
+   * never exists without it until the files are renamed (see _db_finishswap()),
+   * and hold a lock on it, so that only one process compacts at a time.
+   */
+  if ((lockfd = open(tmpname, O_RDWR | O_CREAT, mode)) < 0) {
+    free(tmpname);
+    return (-1);
+  }
+  if (_db_write_lock(db, lockfd, 0, 0) < 0) {
+    close(lockfd);
+    free(tmpname);
+    errno = EBUSY;
+    return (-1);
+  }
+
+  /*
+   * With a write-ahead log, hold off updates with the log lock, and empty the
+   * log, whose records refer to the old files.
+   */
+  _db_opbegin(db);
+  if (db->walfd >= 0) {
+    _db_walckpt(db);
+  }
+
+  /*
+   * Read lock the whole index file while the records are copied: readers
+   * carry on, but nothing can be changed.
+   */
+  if (_db_readw_lock(db, db->idxfd, 0, 0) < 0) {
+    err_dump("db_compact(): readw_lock() error");
+  }
+  if (db->maxload != 0) {
+    db->nbucket = _db_readnbucket(db);
+  }
+  memset(&o, 0, sizeof(o));
+  o.format = db->format;
+  o.nhash = db->nbucket;
+  o.maxload = db->maxload;
+  o.hashfn = db->hashid;
+  o.seed = db->seed;
+  if (db->features & F_ORDERED) {
+    o.flags |= DB_OPT_ORDERED;
+  }
+  if (db->features & F_CHECKSUM) {
+    o.flags |= DB_OPT_CHECKSUM;
+  }
+  if (db->features & F_PACKED) {
+    o.flags |= DB_OPT_COMPRESS;
+    o.dict = db->dict;
+    o.dictlen = db->dictlen;
+  }
+  tmpname[tmplen] = 0;
+  if ((newdb = db_openopt(tmpname, O_RDWR | O_CREAT | O_TRUNC, mode, &o)) ==
+      NULL) {
+    err = errno;
+  fail:
+    strcpy(tmpname + tmplen, ".dat");
+    unlink(tmpname);
+    if (_db_un_lock(db, db->idxfd, 0, 0) < 0) {
+      err_dump("db_compact(): un_lock() error");
+    }
+    _db_opend(db);
+    if (_db_un_lock(db, lockfd, 0, 0) < 0) {
+      err_dump("db_compact(): un_lock() error");
+    }
+    close(lockfd);
+    free(tmpname);
+    errno = err;
+    return (-1);
+  }
+  if (fstat(db->idxfd, &statbuff) < 0) {
+    err_dump("db_compact(): fstat() error");
+  }
+  st.oldidx = statbuff.st_size;
+  if (fstat(db->datfd, &statbuff) < 0) {
+    err_dump("db_compact(): fstat() error");
+  }
+  st.olddat = statbuff.st_size;
+
+  /*
+   * Copy the records chain by chain, so that the records of each chain end up
+   * next to each other in the new files.
+   */
+  st.nbucket = db->nbucket;
+  if ((step = db->nbucket / 100) == 0) {
+    step = 1;
+  }
+  for (b = 0; b < db->nbucket; b++) {
+    for (offset = _db_readptr(db, _db_bucketoff(db, b)); offset != 0;) {
+      offset = _db_readidx(db, offset);
+      if (db->bad || (data = _db_readdat(db)) == NULL) {
+        /*
+         * Leave the database as it is, bad record and all, for db_verify()
+         * to look at.
+         */
+        err = db->bad;
+        db_close(newdb);
+        strcpy(tmpname + tmplen, ".idx");
+        unlink(tmpname);
+        goto fail;
+      }
+      if (db_store(newdb, db->idxbuf, data, DB_INSERT) != 0) {
+        err_dump("db_compact(): db_store() error for key %s", db->idxbuf);
+      }
+      st.nrec++;
+    }
+    st.bucket = b + 1;
+    if (progress != NULL && (st.bucket % step == 0 || b + 1 == db->nbucket)) {
+      (*progress)(&st);
+    }
+  }
+  if (db->format == DB_FMT_BINARY &&
+      (pread(db->idxfd, seqbuf, 8, HDR_CHGSEQ) != 8 ||
+       pwrite(newdb->idxfd, seqbuf, 8, HDR_CHGSEQ) != 8)) {
+    err_dump("db_compact(): can't copy change sequence number");
+  }
+  if (db->features & F_SNAPSHOT) {
+    /*
+     * The records were copied without their epochs, which every snapshot taken
+     * from now on sees as before it; the new files go on from the same epoch,
+     * with empty retire lists.
+     */
+    _db_put32(seqbuf, newdb->features | F_SNAPSHOT);
+    if (pwrite(newdb->idxfd, seqbuf, 4, HDR_FEATURES) != 4 ||
+        pread(db->idxfd, seqbuf, 4, HDR_EPOCH) != 4 ||
+        pwrite(newdb->idxfd, seqbuf, 4, HDR_EPOCH) != 4) {
+      err_dump("db_compact(): can't copy snapshot epoch");
+    }
+  }
+  if (fsync(newdb->datfd) < 0 || fsync(newdb->idxfd) < 0) {
+    err_dump("db_compact(): fsync() error");
+  }
+
+  /*
+   * Swap the files.  Upgrading to a write lock waits for the readers to
+   * finish.  Processes that open the database, or find the old files gone,
+   * wait on the lock on the new index file until both files are in place; with
+   * a shared lock table, the processes that find the old files gone wait on
+   * the lock in the table.
+   */
+  if (fstat(newdb->idxfd, &statbuff) < 0) {
+    err_dump("db_compact(): fstat() error");
+  }
+  if (_db_lockwait(newdb->idxfd, F_SETLKW, F_WRLCK, 0, 0) < 0 ||
+      (db->lt != NULL &&
+       _db_ltlock(db, statbuff.st_ino, F_SETLKW, F_WRLCK, 0, 0) < 0) ||
+      _db_writew_lock(db, db->idxfd, 0, 0) < 0) {
+    err_dump("db_compact(): writew_lock() error");
+  }
+  strcpy(tmpname + tmplen, ".dat");
+  strcpy(db->name + db->namelen, ".dat");
+  if (rename(tmpname, db->name) < 0) {
+    err_dump("db_compact(): rename() error for %s", db->name);
+  }
+  strcpy(tmpname + tmplen, ".idx");
+  strcpy(db->name + db->namelen, ".idx");
+  if (rename(tmpname, db->name) < 0) {
+    err_dump("db_compact(): rename() error for %s", db->name);
+  }
+  _db_syncdir(db->name);
+  if (fstat(newdb->idxfd, &statbuff) < 0) {
+    err_dump("db_compact(): fstat() error");
+  }
+  st.newidx = statbuff.st_size;
+  if (fstat(newdb->datfd, &statbuff) < 0) {
+    err_dump("db_compact(): fstat() error");
+  }
+  st.newdat = statbuff.st_size;
+
+  /*
+   * Closing the old index file releases the locks on it.
+   */
+  _db_setfiles(db, newdb->idxfd, newdb->datfd);
+  newdb->idxfd = newdb->datfd = -1;
+  _db_free(newdb);
+  if (_db_un_lock(db, lockfd, 0, 0) < 0) {
+    err_dump("db_compact(): un_lock() error");
+  }
+  close(lockfd);
+  if (_db_un_lock(db, db->idxfd, 0, 0) < 0 ||
+      (db->lt != NULL &&
+       lock_reg(db->idxfd, F_SETLK, F_UNLCK, 0, SEEK_SET, 0) < 0)) {
+    err_dump("db_compact(): un_lock() error");
+  }
+  _db_opend(db);
+  free(tmpname);
+  if (stats != NULL) {
+    *stats = st;
+  }
+  return (0);
+} /* db_compact() */
+
+/**
+ * Check whether db_compact(), in this or another process, has replaced the
+ * database files since they were opened: the index file has no links left.
+ * If so, open the new files instead.
+ * @param db pointer to database structure.
+ * @return 1 if the files were replaced; 0 if not.
+ */
+static int _db_checkswap(DB *db) {
+  struct stat statbuff;
+  int idxfd, datfd;
+
+  if (fstat(db->idxfd, &statbuff) < 0) {
+    err_dump("_db_checkswap(): fstat() error");
+  }
+  if (statbuff.st_nlink > 0) {
+    return (0);
+  }
+  strcpy(db->name + db->namelen, ".idx");
+  if ((idxfd = open(db->name, db->oflag)) < 0) {
+    err_dump("_db_checkswap(): can't open %s", db->name);
+  }
+  strcpy(db->name + db->namelen, ".dat");
+  if ((datfd = open(db->name, db->oflag)) < 0) {
+    err_dump("_db_checkswap(): can't open %s", db->name);
+  }
+  _db_setfiles(db, idxfd, datfd);
+  return (1);
+} /* _db_checkswap() */
+
+/**
+ * Switch the database to new index and data files, closing the old ones and
+ * dropping their mappings.  A snapshot held by the handle keeps reading the old
+ * files, so they're only unlocked, and closed when the snapshot ends.
+ * @param db pointer to database structure.
+ * @param idxfd descriptor of the new index file.
+ * @param datfd descriptor of the new data file.
+ */
+static void _db_setfiles(DB *db, int idxfd, int datfd) {
+  DBSHARE *sh = db->share;
+  struct stat statbuff;
+
+  _db_unmap(&db->idxmap);
+  _db_unmap(&db->datmap);
+  if (db->snapslot >= 0 && db->snapidxfd < 0) {
+    if (lock_reg(db->idxfd, F_SETLK, F_UNLCK, 0, SEEK_SET, 0) < 0) {
+      err_dump("_db_setfiles(): un_lock() error");
+    }
+    db->snapidxfd = db->idxfd;
+    db->snapdatfd = db->datfd;
+  } else {
+    close(db->idxfd);
+    close(db->datfd);
+  }
+  db->idxfd = idxfd;
+  db->datfd = datfd;
+  if (sh != NULL) {
+    /*
+     * Closing the old files released the locks of every cursor on them; take
+     * ours out of the lock table.  Other cursors take theirs out when they find
+     * the files replaced.
+     */
+    pthread_mutex_lock(&sh->mutex);
+    _db_lockcut(sh, db, LOCK_IDX, db->idxino, 0, LOCK_EOF, 1);
+    _db_lockcut(sh, db, LOCK_DAT, db->idxino, 0, LOCK_EOF, 1);
+    pthread_cond_broadcast(&sh->cond);
+    pthread_mutex_unlock(&sh->mutex);
+  }
+  if (db->lt != NULL) {
+    _db_ltpurge(db->lt, db->ltowner, db->idxino);
+  }
+  if (sh != NULL || db->lt != NULL) {
+    if (fstat(db->idxfd, &statbuff) < 0) {
+      err_dump("_db_setfiles(): fstat() error");
+    }
+    db->idxino = statbuff.st_ino;
+  }
+  _db_cacheclear(db); /* the generations of the new chains start again */
+  db->treevalid = 0;  /* and so does the ordered index */
+  if (_db_readhdr(db) < 0) {
+    err_dump("_db_setfiles(): invalid index file header");
+  }
+  if (db->blmfd >= 0) {
+    _db_bloomclose(db); /* the filters were of the old files */
+    if (_db_bloomopen(db, 1, db->oflag) < 0) {
+      err_dump("_db_setfiles(): can't open Bloom filters");
+    }
+  }
+  db->scanoff = db->idxoff = db->recoff; /* as db_rewind(), but the snapshot */
+} /* _db_setfiles() */
 
-      /*
-       * Append new index and data records to end of files.
-       */
-      _db_writedat(db, data, 0, SEEK_END);
-      _db_writeidx(db, key, 0, SEEK_END, ptrval);
+/**
+ * Complete the swap of a db_compact() that was interrupted after the new data
+ * file was renamed into place, but before the new index file was: the new
+ * index file is left on its own.  db_compact() holds a lock on the new index
+ * file while it renames the files, so wait for that lock, and check again.
+ * @param pathname string containing prefix of database filenames.
+ */
+static void _db_finishswap(const char *pathname) {
+  struct stat statbuff, fdstatbuff;
+  char *tmpname, *name;
+  size_t len, tmplen;
+  int fd;
 
+  len = strlen(pathname);
+  tmplen = len + strlen(COMPACT_SUFFIX);
+  if ((tmpname = malloc(tmplen + 5)) == NULL ||
+      (name = malloc(len + 5)) == NULL) {
+    err_dump("_db_finishswap(): malloc() error");
+  }
+  strcpy(tmpname, pathname);
+  strcat(tmpname, COMPACT_SUFFIX ".idx");
+  if ((fd = open(tmpname, O_RDWR)) >= 0) {
+    if (_db_lockwait(fd, F_SETLKW, F_WRLCK, 0, 0) < 0) {
+      err_dump("_db_finishswap(): writew_lock() error");
+    }
+    strcpy(tmpname + tmplen, ".dat");
+    if (access(tmpname, F_OK) < 0 && errno == ENOENT) {
       /*
-       * New record goes to the front of the hash chain.
-       */
-      _db_writeptr(db, db->chainoff, db->idxoff);
-      db->cnt_stor3++;
-    } else {
-      /*
-       * Case 4: Same size data, just replace data record.
+       * Make sure the name still refers to the file that is locked.
        */
-      _db_writedat(db, data, db->datoff, SEEK_SET);
-      db->cnt_stor4++;
+      strcpy(tmpname + tmplen, ".idx");
+      if (stat(tmpname, &statbuff) == 0 && fstat(fd, &fdstatbuff) == 0 &&
+          statbuff.st_dev == fdstatbuff.st_dev &&
+          statbuff.st_ino == fdstatbuff.st_ino) {
+        sprintf(name, "%s.idx", pathname);
+        if (rename(tmpname, name) == 0) {
+          _db_syncdir(name);
+        }
+      }
     }
+    close(fd); /* also releases the lock */
   }
-  rc = 0; /* OK */
+  free(tmpname);
+  free(name);
+} /* _db_finishswap() */
 
-  /* Unlock hash chain locked by _db_find_and_lock() */
-doreturn:
-  if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0) {
-    err_dump("db_store(): un_lock() error");
+/**
+ * Flush the directory entry changes made by rename(2) to disk.  Errors are
+ * ignored, as not all file systems allow a directory to be synced.
+ * @param path pathname of a file in the directory.
+ */
+static void _db_syncdir(const char *path) {
+  char *dir, *p;
+  int fd;
+
+  if ((dir = strdup(path)) == NULL) {
+    err_dump("_db_syncdir(): strdup() error");
   }
-  return (rc);
-} /* db_store() */
+  if ((p = strrchr(dir, '/')) == NULL) {
+    strcpy(dir, ".");
+  } else if (p == dir) {
+    p[1] = 0; /* root directory */
+  } else {
+    *p = 0;
+  }
+  if ((fd = open(dir, O_RDONLY)) >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+} /* _db_syncdir() */
 
 /**
- * Try to find a free index record and accompanying data record of the correct
- * sizes.  This function is only called by db_store().
+ * Write to the index file, the data file or the change log with pwrite(2),
+ * logging the write to the write-ahead log first if an update is in progress.
  * @param db pointer to database structure.
- * @param keylen size of key.
- * @param datlen size of data record.
- * @return 0 on success; -1 if no match is found; dump core if write locking
- * fails.
+ * @param fd db->idxfd, db->datfd or db->chgfd.
+ * @param buf bytes to write.
+ * @param len number of bytes.
+ * @param off file offset to write at.
+ * @return as for pwrite(2).
  */
-static int _db_findfree(DB *db, int keylen, int datlen) {
-  int rc;
-  off_t offset, nextoffset, saveoffset;
+static ssize_t _db_pwrite(DB *db, int fd, const void *buf, size_t len,
+                          off_t off) {
+  struct iovec iov;
 
-  /*
-   * Lock the free list to avoid interfering with any other processes using the
-   * free list.
-   */
-  if (writew_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
-    err_dump("_db_findfree(): writew_lock() error");
+  if (db->inop) {
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    _db_walappend(db, W_WRITE, fd, &iov, 1, off);
   }
+  return (pwrite(fd, buf, len, off));
+} /* _db_pwrite() */
 
-  /*
-   * Read the free list pointer at the head of the list.
-   */
-  saveoffset = FREE_OFF;
-  offset = _db_readptr(db, saveoffset);
-
-  /*
-   * Iterate the free list to find a record with matching key and data sizes.
-   * This simple db library implementation only reuses deleted records if the
-   * key length and data length equal the lengths of the new record being
-   * inserted.
-   */
-  while (offset != 0) {
-    nextoffset = _db_readidx(db, offset);
-    if (strlen(db->idxbuf) == keylen && db->datlen == datlen) {
-      break; /* found a match for key size & data size */
-    }
-    saveoffset = offset;
-    offset = nextoffset;
+/**
+ * Gathering version of _db_pwrite(), with pwritev(2).
+ * @param db pointer to database structure.
+ * @param fd db->idxfd, db->datfd or db->chgfd.
+ * @param iov buffers to write.
+ * @param iovcnt number of buffers.
+ * @param off file offset to write at.
+ * @return as for pwritev(2).
+ */
+static ssize_t _db_pwritev(DB *db, int fd, const struct iovec *iov, int iovcnt,
+                           off_t off) {
+  if (db->inop) {
+    _db_walappend(db, W_WRITE, fd, iov, iovcnt, off);
   }
+  return (pwritev(fd, iov, iovcnt, off));
+} /* _db_pwritev() */
 
-  if (offset == 0) {
-    rc = -1; /* no match found */
-  } else {
+/**
+ * Open the write-ahead log of a database, if it has one or is to have one, and
+ * recover the index and data files from it.  A database has a write-ahead log
+ * once it has been opened with DB_OPT_WAL, and every process that opens it for
+ * writing uses the log from then on.
+ * @param db pointer to database structure, with the files open.
+ * @param create nonzero to create the log if there is none (DB_OPT_WAL).
+ * @param oflag flags the database was opened with.
+ * @return 0 if OK, or if the database has no log; -1 on error, with errno set.
+ */
+static int _db_walopen(DB *db, int create, int oflag) {
+  struct stat statbuff;
+
+  strcpy(db->name + db->namelen, ".wal");
+  if (create) {
+    if (fstat(db->idxfd, &statbuff) < 0) {
+      err_dump("_db_walopen(): fstat() error");
+    }
+    db->walfd = open(db->name, O_RDWR | O_CREAT | (oflag & O_TRUNC),
+                     statbuff.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+  } else if (oflag & O_TRUNC) {
     /*
-     * Found a free record with matching key an data sizes.  The index record
-     * was read in by _db_readidx() above, which sets db->ptrval.  Also,
-     * saveoffset points to the chain ptr that pointed to this empty record on
-     * the free list.  Set this chain ptr to db->ptrval, which removes the empty
-     * record from the free list.  By writing the previous record's chain ptr
-     * to point to the next chain pointer value of the record that was found,
-     * it removes the record from the free list.
+     * A log left over from the old files would be replayed over the new ones.
      */
-    _db_writeptr(db, saveoffset, db->ptrval);
-    rc = 0;
+    unlink(db->name);
+    return (0);
+  } else if ((db->walfd = open(db->name, O_RDWR)) < 0 && errno == ENOENT) {
+    return (0); /* no log */
+  }
+  if (db->walfd < 0) {
+    return (-1);
+  }
+  return (_db_walrecover(db));
+} /* _db_walopen() */
+
+/**
+ * Bring the index and data files up to date from the write-ahead log, and
+ * empty it.  The writes of each committed update are made again, in order, in
+ * case they didn't reach the disk; then the writes of an update that didn't
+ * commit, because its process died part way through, are undone in reverse
+ * order.  The log is read up to the first record that is incomplete or
+ * corrupt.  Updates are made one at a time, under the log lock, so the updates
+ * in the log never overlap.  The Bloom filters, which the log doesn't cover,
+ * are marked unknown if anything was applied.  A new log just gets its header.
+ * @param db pointer to database structure.
+ * @return 0 if OK; -1 with errno set to EINVAL if the log is not recognised.
+ */
+static int _db_walrecover(DB *db) {
+  unsigned char hdr[WAL_HDR_SZ];
+  struct stat statbuff;
+  off_t off, *pending = NULL;
+  long i, npending = 0, maxpending = 0;
+  size_t reclen;
+
+  if (_db_writew_lock(db, db->walfd, WAL_LCK_WRITE, 1) < 0) {
+    err_dump("_db_walrecover(): writew_lock() error");
+  }
+  if (fstat(db->walfd, &statbuff) < 0) {
+    err_dump("_db_walrecover(): fstat() error");
+  }
+  if (statbuff.st_size < WAL_HDR_SZ) {
+    memset(hdr, 0, WAL_HDR_SZ);
+    memcpy(hdr, WAL_MAGIC, 8);
+    _db_put64(hdr + WAL_GEN, 1);
+    _db_put64(hdr + WAL_SYNCED, WAL_HDR_SZ);
+    if (pwrite(db->walfd, hdr, WAL_HDR_SZ, 0) != WAL_HDR_SZ ||
+        ftruncate(db->walfd, WAL_HDR_SZ) < 0 || fdatasync(db->walfd) < 0) {
+      err_dump("_db_walrecover(): can't initialise log");
+    }
+    statbuff.st_size = WAL_HDR_SZ;
+  } else if (pread(db->walfd, hdr, WAL_HDR_SZ, 0) != WAL_HDR_SZ) {
+    err_dump("_db_walrecover(): pread() error");
+  } else if (memcmp(hdr, WAL_MAGIC, 8) != 0) {
+    if (_db_un_lock(db, db->walfd, WAL_LCK_WRITE, 1) < 0) {
+      err_dump("_db_walrecover(): un_lock() error");
+    }
+    errno = EINVAL;
+    return (-1);
+  }
+  db->walgen = _db_get64(hdr + WAL_GEN);
 
+  if (statbuff.st_size > WAL_HDR_SZ) {
     /*
-     * Note: _db_readidx() set both db->idxoff and db->datoff.  This is used by
-     * the caller, db_store(), to write the new index record and data record.
+     * Keep readers in other processes out while old bytes are written again.
      */
+    if (_db_writew_lock(db, db->idxfd, 0, 0) < 0) {
+      err_dump("_db_walrecover(): writew_lock() error");
+    }
+    for (off = WAL_HDR_SZ;
+         (reclen = _db_walread(db, off, statbuff.st_size)) != 0;
+         off += reclen) {
+      if (_db_get16(db->walbuf + WREC_TYPE) == W_COMMIT) {
+        for (i = 0; i < npending; i++) {
+          _db_walapply(db, pending[i], statbuff.st_size, 0);
+        }
+        npending = 0;
+      } else {
+        if (npending == maxpending) {
+          maxpending = maxpending * 2 + 64;
+          if ((pending = realloc(pending, maxpending * sizeof(off_t))) ==
+              NULL) {
+            err_dump("_db_walrecover(): realloc() error");
+          }
+        }
+        pending[npending++] = off;
+      }
+    }
+    for (i = npending - 1; i >= 0; i--) {
+      _db_walapply(db, pending[i], statbuff.st_size, 1);
+    }
+    free(pending);
+    if (off > WAL_HDR_SZ) {
+      _db_bloomforget(db);
+    }
+    _db_walckpt(db);
+    if (_db_un_lock(db, db->idxfd, 0, 0) < 0) {
+      err_dump("_db_walrecover(): un_lock() error");
+    }
   }
+  if (_db_un_lock(db, db->walfd, WAL_LCK_WRITE, 1) < 0) {
+    err_dump("_db_walrecover(): un_lock() error");
+  }
+  return (0);
+} /* _db_walrecover() */
 
-  /*
-   * Unlock the free list.
-   */
-  if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
-    err_dump("_db_findfree(): un_lock() error");
+/**
+ * Read a log record into db->walbuf, and check it.
+ * @param db pointer to database structure.
+ * @param off offset of the record in the log.
+ * @param size size of the log.
+ * @return length of the record; 0 if there is no complete, valid record of the
+ * current checkpoint generation at off.
+ */
+static size_t _db_walread(DB *db, off_t off, off_t size) {
+  unsigned char *rec;
+  size_t reclen;
+  uint64_t sum;
+
+  if (off + WAL_REC_SZ > size) {
+    return (0);
   }
-  return (rc);
-} /* _db_findfree() */
+  rec = _db_walbuf(db, WAL_REC_SZ);
+  if (pread(db->walfd, rec, WAL_REC_SZ, off) != WAL_REC_SZ) {
+    err_dump("_db_walread(): pread() error");
+  }
+  reclen = WAL_REC_SZ + (size_t)_db_get32(rec + WREC_LEN) +
+           _db_get32(rec + WREC_OLDLEN);
+  if (_db_get32(rec + WREC_MAGIC) != WAL_REC_MAGIC ||
+      _db_get64(rec + WREC_GEN) != db->walgen || reclen > size - off) {
+    return (0);
+  }
+  rec = _db_walbuf(db, reclen);
+  if (pread(db->walfd, rec, reclen, off) != reclen) {
+    err_dump("_db_walread(): pread() error");
+  }
+  sum = _db_get64(rec + WREC_SUM);
+  _db_put64(rec + WREC_SUM, 0);
+  if (_db_hash_xxh64((char *)rec, reclen, 0) != sum) {
+    return (0);
+  }
+  return (reclen);
+} /* _db_walread() */
 
 /**
- * Rewind the index file for db_nextrec().  Automatically called by db_open().
- * Must be called before first db_nextrec().
- * @param h database handle.
+ * Make a logged write again, or undo it.
+ * @param db pointer to database structure.
+ * @param off offset of the record in the log.
+ * @param size size of the log.
+ * @param undo 0 to write the new bytes; 1 to put back the old ones, and the
+ * file size if the write made the file bigger.
  */
-void db_rewind(DBHANDLE h) {
-  DB *db = h;
-  off_t offset;
+static void _db_walapply(DB *db, off_t off, off_t size, int undo) {
+  unsigned char *rec;
+  size_t len, oldlen;
+  off_t woff;
+  uint64_t fsize;
+  int fd;
 
-  offset = (db->nhash + 1) * PTR_SZ; /* +1 for free list ptr */
+  if (_db_walread(db, off, size) == 0) {
+    err_dump("_db_walapply(): log record changed");
+  }
+  rec = db->walbuf;
+  switch (_db_get16(rec + WREC_FILE)) {
+  case HEAP_DAT:
+    fd = db->datfd;
+    break;
+  case WAL_CHG:
+    if ((fd = db->chgfd) < 0) {
+      return; /* the change log has been removed */
+    }
+    break;
+  default:
+    fd = db->idxfd;
+    break;
+  }
+  woff = _db_get64(rec + WREC_OFF);
+  len = _db_get32(rec + WREC_LEN);
+  oldlen = _db_get32(rec + WREC_OLDLEN);
+  fsize = _db_get64(rec + WREC_FSIZE);
+  if (!undo) {
+    if (pwrite(fd, rec + WAL_REC_SZ, len, woff) != len) {
+      err_dump("_db_walapply(): pwrite() error");
+    }
+    return;
+  }
+  if (oldlen > 0 &&
+      pwrite(fd, rec + WAL_REC_SZ + len, oldlen, woff) != oldlen) {
+    err_dump("_db_walapply(): pwrite() error");
+  }
+  if (fsize != WAL_NOSIZE && ftruncate(fd, fsize) < 0) {
+    err_dump("_db_walapply(): ftruncate() error");
+  }
+} /* _db_walapply() */
 
-  /*
-   * Just set the file offset for this process to the start of the index
-   * records; no need to lock.  +1 below for newline at end of hash table.
-   */
-  if ((db->idxoff = lseek(db->idxfd, offset + 1, SEEK_SET)) == -1) {
-    err_dump("db_rewind(): lseek() error");
+/**
+ * Start an update.  In a database that copies on write, find out the epoch of
+ * the update and hold off snapshots until it ends, and then, with the log
+ * started by _db_walbegin(), free some of the extents that no snapshot needs
+ * any more.
+ * @param db pointer to database structure.
+ */
+static void _db_opbegin(DB *db) {
+  if (db->snpfd >= 0) {
+    _db_snpbegin(db);
   }
-} /* db_rewind() */
+  _db_walbegin(db);
+  if (db->snpfd >= 0) {
+    _db_reclaim(db);
+  }
+} /* _db_opbegin() */
 
 /**
- * Return the next sequential record.  This function steps through the index
- * file, ignoring deleted records.  db_rewind() must be called before this
- * function is called the first time.
- * @param h database handle.
- * @param key if caller provides a non-null pointer, the corresponding key is
- * copied to the address pointed to by the pointer.  The caller is responsible
- * for allocating a buffer large enough to store the key.  A buffer whose size
- * is IDXLEN_MAX bytes is large enough to hold any key.
- * @return pointer to data buffer for data record.  Records are returned
- * sequentially in the order they happen to be stored in the database file.
- * The records are not sorted by key value.  Also, because hash chains are not
- * followed, deleted records can be found, however deleted records will not be
- * returned to the caller.  This function can dump core and terminate the
- * calling process if the index file lock request fails.
+ * End an update started by _db_opbegin(), letting snapshots be taken again.
+ * @param db pointer to database structure.
  */
-char *db_nextrec(DBHANDLE h, char *key) {
-  DB *db = h;
-  char c;
-  char *ptr;
+static void _db_opend(DB *db) {
+  _db_walend(db);
+  if (db->snpfd >= 0 && _db_un_lock(db, db->snpfd, SNP_LCK_EPOCH, 1) < 0) {
+    err_dump("_db_opend(): un_lock() error");
+  }
+} /* _db_opend() */
 
-  /*
-   * Read lock the free list so that a record is not read in the middle of it
-   * being deleted by another process.
-   */
-  if (readw_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
-    err_dump("db_nextrec(): readw_lock() error");
+/**
+ * Start an update of a database with a write-ahead log: take the log lock,
+ * which makes updates one at a time, and log every write to the index and
+ * data files from now on.  Does nothing for a database without a log.
+ * @param db pointer to database structure.
+ */
+static void _db_walbegin(DB *db) {
+  unsigned char buf[8];
+
+  if (db->walfd < 0) {
+    return;
+  }
+  if (_db_writew_lock(db, db->walfd, WAL_LCK_WRITE, 1) < 0) {
+    err_dump("_db_walbegin(): writew_lock() error");
   }
+  if (pread(db->walfd, buf, 8, WAL_GEN) != 8) {
+    err_dump("_db_walbegin(): pread() error");
+  }
+  db->walgen = _db_get64(buf);
+  if ((db->walend = lseek(db->walfd, 0, SEEK_END)) == -1) {
+    err_dump("_db_walbegin(): lseek() error");
+  }
+  db->walrecs = 0;
+  db->inop = 1;
+} /* _db_walbegin() */
 
-  do {
-    /*
-     * Read next sequential index record; starting from the current offset.
-     */
-    if (_db_readidx(db, 0) < 0) {
-      ptr = NULL; /* end of index file, EOF */
-      goto doreturn;
+/**
+ * End an update started by _db_walbegin().  If anything was written, log the
+ * commit, release the log lock so that the next update can start, and wait
+ * until the log is on disk (group commit: one fsync covers the updates of all
+ * the processes that have committed by then).  The files themselves are only
+ * synced at checkpoints, when the log gets too big.
+ * @param db pointer to database structure.
+ */
+static void _db_walend(DB *db) {
+  off_t lsn = 0;
+
+  if (db->walfd < 0) {
+    return;
+  }
+  db->inop = 0;
+  if (db->walrecs > 0) {
+    _db_walappend(db, W_COMMIT, db->idxfd, NULL, 0, 0);
+    if ((lsn = db->walend) > WAL_CKPT) {
+      _db_walckpt(db);
+      lsn = 0; /* the checkpoint synced everything */
     }
+  }
+  if (_db_un_lock(db, db->walfd, WAL_LCK_WRITE, 1) < 0) {
+    err_dump("_db_walend(): un_lock() error");
+  }
+  if (lsn != 0) {
+    _db_walsync(db, db->walgen, lsn);
+  }
+} /* _db_walend() */
 
-    /*
-     * Check if key is all blank (empty record).  While reading the index file
-     * sequentially, it is possible to find records that have been deleted.
-     * In order to return only valid records, any record whose key is all
-     * spaces is skipped (_db_dodelete() clears a key by setting it to all
-     * blanks).
-     */
-    ptr = db->idxbuf;
-    while ((c = *ptr++) != 0 && c == SPACE) {
-      ; /* skip until null byte or nonblank */
+/**
+ * Append a record to the write-ahead log.  A write record holds the bytes
+ * about to be written, the bytes they replace, and the file size if the write
+ * makes the file bigger.  Called with the log lock held.
+ * @param db pointer to database structure.
+ * @param type W_WRITE or W_COMMIT.
+ * @param fd db->idxfd, db->datfd or db->chgfd.
+ * @param iov bytes about to be written.
+ * @param iovcnt number of buffers.
+ * @param off file offset they are written at.
+ */
+static void _db_walappend(DB *db, int type, int fd, const struct iovec *iov,
+                          int iovcnt, off_t off) {
+  struct stat statbuff;
+  unsigned char *rec, *p;
+  size_t len = 0, reclen;
+  ssize_t oldlen = 0;
+  uint64_t fsize = WAL_NOSIZE;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+  rec = _db_walbuf(db, WAL_REC_SZ + 2 * len);
+  for (p = rec + WAL_REC_SZ, i = 0; i < iovcnt; i++) {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+  if (type == W_WRITE) {
+    if ((oldlen = pread(fd, p, len, off)) < 0) {
+      err_dump("_db_walappend(): pread() error");
     }
-  } while (c == 0); /* loop until a nonblank key is found */
+    if ((size_t)oldlen < len) {
+      if (fstat(fd, &statbuff) < 0) {
+        err_dump("_db_walappend(): fstat() error");
+      }
+      fsize = statbuff.st_size;
+    }
+  }
+  memset(rec, 0, WAL_REC_SZ);
+  _db_put32(rec + WREC_MAGIC, WAL_REC_MAGIC);
+  _db_put16(rec + WREC_TYPE, type);
+  _db_put16(rec + WREC_FILE, fd == db->datfd   ? HEAP_DAT
+                             : fd == db->chgfd ? WAL_CHG
+                                               : HEAP_IDX);
+  _db_put64(rec + WREC_OFF, off);
+  _db_put32(rec + WREC_LEN, len);
+  _db_put32(rec + WREC_OLDLEN, oldlen);
+  _db_put64(rec + WREC_FSIZE, fsize);
+  _db_put64(rec + WREC_GEN, db->walgen);
+  reclen = WAL_REC_SZ + len + oldlen;
+  _db_put64(rec + WREC_SUM, _db_hash_xxh64((char *)rec, reclen, 0));
+  if (pwrite(db->walfd, rec, reclen, db->walend) != reclen) {
+    err_dump("_db_walappend(): pwrite() error");
+  }
+  db->walend += reclen;
+  db->walrecs++;
+} /* _db_walappend() */
 
-  /* Check if caller provided a non-null key buffer */
-  if (key != NULL) {
-    strcpy(key, db->idxbuf); /* return key copied to caller's buffer */
+/**
+ * Wait until the write-ahead log is on disk up to a given offset.  Only one
+ * process syncs at a time; those waiting behind it usually find that its
+ * fsync covered their updates too.
+ * @param db pointer to database structure.
+ * @param gen checkpoint generation of the log when it was written.
+ * @param lsn offset in the log of the end of the update.
+ */
+static void _db_walsync(DB *db, uint64_t gen, off_t lsn) {
+  unsigned char hdr[16];
+  off_t end;
+
+  if (_db_writew_lock(db, db->walfd, WAL_LCK_SYNC, 1) < 0) {
+    err_dump("_db_walsync(): writew_lock() error");
+  }
+  if (pread(db->walfd, hdr, 16, WAL_GEN) != 16) {
+    err_dump("_db_walsync(): pread() error");
   }
+
   /*
-   * Read data record and set return value to point to the internal buffer
-   * containing the data record.
+   * After a checkpoint, the files themselves have been synced.
    */
-  ptr = _db_readdat(db); /* return pointer to data buffer */
-  db->cnt_nextrec++;
+  if (_db_get64(hdr) == gen && _db_get64(hdr + 8) < (uint64_t)lsn) {
+    if ((end = lseek(db->walfd, 0, SEEK_END)) == -1) {
+      err_dump("_db_walsync(): lseek() error");
+    }
+    if (fdatasync(db->walfd) < 0) {
+      err_dump("_db_walsync(): fdatasync() error");
+    }
+    _db_put64(hdr + 8, end);
+    if (pwrite(db->walfd, hdr + 8, 8, WAL_SYNCED) != 8) {
+      err_dump("_db_walsync(): pwrite() error");
+    }
+  }
+  if (_db_un_lock(db, db->walfd, WAL_LCK_SYNC, 1) < 0) {
+    err_dump("_db_walsync(): un_lock() error");
+  }
+} /* _db_walsync() */
 
-doreturn:
-  /* Unlock the free list */
-  if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0) {
-    err_dump("db_nextrec(): un_lock() error");
+/**
+ * Checkpoint the write-ahead log: sync the index and data files, and the
+ * change log, then empty
+ * the log and start a new generation of it.  Called with the log lock held.
+ * @param db pointer to database structure.
+ */
+static void _db_walckpt(DB *db) {
+  unsigned char hdr[16];
+
+  if (_db_writew_lock(db, db->walfd, WAL_LCK_SYNC, 1) < 0) {
+    err_dump("_db_walckpt(): writew_lock() error");
   }
-  return (ptr);
-} /* db_nextrec() */
+  if (fsync(db->datfd) < 0 || fsync(db->idxfd) < 0 ||
+      (db->chgfd >= 0 && fsync(db->chgfd) < 0)) {
+    err_dump("_db_walckpt(): fsync() error");
+  }
+  _db_put64(hdr, ++db->walgen);
+  _db_put64(hdr + 8, WAL_HDR_SZ);
+  if (ftruncate(db->walfd, WAL_HDR_SZ) < 0 ||
+      pwrite(db->walfd, hdr, 16, WAL_GEN) != 16 || fdatasync(db->walfd) < 0) {
+    err_dump("_db_walckpt(): can't empty log");
+  }
+  db->walend = WAL_HDR_SZ;
+  if (_db_un_lock(db, db->walfd, WAL_LCK_SYNC, 1) < 0) {
+    err_dump("_db_walckpt(): un_lock() error");
+  }
+} /* _db_walckpt() */
+
+/**
+ * Make sure the log record buffer holds at least a given number of bytes.
+ * @param db pointer to database structure.
+ * @param size number of bytes needed.
+ * @return pointer to the buffer.
+ */
+static unsigned char *_db_walbuf(DB *db, size_t size) {
+  unsigned char *buf;
+
+  if (size > db->walbufsize) {
+    if ((buf = realloc(db->walbuf, size)) == NULL) {
+      err_dump("_db_walbuf(): realloc() error");
+    }
+    db->walbuf = buf;
+    db->walbufsize = size;
+  }
+  return (db->walbuf);
+} /* _db_walbuf() */
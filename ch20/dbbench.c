@@ -0,0 +1,527 @@
+/*
+ * Program used to measure the performance of the database library under a
+ * synthetic workload.  Usage:
+ *   $ dbbench [-a | -b] [-n nhash] [-l maxload] [-c megabytes] [-m] [-w] [-L]
+ *             [-B] [-C] [-N nrec] [-k keylen] [-v vallen] [-r readpct]
+ *             [-M misspct] [-z theta] [-P nproc] [-T nthreads] [-x nops]
+ *             [-s seed] dbname
+ * The database is created in the ASCII format with -a, or the binary format
+ * (the default) with -b, and loaded with nrec records (default 100000) of
+ * keylen-byte keys (default 16) and vallen-byte data (default 100).  Then
+ * nproc processes (default 1), each with nthreads threads sharing one handle
+ * (default 1), each do nops operations (default 100000) on those keys: a
+ * db_fetch() readpct percent of the time (default 90), otherwise a db_store()
+ * that replaces the data.  misspct percent of the fetches (default 0) are of
+ * a key that isn't in the database.  Keys are chosen uniformly, or with -z from
+ * a Zipf distribution of exponent theta, between 0 and 1, with the popular keys
+ * scattered over the key space.  -n and -l size the hash table as for
+ * dbbulkload, -c gives each handle a record cache, and -m, -w, -L, -B and -C
+ * select DB_OPT_MMAP, DB_OPT_WAL, DB_OPT_LOCKTAB, DB_OPT_BLOOM and
+ * DB_OPT_COMPRESS.  The same seed (default 1) gives the same sequence of
+ * operations.  Throughput and latency percentiles are reported, from
+ * db_stats().
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define LOADBATCH 1000 /* records stored by each db_commit() of the load */
+
+static DBOPTS opts;   /* options of the database and the handles */
+static long nrec;     /* records loaded, which the operations pick from */
+static int keylen;    /* bytes in a key */
+static int vallen;    /* bytes in the data */
+static int readpct;   /* percentage of operations that are fetches */
+static int misspct;   /* percentage of fetches of a key that isn't there */
+static double theta;  /* Zipf exponent; 0 for uniform keys */
+static long nops;     /* operations of each thread */
+static unsigned long seed; /* seed of the random numbers */
+static double zetan;  /* Zipf: sum of 1 / i^theta for i from 1 to nrec */
+static double zeta2;  /* Zipf: the same, up to 2 */
+static unsigned long scatter; /* multiplier that scatters popular keys */
+
+/*
+ * One thread of a worker process.
+ */
+typedef struct {
+  DBHANDLE db;   /* handle of the process */
+  long id;       /* number of the thread across all the processes */
+  pthread_t tid; /* the thread */
+} WORKER;
+
+static double now(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+    err_sys("dbbench: clock_gettime() error");
+  }
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * xorshift64* random number generator: one state per thread, so that each
+ * thread makes the same choices on every run.
+ */
+static uint64_t rnd(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return (*state * ((uint64_t)0x2545f491 << 32 | 0x4f6cdd1d));
+}
+
+static double rnd01(uint64_t *state) {
+  return ((rnd(state) >> 11) * (1.0 / 9007199254740992.0)); /* 2^53 */
+}
+
+/*
+ * Pick the number of the key of the next operation.  Zipf ranks are drawn as
+ * in Gray et al., "Quickly Generating Billion-Record Synthetic Databases", and
+ * then multiplied by a number prime to nrec, so that the popular keys aren't
+ * all next to each other.
+ */
+static long pickkey(uint64_t *state) {
+  double u, uz;
+  long rank;
+
+  if (theta == 0) {
+    return ((long)(rnd(state) % (uint64_t)nrec));
+  }
+  u = rnd01(state);
+  uz = u * zetan;
+  if (uz < 1) {
+    rank = 0;
+  } else if (uz < 1 + pow(0.5, theta)) {
+    rank = 1;
+  } else {
+    rank = (long)(nrec * pow((1 - pow(2.0 / nrec, 1 - theta)) /
+                                     (1 - zeta2 / zetan) * (u - 1) + 1,
+                                 1 / (1 - theta)));
+    if (rank >= nrec) {
+      rank = nrec - 1;
+    }
+  }
+  return ((long)((uint64_t)rank * scatter % (uint64_t)nrec));
+}
+
+static void setzipf(void) {
+  unsigned long a, b, t;
+  long i;
+
+  zetan = 0;
+  for (i = 1; i <= nrec; i++) {
+    zetan += 1 / pow((double)i, theta);
+  }
+  zeta2 = 1 + 1 / pow(2.0, theta);
+  for (scatter = 2654435761UL % nrec; scatter > 1; scatter++) {
+    for (a = scatter, b = nrec; b != 0; t = a % b, a = b, b = t) {
+      ;
+    }
+    if (a == 1) {
+      break;
+    }
+  }
+  if (scatter == 0) {
+    scatter = 1;
+  }
+}
+
+static void makekey(char *key, long n) {
+  sprintf(key, "%0*ld", keylen, n);
+}
+
+static void *work(void *arg) {
+  WORKER *w = arg;
+  uint64_t state;
+  char key[IDXLEN_MAX], *val;
+  long i, n;
+
+  if ((val = malloc(vallen + 1)) == NULL) {
+    err_sys("dbbench: malloc() error");
+  }
+  state = ((uint64_t)seed << 20) + w->id + 1;
+  for (i = 0; i < 4; i++) {
+    rnd(&state); /* mix the seed in */
+  }
+  for (i = 0; i < nops; i++) {
+    n = pickkey(&state);
+    makekey(key, n);
+    if ((long)(rnd(&state) % 100) < readpct) {
+      if ((long)(rnd(&state) % 100) < misspct) {
+        key[0] = 'x'; /* no key that was loaded starts with a letter */
+        if (db_fetch(w->db, key) != NULL) {
+          err_quit("dbbench: key %s found", key);
+        }
+      } else if (db_fetch(w->db, key) == NULL) {
+        err_quit("dbbench: key %s not found", key);
+      }
+    } else {
+      memset(val, 'a' + (int)((n + i) % 26), vallen);
+      val[vallen] = 0;
+      if (db_store(w->db, key, val, DB_REPLACE) != 0) {
+        err_sys("dbbench: db_store() error for %s", key);
+      }
+    }
+  }
+  free(val);
+  return (NULL);
+}
+
+/*
+ * Worker process: open the database, say so on statfd, wait for the go-ahead
+ * on gofd, run the threads, and write the statistics of the handle to statfd.
+ */
+static void worker(const char *name, int proc, int nthreads, int gofd,
+                   int statfd) {
+  DBOPTS o = opts;
+  DBSTATS st;
+  WORKER *w;
+  char c;
+  int i, err;
+
+  if (nthreads > 1) {
+    o.flags |= DB_OPT_THREADS;
+  }
+  if ((w = calloc(nthreads, sizeof(WORKER))) == NULL) {
+    err_sys("dbbench: calloc() error");
+  }
+  if ((w[0].db = db_openopt(name, O_RDWR, FILE_MODE, &o)) == NULL) {
+    err_sys("dbbench: can't open %s", name);
+  }
+  c = 'r';
+  if (write(statfd, &c, 1) != 1 || read(gofd, &c, 1) < 0) {
+    err_sys("dbbench: pipe read or write error");
+  }
+  for (i = 0; i < nthreads; i++) {
+    w[i].db = w[0].db;
+    w[i].id = (long)proc * nthreads + i;
+    if ((err = pthread_create(&w[i].tid, NULL, work, &w[i])) != 0) {
+      err_exit(err, "dbbench: can't create thread");
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(w[i].tid, NULL);
+  }
+  db_stats(w[0].db, &st);
+  if (writen(statfd, &st, sizeof(st)) != sizeof(st)) {
+    err_sys("dbbench: write() error");
+  }
+  db_close(w[0].db);
+  exit(0);
+}
+
+/*
+ * Add the latencies of a process to the totals.
+ */
+static void addlat(DBLAT *sum, const DBLAT *lat) {
+  int i;
+
+  if (lat->count == 0) {
+    return;
+  }
+  if (sum->count == 0 || lat->min < sum->min) {
+    sum->min = lat->min;
+  }
+  if (lat->max > sum->max) {
+    sum->max = lat->max;
+  }
+  sum->count += lat->count;
+  sum->total += lat->total;
+  for (i = 0; i < DB_NLAT; i++) {
+    sum->hist[i] += lat->hist[i];
+  }
+}
+
+/*
+ * Percentile of the latencies: the highest latency of the bucket it falls in,
+ * but no more than the slowest operation.
+ */
+static double percentile(const DBLAT *lat, double q) {
+  unsigned long sum;
+  int i;
+
+  sum = 0;
+  for (i = 0; i < DB_NLAT; i++) {
+    if ((sum += lat->hist[i]) >= q * lat->count && sum > 0) {
+      break;
+    }
+  }
+  if (i == DB_NLAT || db_latbound(i + 1) - 1 > lat->max) {
+    return (lat->max);
+  }
+  return (db_latbound(i + 1) - 1);
+}
+
+static void prlat(const char *name, const DBLAT *lat) {
+  if (lat->count == 0) {
+    return;
+  }
+  printf("%-6s %10lu %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, lat->count,
+         lat->total / lat->count / 1000, percentile(lat, 0.5) / 1000,
+         percentile(lat, 0.99) / 1000, percentile(lat, 0.999) / 1000,
+         lat->max / 1000);
+}
+
+int main(int argc, char *argv[]) {
+  DBHANDLE db;
+  DBOPTS o;
+  DBSTATS st, sum;
+  DBLAT all;
+  char key[IDXLEN_MAX], *val;
+  int c, err, nproc, nthreads, i, status, fd[2], gofd[2], *statfd;
+  long n;
+  double start, elapsed;
+  pid_t pid;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.format = DB_FMT_BINARY;
+  nrec = 100000;
+  keylen = 16;
+  vallen = 100;
+  readpct = 90;
+  nops = 100000;
+  seed = 1;
+  nproc = 1;
+  nthreads = 1;
+  err = 0;
+  while ((c = getopt(argc, argv, "abn:l:c:mwLBCN:k:v:r:M:z:P:T:x:s:")) != -1) {
+    switch (c) {
+    case 'a': /* create in the ASCII format */
+      opts.format = DB_FMT_ASCII;
+      break;
+    case 'b': /* create in the binary format */
+      opts.format = DB_FMT_BINARY;
+      break;
+    case 'n': /* initial hash table size */
+      if ((opts.nhash = atol(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 'l': /* maximum average chain length */
+      if ((opts.maxload = atoi(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 'c': /* megabytes of record cache per handle */
+      if (atol(optarg) < 1) {
+        err = 1;
+      }
+      opts.cachesize = (size_t)atol(optarg) * 1024 * 1024;
+      break;
+    case 'm': /* read through mappings */
+      opts.flags |= DB_OPT_MMAP;
+      break;
+    case 'w': /* write-ahead log */
+      opts.flags |= DB_OPT_WAL;
+      break;
+    case 'L': /* shared lock table */
+      opts.flags |= DB_OPT_LOCKTAB;
+      break;
+    case 'B': /* Bloom filters */
+      opts.flags |= DB_OPT_BLOOM;
+      break;
+    case 'C': /* compressed data */
+      opts.flags |= DB_OPT_COMPRESS;
+      break;
+    case 'N': /* records loaded */
+      if ((nrec = atol(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 'k': /* key length */
+      keylen = atoi(optarg);
+      break;
+    case 'v': /* data length */
+      vallen = atoi(optarg);
+      break;
+    case 'r': /* percentage of fetches */
+      if ((readpct = atoi(optarg)) < 0 || readpct > 100) {
+        err = 1;
+      }
+      break;
+    case 'M': /* percentage of fetches that miss */
+      if ((misspct = atoi(optarg)) < 0 || misspct > 100) {
+        err = 1;
+      }
+      break;
+    case 'z': /* Zipf exponent */
+      if ((theta = atof(optarg)) <= 0 || theta >= 1) {
+        err = 1;
+      }
+      break;
+    case 'P': /* processes */
+      if ((nproc = atoi(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 'T': /* threads per process */
+      if ((nthreads = atoi(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 'x': /* operations per thread */
+      if ((nops = atol(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 's': /* random number seed */
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  if (err || optind != argc - 1) {
+    err_quit("Usage: %s [-a | -b] [-n nhash] [-l maxload] [-c megabytes] [-m] "
+             "[-w] [-L]\n"
+             "       [-B] [-C] [-N nrec] [-k keylen] [-v vallen] [-r readpct]\n"
+             "       [-M misspct] [-z theta] [-P nproc] [-T nthreads] "
+             "[-x nops]\n"
+             "       [-s seed] dbname",
+             argv[0]);
+  }
+  sprintf(key, "%ld", nrec - 1);
+  if (keylen < (int)strlen(key) || keylen > IDXLEN_MAX / 2) {
+    err_quit("dbbench: keys must be from %d to %d bytes for %ld records",
+             (int)strlen(key), IDXLEN_MAX / 2, nrec);
+  }
+  if (vallen < 1 || vallen >= (opts.format == DB_FMT_ASCII ? DATLEN_MAX
+                                                             : DATLEN_BIG)) {
+    err_quit("dbbench: data must be from 1 to %d bytes",
+             (opts.format == DB_FMT_ASCII ? DATLEN_MAX : DATLEN_BIG) - 1);
+  }
+  if (theta != 0) {
+    setzipf();
+  }
+
+  /*
+   * Create and load the database.
+   */
+  o = opts;
+  o.cachesize = 0;
+  if ((db = db_openopt(argv[optind], O_RDWR | O_CREAT | O_TRUNC, FILE_MODE,
+                       &o)) == NULL) {
+    err_sys("dbbench: can't create %s", argv[optind]);
+  }
+  if ((val = malloc(vallen + 1)) == NULL) {
+    err_sys("dbbench: malloc() error");
+  }
+  start = now();
+  for (n = 0; n < nrec; n++) {
+    if (n % LOADBATCH == 0 && db_begin(db) < 0) {
+      err_sys("dbbench: db_begin() error");
+    }
+    makekey(key, n);
+    memset(val, 'a' + (int)(n % 26), vallen);
+    val[vallen] = 0;
+    if (db_store(db, key, val, DB_INSERT) != 0) {
+      err_sys("dbbench: db_store() error for %s", key);
+    }
+    if ((n % LOADBATCH == LOADBATCH - 1 || n == nrec - 1) &&
+        db_commit(db) < 0) {
+      err_sys("dbbench: db_commit() error");
+    }
+  }
+  elapsed = now() - start;
+  db_close(db);
+  free(val);
+  printf("%s, %ld records of %d + %d bytes, %d%% fetches (%d%% misses), ",
+         opts.format == DB_FMT_ASCII ? "ascii" : "binary", nrec, keylen,
+         vallen, readpct, misspct);
+  if (theta != 0) {
+    printf("zipf %.2f keys, ", theta);
+  } else {
+    printf("uniform keys, ");
+  }
+  printf("%d x %d threads\n", nproc, nthreads);
+  printf("load: %ld records in %.3f s, %.0f records/s\n", nrec, elapsed,
+         nrec / elapsed);
+
+  /*
+   * Start the workers together, once they all have the database open, and
+   * collect the statistics of each.
+   */
+  if (pipe(gofd) < 0) {
+    err_sys("dbbench: pipe() error");
+  }
+  if ((statfd = calloc(nproc, sizeof(int))) == NULL) {
+    err_sys("dbbench: calloc() error");
+  }
+  fflush(stdout);
+  for (i = 0; i < nproc; i++) {
+    if (pipe(fd) < 0) {
+      err_sys("dbbench: pipe() error");
+    }
+    if ((pid = fork()) < 0) {
+      err_sys("dbbench: fork() error");
+    } else if (pid == 0) {
+      close(gofd[1]);
+      close(fd[0]);
+      worker(argv[optind], i, nthreads, gofd[0], fd[1]);
+    }
+    close(fd[1]);
+    statfd[i] = fd[0];
+  }
+  close(gofd[0]);
+  for (i = 0; i < nproc; i++) {
+    if (read(statfd[i], &c, 1) != 1) {
+      err_quit("dbbench: worker %d failed", i);
+    }
+  }
+  start = now();
+  close(gofd[1]);
+  memset(&sum, 0, sizeof(sum));
+  for (i = 0; i < nproc; i++) {
+    if (readn(statfd[i], &st, sizeof(st)) != sizeof(st)) {
+      err_quit("dbbench: worker %d failed", i);
+    }
+    close(statfd[i]);
+    sum.fetchok += st.fetchok;
+    sum.fetcherr += st.fetcherr;
+    sum.bloomneg += st.bloomneg;
+    sum.stor3 += st.stor3;
+    sum.stor4 += st.stor4;
+    sum.lookups += st.lookups;
+    sum.hops += st.hops;
+    sum.locks += st.locks;
+    sum.lockwait += st.lockwait;
+    if (st.lockmax > sum.lockmax) {
+      sum.lockmax = st.lockmax;
+    }
+    addlat(&sum.fetch, &st.fetch);
+    addlat(&sum.store, &st.store);
+  }
+  elapsed = now() - start;
+  while (wait(&status) > 0) {
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      err_quit("dbbench: a worker failed");
+    }
+  }
+
+  n = (long)(sum.fetch.count + sum.store.count);
+  printf("run:  %ld operations in %.3f s, %.0f operations/s\n", n, elapsed,
+         n / elapsed);
+  printf("latency (us)  count      mean       p50       p99     p99.9       "
+         "max\n");
+  prlat("fetch", &sum.fetch);
+  prlat("store", &sum.store);
+  memset(&all, 0, sizeof(all));
+  addlat(&all, &sum.fetch);
+  addlat(&all, &sum.store);
+  prlat("all", &all);
+  printf("%.2f records compared per lookup; %lu stores in place, %lu moved\n",
+         sum.lookups == 0 ? 0.0 : (double)sum.hops / sum.lookups, sum.stor4,
+         sum.stor3);
+  if (sum.fetcherr > 0) {
+    printf("%lu fetches missed, %lu answered by a Bloom filter\n",
+           sum.fetcherr, sum.bloomneg);
+  }
+  printf("%lu locks waited for, %.3f ms in all, %.3f ms at most\n", sum.locks,
+         sum.lockwait / 1e6, sum.lockmax / 1e6);
+  exit(0);
+}
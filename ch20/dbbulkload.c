@@ -0,0 +1,167 @@
+/*
+ * Program used to load a database from a file of records, or from standard
+ * input, with db_bulkload().  Each line holds a key, a tab and the data, as
+ * written by t4dump.  Usage:
+ *   $ dbbulkload [-a | -b] [-n nhash] [-l maxload] [-m megabytes] [-o] [-c]
+ *                [-k] [-z | -Z] [-s] [-x] dbname [file]
+ * The database is created in the ASCII format with -a, or the binary format
+ * (the default) with -b, with a hash table of nhash buckets that grows above
+ * an average chain length of maxload (binary only), and that keeps its keys in
+ * order with -o (binary only), with a change log with -c (binary only), and
+ * with checksums of its records with -k (binary only).  -z compresses the data
+ * of its records (binary only), and -Z does too, with a dictionary trained on
+ * the data of the first TRAINMAX bytes of records, which must then be read
+ * from a file.  -s lets scans read from snapshots (binary only).  -x loads into
+ * an existing database instead.  -m sets the memory used to sort the records.
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <errno.h>
+#include <fcntl.h>
+
+#define TRAINMAX (4 * 1024 * 1024) /* bytes of records to train on */
+
+/**
+ * Train a compression dictionary on the data of the records at the start of
+ * a file, and leave the file at its start again.
+ * @param fd descriptor of the file of records.
+ * @param opts options to set the dictionary in.
+ */
+static void train(int fd, DBOPTS *opts) {
+  const char **samples;
+  char *buf, *dict, *ptr, *end, *nl, *tab;
+  ssize_t n, len;
+  long nsamples;
+
+  if ((buf = malloc(TRAINMAX + 1)) == NULL ||
+      (samples = malloc(TRAINMAX / 2 * sizeof(char *))) == NULL ||
+      (dict = malloc(DB_DICTMAX)) == NULL) {
+    err_sys("dbbulkload: malloc() error");
+  }
+  for (len = 0; len < TRAINMAX; len += n) {
+    if ((n = read(fd, buf + len, TRAINMAX - len)) < 0) {
+      err_sys("dbbulkload: read() error");
+    } else if (n == 0) {
+      break;
+    }
+  }
+  if (lseek(fd, 0, SEEK_SET) < 0) {
+    err_sys("dbbulkload: -Z needs a file of records to read twice");
+  }
+
+  /* The data of each whole line is a sample */
+  nsamples = 0;
+  end = buf + len;
+  for (ptr = buf; (nl = memchr(ptr, '\n', end - ptr)) != NULL; ptr = nl + 1) {
+    *nl = 0;
+    if ((tab = strchr(ptr, '\t')) != NULL) {
+      samples[nsamples++] = tab + 1;
+    }
+  }
+  opts->dictlen = db_traindict(samples, nsamples, dict, DB_DICTMAX);
+  opts->dict = dict;
+  free(samples);
+  free(buf);
+} /* train() */
+
+int main(int argc, char *argv[]) {
+  DBHANDLE db;
+  DBOPTS opts;
+  DBBULK st;
+  int c, err, fd, oflag, dotrain;
+
+  memset(&opts, 0, sizeof(opts));
+  memset(&st, 0, sizeof(st));
+  opts.format = DB_FMT_BINARY;
+  oflag = O_RDWR | O_CREAT | O_TRUNC;
+  err = dotrain = 0;
+  while ((c = getopt(argc, argv, "abn:l:m:ockzZsx")) != -1) {
+    switch (c) {
+    case 'a': /* create in the ASCII format */
+      opts.format = DB_FMT_ASCII;
+      break;
+    case 'b': /* create in the binary format */
+      opts.format = DB_FMT_BINARY;
+      break;
+    case 'n': /* initial hash table size */
+      if ((opts.nhash = atol(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 'l': /* maximum average chain length */
+      if ((opts.maxload = atoi(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 'm': /* megabytes of memory to sort in */
+      if (atol(optarg) < 1) {
+        err = 1;
+      }
+      st.memlimit = (size_t)atol(optarg) * 1024 * 1024;
+      break;
+    case 'o': /* keep the keys in order */
+      opts.flags |= DB_OPT_ORDERED;
+      break;
+    case 'c': /* log the changes */
+      opts.flags |= DB_OPT_CHANGES;
+      break;
+    case 'k': /* checksum the records */
+      opts.flags |= DB_OPT_CHECKSUM;
+      break;
+    case 'z': /* compress the data */
+      opts.flags |= DB_OPT_COMPRESS;
+      break;
+    case 'Z': /* compress with a dictionary trained on the records */
+      opts.flags |= DB_OPT_COMPRESS;
+      dotrain = 1;
+      break;
+    case 's': /* scans can read from snapshots */
+      opts.flags |= DB_OPT_SNAPSHOT;
+      break;
+    case 'x': /* load into an existing database */
+      oflag = O_RDWR;
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  if (err || optind < argc - 2 || optind > argc - 1) {
+    err_quit("Usage: %s [-a | -b] [-n nhash] [-l maxload] [-m megabytes] [-o] "
+             "[-c]\n"
+             "       [-k] [-z | -Z] [-s] [-x] dbname [file]",
+             argv[0]);
+  }
+
+  if (optind == argc - 2 && strcmp(argv[optind + 1], "-") != 0) {
+    if ((fd = open(argv[optind + 1], O_RDONLY)) < 0) {
+      err_sys("dbbulkload: can't open %s", argv[optind + 1]);
+    }
+  } else {
+    fd = STDIN_FILENO;
+  }
+  if (dotrain && oflag != O_RDWR) {
+    train(fd, &opts);
+  }
+  if ((db = db_openopt(argv[optind], oflag, FILE_MODE, &opts)) == NULL) {
+    err_sys("dbbulkload: can't open %s", argv[optind]);
+  }
+  if (db_bulkload(db, fd, &st) < 0) {
+    if (errno == EINVAL) {
+      err_quit("dbbulkload: line %ld: not a key, a tab and data", st.nline);
+    }
+    err_sys("dbbulkload: can't load %s", argv[optind]);
+  }
+  db_close(db);
+  free((void *)opts.dict);
+
+  printf("%ld records loaded from %ld lines", st.nrec, st.nline);
+  if (st.ndup > 0) {
+    printf(", %ld replaced by later lines", st.ndup);
+  }
+  if (st.npart > 0) {
+    printf(", sorted in %ld partitions", st.npart);
+  }
+  putchar('\n');
+  exit(0);
+}
@@ -0,0 +1,106 @@
+/*
+ * Program used to print a histogram of the hash chain lengths of a database,
+ * to check how evenly the hash function spreads the keys over the buckets.
+ * Usage:
+ *   $ dbchains [-w maxlen] dbname
+ * Chains longer than maxlen (default 20) are counted in the last row.
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <fcntl.h>
+#include <math.h>
+
+#define BARWIDTH 50 /* width of the longest histogram bar */
+
+static const char *hashname(int hashfn) {
+  switch (hashfn) {
+  case DB_HASH_APUE:
+    return ("apue");
+  case DB_HASH_XXH64:
+    return ("xxh64");
+  case DB_HASH_SIPHASH:
+    return ("siphash-2-4");
+  }
+  return ("unknown");
+}
+
+int main(int argc, char *argv[]) {
+  DBHANDLE db;
+  DBINFO info;
+  long b, len, maxlen, longest, nrec, *hist, maxcount;
+  double mean, var;
+  int c, err, i, bar;
+
+  maxlen = 20;
+  err = 0;
+  while ((c = getopt(argc, argv, "w:")) != -1) {
+    switch (c) {
+    case 'w': /* width of histogram, in chain lengths */
+      if ((maxlen = atol(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  if (err || (optind != argc - 1)) {
+    err_quit("Usage: %s [-w maxlen] dbname", argv[0]);
+  }
+
+  if ((db = db_open(argv[optind], O_RDONLY)) == NULL) {
+    err_sys("dbchains: can't open %s", argv[optind]);
+  }
+  db_info(db, &info);
+  if ((hist = calloc(maxlen + 1, sizeof(long))) == NULL) {
+    err_sys("dbchains: calloc() error");
+  }
+
+  /*
+   * Walk every chain once, accumulating the histogram, the sum and the sum of
+   * squares of the chain lengths.
+   */
+  nrec = longest = 0;
+  var = 0.0;
+  for (b = 0; b < info.nbucket; b++) {
+    if ((len = db_chainlen(db, b)) < 0) {
+      err_sys("dbchains: db_chainlen() error for bucket %ld", b);
+    }
+    hist[len < maxlen ? len : maxlen]++;
+    nrec += len;
+    var += (double)len * len;
+    if (len > longest) {
+      longest = len;
+    }
+  }
+  mean = (double)nrec / info.nbucket;
+  var = var / info.nbucket - mean * mean;
+
+  printf("format %s, hash %s, seed %#lx\n",
+         info.format == DB_FMT_BINARY ? "binary" : "ascii",
+         hashname(info.hashfn), info.seed);
+  printf("%ld records, %ld buckets (%ld initial), maxload %d\n", nrec,
+         info.nbucket, info.nhash, info.maxload);
+  printf("chain length: mean %.2f, stddev %.2f (uniform: %.2f), max %ld\n",
+         mean, sqrt(var > 0 ? var : 0), sqrt(mean), longest);
+
+  maxcount = 1;
+  for (i = 0; i <= maxlen; i++) {
+    if (hist[i] > maxcount) {
+      maxcount = hist[i];
+    }
+  }
+  printf("\n length  buckets\n");
+  for (i = 0; i <= maxlen; i++) {
+    printf("%s%5d  %7ld  ", i == maxlen ? ">=" : "  ", i, hist[i]);
+    for (bar = hist[i] * BARWIDTH / maxcount; bar > 0; bar--) {
+      putchar('#');
+    }
+    putchar('\n');
+  }
+
+  free(hist);
+  db_close(db);
+  exit(0);
+}
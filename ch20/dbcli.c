@@ -0,0 +1,360 @@
+/*
+ * Client of the database server, dbserv.  Usage:
+ *   $ dbcli [-h host] [-p port | -s path] [-n dbnum] [-w window] [-q]
+ *           [command]
+ * A command is one of
+ *   get key
+ *   insert key data
+ *   replace key data
+ *   store key data
+ *   delete key
+ * with the operation, key and data separated by a space or a tab; the data is
+ * the rest of the line.  The command is taken from the arguments if given,
+ * and otherwise one per line from standard input.  The client connects to
+ * dbserv on host (default localhost) and port (default DBS_PORT), or on the
+ * UNIX domain socket path with -s, and works on database dbnum (default 0).
+ * Up to window requests (default 64; 1 if standard input is a terminal) are
+ * sent before their replies are read.  Each reply is printed on a line: the
+ * data for a get, or ok, not found, exists or the error.  -q prints only how
+ * many requests were answered each way, and how quickly.
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include "dbserv.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define LINEMAX (IDXLEN_MAX + DATLEN_BIG + 16) /* longest command */
+
+static int dbnum;  /* database of the requests */
+static int quiet;  /* count the replies instead of printing them */
+static char *out;  /* malloc'ed requests not yet sent */
+static size_t outpos, outlen, outsize;
+static char *in;   /* malloc'ed replies not yet printed */
+static size_t inlen, insize;
+static uint32_t nsent, nrecv; /* requests sent and replies read */
+static unsigned long nstatus[DBS_ERROR + 1]; /* replies of each status */
+
+static uint32_t get32(const unsigned char *p) {
+  return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static void put16(unsigned char *p, uint32_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+    err_sys("dbcli: clock_gettime() error");
+  }
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Make sure that a malloc'ed buffer has room for more bytes.
+ * @param buf pointer to the buffer.
+ * @param size pointer to its size.
+ * @param need bytes it must hold.
+ */
+static void grow(char **buf, size_t *size, size_t need) {
+  char *p;
+
+  if (need > *size) {
+    if ((p = realloc(*buf, need * 2 + 4096)) == NULL) {
+      err_sys("dbcli: realloc() error");
+    }
+    *buf = p;
+    *size = need * 2 + 4096;
+  }
+}
+
+/**
+ * Connect to the server over TCP, trying each address of the host in turn.
+ * @param host name of the host.
+ * @param port port number or service name.
+ * @return fd of the connection.
+ */
+static int tcp_conn(const char *host, const char *port) {
+  struct addrinfo hint, *ailist, *aip;
+  int fd, err;
+
+  memset(&hint, 0, sizeof(hint));
+  hint.ai_socktype = SOCK_STREAM;
+  if ((err = getaddrinfo(host, port, &hint, &ailist)) != 0) {
+    err_quit("dbcli: getaddrinfo() error: %s", gai_strerror(err));
+  }
+  for (fd = -1, aip = ailist; aip != NULL && fd < 0; aip = aip->ai_next) {
+    if ((fd = socket(aip->ai_family, SOCK_STREAM, 0)) >= 0 &&
+        connect(fd, aip->ai_addr, aip->ai_addrlen) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd < 0) {
+    err_sys("dbcli: can't connect to %s port %s", host, port);
+  }
+  freeaddrinfo(ailist);
+  return (fd);
+}
+
+/**
+ * Queue the request of a command to be sent.
+ * @param cmd the command, null terminated, without a newline.
+ * @return 0 if OK; -1 if the command isn't valid.
+ */
+static int request(char *cmd) {
+  static const char *ops[] = {"get", "insert", "replace", "store", "delete"};
+  unsigned char *h;
+  char *key, *data;
+  size_t keylen, datlen;
+  int op;
+
+  if ((key = strpbrk(cmd, " \t")) == NULL) {
+    return (-1);
+  }
+  *key++ = 0;
+  for (op = DBS_GET; op <= DBS_DELETE && strcmp(cmd, ops[op]) != 0; op++) {
+    ;
+  }
+  if (op > DBS_DELETE) {
+    return (-1);
+  }
+  if ((data = strpbrk(key, " \t")) != NULL) {
+    *data++ = 0;
+  }
+  if ((op == DBS_GET || op == DBS_DELETE) != (data == NULL)) {
+    return (-1);
+  }
+  keylen = strlen(key);
+  datlen = data == NULL ? 0 : strlen(data);
+  if (keylen > 0xffff) {
+    return (-1);
+  }
+  grow(&out, &outsize, outlen + DBS_HDR_SZ + keylen + datlen);
+  h = (unsigned char *)out + outlen;
+  h[DBS_OP] = op;
+  h[DBS_DB] = dbnum;
+  put16(h + DBS_KEYLEN, keylen);
+  put32(h + DBS_DATLEN, datlen);
+  put32(h + DBS_ID, nsent++);
+  memcpy(h + DBS_HDR_SZ, key, keylen);
+  if (data != NULL) {
+    memcpy(h + DBS_HDR_SZ + keylen, data, datlen);
+  }
+  outlen += DBS_HDR_SZ + keylen + datlen;
+  return (0);
+}
+
+/**
+ * Print the replies that have arrived in full.
+ */
+static void replies(void) {
+  unsigned char *h;
+  size_t pos, datlen;
+  int status;
+
+  for (pos = 0; inlen - pos >= DBS_HDR_SZ; pos += DBS_HDR_SZ + datlen) {
+    h = (unsigned char *)in + pos;
+    datlen = get32(h + DBS_DATLEN);
+    if (inlen - pos < DBS_HDR_SZ + datlen) {
+      break;
+    }
+    status = h[DBS_STATUS];
+    if (status > DBS_ERROR || get32(h + DBS_ID) != nrecv) {
+      err_quit("dbcli: bad reply from server");
+    }
+    nrecv++;
+    nstatus[status]++;
+    if (quiet) {
+      continue;
+    }
+    switch (status) {
+    case DBS_OK:
+      if (datlen == 0) {
+        printf("ok\n");
+        break;
+      }
+      /* FALLTHROUGH */
+    case DBS_ERROR:
+      printf("%s%.*s\n", status == DBS_ERROR ? "error: " : "", (int)datlen,
+             (char *)h + DBS_HDR_SZ);
+      break;
+    case DBS_NOTFOUND:
+      printf("not found\n");
+      break;
+    case DBS_EXISTS:
+      printf("exists\n");
+      break;
+    }
+  }
+  memmove(in, in + pos, inlen - pos);
+  inlen -= pos;
+}
+
+int main(int argc, char *argv[]) {
+  struct pollfd pfd;
+  char *host, *port, *sockpath, *line, *p;
+  int c, err, fd, window, eof;
+  size_t len;
+  ssize_t n;
+  double start, elapsed;
+
+  host = "localhost";
+  port = DBS_PORT;
+  sockpath = NULL;
+  window = isatty(STDIN_FILENO) ? 1 : 64;
+  err = 0;
+  while ((c = getopt(argc, argv, "h:p:s:n:w:q")) != -1) {
+    switch (c) {
+    case 'h': /* host of the server */
+      host = optarg;
+      break;
+    case 'p': /* TCP port */
+      port = optarg;
+      break;
+    case 's': /* UNIX domain socket */
+      sockpath = optarg;
+      break;
+    case 'n': /* database number */
+      if ((dbnum = atoi(optarg)) < 0 || dbnum > 255) {
+        err = 1;
+      }
+      break;
+    case 'w': /* requests in flight */
+      if ((window = atoi(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 'q': /* count the replies only */
+      quiet = 1;
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  if (err) {
+    err_quit("Usage: %s [-h host] [-p port | -s path] [-n dbnum] [-w window] "
+             "[-q]\n"
+             "       [get key | insert key data | replace key data | "
+             "store key data |\n"
+             "        delete key]",
+             argv[0]);
+  }
+
+  if (sockpath != NULL) {
+    if ((fd = cli_conn(sockpath)) < 0) {
+      err_sys("dbcli: can't connect to %s", sockpath);
+    }
+  } else {
+    fd = tcp_conn(host, port);
+  }
+  set_fl(fd, O_NONBLOCK);
+
+  /*
+   * Join the arguments into a command, if there are any.
+   */
+  if (optind < argc) {
+    for (len = 0, c = optind; c < argc; c++) {
+      len += strlen(argv[c]) + 1;
+    }
+    if ((line = malloc(len)) == NULL) {
+      err_sys("dbcli: malloc() error");
+    }
+    strcpy(line, argv[optind]);
+    for (c = optind + 1; c < argc; c++) {
+      strcat(line, " ");
+      strcat(line, argv[c]);
+    }
+    if (request(line) < 0) {
+      err_quit("dbcli: invalid command: %s", line);
+    }
+    eof = 1;
+  } else {
+    if ((line = malloc(LINEMAX)) == NULL) {
+      err_sys("dbcli: malloc() error");
+    }
+    eof = 0;
+  }
+
+  /*
+   * Read commands while fewer than window requests are outstanding, send
+   * the requests, and print the replies as they come in.
+   */
+  start = now();
+  while (!eof || nrecv < nsent) {
+    while (!eof && nsent - nrecv < (uint32_t)window &&
+           outlen - outpos < 65536) {
+      if (fgets(line, LINEMAX, stdin) == NULL) {
+        eof = 1;
+        break;
+      }
+      if ((p = strchr(line, '\n')) != NULL) {
+        *p = 0;
+      }
+      if (line[0] != 0 && request(line) < 0) {
+        err_msg("dbcli: invalid command: %s", line);
+      }
+    }
+    if (nrecv == nsent && outpos == outlen) {
+      continue;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN | (outpos < outlen ? POLLOUT : 0);
+    if (poll(&pfd, 1, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err_sys("dbcli: poll() error");
+    }
+    if ((pfd.revents & POLLOUT) && outpos < outlen) {
+      if ((n = write(fd, out + outpos, outlen - outpos)) >= 0) {
+        outpos += n;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        err_sys("dbcli: write() error");
+      }
+      if (outpos == outlen) {
+        outpos = outlen = 0;
+      }
+    }
+    if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) {
+      grow(&in, &insize, inlen + 65536);
+      if ((n = read(fd, in + inlen, insize - inlen)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          err_sys("dbcli: read() error");
+        }
+      } else if (n == 0) {
+        err_quit("dbcli: server closed the connection");
+      } else {
+        inlen += n;
+        replies();
+      }
+    }
+  }
+  elapsed = now() - start;
+  close(fd);
+
+  if (quiet) {
+    printf("%lu requests in %.3f s, %.0f requests/s: %lu ok, %lu not found, "
+           "%lu exists, %lu errors\n",
+           (unsigned long)nrecv, elapsed, elapsed > 0 ? nrecv / elapsed : 0.0,
+           nstatus[DBS_OK], nstatus[DBS_NOTFOUND], nstatus[DBS_EXISTS],
+           nstatus[DBS_ERROR]);
+  }
+  exit(0);
+}
@@ -0,0 +1,60 @@
+/*
+ * Program used to compact a database in place, reclaiming the space of deleted
+ * and replaced records.  Other processes can keep using the database while it
+ * is compacted.  Usage:
+ *   $ dbcompact [-q] dbname
+ * Progress is reported on standard error, unless -q is given, and the space
+ * reclaimed on standard output.
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <fcntl.h>
+
+static void progress(const DBCOMPACT *st) {
+  fprintf(stderr, "\rcompacting: %3ld%% of %ld chains, %ld records",
+          st->bucket * 100 / st->nbucket, st->nbucket, st->nrec);
+  if (st->bucket == st->nbucket) {
+    fputc('\n', stderr);
+  }
+}
+
+static void report(const char *what, off_t before, off_t after) {
+  printf("%-11s %12lld -> %12lld bytes (%5.1f%%)\n", what, (long long)before,
+         (long long)after,
+         before > 0 ? 100.0 * (double)(before - after) / before : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+  DBHANDLE db;
+  DBCOMPACT st;
+  int c, err, quiet;
+
+  err = quiet = 0;
+  while ((c = getopt(argc, argv, "q")) != -1) {
+    switch (c) {
+    case 'q': /* no progress report */
+      quiet = 1;
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  if (err || (optind != argc - 1)) {
+    err_quit("Usage: %s [-q] dbname", argv[0]);
+  }
+
+  if ((db = db_open(argv[optind], O_RDWR)) == NULL) {
+    err_sys("dbcompact: can't open %s", argv[optind]);
+  }
+  if (db_compact(db, &st, quiet ? NULL : progress) < 0) {
+    err_sys("dbcompact: can't compact %s", argv[optind]);
+  }
+  db_close(db);
+
+  printf("%ld records copied\n", st.nrec);
+  report("index file", st.oldidx, st.newidx);
+  report("data file", st.olddat, st.newdat);
+  report("total", st.oldidx + st.olddat, st.newidx + st.newdat);
+  exit(0);
+}
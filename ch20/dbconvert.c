@@ -0,0 +1,149 @@
+/*
+ * Program used to convert a database between the ASCII and binary index file
+ * formats.  Every record of the source database is copied to a newly created
+ * destination database.  Usage:
+ *   $ dbconvert [-a | -b] [-o] [-k] [-z | -Z] [-s] from to
+ * -a creates the destination in the ASCII format, -b (the default) in the
+ * binary format.  -o also keeps the keys of a binary destination in order, -k
+ * checksums its records and -z compresses their data.  -Z compresses it with a
+ * dictionary trained on the data of the first TRAINMAX bytes of records of
+ * the source.  -s lets scans of a binary destination read from snapshots.  The
+ * source is read from a snapshot if it has them, so that it can be converted
+ * while it's updated.
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <errno.h>
+#include <fcntl.h>
+
+#define TRAINMAX (4 * 1024 * 1024) /* bytes of data to train on */
+
+/**
+ * Train a compression dictionary on the data of the first records of a
+ * database.
+ * @param from database to take the records from.
+ * @param opts options to set the dictionary in.
+ */
+static void train(DBHANDLE from, DBOPTS *opts) {
+  char **samples;
+  char *ptr, *dict;
+  char key[IDXLEN_MAX];
+  size_t total;
+  long nsamples, maxsamples, i;
+
+  maxsamples = 1024;
+  if ((samples = malloc(maxsamples * sizeof(char *))) == NULL ||
+      (dict = malloc(DB_DICTMAX)) == NULL) {
+    err_sys("dbconvert: malloc() error");
+  }
+  db_rewind(from);
+  for (nsamples = 0, total = 0; total < TRAINMAX; nsamples++) {
+    if ((ptr = db_nextrec(from, key)) == NULL) {
+      break;
+    }
+    if (nsamples == maxsamples) {
+      maxsamples *= 2;
+      if ((samples = realloc(samples, maxsamples * sizeof(char *))) == NULL) {
+        err_sys("dbconvert: realloc() error");
+      }
+    }
+    if ((samples[nsamples] = strdup(ptr)) == NULL) {
+      err_sys("dbconvert: strdup() error");
+    }
+    total += strlen(ptr);
+  }
+  opts->dictlen = db_traindict((const char *const *)samples, nsamples, dict,
+                               DB_DICTMAX);
+  opts->dict = dict;
+  for (i = 0; i < nsamples; i++) {
+    free(samples[i]);
+  }
+  free(samples);
+} /* train() */
+
+int main(int argc, char *argv[]) {
+  DBHANDLE from, to;
+  DBOPTS opts;
+  DBINFO info;
+  char *ptr;
+  char key[IDXLEN_MAX];
+  long nrec;
+  int c, err, dotrain;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.format = DB_FMT_BINARY;
+  err = dotrain = 0;
+  while ((c = getopt(argc, argv, "abokzZs")) != -1) {
+    switch (c) {
+    case 'a': /* convert to the ASCII format */
+      opts.format = DB_FMT_ASCII;
+      break;
+    case 'b': /* convert to the binary format */
+      opts.format = DB_FMT_BINARY;
+      break;
+    case 'o': /* keep the keys in order */
+      opts.flags |= DB_OPT_ORDERED;
+      break;
+    case 'k': /* checksum the records */
+      opts.flags |= DB_OPT_CHECKSUM;
+      break;
+    case 'z': /* compress the data */
+      opts.flags |= DB_OPT_COMPRESS;
+      break;
+    case 'Z': /* compress with a dictionary trained on the records */
+      opts.flags |= DB_OPT_COMPRESS;
+      dotrain = 1;
+      break;
+    case 's': /* scans can read from snapshots */
+      opts.flags |= DB_OPT_SNAPSHOT;
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  if (err || (optind != argc - 2)) {
+    err_quit("Usage: %s [-a | -b] [-o] [-k] [-z | -Z] [-s] from to",
+             argv[0]);
+  }
+
+  if ((from = db_open(argv[optind], O_RDONLY)) == NULL) {
+    err_sys("dbconvert: can't open %s", argv[optind]);
+  }
+  if (dotrain) {
+    train(from, &opts);
+  }
+  if ((to = db_openopt(argv[optind + 1], O_RDWR | O_CREAT | O_TRUNC,
+                       FILE_MODE, &opts)) == NULL) {
+    err_sys("dbconvert: can't create %s", argv[optind + 1]);
+  }
+
+  db_info(from, &info);
+  if (info.snapshot && db_snapshot(from) < 0) {
+    err_ret("dbconvert: can't take a snapshot of %s; copying it as it is",
+            argv[optind]);
+  }
+
+  /* db_rewind() must be called before db_nextrec() */
+  db_rewind(from);
+  nrec = 0;
+  for (;;) {
+    errno = 0;
+    if ((ptr = db_nextrec(from, key)) == NULL) {
+      break;
+    }
+    if (db_store(to, key, ptr, DB_INSERT) != 0) {
+      err_quit("dbconvert: db_store() error for %s", key);
+    }
+    nrec++;
+  }
+  if (errno == EBADMSG) {
+    err_sys("dbconvert: bad record after %ld", nrec);
+  }
+  printf("%ld records converted\n", nrec);
+
+  db_close(to);
+  db_close(from);
+  free((void *)opts.dict);
+  exit(0);
+}
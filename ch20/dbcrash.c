@@ -0,0 +1,157 @@
+/*
+ * Test recovery from the write-ahead log.  Usage:
+ *   $ dbcrash [-n cycles] [-s seed] dbname
+ * dbname is created as a binary database with a write-ahead log, an ordered
+ * index, Bloom filters, a change log and checksums.  Then, cycles times
+ * (default 300), a child process commits batches of NBATCH random stores and
+ * deletes of NKEY keys until it is killed with SIGKILL, after a random time of
+ * up to 20 ms; the database is opened again, which recovers it from the log,
+ * and every key that db_nextrec() finds must be found by db_fetch() too, and
+ * db_verify() must find no problem.  The exit status is 0 if every cycle
+ * passed, 1 if not.  seed (default 1) picks the sequence of updates and kills.
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define NKEY 400   /* keys updated */
+#define NBATCH 50  /* updates committed at a time */
+#define MAXKILL 20 /* most milliseconds before the child is killed */
+
+static DBOPTS opts;
+
+/**
+ * Commit batches of random updates to a database until killed.
+ * @param name name of the database.
+ * @param seed seed of the updates.
+ */
+static void update(const char *name, unsigned seed) {
+  DBHANDLE db;
+  char key[32], data[64];
+  int i, k;
+
+  if ((db = db_openopt(name, O_RDWR, 0, &opts)) == NULL) {
+    err_sys("dbcrash: can't open %s", name);
+  }
+  srand(seed);
+  for (;;) {
+    if (db_begin(db) < 0) {
+      err_sys("dbcrash: db_begin() error");
+    }
+    for (i = 0; i < NBATCH; i++) {
+      k = rand() % NKEY;
+      sprintf(key, "k%d", k);
+      if (rand() % 3 == 0) {
+        db_delete(db, key);
+      } else {
+        sprintf(data, "v%d-%d", k, rand());
+        db_store(db, key, data, DB_STORE);
+      }
+    }
+    if (db_commit(db) < 0) {
+      err_sys("dbcrash: db_commit() error");
+    }
+  }
+} /* update() */
+
+/**
+ * Open a database, recovering it, and check that every record can be fetched.
+ * @param name name of the database.
+ * @param cycle number of the cycle, for the report.
+ * @return 0 if the database is sound; -1 if not.
+ */
+static int check(const char *name, long cycle) {
+  DBHANDLE db;
+  DBVERIFY vr;
+  char key[IDXLEN_MAX];
+  long nrec, nmiss;
+  int rc = 0;
+
+  if ((db = db_openopt(name, O_RDWR, 0, &opts)) == NULL) {
+    err_sys("dbcrash: can't open %s", name);
+  }
+  db_rewind(db);
+  nrec = nmiss = 0;
+  while (db_nextrec(db, key) != NULL) {
+    nrec++;
+    if (db_fetch(db, key) == NULL) {
+      if (nmiss++ == 0) {
+        err_ret("dbcrash: cycle %ld: %s not fetched", cycle, key);
+      }
+    }
+  }
+  if (nmiss > 0) {
+    printf("cycle %ld: %ld of %ld records not fetched\n", cycle, nmiss, nrec);
+    rc = -1;
+  }
+  if (db_verify(db, 1, &vr, NULL, NULL) < 0) {
+    printf("cycle %ld: %ld problems found\n", cycle, vr.nbad);
+    rc = -1;
+  }
+  db_close(db);
+  return (rc);
+} /* check() */
+
+int main(int argc, char *argv[]) {
+  DBHANDLE db;
+  struct timespec ts;
+  long cycles = 300, i;
+  unsigned seed = 1, childseed;
+  int c, err = 0, status;
+  pid_t pid;
+
+  while ((c = getopt(argc, argv, "n:s:")) != -1) {
+    switch (c) {
+    case 'n': /* kill cycles */
+      if ((cycles = atol(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 's': /* seed */
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  if (err || optind != argc - 1) {
+    err_quit("Usage: %s [-n cycles] [-s seed] dbname", argv[0]);
+  }
+
+  opts.format = DB_FMT_BINARY;
+  opts.nhash = 7;
+  opts.maxload = 2; /* split often */
+  opts.flags = DB_OPT_WAL | DB_OPT_ORDERED | DB_OPT_BLOOM | DB_OPT_CHANGES |
+               DB_OPT_CHECKSUM;
+  if ((db = db_openopt(argv[optind], O_RDWR | O_CREAT | O_TRUNC, FILE_MODE,
+                       &opts)) == NULL) {
+    err_sys("dbcrash: can't create %s", argv[optind]);
+  }
+  db_close(db);
+
+  srand(seed);
+  for (i = 0; i < cycles; i++) {
+    childseed = rand();
+    if ((pid = fork()) < 0) {
+      err_sys("dbcrash: fork() error");
+    } else if (pid == 0) {
+      update(argv[optind], childseed);
+    }
+    ts.tv_sec = 0;
+    ts.tv_nsec = (rand() % (MAXKILL * 1000)) * 1000L;
+    nanosleep(&ts, NULL);
+    kill(pid, SIGKILL);
+    if (waitpid(pid, &status, 0) < 0) {
+      err_sys("dbcrash: waitpid() error");
+    }
+    if (check(argv[optind], i) < 0) {
+      exit(1);
+    }
+  }
+  printf("%ld cycles recovered\n", cycles);
+  exit(0);
+}
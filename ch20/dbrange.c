@@ -0,0 +1,69 @@
+/*
+ * Program used to print the records of a database in key order, from its
+ * ordered index, as written by t4dump.  Usage:
+ *   $ dbrange [-p prefix | -f from] [-t to] dbname
+ * -p prints only the keys that start with prefix; -f starts from the first key
+ * equal to or greater than from, and -t stops before the first key greater
+ * than to.  The database must have been created with DB_OPT_ORDERED, e.g. by
+ * dbconvert -o or dbbulkload -o.
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <fcntl.h>
+
+int main(int argc, char *argv[]) {
+  DBHANDLE db;
+  DBINFO info;
+  char *ptr, *prefix, *from, *to;
+  char key[IDXLEN_MAX];
+  size_t prefixlen;
+  long nrec;
+  int c, err;
+
+  prefix = from = to = NULL;
+  err = 0;
+  while ((c = getopt(argc, argv, "p:f:t:")) != -1) {
+    switch (c) {
+    case 'p': /* keys that start with a prefix */
+      prefix = optarg;
+      break;
+    case 'f': /* keys from this one on */
+      from = optarg;
+      break;
+    case 't': /* keys up to this one */
+      to = optarg;
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  if (err || (prefix != NULL && from != NULL) || optind != argc - 1) {
+    err_quit("Usage: %s [-p prefix | -f from] [-t to] dbname", argv[0]);
+  }
+
+  if ((db = db_open(argv[optind], O_RDONLY)) == NULL) {
+    err_sys("dbrange: can't open %s", argv[optind]);
+  }
+  db_info(db, &info);
+  if (!info.ordered) {
+    err_quit("dbrange: %s has no ordered index", argv[optind]);
+  }
+  if (db_seek(db, prefix != NULL ? prefix : from) < 0) {
+    err_quit("dbrange: key too long");
+  }
+  prefixlen = (prefix != NULL ? strlen(prefix) : 0);
+  nrec = 0;
+  while ((ptr = db_next(db, key)) != NULL) {
+    if ((prefix != NULL && strncmp(key, prefix, prefixlen) != 0) ||
+        (to != NULL && strcmp(key, to) > 0)) {
+      break;
+    }
+    printf("%s\t%s\n", key, ptr);
+    nrec++;
+  }
+  fprintf(stderr, "%ld records\n", nrec);
+
+  db_close(db);
+  exit(0);
+}
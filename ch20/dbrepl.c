@@ -0,0 +1,267 @@
+/*
+ * Keep copies of a database up to date with the changes made to it, from its
+ * change log (DB_OPT_CHANGES).  Usage:
+ *   $ dbrepl -l [-s path] [-n seq] [-i ms] [-e] dbname
+ *   $ dbrepl [-s path] [-q] dbname
+ * With -l, dbrepl is the leader: it writes the changes made to dbname after
+ * change seq (default 0: every change since the database was created) to
+ * standard output, as db_readchanges() returns them, looking for new ones
+ * every ms milliseconds (default 100); -e makes it exit once it has written
+ * every change there is.  With -s, the leader instead listens on the UNIX
+ * domain socket path, and serves each follower that connects from a child
+ * process of its own: the follower first sends the sequence number of the
+ * last change it has applied, 8 bytes little-endian, and is sent the changes
+ * after it.
+ *
+ * Without -l, dbrepl is a follower: it applies the changes it reads from
+ * standard input, or from the leader listening on path, to dbname with
+ * db_applychanges(), creating dbname as a binary database if it doesn't
+ * exist, until the input ends.  Unless -q is given, it then prints how many
+ * bytes of changes it applied, and the last change.  For example, with a
+ * leader and a follower on one machine:
+ *   $ dbrepl -l db4 | dbrepl copy4
+ * or, with any number of followers that pick up where they left off:
+ *   $ dbrepl -l -s /tmp/db4.sock db4 &
+ *   $ dbrepl -s /tmp/db4.sock copy4
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+
+#define INCHUNK (64 * 1024) /* first size of the buffer for the leader */
+
+static int exitdone;        /* leader: exit once every change is written */
+static struct timespec interval; /* leader: time between looks at the log */
+
+/**
+ * Write the changes of a database after a given one to a descriptor, as they
+ * are made.
+ * @param name name of the database.
+ * @param seq last change not to write.
+ * @param fd descriptor to write to.
+ */
+static void lead(const char *name, unsigned long seq, int fd) {
+  DBHANDLE db;
+  DBINFO info;
+  char *buf;
+  size_t size;
+  ssize_t n;
+
+  if ((db = db_open(name, O_RDONLY)) == NULL) {
+    err_sys("dbrepl: can't open %s", name);
+  }
+  db_info(db, &info);
+  size = DB_CHGHDR + info.maxkey + info.maxdata;
+  if ((buf = malloc(size)) == NULL) {
+    err_sys("dbrepl: malloc() error");
+  }
+  for (;;) {
+    if ((n = db_readchanges(db, &seq, buf, size)) < 0) {
+      if (errno == EINVAL) {
+        err_quit("dbrepl: %s has no change log", name);
+      } else if (errno == ERANGE) {
+        err_quit("dbrepl: the changes after %lu are not in the log of %s", seq,
+                 name);
+      }
+      err_sys("dbrepl: db_readchanges() error");
+    }
+    if (n > 0) {
+      if (writen(fd, buf, n) != n) {
+        break; /* the follower went away */
+      }
+    } else if (exitdone) {
+      break;
+    } else {
+      nanosleep(&interval, NULL);
+    }
+  }
+  free(buf);
+  db_close(db);
+} /* lead() */
+
+/**
+ * Serve followers on a UNIX domain socket, each from a child process.
+ * @param name name of the database.
+ * @param path name of the socket.
+ */
+static void serve(const char *name, const char *path) {
+  unsigned char seqbuf[8];
+  unsigned long seq;
+  int lfd, fd, i;
+  pid_t pid;
+
+  if ((lfd = serv_listen(path)) < 0) {
+    err_sys("dbrepl: can't listen on %s", path);
+  }
+  signal(SIGCHLD, SIG_IGN); /* no zombies */
+  for (;;) {
+    if ((fd = serv_accept(lfd, NULL)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err_sys("dbrepl: serv_accept() error");
+    }
+    if ((pid = fork()) < 0) {
+      err_sys("dbrepl: fork() error");
+    } else if (pid == 0) {
+      close(lfd);
+      if (readn(fd, seqbuf, 8) != 8) {
+        exit(0);
+      }
+      for (seq = 0, i = 7; i >= 0; i--) {
+        seq = seq << 8 | seqbuf[i];
+      }
+      lead(name, seq, fd);
+      exit(0);
+    }
+    close(fd);
+  }
+} /* serve() */
+
+/**
+ * Apply the changes read from a descriptor to a database, until the end of
+ * the input.
+ * @param name name of the database, created if it doesn't exist.
+ * @param fd descriptor to read from; -1 to connect to the leader on path.
+ * @param path name of the socket of the leader.
+ * @param quiet nonzero not to report what was applied.
+ */
+static void follow(const char *name, int fd, const char *path, int quiet) {
+  DBHANDLE db;
+  DBOPTS opts;
+  DBINFO info;
+  unsigned char seqbuf[8];
+  char *buf;
+  size_t size, len;
+  ssize_t n, done;
+  unsigned long total = 0;
+  int i;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.format = DB_FMT_BINARY;
+  opts.maxload = 4;
+  if ((db = db_openopt(name, O_RDWR, FILE_MODE, &opts)) == NULL &&
+      (errno != ENOENT ||
+       (db = db_openopt(name, O_RDWR | O_CREAT | O_TRUNC, FILE_MODE,
+                        &opts)) == NULL)) {
+    err_sys("dbrepl: can't open %s", name);
+  }
+  db_info(db, &info);
+  if (fd < 0) {
+    if ((fd = cli_conn(path)) < 0) {
+      err_sys("dbrepl: can't connect to %s", path);
+    }
+    for (i = 0; i < 8; i++) {
+      seqbuf[i] = (info.chgseq >> (8 * i)) & 0xff;
+    }
+    if (writen(fd, seqbuf, 8) != 8) {
+      err_sys("dbrepl: writen() error");
+    }
+  }
+
+  /*
+   * Apply the whole records read so far, and keep the part of a record at the
+   * end for the next read to complete.  A part that fills the buffer is of a
+   * record longer than it, so the buffer is doubled to make room for the rest;
+   * db_applychanges() has checked that the record isn't longer than the
+   * database takes.
+   */
+  size = INCHUNK;
+  if ((buf = malloc(size)) == NULL) {
+    err_sys("dbrepl: malloc() error");
+  }
+  len = 0;
+  for (;;) {
+    if (len == size) {
+      size *= 2;
+      if ((buf = realloc(buf, size)) == NULL) {
+        err_sys("dbrepl: realloc() error");
+      }
+    }
+    if ((n = read(fd, buf + len, size - len)) == 0) {
+      break;
+    } else if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err_sys("dbrepl: read() error");
+    }
+    len += n;
+    if ((done = db_applychanges(db, buf, len)) < 0) {
+      if (errno == ERANGE) {
+        err_quit("dbrepl: changes are missing after %lu; copy %s again",
+                 info.chgseq, name);
+      }
+      err_sys("dbrepl: db_applychanges() error");
+    }
+    memmove(buf, buf + done, len - done);
+    len -= done;
+    total += done;
+    db_info(db, &info);
+  }
+  if (len > 0) {
+    err_msg("dbrepl: input ends in the middle of a change");
+  }
+  if (!quiet) {
+    printf("%lu bytes of changes applied, up to %lu\n", total, info.chgseq);
+  }
+  free(buf);
+  db_close(db);
+} /* follow() */
+
+int main(int argc, char *argv[]) {
+  char *path = NULL;
+  unsigned long seq = 0;
+  long ms = 100;
+  int c, err = 0, leader = 0, quiet = 0;
+
+  while ((c = getopt(argc, argv, "ls:n:i:eq")) != -1) {
+    switch (c) {
+    case 'l': /* leader */
+      leader = 1;
+      break;
+    case 's': /* UNIX domain socket */
+      path = optarg;
+      break;
+    case 'n': /* last change not to send */
+      seq = strtoul(optarg, NULL, 10);
+      break;
+    case 'i': /* milliseconds between looks at the log */
+      if ((ms = atol(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 'e': /* exit once caught up */
+      exitdone = 1;
+      break;
+    case 'q': /* quiet */
+      quiet = 1;
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  if (err || optind != argc - 1) {
+    err_quit("Usage: %s -l [-s path] [-n seq] [-i ms] [-e] dbname\n"
+             "       %s [-s path] [-q] dbname",
+             argv[0], argv[0]);
+  }
+  interval.tv_sec = ms / 1000;
+  interval.tv_nsec = ms % 1000 * 1000000;
+
+  if (leader) {
+    signal(SIGPIPE, SIG_IGN); /* a follower went away: write() fails instead */
+  }
+  if (leader && path != NULL) {
+    serve(argv[optind], path);
+  } else if (leader) {
+    lead(argv[optind], seq, STDOUT_FILENO);
+  } else {
+    follow(argv[optind], path != NULL ? -1 : STDIN_FILENO, path, quiet);
+  }
+  exit(0);
+}
@@ -0,0 +1,782 @@
+/*
+ * Database server.  It opens one or more databases and serves db_fetch(),
+ * db_store() and db_delete() requests for them from clients, with the
+ * protocol of dbserv.h, so that the clients share one set of handles, locks
+ * and caches instead of each opening the files.  Usage:
+ *   $ dbserv [-d] [-h host] [-p port] [-s path] [-c megabytes] [-l maxload]
+ *            [-m] [-w] [-L] [-B] dbname...
+ * The server listens for TCP connections on host (default localhost) and port
+ * (default DBS_PORT), and with -s also on a UNIX domain socket named path.
+ * Databases that don't exist are created in the binary format, with a hash
+ * table that grows above an average chain length of maxload; -c gives each
+ * handle a record cache, and -m, -w, -L and -B select DB_OPT_MMAP, DB_OPT_WAL,
+ * DB_OPT_LOCKTAB and DB_OPT_BLOOM.  Requests name a database by its place on
+ * the command line, from 0.  The server runs as a daemon unless -d is given;
+ * SIGTERM or SIGINT closes the databases and stops it.
+ *
+ * One process serves all the clients, with poll().  Each time round the loop
+ * it reads what every client has sent, and then carries out all the complete
+ * requests together: a run of fetches from one database is done with one
+ * db_fetch_many(), and a run of updates to one database with one batch of
+ * db_begin() and db_commit_results(), so that each hash chain is locked and
+ * walked once for the run however many clients sent to it.  A client's
+ * requests are carried out, and answered, in the order it sent them.
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include "dbserv.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <syslog.h>
+
+#define QLEN 128              /* connections waiting to be accepted */
+#define INCHUNK (64 * 1024)   /* bytes read from a client at a time */
+#define OUTMAX (1024 * 1024)  /* stop reading a client with this much unsent */
+#define MAXREQ 4096           /* requests carried out together, at most */
+
+/*
+ * A connected client.
+ */
+typedef struct {
+  int fd;        /* connection; -1 if the entry is free */
+  char *in;      /* malloc'ed input, from the first request not yet parsed */
+  size_t inlen;  /* bytes in in */
+  size_t insize; /* size of in */
+  size_t inpos;  /* bytes of in parsed this time round the loop */
+  char *out;     /* malloc'ed replies */
+  size_t outpos; /* bytes of out already sent */
+  size_t outlen; /* bytes in out */
+  size_t outsize; /* size of out */
+  int eof;       /* client has shut down its side, or sent a bad request */
+} CLIENT;
+
+/*
+ * A request parsed from a client, to be carried out this time round the loop.
+ */
+typedef struct {
+  int client;   /* index of the client in client[] */
+  uint32_t id;  /* id from the request */
+  int op;       /* DBS_xxx operation */
+  int db;       /* database number */
+  size_t key;   /* offset of the null-terminated key in arena */
+  size_t data;  /* offset of the null-terminated data in arena */
+  int status;   /* DBS_xxx result */
+  char *reply;  /* malloc'ed data of the reply; NULL if none */
+  const char *msg; /* error message of a DBS_ERROR reply */
+} REQ;
+
+int log_to_stderr; /* for the log_xxx() functions */
+
+static DBHANDLE *db;    /* the databases */
+static DBINFO *dbinfo;  /* their limits */
+static int ndb;         /* number of databases */
+static CLIENT *client;  /* malloc'ed array of clients */
+static int nclient;     /* size of client[] */
+static REQ req[MAXREQ]; /* requests of this time round the loop */
+static int nreq;        /* number of requests in req[] */
+static char *arena;     /* malloc'ed keys and data of the requests */
+static size_t arenalen, arenasize;
+static int results[MAXREQ]; /* results of a batch of updates */
+static volatile sig_atomic_t quit; /* set by SIGTERM and SIGINT */
+static unsigned long nrequest, nbatch; /* requests and batches carried out */
+
+static void sig_quit(int signo) {
+  quit = 1;
+}
+
+static uint32_t get16(const unsigned char *p) {
+  return (p[0] | p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char *p) {
+  return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+/**
+ * Make sure that a malloc'ed buffer has room for more bytes.
+ * @param buf pointer to the buffer.
+ * @param size pointer to its size.
+ * @param need bytes it must hold.
+ */
+static void grow(char **buf, size_t *size, size_t need) {
+  char *p;
+
+  if (need > *size) {
+    if ((p = realloc(*buf, need * 2 + INCHUNK)) == NULL) {
+      log_sys("dbserv: realloc() error");
+    }
+    *buf = p;
+    *size = need * 2 + INCHUNK;
+  }
+}
+
+/**
+ * Create a socket bound to an address, and listen on it.  As initserver() of
+ * chapter 16, with SO_REUSEADDR so that the server can be restarted at once.
+ * @param addr address to bind.
+ * @param alen length of addr.
+ * @return fd of the socket; -1 on error.
+ */
+static int initserver(const struct sockaddr *addr, socklen_t alen) {
+  int fd, err, reuse = 1;
+
+  if ((fd = socket(addr->sa_family, SOCK_STREAM, 0)) < 0) {
+    return (-1);
+  }
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) < 0 ||
+      bind(fd, addr, alen) < 0 || listen(fd, QLEN) < 0) {
+    err = errno;
+    close(fd);
+    errno = err;
+    return (-1);
+  }
+  return (fd);
+}
+
+/**
+ * Add a connection to the client[] array.
+ * @param fd the connection.
+ * @param tcp nonzero for a TCP connection.
+ */
+static void client_add(int fd, int tcp) {
+  int i, on = 1;
+
+  set_cloexec(fd);
+  set_fl(fd, O_NONBLOCK);
+  if (tcp) { /* replies are sent a batch at a time; don't hold them back */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  for (i = 0; i < nclient && client[i].fd >= 0; i++) {
+    ;
+  }
+  if (i == nclient) {
+    if ((client = realloc(client, (nclient * 2 + 8) * sizeof(CLIENT))) ==
+        NULL) {
+      log_sys("dbserv: realloc() error");
+    }
+    memset(client + nclient, 0, (nclient + 8) * sizeof(CLIENT));
+    for (i = nclient; i < nclient * 2 + 8; i++) {
+      client[i].fd = -1;
+    }
+    i = nclient;
+    nclient = nclient * 2 + 8;
+  }
+  client[i].fd = fd;
+  client[i].inlen = client[i].inpos = 0;
+  client[i].outlen = client[i].outpos = 0;
+  client[i].eof = 0;
+}
+
+/**
+ * Close the connection of a client and free its entry.
+ * @param c the client.
+ */
+static void client_del(CLIENT *c) {
+  close(c->fd);
+  c->fd = -1;
+  free(c->in);
+  free(c->out);
+  c->in = c->out = NULL;
+  c->insize = c->outsize = 0;
+}
+
+/**
+ * Read what a client has sent.  A client is read once each time round the
+ * loop, for as much as a request that is only partly there still needs, or
+ * INCHUNK bytes if that's more.  A request too long for any database is left
+ * for client_parse() to reject.
+ * @param c the client.
+ */
+static void client_read(CLIENT *c) {
+  size_t want = INCHUNK, len;
+  ssize_t n;
+
+  if (c->inlen >= DBS_HDR_SZ) {
+    len = DBS_HDR_SZ + get16((unsigned char *)c->in + DBS_KEYLEN) +
+          get32((unsigned char *)c->in + DBS_DATLEN);
+    if (len > c->inlen && len - c->inlen > want &&
+        len <= DBS_HDR_SZ + IDXLEN_MAX + DATLEN_BIG) {
+      want = len - c->inlen;
+    }
+  }
+  grow(&c->in, &c->insize, c->inlen + want);
+  if ((n = read(c->fd, c->in + c->inlen, want)) < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      c->eof = 1;
+      c->inlen = 0; /* the connection has failed */
+    }
+  } else if (n == 0) {
+    c->eof = 1;
+  } else {
+    c->inlen += n;
+  }
+}
+
+/**
+ * Send as much of the replies to a client as it will take without blocking.
+ * @param c the client.
+ * @return 0 if OK; -1 if the connection has failed.
+ */
+static int client_write(CLIENT *c) {
+  ssize_t n;
+
+  while (c->outpos < c->outlen) {
+    if ((n = write(c->fd, c->out + c->outpos, c->outlen - c->outpos)) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return (-1);
+    }
+    c->outpos += n;
+  }
+  if (c->outpos == c->outlen) {
+    c->outpos = c->outlen = 0;
+  }
+  return (0);
+}
+
+/**
+ * Copy a string of the request of a client into the arena, null terminated.
+ * @param p the string.
+ * @param len its length.
+ * @return offset of the copy in the arena.
+ */
+static size_t arena_add(const char *p, size_t len) {
+  size_t off = arenalen;
+
+  grow(&arena, &arenasize, arenalen + len + 1);
+  memcpy(arena + off, p, len);
+  arena[off + len] = 0;
+  arenalen += len + 1;
+  return (off);
+}
+
+/**
+ * Parse the complete requests that a client has sent into req[], as long as
+ * there is room.  A request with bad lengths can't be skipped, so it is
+ * answered with DBS_ERROR and the client is closed once the replies have been
+ * sent.
+ * @param ci index of the client in client[].
+ */
+static void client_parse(int ci) {
+  CLIENT *c = &client[ci];
+  unsigned char *h;
+  size_t keylen, datlen, maxkey, maxdata;
+  REQ *r;
+
+  while (nreq < MAXREQ && c->inlen - c->inpos >= DBS_HDR_SZ) {
+    h = (unsigned char *)c->in + c->inpos;
+    keylen = get16(h + DBS_KEYLEN);
+    datlen = get32(h + DBS_DATLEN);
+    r = &req[nreq];
+    r->client = ci;
+    r->id = get32(h + DBS_ID);
+    r->op = h[DBS_OP];
+    r->db = h[DBS_DB];
+    r->status = DBS_OK;
+    r->reply = NULL;
+    r->msg = NULL;
+    maxkey = r->db < ndb ? dbinfo[r->db].maxkey : IDXLEN_MAX;
+    maxdata = r->db < ndb ? dbinfo[r->db].maxdata : DATLEN_MAX;
+    if (keylen > maxkey || datlen > maxdata) {
+      r->status = DBS_ERROR;
+      r->msg = "key or data too long";
+      c->eof = 1;
+      c->inlen = c->inpos = 0; /* drop the rest */
+      nreq++;
+      break;
+    }
+    if (c->inlen - c->inpos < DBS_HDR_SZ + keylen + datlen) {
+      break; /* the rest hasn't arrived yet */
+    }
+    r->key = arena_add((char *)h + DBS_HDR_SZ, keylen);
+    r->data = arena_add((char *)h + DBS_HDR_SZ + keylen, datlen);
+    c->inpos += DBS_HDR_SZ + keylen + datlen;
+    nreq++;
+    if (r->db >= ndb) {
+      r->status = DBS_ERROR;
+      r->msg = "no such database";
+    } else if (r->op < DBS_GET || r->op > DBS_DELETE) {
+      r->status = DBS_ERROR;
+      r->msg = "no such operation";
+    } else if (keylen == 0 || memchr(arena + r->key, 0, keylen) != NULL) {
+      r->status = DBS_ERROR;
+      r->msg = "invalid key";
+    } else if ((r->op == DBS_GET || r->op == DBS_DELETE) != (datlen == 0) ||
+               memchr(arena + r->data, 0, datlen) != NULL) {
+      r->status = DBS_ERROR;
+      r->msg = "invalid data";
+    }
+  }
+}
+
+/**
+ * Carry out a run of fetches from one database with db_fetch_many().  If that
+ * fails, as it does for a bad record, the keys are fetched one at a time, so
+ * that only the requests that fail get an error.
+ * @param r the first request.
+ * @param n number of requests.
+ */
+static void do_fetches(REQ *r, long n) {
+  char **keys, **datas, *ptr;
+  long i;
+
+  if ((keys = malloc(n * 2 * sizeof(char *))) == NULL) {
+    log_sys("dbserv: malloc() error");
+  }
+  datas = keys + n;
+  for (i = 0; i < n; i++) {
+    keys[i] = arena + r[i].key;
+  }
+  if (db_fetch_many(db[r->db], keys, datas, n) >= 0) {
+    for (i = 0; i < n; i++) {
+      if ((r[i].reply = datas[i]) == NULL) {
+        r[i].status = DBS_NOTFOUND;
+      }
+    }
+    free(keys);
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    if ((ptr = db_fetch(db[r->db], keys[i])) != NULL) {
+      if ((r[i].reply = strdup(ptr)) == NULL) {
+        log_sys("dbserv: strdup() error");
+      }
+    } else if (errno == ENOENT) {
+      r[i].status = DBS_NOTFOUND;
+    } else {
+      r[i].status = DBS_ERROR;
+      r[i].msg = strerror(errno);
+    }
+  }
+  free(keys);
+}
+
+/**
+ * Set the status of an update from its result.
+ * @param r the request.
+ * @param err 0 if the update was made; EEXIST if the key of a DBS_INSERT
+ * exists, ENOENT if the key of a DBS_REPLACE or DBS_DELETE doesn't, or the
+ * error that made it fail.
+ */
+static void update_status(REQ *r, int err) {
+  if (err == 0) {
+    r->status = DBS_OK;
+  } else if (err == EEXIST) {
+    r->status = DBS_EXISTS;
+  } else if (err == ENOENT) {
+    r->status = DBS_NOTFOUND;
+  } else {
+    r->status = DBS_ERROR;
+    r->msg = strerror(err);
+  }
+}
+
+/**
+ * Carry out an update on its own, with db_store() or db_delete().
+ * @param r the request.
+ */
+static void do_update(REQ *r) {
+  DBHANDLE h = db[r->db];
+  int rc;
+
+  if (r->op == DBS_DELETE) {
+    rc = db_delete(h, arena + r->key);
+  } else {
+    rc = db_store(h, arena + r->key, arena + r->data, r->op);
+  }
+  update_status(r, rc == 1 ? EEXIST : rc < 0 ? errno : 0);
+}
+
+/**
+ * Carry out a run of updates of one database: on its own, or in a batch if
+ * there are several.  Each update of the batch gets the status it would have
+ * got on its own.
+ * @param r the first request.
+ * @param n number of requests.
+ */
+static void do_updates(REQ *r, long n) {
+  DBHANDLE h = db[r->db];
+  long i, nstaged;
+  int rc;
+
+  if (n == 1) {
+    do_update(r);
+    return;
+  }
+
+  if (db_begin(h) < 0) {
+    log_sys("dbserv: db_begin() error");
+  }
+  for (i = nstaged = 0; i < n; i++) {
+    if (r[i].op == DBS_DELETE) {
+      rc = db_delete(h, arena + r[i].key);
+    } else {
+      rc = db_store(h, arena + r[i].key, arena + r[i].data, r[i].op);
+    }
+    if (rc < 0) {
+      r[i].status = DBS_ERROR;
+      r[i].msg = strerror(errno);
+    } else {
+      r[i].status = nstaged++; /* for now, the place of its result */
+    }
+  }
+  if (db_commit_results(h, results) < 0) {
+    /*
+     * It fails only if no batch is open or the handle holds mapped views,
+     * neither of which can happen here; if it does, make the updates one at
+     * a time rather than exit.
+     */
+    db_abort(h);
+    for (i = 0; i < n; i++) {
+      if (r[i].msg == NULL) {
+        do_update(r + i);
+      }
+    }
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    if (r[i].msg == NULL) {
+      update_status(r + i, results[r[i].status]);
+    }
+  }
+  nbatch++;
+}
+
+/**
+ * Carry out the requests in req[], a run of fetches or updates of one
+ * database at a time, and queue the replies to the clients.
+ */
+static void do_requests(void) {
+  unsigned char hdr[DBS_HDR_SZ];
+  CLIENT *c;
+  size_t len;
+  long i, j;
+  int upd;
+
+  for (i = 0; i < nreq; i = j) {
+    if (req[i].status != DBS_OK) {
+      j = i + 1;
+      continue;
+    }
+    upd = req[i].op != DBS_GET;
+    for (j = i + 1; j < nreq && req[j].status == DBS_OK &&
+                    req[j].db == req[i].db && (req[j].op != DBS_GET) == upd;
+         j++) {
+      ;
+    }
+    if (upd) {
+      do_updates(req + i, j - i);
+    } else {
+      do_fetches(req + i, j - i);
+    }
+  }
+
+  for (i = 0; i < nreq; i++) {
+    c = &client[req[i].client];
+    if (req[i].reply != NULL) {
+      len = strlen(req[i].reply);
+    } else if (req[i].msg != NULL) {
+      len = strlen(req[i].msg);
+    } else {
+      len = 0;
+    }
+    memset(hdr, 0, DBS_HDR_SZ);
+    hdr[DBS_STATUS] = req[i].status;
+    put32(hdr + DBS_DATLEN, len);
+    put32(hdr + DBS_ID, req[i].id);
+    grow(&c->out, &c->outsize, c->outlen + DBS_HDR_SZ + len);
+    memcpy(c->out + c->outlen, hdr, DBS_HDR_SZ);
+    if (len > 0) {
+      memcpy(c->out + c->outlen + DBS_HDR_SZ,
+             req[i].reply != NULL ? req[i].reply : req[i].msg, len);
+    }
+    c->outlen += DBS_HDR_SZ + len;
+    free(req[i].reply);
+  }
+  nrequest += nreq;
+  nreq = 0;
+  arenalen = 0;
+}
+
+/**
+ * Serve the clients until told to quit.
+ * @param lfd listening sockets.
+ * @param nlfd number of listening sockets.
+ * @param unixfd which of them is the UNIX domain socket; -1 if none.
+ */
+static void loop(int *lfd, int nlfd, int unixfd) {
+  struct pollfd *pfd = NULL;
+  int *pci = NULL;
+  int i, npfd, fd, more;
+  uid_t uid;
+  CLIENT *c;
+
+  for (;;) {
+    /*
+     * Wait for connections, for requests from clients that don't have too
+     * many replies outstanding, and for room to send replies.
+     */
+    if ((pfd = realloc(pfd, (nlfd + nclient) * sizeof(struct pollfd))) ==
+            NULL ||
+        (pci = realloc(pci, (nlfd + nclient) * sizeof(int))) == NULL) {
+      log_sys("dbserv: realloc() error");
+    }
+    for (npfd = 0; npfd < nlfd; npfd++) {
+      pfd[npfd].fd = lfd[npfd];
+      pfd[npfd].events = POLLIN;
+      pci[npfd] = -1;
+    }
+    for (i = 0; i < nclient; i++) {
+      c = &client[i];
+      if (c->fd < 0) {
+        continue;
+      }
+      pfd[npfd].fd = c->fd;
+      pfd[npfd].events = 0;
+      if (!c->eof && c->outlen - c->outpos < OUTMAX) {
+        pfd[npfd].events |= POLLIN;
+      }
+      if (c->outpos < c->outlen) {
+        pfd[npfd].events |= POLLOUT;
+      }
+      pci[npfd++] = i;
+    }
+    if (quit) {
+      break;
+    }
+    if (poll(pfd, npfd, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_sys("dbserv: poll() error");
+    }
+
+    for (i = 0; i < nlfd; i++) {
+      if (pfd[i].revents & POLLIN) {
+        if (lfd[i] == unixfd) {
+          fd = serv_accept(lfd[i], &uid);
+        } else {
+          fd = accept(lfd[i], NULL, NULL);
+        }
+        if (fd >= 0) {
+          client_add(fd, lfd[i] != unixfd);
+        }
+      }
+    }
+    for (i = nlfd; i < npfd; i++) {
+      c = &client[pci[i]];
+      if (!c->eof && (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+        client_read(c);
+      }
+    }
+
+    /*
+     * Carry out the complete requests, MAXREQ at a time, and send the
+     * replies.
+     */
+    do {
+      more = 0;
+      for (i = 0; i < nclient; i++) {
+        if (client[i].fd >= 0) {
+          client_parse(i);
+          if (nreq == MAXREQ) {
+            more = 1;
+          }
+        }
+      }
+      do_requests();
+    } while (more);
+    for (i = 0; i < nclient; i++) {
+      c = &client[i];
+      if (c->fd < 0) {
+        continue;
+      }
+      if (c->inpos > 0) {
+        memmove(c->in, c->in + c->inpos, c->inlen - c->inpos);
+        c->inlen -= c->inpos;
+        c->inpos = 0;
+      }
+      if (client_write(c) < 0 || (c->eof && c->outlen == 0)) {
+        client_del(c);
+      }
+    }
+  }
+  free(pfd);
+  free(pci);
+}
+
+int main(int argc, char *argv[]) {
+  struct addrinfo hint, *ailist, *aip;
+  DBOPTS opts;
+  char *host, *port, *sockpath, *cwd, *name;
+  int c, err, i, nlfd, unixfd, *lfd;
+  size_t size;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.format = DB_FMT_BINARY;
+  opts.maxload = 4;
+  host = "localhost";
+  port = DBS_PORT;
+  sockpath = NULL;
+  err = 0;
+  while ((c = getopt(argc, argv, "dh:p:s:c:l:mwLB")) != -1) {
+    switch (c) {
+    case 'd': /* debug: stay in the foreground */
+      log_to_stderr = 1;
+      break;
+    case 'h': /* address to listen on */
+      host = optarg;
+      break;
+    case 'p': /* TCP port */
+      port = optarg;
+      break;
+    case 's': /* UNIX domain socket */
+      sockpath = optarg;
+      break;
+    case 'c': /* megabytes of record cache per handle */
+      if (atol(optarg) < 1) {
+        err = 1;
+      }
+      opts.cachesize = (size_t)atol(optarg) * 1024 * 1024;
+      break;
+    case 'l': /* maximum average chain length */
+      if ((opts.maxload = atoi(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 'm': /* read through mappings */
+      opts.flags |= DB_OPT_MMAP;
+      break;
+    case 'w': /* write-ahead log */
+      opts.flags |= DB_OPT_WAL;
+      break;
+    case 'L': /* shared lock table */
+      opts.flags |= DB_OPT_LOCKTAB;
+      break;
+    case 'B': /* Bloom filters */
+      opts.flags |= DB_OPT_BLOOM;
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  ndb = argc - optind;
+  if (err || ndb < 1 || ndb > 256) {
+    err_quit("Usage: %s [-d] [-h host] [-p port] [-s path] [-c megabytes] "
+             "[-l maxload]\n"
+             "       [-m] [-w] [-L] [-B] dbname...",
+             argv[0]);
+  }
+
+  /*
+   * daemonize() changes to the root directory, so make the names of the
+   * databases absolute, and check that they can be opened before going into
+   * the background.  It also closes all descriptors, so the databases are
+   * opened again after.
+   */
+  if ((cwd = path_alloc(&size)) == NULL || getcwd(cwd, size) == NULL) {
+    err_sys("dbserv: getcwd() error");
+  }
+  if ((db = calloc(ndb, sizeof(DBHANDLE))) == NULL ||
+      (dbinfo = calloc(ndb, sizeof(DBINFO))) == NULL) {
+    err_sys("dbserv: calloc() error");
+  }
+  for (i = 0; i < ndb; i++) {
+    name = argv[optind + i];
+    if (name[0] != '/') {
+      if ((argv[optind + i] = malloc(strlen(cwd) + strlen(name) + 2)) ==
+          NULL) {
+        err_sys("dbserv: malloc() error");
+      }
+      sprintf(argv[optind + i], "%s/%s", cwd, name);
+    }
+    if ((db[i] = db_openopt(argv[optind + i], O_RDWR, FILE_MODE, &opts)) ==
+            NULL &&
+        (errno != ENOENT ||
+         (db[i] = db_openopt(argv[optind + i], O_RDWR | O_CREAT | O_TRUNC,
+                             FILE_MODE, &opts)) == NULL)) {
+      err_sys("dbserv: can't open %s", name);
+    }
+    db_close(db[i]);
+  }
+  free(cwd);
+
+  log_open("dbserv", LOG_PID, LOG_USER);
+  if (!log_to_stderr) {
+    daemonize("dbserv");
+  }
+  signal_intr(SIGTERM, sig_quit);
+  signal_intr(SIGINT, sig_quit);
+  signal(SIGPIPE, SIG_IGN); /* a client went away: write() fails instead */
+  for (i = 0; i < ndb; i++) {
+    if ((db[i] = db_openopt(argv[optind + i], O_RDWR, FILE_MODE, &opts)) ==
+        NULL) {
+      log_sys("dbserv: can't open %s", argv[optind + i]);
+    }
+    db_info(db[i], &dbinfo[i]);
+  }
+
+  /*
+   * Listen on every address of host, and on the UNIX domain socket.
+   */
+  memset(&hint, 0, sizeof(hint));
+  hint.ai_flags = AI_PASSIVE;
+  hint.ai_socktype = SOCK_STREAM;
+  if ((err = getaddrinfo(host, port, &hint, &ailist)) != 0) {
+    log_quit("dbserv: getaddrinfo() error: %s", gai_strerror(err));
+  }
+  for (nlfd = 1, aip = ailist; aip != NULL; aip = aip->ai_next) {
+    nlfd++;
+  }
+  if ((lfd = malloc(nlfd * sizeof(int))) == NULL) {
+    log_sys("dbserv: malloc() error");
+  }
+  for (nlfd = 0, aip = ailist; aip != NULL; aip = aip->ai_next) {
+    if ((lfd[nlfd] = initserver(aip->ai_addr, aip->ai_addrlen)) >= 0) {
+      set_cloexec(lfd[nlfd++]);
+    } else if (errno != EADDRNOTAVAIL && errno != EAFNOSUPPORT) {
+      log_sys("dbserv: can't listen on %s port %s", host, port);
+    }
+  }
+  freeaddrinfo(ailist);
+  if (nlfd == 0) {
+    log_quit("dbserv: can't listen on %s port %s", host, port);
+  }
+  unixfd = -1;
+  if (sockpath != NULL) {
+    if ((unixfd = serv_listen(sockpath)) < 0) {
+      log_sys("dbserv: can't listen on %s", sockpath);
+    }
+    set_cloexec(unixfd);
+    lfd[nlfd++] = unixfd;
+  }
+
+  loop(lfd, nlfd, unixfd);
+
+  for (i = 0; i < ndb; i++) {
+    db_close(db[i]);
+  }
+  if (sockpath != NULL) {
+    unlink(sockpath);
+  }
+  log_msg("dbserv: %lu requests, %lu batches of updates", nrequest, nbatch);
+  exit(0);
+}
@@ -0,0 +1,54 @@
+/*
+ * Protocol of the database server, dbserv, and its client, dbcli.
+ *
+ * A client sends requests over a TCP or UNIX domain stream connection, and may
+ * send any number of them before reading the replies, which come back in the
+ * order the requests were sent.  A request is a DBS_HDR_SZ byte header
+ * followed by the key and then the data; a reply is a header followed by the
+ * data.  Neither key nor data is null terminated, and neither may contain a
+ * null byte.  All integers are little-endian.
+ *
+ * Request header:
+ *   u8  op      DBS_xxx operation
+ *   u8  db      number of the database, in the order given to dbserv
+ *   u16 keylen  bytes of key
+ *   u32 datlen  bytes of data: 0 for DBS_GET and DBS_DELETE
+ *   u32 id      chosen by the client, and returned in the reply
+ * Reply header:
+ *   u8  status  DBS_OK, DBS_NOTFOUND, DBS_EXISTS or DBS_ERROR
+ *   u8  0
+ *   u16 0
+ *   u32 datlen  bytes of data: the record for DBS_GET, or an error message
+ *   u32 id      id of the request
+ */
+#ifndef _DBSERV_H
+#define _DBSERV_H
+
+#define DBS_PORT "7421" /* default TCP port */
+
+#define DBS_HDR_SZ 12 /* bytes in a request or reply header */
+#define DBS_OP 0      /* u8: request operation */
+#define DBS_STATUS 0  /* u8: reply status */
+#define DBS_DB 1      /* u8: database number */
+#define DBS_KEYLEN 2  /* u16: bytes of key */
+#define DBS_DATLEN 4  /* u32: bytes of data */
+#define DBS_ID 8      /* u32: request id */
+
+/*
+ * Operations.  The stores are the db_store() flags.
+ */
+#define DBS_GET 0
+#define DBS_INSERT DB_INSERT
+#define DBS_REPLACE DB_REPLACE
+#define DBS_STORE DB_STORE
+#define DBS_DELETE 4
+
+/*
+ * Reply status.
+ */
+#define DBS_OK 0       /* done; the data of a DBS_GET follows */
+#define DBS_NOTFOUND 1 /* no such key: DBS_GET, DBS_REPLACE or DBS_DELETE */
+#define DBS_EXISTS 2   /* the key of a DBS_INSERT is in the database already */
+#define DBS_ERROR 3    /* invalid request; an error message follows */
+
+#endif /* _DBSERV_H */
@@ -0,0 +1,88 @@
+/*
+ * Check a database for damage with db_verify(), reading its files with several
+ * threads at once.  Usage:
+ *   $ dbverify [-j nthreads] [-q] dbname
+ * Each problem found is printed on standard output, as the file, the offset in
+ * it and what is wrong, and then what the database holds and how fast it was
+ * read.  -q prints nothing, leaving the exit status to tell: 0 if no problem
+ * was found, 1 if some were.  nthreads defaults to the number of processors
+ * online.  The database is only read, and other processes can keep using it:
+ * fetches carry on, while updates wait until the check is done.
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+static void report(void *arg, const char *file, off_t off, const char *msg) {
+  if (!*(int *)arg) {
+    printf("%s: offset %lld: %s\n", file, (long long)off, msg);
+  }
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+    err_sys("dbverify: clock_gettime() error");
+  }
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+int main(int argc, char *argv[]) {
+  DBHANDLE db;
+  DBVERIFY vr;
+  double start, elapsed;
+  long nthreads;
+  int c, err, quiet, rc;
+
+  if ((nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+    nthreads = 1;
+  }
+  err = quiet = 0;
+  while ((c = getopt(argc, argv, "j:q")) != -1) {
+    switch (c) {
+    case 'j': /* threads */
+      if ((nthreads = atol(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case 'q': /* exit status only */
+      quiet = 1;
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  if (err || (optind != argc - 1)) {
+    err_quit("Usage: %s [-j nthreads] [-q] dbname", argv[0]);
+  }
+
+  if ((db = db_open(argv[optind], O_RDONLY)) == NULL) {
+    err_sys("dbverify: can't open %s", argv[optind]);
+  }
+  start = now();
+  if ((rc = db_verify(db, nthreads, &vr, report, &quiet)) < 0 &&
+      errno != EBADMSG) {
+    err_sys("dbverify: can't check %s", argv[optind]);
+  }
+  elapsed = now() - start;
+  db_close(db);
+
+  if (!quiet) {
+    printf("%ld records on %ld chains, longest %ld\n", vr.nrec, vr.nchain,
+           vr.maxchain);
+    printf("%ld free, %lld bytes\n", vr.nfree, (long long)vr.freebytes);
+    printf("%lld bytes read in %.3f s, %.1f MB/s\n",
+           (long long)(vr.idxsize + vr.datsize), elapsed,
+           elapsed > 0 ? (vr.idxsize + vr.datsize) / elapsed / 1e6 : 0.0);
+    if (vr.nbad > 0) {
+      printf("%ld problems found\n", vr.nbad);
+    } else {
+      printf("no problems found\n");
+    }
+  }
+  exit(rc < 0 ? 1 : 0);
+}
@@ -1,23 +1,142 @@
 /*
- * Program used to dump the database to stdout.
+ * Program used to dump the database to stdout.  Usage:
+ *   $ t4dump [-j nthreads] [dbname]
+ *   $ t4dump --stats [dbname]
+ * The database is db4 unless named.  -j scans it with nthreads threads at once,
+ * with db_scan(), instead of with db_nextrec().  A database created with
+ * DB_OPT_SNAPSHOT is dumped from a snapshot, as it was when the dump started,
+ * even while it's updated.  --stats fetches each record once instead of
+ * printing it, and prints the statistics of db_stats(): the number of records
+ * compared per lookup, the lock waits and the latencies.
  */
 #include "apue.h"
 #include "apue_db.h"
+#include <errno.h>
 #include <fcntl.h>
 
-int main(void) {
+static int print(void *arg, const char *key, const char *data) {
+  printf("%s\t%s\n", key, data);
+  return (0);
+}
+
+static void prlat(const char *name, const DBLAT *lat) {
+  int i;
+
+  if (lat->count == 0) {
+    return;
+  }
+  printf("%-7s %9lu %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", name,
+         lat->count, lat->min / 1000, lat->total / lat->count / 1000,
+         lat->p50 / 1000, lat->p90 / 1000, lat->p99 / 1000, lat->p999 / 1000,
+         lat->max / 1000);
+  for (i = 0; i < DB_NLAT; i++) {
+    if (lat->hist[i] != 0) {
+      printf("  %12.3f us  %9lu\n", db_latbound(i) / 1000, lat->hist[i]);
+    }
+  }
+}
+
+static void prstats(DBHANDLE db) {
+  DBSTATS st;
+
+  db_stats(db, &st);
+  printf("fetch:  %lu found, %lu not found, %lu from the cache\n", st.fetchok,
+         st.fetcherr, st.cachehit);
+  printf("store:  %lu appended, %lu reused, %lu moved, %lu in place, "
+         "%lu refused\n",
+         st.stor1, st.stor2, st.stor3, st.stor4, st.storerr);
+  printf("delete: %lu deleted, %lu not found\n", st.delok, st.delerr);
+  printf("scan:   %lu records\n", st.nextrec);
+  printf("lookups: %lu, %.2f records compared per lookup\n", st.lookups,
+         st.lookups == 0 ? 0.0 : (double)st.hops / st.lookups);
+  printf("bloom:  %lu lookups answered by a filter\n", st.bloomneg);
+  printf("read:   %lld bytes of index, %lld bytes of data\n",
+         (long long)st.idxbytes, (long long)st.datbytes);
+  printf("locks:  %lu waited for, %.2f us in all, %.2f us at most\n",
+         st.locks, st.lockwait / 1000, st.lockmax / 1000);
+  printf("latency (us)  count       min      mean       p50       p90       "
+         "p99     p99.9       max\n");
+  prlat("fetch", &st.fetch);
+  prlat("store", &st.store);
+  prlat("delete", &st.delete);
+}
+
+int main(int argc, char *argv[]) {
   DBHANDLE db;
+  DBINFO info;
   char *ptr = NULL;
   char key[IDXLEN_MAX];
+  int c, err, nthreads, stats;
 
-  if ((db = db_open("db4", O_RDONLY, FILE_MODE)) == NULL) {
+  nthreads = 0;
+  stats = 0;
+  err = 0;
+  if (argc > 1 && strcmp(argv[1], "--stats") == 0) { /* not for getopt() */
+    stats = 1;
+    argv[1] = argv[0];
+    argv++;
+    argc--;
+  }
+  while ((c = getopt(argc, argv, "j:")) != -1) {
+    switch (c) {
+    case 'j': /* scan with this many threads */
+      if ((nthreads = atoi(optarg)) < 1) {
+        err = 1;
+      }
+      break;
+    case '?':
+      err = 1;
+      break;
+    }
+  }
+  if (err || optind < argc - 1 || (stats && nthreads > 0)) {
+    err_quit("Usage: %s [-j nthreads] [dbname]\n"
+             "       %s --stats [dbname]",
+             argv[0], argv[0]);
+  }
+
+  if ((db = db_open(optind < argc ? argv[optind] : "db4", O_RDONLY,
+                    FILE_MODE)) == NULL) {
     err_sys("db_open() error");
   }
+  db_info(db, &info);
+  if (!stats && info.snapshot && db_snapshot(db) < 0) {
+    err_ret("t4dump: can't take a snapshot; dumping the records as they are");
+  }
 
-  /* db_rewind() must be called before db_nextrec() */
-  db_rewind(db);
-  while ((ptr = db_nextrec(db, key)) != NULL) {
-    printf("%s\t%s\n", key, ptr);
+  if (stats) {
+    /* fetch each record, so that there are lookups to report */
+    db_rewind(db);
+    for (;;) {
+      errno = 0;
+      if (db_nextrec(db, key) == NULL) {
+        break;
+      }
+      if (db_fetch(db, key) == NULL) {
+        err_quit("t4dump: %s vanished", key);
+      }
+    }
+    if (errno != 0) {
+      err_sys("t4dump: db_nextrec() error");
+    }
+    prstats(db);
+  } else if (nthreads > 0) {
+    if (db_scan(db, nthreads, print, NULL) < 0) {
+      err_sys("t4dump: db_scan() error");
+    }
+  } else {
+    /* db_rewind() must be called before db_nextrec() */
+    db_rewind(db);
+    for (;;) {
+      errno = 0;
+      if ((ptr = db_nextrec(db, key)) == NULL) {
+        break;
+      }
+      printf("%s\t%s\n", key, ptr);
+    }
+    if (errno != 0) {
+      err_sys("t4dump: db_nextrec() error");
+    }
   }
 
   db_close(db);